@@ -70,14 +70,14 @@
 #define __COMMON_H
 
 
-#define HASH_TABLE_SIZE         1024
 #define IMAP_PROXY_VERSION      "1.2.8 [SVN]"
 
 /*
  * Misc. function prototypes.
  */
 extern int BecomeNonRoot( void );
-extern unsigned int Hash(char *, unsigned int );
+extern unsigned int Hash( const char * );
+extern void Hash_Seed( void );
 
 
 #endif /* COMMON_H */
@@ -144,6 +144,7 @@
 #include <pthread.h>
 #include <netinet/in.h>
 #include <time.h>
+#include <sys/time.h>
 #include "config.h"
 
 #if HAVE_LIBSSL
@@ -172,11 +173,25 @@
 #define MAXPASSWDLEN            8192              /* max passwd length       */
 #define POLL_TIMEOUT_MINUTES    30                /* Poll timeout in minutes */
 #define POLL_TIMEOUT            (POLL_TIMEOUT_MINUTES * 60000)
+#define SPLICE_CHUNK            65536             /* max bytes per splice()  */
+#define ITD_MIN_READ            1024              /* compact an ITD buffer   */
+						  /* when less room is left  */
+#if HAVE_SPLICE
+#define FDS_PER_CONN            4                 /* client, server, pipe    */
+#else
+#define FDS_PER_CONN            2                 /* client, server          */
+#endif
 #define SELECT_BUF_SIZE         BUFSIZE           /* max length of a SELECT  */
 						  /* string we can cache     */
-#define SELECT_CACHE_EXP        10                /* # of seconds before we  */
-                                                  /* expire a SELECT cache   */
+#define SELECT_CACHE_EXP        10                /* default # of seconds    */
+                                                  /* before we revalidate a  */
+                                                  /* SELECT cache entry      */
 #define SELECT_STATUS_BUF_SIZE  256               /* size of select status   */
+#define SELECT_CACHE_SIZE       4                 /* default # of mailboxes  */
+						  /* cached per connection   */
+#define SELECT_CACHE_MAX        64                /* most we allow           */
+#define SELECT_OBSERVE_LINE     1024              /* most of an untagged     */
+						  /* response we look at     */
 
 #ifndef DEFAULT_CONFIG_FILE
 #define DEFAULT_CONFIG_FILE     "/etc/imapproxy.conf"
@@ -191,12 +206,69 @@
 #define UNSELECT_NOT_SUPPORTED  0
 #define STARTTLS_SUPPORTED      1
 #define STARTTLS_NOT_SUPPORTED  0
+#define CONDSTORE_SUPPORTED     1
+#define CONDSTORE_NOT_SUPPORTED 0
 #define LOGIN_DISABLED          1
 #define LOGIN_NOT_DISABLED      0
 
 
 #define DEFAULT_SERVER_CONNECT_RETRIES	10
 #define DEFAULT_SERVER_CONNECT_DELAY	5
+#define DEFAULT_SERVER_CONNECT_TIMEOUT	10
+#define BACKEND_SPARE_MAX_AGE	30	/* seconds before a spare is replaced */
+#define BACKEND_EYEBALL_DELAY	250	/* ms before racing the next address */
+#define BACKEND_MAX_BACKOFF	64	/* most seconds an address stays down */
+
+/*
+ * A Backend is one address of the IMAP server, along with any spare
+ * connections to it we keep open (see backend.c).  Spare[] is kept
+ * oldest first.  Connections counts the server connections that have
+ * been handed to logins and are still open, Active those of them that
+ * are in use rather than cached.
+ *
+ * Backends are never freed, since connections point at them.  One that
+ * DNS stops returning is Retired; if the address comes back, so does
+ * the same Backend.  The current list of them is a BackendSet, which is
+ * replaced whole when DNS changes and freed when the last thread using
+ * it lets go.
+ */
+struct BackendSpare
+{
+    struct IMAPConnectionDescriptor *conn;
+    time_t Opened;
+};
+
+struct Backend
+{
+    struct sockaddr_storage Addr;
+    socklen_t AddrLen;
+    int Family;
+    int SockType;
+    int Protocol;
+    char Name[ 64 ];                    /* the address, for logging        */
+    struct Backend *anext;              /* list of every Backend there is  */
+    unsigned int Retired;               /* no longer in DNS                */
+    unsigned int Spared;                /* we want spares kept to it       */
+    unsigned int SpareThread;           /* its spare thread is running     */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                /* signalled when a spare is taken */
+    struct BackendSpare *Spare;
+    unsigned int Spares;                /* how many are open               */
+    unsigned int Connections;
+    unsigned int Active;
+    unsigned int Failures;              /* connects failed in a row        */
+    time_t DownUntil;                   /* skip it for new logins till then */
+#if HAVE_LIBSSL
+    SSL_SESSION *Session;               /* newest one to resume, if any    */
+#endif
+};
+
+struct BackendSet
+{
+    unsigned int Count;
+    unsigned int Refs;                  /* threads using it, +1 if current */
+    struct Backend **Backend;
+};
 
 /*
  * One IMAPServerDescriptor will be globally allocated such that each thread
@@ -208,20 +280,52 @@ struct IMAPServerDescriptor
     struct addrinfo *airesults; /* IMAP server info (top of addrinfo
 				   list from getaddrinfo() */
     struct addrinfo *srv;	/* IMAP server active socket info */
+    struct BackendSet *Backends;	/* every address of the server, as of
+					   the last DNS lookup */
+    struct Backend *AllBackends;	/* ... and every one there's been */
+    unsigned int NextBackend;	/* who we try first; rotates with DNS RR */
+    unsigned int LeastConnections;	/* backend_policy least_connections */
 };
 
 
 /*
- * IMAPSelectCaches provide for caching of SELECT output from an IMAP server
+ * IMAPSelectCaches provide for caching of SELECT output from an IMAP server.
+ * Each server connection keeps the select_cache_size mailboxes it most
+ * recently SELECTed, in an array allocated on its first SELECT.  Current
+ * is the one the server has selected (-1 if none or we don't know).
+ * Wanted, unless it's -1, is one the client was told it selected from the
+ * cache; the server isn't sent the SELECT for it until the client's next
+ * command.  The rest is Select_Cache_Observe()'s place in the stream of
+ * server responses, which it uses to keep the Current entry up to date.
  */
-struct IMAPSelectCache
+struct IMAPSelectCacheEntry
 {
-    time_t ISCTime;
+    time_t ISCTime;                     /* when cached; 0 if not valid */
+    unsigned long LastUsed;             /* ISC Clock when last SELECTed */
+    unsigned long UIDValidity;          /* 0 if the server didn't say */
+    unsigned long UIDNext;              /* likewise */
+    unsigned long Messages;             /* EXISTS */
+    unsigned long long HighestModSeq;   /* 0 unless the server has CONDSTORE */
     char MailboxName[ MAXMAILBOXNAME ];
     char SelectString[ SELECT_BUF_SIZE ];
     char SelectStatus[ SELECT_STATUS_BUF_SIZE ];
 };
 
+struct IMAPSelectCache
+{
+    struct IMAPSelectCacheEntry *Entry;
+    unsigned long Clock;                /* counts SELECTs, for the LRU */
+    int Current;
+    int Wanted;
+    int CondStore;                      /* the server session has it on */
+    unsigned long Skip;                 /* literal bytes still to come */
+    unsigned int LineLen;
+    unsigned int TailLen;
+    int Overflow;                       /* response didn't fit in Line */
+    char Line[ SELECT_OBSERVE_LINE ];   /* response so far, less literals */
+    char Tail[ 32 ];                    /* last bytes of it, for {n} */
+};
+
 
 /*
  * IMAPConnectionDescriptors contain the info needed to communicate on an
@@ -235,6 +339,7 @@ struct IMAPConnectionDescriptor
 #endif
     struct IMAPSelectCache ISC;      /* Cached SELECT data                   */
     struct IMAPConnectionContext *ICC; /* backreference the ICC */
+    struct Backend *Backend;         /* server connections: who it's to     */
     unsigned int reused;             /* Was the connection reused?           */
 };
 
@@ -249,12 +354,23 @@ struct IMAPTransactionDescriptor
     char ReadBuf[ BUFSIZE ];         /* Read Buffer                          */
     unsigned int BytesInReadBuffer;  /* bytes left in read buffer            */
     unsigned int ReadBytesProcessed; /* bytes already processed in read buf  */
+    unsigned int LineStart;          /* where the last line handed out began */
     unsigned int LiteralBytesRemaining; /* num of bytes left as literal     */
     unsigned char NonSyncLiteral;    /* rfc2088 alert flag                   */
     unsigned char MoreData;          /* flag to tell caller "more data"      */
     unsigned char TraceOn;           /* trace this transaction?              */
+    unsigned int TraceSession;       /* its session id in the protocol log   */
+    struct EngineSession *Session;   /* event engine session, if any         */
+    struct timeval CommandSent;      /* server: oldest unanswered command    */
 };
 
+/*
+ * The line (or chunk of a literal) handed out by the last call to
+ * IMAP_Line_Read() or IMAP_Literal_Read().  Its length is what the
+ * call returned.
+ */
+#define ITD_LINE( ITD )         ( &(ITD)->ReadBuf[ (ITD)->LineStart ] )
+
 
 /*
  * IMAPConnectionContext structures are used to cache connection info on
@@ -266,28 +382,113 @@ struct IMAPConnectionContext
     char username[MAXUSERNAMELEN];      /* username connected on this sd     */
     char hashedpw[16];                  /* md5 hash copy of password         */
     time_t logouttime;                  /* time the user logged out last     */
-    struct IMAPConnectionContext *next; /* linked list next pointer          */
+    time_t expires;                     /* when it's due to be reaped        */
+    unsigned int shard;                 /* ICC shard this one is linked into */
+    struct ICCPool *pool;               /* the user's pool                   */
+    struct IMAPConnectionContext *next; /* pool member / free list pointer   */
+    struct IMAPConnectionContext *inext;  /* pool idle list, toward oldest   */
+    struct IMAPConnectionContext *iprev;  /* pool idle list, toward newest   */
+    struct IMAPConnectionContext *wnext;  /* timing wheel slot list          */
+    struct IMAPConnectionContext **wprev; /* ptr to whatever points at us    */
+    struct IMAPConnectionContext *lnext;  /* shard LRU list, toward newest   */
+    struct IMAPConnectionContext *lprev;  /* shard LRU list, toward oldest   */
+};
+
+
+/*
+ * All the ICCs of one user hang off an ICCPool: every one of them on the
+ * Members list and the cached (logged out) ones on the Idle list too,
+ * most recently cached first, so a login can check one out in O(1).
+ * LastMailbox remembers what the user last SELECTed so that checkout
+ * can prefer a connection whose select cache already holds it.
+ */
+struct ICCPool
+{
+    unsigned int hash;                          /* Hash( username )        */
+    unsigned int Connections;                   /* members, active or not  */
+    unsigned int Cached;                        /* on the idle list        */
+    unsigned int LastMailbox;                   /* Hash() of last SELECT   */
+    struct IMAPConnectionContext *Members;      /* via ICC->next           */
+    struct IMAPConnectionContext *Idle;         /* via ICC->inext          */
+    struct ICCPool *next;                       /* hash chain / free list  */
+};
+
+
+/*
+ * The ICC cache is split into shards by username hash.  Each shard has
+ * its own mutex, hash chains of user pools and free lists, so logins for
+ * users that land in different shards never wait on each other.  The low bits of
+ * Hash( Username ) pick the shard and the rest pick the chain in it.
+ *
+ * A shard's chain table starts out sized for its share of cache_size
+ * and doubles whenever it averages more than ICC_MAX_LOAD entries per
+ * chain.  While it grows, the old table hangs around and every lookup
+ * or insert moves another ICC_MIGRATE_STEP of its chains over, so no
+ * single login pays for the whole rehash.
+ *
+ * Cached (logged out) connections also sit on the shard's timing wheel,
+ * one slot per second modulo ICC_WHEEL_SLOTS, in the slot for the second
+ * they are due to expire.  The recycle thread turns the wheel once a
+ * second instead of sweeping the whole cache.  They are also kept on a
+ * per-shard LRU list in logout order, so that when every structure is
+ * in use the oldest cached connection can be evicted for a new login.
+ */
+#define ICC_SHARDS              16
+#define ICC_MIN_BUCKETS         16
+#define ICC_MAX_LOAD            2
+#define ICC_MIGRATE_STEP        8
+#define ICC_WHEEL_SLOTS         256
+#define ICC_SHARD( Hash )       ( &ICC_Shards[ (Hash) % ICC_SHARDS ] )
+
+struct ICCShard
+{
+    pthread_mutex_t mutex;                      /* guards everything below */
+    struct IMAPConnectionContext *free;         /* free listhead           */
+    struct ICCPool *PoolFree;                   /* free pools              */
+    struct ICCPool **HashTable;                 /* chain heads             */
+    unsigned int Buckets;                       /* power of two            */
+    struct ICCPool **OldTable;                  /* table being grown from  */
+    unsigned int OldBuckets;
+    unsigned int Migrated;                      /* old chains moved so far */
+    unsigned int Entries;                       /* pools linked into chains */
+    struct IMAPConnectionContext *Wheel[ ICC_WHEEL_SLOTS ]; /* expiry wheel */
+    time_t WheelTime;                           /* next second to process  */
+    struct IMAPConnectionContext *LRU;          /* oldest cached ICC       */
+    struct IMAPConnectionContext *LRUTail;      /* newest cached ICC       */
 };
 
 
 /*
  * One ProxyConfig structure will be used globally to keep track of
  * configurable options.  All of these options are set by reading values
- * from the global config file except for support_unselect.  That's set
- * based on the CAPABILITY string from the real IMAP server.
+ * from the global config file except for support_unselect and
+ * support_condstore.  Those are set based on the CAPABILITY string from
+ * the real IMAP server.
  */
 struct ProxyConfig
 {
     char *listen_port;         	              /* port we bind to */
     char *listen_addr;                        /* address we bind to */
+    unsigned int listen_backlog;              /* listen() backlog */
+    unsigned int listen_sockets;              /* SO_REUSEPORT listeners */
+    char *metrics_port;                       /* HTTP metrics page, if set */
+    char *metrics_addr;                       /* ...and the address for it */
+    unsigned int max_connections_per_user;    /* cap on a user's pool */
+    unsigned int spare_server_connections;    /* per backend, pre-opened */
     char *server_hostname;                    /* server we proxy to */
     char *server_port;                        /* port we proxy to */
     unsigned int server_connect_retries;      /* connect retries to IMAP server */
     unsigned int server_connect_delay;	      /* delay between connection retry rounds */
+    unsigned int server_connect_timeout;      /* give up on connect() after this */
+    char *backend_policy;                     /* how new connections pick an address */
+    unsigned int health_check_interval;       /* seconds between backend probes */
+    unsigned int dns_refresh_interval;        /* seconds between DNS lookups */
     unsigned int cache_size;                  /* number of cache slots */
     unsigned int cache_expiration_time;       /* cache exp time in seconds */
     unsigned int send_tcp_keepalives;         /* flag to send keepalives */
     unsigned int enable_select_cache;         /* flag to enable select cache */
+    unsigned int select_cache_size;           /* mailboxes cached per conn */
+    unsigned int select_cache_lifetime;       /* secs before revalidating */
     unsigned int foreground_mode;             /* flag to enable fg mode */
     char *proc_username;                      /* username to run as */
     char *proc_groupname;                     /* groupname to run as */
@@ -307,6 +508,7 @@ struct ProxyConfig
     unsigned int force_tls;                   /* flag to force TLS */
     unsigned int enable_admin_commands;       /* flag to enable admin cmds */
     unsigned char support_unselect;           /* unselect support flag */
+    unsigned char support_condstore;          /* condstore support flag */
     unsigned char support_starttls;           /* starttls support flag */
     unsigned char login_disabled;             /* login disabled flag */
     char *chroot_directory;                   /* chroot(2) into this dir */
@@ -316,20 +518,43 @@ struct ProxyConfig
     char *auth_shared_secret;                 /* REQUIRED shared secret in leiu of a user password when using LOGIN command with SASL PLAIN authentication */
     unsigned int ipversion;                   /* limit DNS requests to AF_INET or AF_INET6 */
     unsigned int dnsrr;                       /* cycle through all DNS entries we got */
+    char *io_engine;                          /* "threads" or "epoll" */
+    unsigned int io_engine_threads;           /* number of epoll worker threads */
+    unsigned int io_engine_helper_threads;    /* threads for blocking steps */
 };
 
 
 /*
  * One IMAPCounter structure will be used globally to keep track of
  * several different things that we want to keep a count of, purely for
- * diagnostic, or usage tracking purposes.
+ * diagnostic, or usage tracking purposes.  It lives in the stat file,
+ * for pimpstat to read.
+ *
+ * The counts themselves aren't kept there.  Each thread adds to its own
+ * IMAPCounterBlock with the COUNT() macro, so no mutex is taken and no
+ * cache line is fought over, and once a second Counter_Sync() adds them
+ * all up into the stat file (see counter.c).  The peaks are taken then
+ * too, so one that lasts less than a second can be missed.
  *
- * IMPORTANT NOTE: No attempt is made to guarantee that these counters
- * will be completely accurate.  No mutex is ever taken out when these
- * counters are updated.  This was done for performance -- these numbers
- * aren't considered important enough to waste time locking a mutex to
- * guarantee their accuracy.
+ * Latency[] holds a histogram for each of the LATENCY_ timings, counted
+ * the same way with Counter_Latency().  Bucket i starts at
+ * LATENCY_BUCKET_LOW( i ) microseconds: one bucket per microsecond up
+ * to 4, then four buckets per doubling, so any time is off by no more
+ * than a quarter.  The last bucket takes anything over a couple of
+ * minutes.
  */
+#define LATENCY_CLIENT_LOGIN	0	/* client LOGIN to our OK          */
+#define LATENCY_CONNECT		1	/* connect() to the server         */
+#define LATENCY_STARTTLS	2	/* STARTTLS through the handshake  */
+#define LATENCY_SERVER_LOGIN	3	/* our LOGIN to the server's OK    */
+#define LATENCY_SELECT_CACHED	4	/* SELECT answered from the cache  */
+#define LATENCY_SELECT_UNCACHED	5	/* ...and by asking the server     */
+#define LATENCY_COMMAND		6	/* command relayed to first reply  */
+#define LATENCY_KINDS		7
+#define LATENCY_BUCKETS		104
+#define LATENCY_BUCKET_LOW( i )	( (i) < 4 ? (unsigned long)(i) : \
+				  (unsigned long)( 4 + (i) % 4 ) << ( (i) / 4 - 1 ) )
+
 struct IMAPCounter
 {
     time_t StartTime;
@@ -344,9 +569,206 @@ struct IMAPCounter
     unsigned int TotalClientLogins;
     unsigned int TotalServerConnectionsCreated;
     unsigned int TotalServerConnectionsReused;
+    unsigned int TotalServerConnectionsEvicted;
     unsigned int TotalSelectCommands;
     unsigned int SelectCacheHits;
     unsigned int SelectCacheMisses;
+    unsigned int SelectCacheRevalidations; /* hits after a STATUS check */
+    unsigned int ICCBuckets;            /* ICC hash chains, all shards */
+    unsigned int ICCChainsInUse;        /* chains with anything on them */
+    unsigned int ICCLongestChain;
+    unsigned int ICCPools;              /* users with server connections */
+    unsigned int SpareConnectionHits;   /* new connections from a spare */
+    unsigned int SpareConnectionMisses; /* ...and opened on the spot */
+    unsigned int TLSSessionsResumed;    /* STARTTLS without a full handshake */
+    unsigned int TLSFullHandshakes;
+    unsigned int TraceRecordsDropped;   /* protocol log couldn't keep up */
+    unsigned int RelayWritesSaved;      /* pipelined commands sent along */
+                                        /* with the one before them      */
+    unsigned int Latency[ LATENCY_KINDS ][ LATENCY_BUCKETS ];
+    unsigned long long LatencySum[ LATENCY_KINDS ];  /* microseconds */
+};
+
+struct IMAPCounterBlock
+{
+    int CurrentClientConnections;       /* these three can go negative */
+    int InUseServerConnections;         /* in any one thread's block    */
+    int RetainedServerConnections;
+    unsigned int TotalClientConnectionsAccepted;
+    unsigned int TotalClientLogins;
+    unsigned int TotalServerConnectionsCreated;
+    unsigned int TotalServerConnectionsReused;
+    unsigned int TotalServerConnectionsEvicted;
+    unsigned int TotalSelectCommands;
+    unsigned int SelectCacheHits;
+    unsigned int SelectCacheMisses;
+    unsigned int SelectCacheRevalidations;
+    unsigned int SpareConnectionHits;
+    unsigned int SpareConnectionMisses;
+    unsigned int TLSSessionsResumed;
+    unsigned int TLSFullHandshakes;
+    unsigned int TraceRecordsDropped;
+    unsigned int RelayWritesSaved;
+    unsigned int Latency[ LATENCY_KINDS ][ LATENCY_BUCKETS ];
+    unsigned long long LatencySum[ LATENCY_KINDS ];
+    struct IMAPCounterBlock *next;      /* every block there is */
+    struct IMAPCounterBlock *fnext;     /* blocks no thread owns */
+};
+
+#define COUNTER_ALIGN	64		/* a cache line, on most things */
+
+/* add Delta to the counter Field, in this thread's block */
+#define COUNT( Field, Delta )	( Counter_Block()->Field += ( Delta ) )
+
+
+/*
+ * The stat file describes itself, so pimpstat doesn't have to be built
+ * from the same imapproxy.h as the proxy.  It starts with an
+ * IMAPStatHeader, which points at a table of IMAPStatField records (one
+ * per counter), a table of IMAPStatHistogram records, the lower bound of
+ * each histogram bucket in microseconds and the counters themselves.
+ * Every offset is from the start of the file.  A reader finds counters by
+ * name, skips names it doesn't know, and uses the record sizes in the
+ * header to step through the tables, so counters and record fields can be
+ * added without breaking it.  STAT_VERSION only changes if that stops
+ * being true.
+ *
+ * The proxy writes the magic last, once everything else is in place.
+ */
+#define STAT_MAGIC	"IMAPSTAT"
+#define STAT_VERSION	1
+#define STAT_NAME_LEN	48
+#define STAT_HELP_LEN	80
+
+#define STAT_GAUGE	1		/* a value that goes up and down */
+#define STAT_COUNTER	2		/* a total that only goes up      */
+#define STAT_TIME	3		/* seconds since the epoch        */
+
+struct IMAPStatHeader
+{
+    char Magic[ 8 ];                    /* STAT_MAGIC, no terminator */
+    unsigned int Version;
+    unsigned int HeaderSize;
+    unsigned int FileSize;
+    unsigned int FieldCount;
+    unsigned int FieldOffset;
+    unsigned int FieldSize;             /* of one IMAPStatField */
+    unsigned int HistogramCount;
+    unsigned int HistogramOffset;
+    unsigned int HistogramSize;         /* of one IMAPStatHistogram */
+    unsigned int BucketCount;
+    unsigned int BucketOffset;          /* BucketCount unsigned ints */
+    unsigned int DataOffset;            /* the IMAPCounter */
+};
+
+struct IMAPStatField
+{
+    char Name[ STAT_NAME_LEN ];
+    char Help[ STAT_HELP_LEN ];
+    unsigned int Type;                  /* STAT_GAUGE and so on */
+    unsigned int Size;                  /* 4 or 8 bytes */
+    unsigned int Offset;
+};
+
+struct IMAPStatHistogram
+{
+    char Name[ STAT_NAME_LEN ];
+    char Help[ STAT_HELP_LEN ];
+    unsigned int Offset;                /* BucketCount unsigned ints */
+    unsigned int SumOffset;             /* 8 byte total, microseconds */
+};
+
+
+/*
+ * The protocol log is a series of frames, each a TraceFrame followed by
+ * Length bytes of payload, with every number in network byte order.
+ * Session ties the frames of one traced login together; a TRACE_OPEN
+ * frame starts it (payload: user, client address and server, each NUL
+ * terminated) and a TRACE_CLOSE frame ends it.  Notes from the proxy
+ * itself are in session 0.  pimptrace decodes it.
+ */
+#define TRACE_MAGIC	0xA7
+#define TRACE_VERSION	1
+#define TRACE_TARGETS	16		/* users and addresses traced at once */
+
+#define TRACE_NOTE	0		/* text from the proxy            */
+#define TRACE_OPEN	1		/* a traced session logged in     */
+#define TRACE_CLIENT	2		/* data from the client           */
+#define TRACE_SERVER	3		/* data from the server           */
+#define TRACE_CLOSE	4		/* the session logged out         */
+
+struct TraceFrame
+{
+    unsigned char Magic;                /* TRACE_MAGIC */
+    unsigned char Version;              /* TRACE_VERSION */
+    unsigned char Type;
+    unsigned char Reserved;
+    unsigned int Session;
+    unsigned int Seconds;               /* since the epoch */
+    unsigned int Nanoseconds;
+    unsigned int Length;                /* of the payload */
+};
+
+
+/*
+ * IMAP commands, as Command_Classify() knows them (see command.c).  A
+ * command the proxy doesn't know is CMD_UNKNOWN, with no properties.
+ */
+#define CMD_UNKNOWN		0
+#define CMD_APPEND		1
+#define CMD_AUTHENTICATE	2
+#define CMD_CAPABILITY		3
+#define CMD_CHECK		4
+#define CMD_CLOSE		5
+#define CMD_COPY		6
+#define CMD_CREATE		7
+#define CMD_DELETE		8
+#define CMD_ENABLE		9
+#define CMD_EXAMINE		10
+#define CMD_EXPUNGE		11
+#define CMD_FETCH		12
+#define CMD_ID			13
+#define CMD_IDLE		14
+#define CMD_LIST		15
+#define CMD_LOGIN		16
+#define CMD_LOGOUT		17
+#define CMD_LSUB		18
+#define CMD_MOVE		19
+#define CMD_NAMESPACE		20
+#define CMD_NOOP		21
+#define CMD_RENAME		22
+#define CMD_SEARCH		23
+#define CMD_SELECT		24
+#define CMD_STARTTLS		25
+#define CMD_STATUS		26
+#define CMD_STORE		27
+#define CMD_SUBSCRIBE		28
+#define CMD_UNSELECT		29
+#define CMD_UNSUBSCRIBE		30
+#define CMD_XPROXY_DUMPICC	31
+#define CMD_XPROXY_NEWLOG	32
+#define CMD_XPROXY_RESETCOUNTERS 33
+#define CMD_XPROXY_TRACE	34
+#define CMD_XPROXY_UNTRACE	35
+#define CMD_XPROXY_VERSION	36
+
+#define COMMAND_SAFE		0x01	/* leaves the SELECT cache valid   */
+#define COMMAND_MUTATING	0x02	/* can change the selected mailbox */
+#define COMMAND_SELECTS		0x04	/* changes which one is selected   */
+#define COMMAND_LITERAL		0x08	/* always carries a literal        */
+#define COMMAND_UID		0x10	/* sent as UID <command>           */
+#define COMMAND_ADMIN		0x20	/* one of the proxy's own          */
+
+
+/*
+ * A metrics page being built for one scrape (see metrics.c).
+ */
+struct MetricsPage
+{
+    char *Buf;
+    unsigned int Len;
+    unsigned int Size;
+    unsigned int Failed;                /* ran out of memory building it */
 };
 
    
@@ -364,14 +786,63 @@ typedef struct IMAPSelectCache ISC_Struct;
  */
 extern int IMAP_Write( ICD_Struct *, const void *, int );
 extern int IMAP_Read( ICD_Struct *, void *, int );
+extern int IMAP_Splice_Open( ITD_Struct *, int * );
+extern int IMAP_Splice( ICD_Struct *, ICD_Struct *, int *, unsigned int * );
+extern int IMAP_Splice_Flush( ICD_Struct *, int *, unsigned int * );
 extern int IMAP_Line_Read( ITD_Struct * );
+extern void IMAP_Buffer_Compact( ITD_Struct * );
 extern int IMAP_Literal_Read( ITD_Struct * );
 extern void HandleRequest( int );
+extern int Handle_Preauth_Line( ITD_Struct *, char * );
+extern void Answer_Caught_Logout( ITD_Struct * );
+extern int Relay_Client_Command( ITD_Struct *, ITD_Struct *, ISC_Struct * );
+extern int Relay_Line_Plain( ITD_Struct *, ISC_Struct * );
+extern int Relay_Gather( ITD_Struct *, ISC_Struct * );
+extern int Relay_Finish( ITD_Struct *, ITD_Struct *, int );
+extern void Trace_Init( void );
+extern int Trace_Add( const char * );
+extern int Trace_Remove( const char * );
+extern void Trace_Clear( void );
+extern void Trace_Start( ITD_Struct *, ITD_Struct *, const char *, const char * );
+extern void Trace_End( ITD_Struct * );
+extern void Trace_Data( ITD_Struct *, int, const char *, int );
+extern void Trace_Note( const char * );
+extern void Engine_Init( void );
+extern void Engine_Add_Client( int );
+extern int Engine_Adopt_Relay( struct EngineSession *, ITD_Struct * );
 extern char *memtok( char *, char *, char ** );
 extern int imparse_isatom( const char * );
+extern void Backend_Init( void );
+extern int Backend_Connect( ITD_Struct * );
+extern void Backend_Count( struct Backend *, int, int );
+#if HAVE_LIBSSL
+extern int Attempt_STARTTLS( ITD_Struct *, struct Backend * );
+extern int Backend_New_Session( SSL *, SSL_SESSION * );
+#endif
 extern ICD_Struct *Get_Server_conn( char *, char *, const char *, const char *, unsigned char, char *, char * );
+extern void ICC_Init( unsigned int );
+extern struct ICCPool **ICC_Chain( struct ICCShard *, unsigned int );
+extern struct ICCPool *ICC_Pool_Find( struct ICCShard *, unsigned int, const char * );
+extern ICC_Struct *ICC_Pick_Idle( struct ICCPool * );
+extern void ICC_Note_Select( ICC_Struct *, const char * );
+extern void ICC_Settle( struct ICCShard * );
+extern ICC_Struct *ICC_New( char *, char *, ICD_Struct * );
+extern void ICC_Set_Logout( struct ICCShard *, ICC_Struct *, time_t );
 extern void ICC_Logout( ICC_Struct * );
-extern void ICC_Recycle( unsigned int );
+extern void ICC_Invalidate( ICC_Struct * );
+extern void ICC_Drain_Retired( void );
+extern void Counter_Init( void );
+extern unsigned int Counter_Stat_Size( void );
+extern IMAPCounter_Struct *Counter_Stat_Init( void * );
+extern struct IMAPCounterBlock *Counter_Block( void );
+extern void Counter_Sync( void );
+extern void Counter_Reset( void );
+extern void Counter_Latency( unsigned int, struct timeval * );
+extern void Counter_Metrics( struct MetricsPage * );
+extern void Backend_Metrics( struct MetricsPage * );
+extern void Select_Metrics( struct MetricsPage * );
+extern void Metrics_Init( int );
+extern void Metrics_Printf( struct MetricsPage *, const char *, ... );
 extern void ICC_Recycle_Loop( void );
 extern void LockMutex( pthread_mutex_t * );
 extern void UnLockMutex( pthread_mutex_t * );
@@ -379,8 +850,14 @@ extern void SetDefaultConfigValues(ProxyConfig_Struct *);
 extern void SetConfigOptions( char * );
 extern void SetLogOptions( void );
 extern int Handle_Select_Command( ITD_Struct *, ITD_Struct *, ISC_Struct *, char *, int );
-extern unsigned int Is_Safe_Command( char *Command );
+extern unsigned int Command_Classify( const char *, unsigned int, unsigned int * );
 extern void Invalidate_Cache_Entry( ISC_Struct * );
+extern void Select_Cache_Command( ISC_Struct *, unsigned int, unsigned int, const char *, unsigned int );
+extern int Select_Cache_Sync( ITD_Struct *, ITD_Struct *, ISC_Struct * );
+extern int Select_Cache_Holds( ISC_Struct *, unsigned int, time_t );
+extern void Select_Cache_Free( ISC_Struct * );
+extern void Select_Cache_Observe( ISC_Struct *, const char *, int );
+extern void Select_Cache_Observe_Reset( ISC_Struct * );
 extern int atoui( const char *, unsigned int * );
 
 
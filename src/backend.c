@@ -0,0 +1,1606 @@
+/*
+**
+** Copyright (c) 2010-2016 The SquirrelMail Project Team
+**
+** Licensed under the GNU GPL. For full terms see the file COPYING.
+**
+** This file is part of SquirrelMail IMAP Proxy.
+**
+**  Facility:
+**
+**	backend.c
+**
+**  Abstract:
+**
+**	Routines to open new connections to the IMAP server.  Each address
+**	of the server is a backend.  New connections race the addresses
+**	that aren't marked down, happy eyeballs style, so one dead address
+**	costs a login no more than a fraction of a second.  If
+**	spare_server_connections is set, a thread per backend keeps that
+**	many connections to it open, with the banner read and STARTTLS
+**	done, so that a login that can't reuse a cached connection only has
+**	to wait for the LOGIN itself.
+**
+**	Backends keep count of the connections they have, so that with
+**	backend_policy least_connections each login goes to the least
+**	loaded one, and an optional health check thread probes them all
+**	every health_check_interval seconds.
+**
+**	With dns_refresh_interval set, another thread looks the server up
+**	again every so often and swaps in the new list of backends.  Logins
+**	take a reference to whatever list is current, so they never wait
+**	on DNS, and the old list is freed when the last of them is done
+**	with it.  Cached connections to addresses that have gone away are
+**	closed; ones in use are left to finish.
+**
+**  Authors:
+**
+**      The SquirrelMail Project Team
+**
+**  Version:
+**
+**      $Id$
+**
+**  Modification History:
+**
+**      $Log$
+**
+*/
+
+
+#define _REENTRANT
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "imapproxy.h"
+
+/*
+ * External globals
+ */
+extern ISD_Struct ISD;
+extern pthread_mutex_t aimtx;
+extern IMAPCounter_Struct *IMAPCount;
+extern ProxyConfig_Struct PC_Struct;
+
+/*
+ * internal prototypes
+ */
+static struct Backend *Backend_Find( struct addrinfo * );
+static struct BackendSet *Backend_Set_Build( struct addrinfo * );
+static int Backend_Set_Has( struct BackendSet *, struct Backend * );
+static struct BackendSet *Backend_Set_Get( unsigned int * );
+static void Backend_Set_Put( struct BackendSet * );
+static void Backend_Spares_Update( void );
+static void *Backend_Refresh_Loop( void * );
+static int Backend_Open( struct BackendSet *, struct Backend *, ITD_Struct * );
+static int Backend_Dial( struct BackendSet *, struct Backend *, struct Backend ** );
+static void Backend_Mark( struct Backend *, int );
+static long Backend_Msecs( struct timeval * );
+static struct Backend *Backend_Least_Loaded( struct BackendSet *, unsigned int );
+static int Backend_Probe( struct Backend * );
+static void *Backend_Health_Loop( void * );
+static int Backend_Take_Spare( struct Backend *, ITD_Struct * );
+static void Backend_Close( ICD_Struct * );
+static void *Backend_Spare_Loop( void * );
+
+
+
+/*++
+ * Function:	Backend_Init
+ *
+ * Purpose:	Set up a backend for each address of the server and start
+ *		the threads that look after them.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Must be called after ServerInit() has found the server.
+ *		Without DNS round robin or least_connections, new
+ *		connections go to ISD.srv as long as it's up, and only it
+ *		gets spares; the other addresses are only there to fall
+ *		back on.
+ *--
+ */
+extern void Backend_Init( void )
+{
+    char *fn = "Backend_Init()";
+    struct BackendSet *Set;
+    struct Backend *Primary;
+    pthread_attr_t attr;
+    pthread_t ThreadId;
+    unsigned int i;
+    int rc;
+
+    if ( PC_Struct.backend_policy &&
+	 strcasecmp( PC_Struct.backend_policy, "round_robin" ) )
+    {
+	if ( strcasecmp( PC_Struct.backend_policy, "least_connections" ) )
+	{
+	    syslog( LOG_ERR, "%s: Unknown backend_policy '%s' in config file.  Exiting.", fn, PC_Struct.backend_policy );
+	    exit( 1 );
+	}
+	ISD.LeastConnections = 1;
+    }
+
+    Set = Backend_Set_Build( ISD.airesults );
+    Set->Refs = 1;
+
+    Primary = Backend_Find( ISD.srv );
+    for ( i = 0; i < Set->Count; i++ )
+	if ( Set->Backend[ i ] == Primary )
+	    ISD.NextBackend = i;
+
+    ISD.Backends = Set;
+
+    rc = pthread_attr_init( &attr );
+    if ( ! rc )
+	rc = pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if ( rc )
+    {
+	syslog(LOG_ERR, "%s: pthread_attr setup failed: [%d] -- Exiting.", fn, rc);
+	exit( 1 );
+    }
+
+    if ( PC_Struct.health_check_interval )
+    {
+	rc = pthread_create( &ThreadId, &attr, Backend_Health_Loop, NULL );
+	if ( rc )
+	{
+	    syslog(LOG_ERR, "%s: pthread_create() returned error [%d] for Backend_Health_Loop -- Exiting.", fn, rc );
+	    exit( 1 );
+	}
+    }
+
+    if ( PC_Struct.dns_refresh_interval )
+    {
+	rc = pthread_create( &ThreadId, &attr, Backend_Refresh_Loop, NULL );
+	if ( rc )
+	{
+	    syslog(LOG_ERR, "%s: pthread_create() returned error [%d] for Backend_Refresh_Loop -- Exiting.", fn, rc );
+	    exit( 1 );
+	}
+	syslog(LOG_INFO, "%s: Looking up '%s' again every %d seconds.", fn, PC_Struct.server_hostname, PC_Struct.dns_refresh_interval );
+    }
+
+    pthread_attr_destroy( &attr );
+
+    if ( ! PC_Struct.spare_server_connections )
+	return;
+
+    Backend_Spares_Update();
+
+    syslog(LOG_INFO, "%s: Keeping %d spare server connections to each of %d backends.", fn, PC_Struct.spare_server_connections, ( PC_Struct.dnsrr || ISD.LeastConnections ) ? Set->Count : 1 );
+}
+
+
+
+/*++
+ * Function:	Backend_Find
+ *
+ * Purpose:	Find the backend for an address, making one if there isn't
+ *		one yet.
+ *
+ * Parameters:	ptr to the addrinfo for the address
+ *
+ * Returns:	ptr to the backend -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Only Backend_Init() and then the DNS refresh thread add to
+ *		ISD.AllBackends, so walking it needs no lock.
+ *--
+ */
+static struct Backend *Backend_Find( struct addrinfo *ai )
+{
+    char *fn = "Backend_Find()";
+    struct Backend *Backend;
+    int rc;
+
+    for ( Backend = ISD.AllBackends; Backend; Backend = Backend->anext )
+    {
+	if ( ( Backend->AddrLen == ai->ai_addrlen ) &&
+	     ! memcmp( &Backend->Addr, ai->ai_addr, ai->ai_addrlen ) )
+	    return( Backend );
+    }
+
+    Backend = (struct Backend *)calloc( 1, sizeof ( struct Backend ) );
+    if ( ! Backend )
+    {
+	syslog(LOG_ERR, "%s: calloc() failed to allocate a backend: %s -- Exiting.", fn, strerror( errno ) );
+	exit( 1 );
+    }
+
+    memcpy( &Backend->Addr, ai->ai_addr, ai->ai_addrlen );
+    Backend->AddrLen = ai->ai_addrlen;
+    Backend->Family = ai->ai_family;
+    Backend->SockType = ai->ai_socktype;
+    Backend->Protocol = ai->ai_protocol;
+
+    if ( getnameinfo( ai->ai_addr, ai->ai_addrlen,
+		      Backend->Name, sizeof Backend->Name,
+		      NULL, 0, NI_NUMERICHOST ) )
+	strcpy( Backend->Name, "unknown" );
+
+    rc = pthread_mutex_init( &Backend->mutex, NULL );
+    if ( ! rc )
+	rc = pthread_cond_init( &Backend->cond, NULL );
+    if ( rc )
+    {
+	syslog(LOG_ERR, "%s: pthread_mutex_init() or pthread_cond_init() returned error [%d] initializing backend.  Exiting.", fn, rc );
+	exit( 1 );
+    }
+
+    Backend->anext = ISD.AllBackends;
+    ISD.AllBackends = Backend;
+
+    return( Backend );
+}
+
+
+
+/*++
+ * Function:	Backend_Set_Build
+ *
+ * Purpose:	Make a backend set out of the results of a DNS lookup.
+ *
+ * Parameters:	ptr to the addrinfo list
+ *
+ * Returns:	ptr to the set, with no references -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static struct BackendSet *Backend_Set_Build( struct addrinfo *List )
+{
+    char *fn = "Backend_Set_Build()";
+    struct BackendSet *Set;
+    struct Backend *Backend;
+    struct addrinfo *ai;
+    unsigned int Count = 0;
+
+    for ( ai = List; ai; ai = ai->ai_next )
+	Count++;
+
+    Set = (struct BackendSet *)malloc( sizeof ( struct BackendSet ) );
+    if ( Set )
+	Set->Backend = (struct Backend **)malloc( Count * sizeof ( struct Backend * ) );
+    if ( ! Set || ! Set->Backend )
+    {
+	syslog(LOG_ERR, "%s: malloc() failed to allocate [%d] backends: %s -- Exiting.", fn, Count, strerror( errno ) );
+	exit( 1 );
+    }
+
+    Set->Count = 0;
+    Set->Refs = 0;
+
+    for ( ai = List; ai; ai = ai->ai_next )
+    {
+	Backend = Backend_Find( ai );
+	if ( ! Backend_Set_Has( Set, Backend ) )
+	    Set->Backend[ Set->Count++ ] = Backend;
+    }
+
+    return( Set );
+}
+
+
+
+/*++
+ * Function:	Backend_Set_Has
+ *
+ * Purpose:	Tell whether a backend is in a set.
+ *
+ * Parameters:	ptr to the set
+ *		ptr to the backend
+ *
+ * Returns:	1 if it is
+ *		0 if not
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static int Backend_Set_Has( struct BackendSet *Set, struct Backend *Backend )
+{
+    unsigned int i;
+
+    for ( i = 0; i < Set->Count; i++ )
+	if ( Set->Backend[ i ] == Backend )
+	    return( 1 );
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Backend_Set_Get
+ *
+ * Purpose:	Get a reference to the current backend set.
+ *
+ * Parameters:	ptr to where to put the index of the backend to try first,
+ *		or NULL if we're not here to connect
+ *
+ * Returns:	ptr to the set, which stays valid until Backend_Set_Put()
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	aimtx is only held long enough to take the reference and,
+ *		with DNS round robin or least_connections, move the
+ *		rotation along.
+ *--
+ */
+static struct BackendSet *Backend_Set_Get( unsigned int *Next )
+{
+    struct BackendSet *Set;
+
+    LockMutex( &aimtx );
+    Set = ISD.Backends;
+    Set->Refs++;
+    if ( Next )
+    {
+	*Next = ISD.NextBackend;
+	if ( PC_Struct.dnsrr || ISD.LeastConnections )
+	{
+	    /* cycle through returned hosts */
+	    ISD.NextBackend = ( ISD.NextBackend + 1 ) % Set->Count;
+	}
+    }
+    UnLockMutex( &aimtx );
+
+    return( Set );
+}
+
+
+
+/*++
+ * Function:	Backend_Set_Put
+ *
+ * Purpose:	Let go of a reference to a backend set.
+ *
+ * Parameters:	ptr to the set
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The last one out frees it.  The current set always has a
+ *		reference of its own, so only one that's been replaced can
+ *		go.  The backends themselves are never freed.
+ *--
+ */
+static void Backend_Set_Put( struct BackendSet *Set )
+{
+    unsigned int Refs;
+
+    LockMutex( &aimtx );
+    Refs = --Set->Refs;
+    UnLockMutex( &aimtx );
+
+    if ( Refs )
+	return;
+
+    free( Set->Backend );
+    free( Set );
+}
+
+
+
+/*++
+ * Function:	Backend_Connect
+ *
+ * Purpose:	Get a new, unauthenticated connection to the IMAP server.
+ *
+ * Parameters:	ptr to the server ITD, whose conn gets filled in
+ *
+ * Returns:	0 on success
+ *		-1 on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	With least_connections, each call starts with the backend
+ *		that has the fewest connections; with DNS round robin, with
+ *		the next backend.  A spare connection is used if that
+ *		backend has one and isn't down; otherwise we open one here
+ *		and now.
+ *--
+ */
+extern int Backend_Connect( ITD_Struct *Server )
+{
+    struct BackendSet *Set;
+    struct Backend *Backend;
+    unsigned int Next;
+    int rc = 0;
+
+    Set = Backend_Set_Get( &Next );
+
+    if ( ISD.LeastConnections )
+	Backend = Backend_Least_Loaded( Set, Next );
+    else
+	Backend = Set->Backend[ Next ];
+
+    if ( Backend->Spared && ( Backend->DownUntil <= time( 0 ) ) &&
+	 ( Backend_Take_Spare( Backend, Server ) == 0 ) )
+    {
+	COUNT( SpareConnectionHits, 1 );
+    }
+    else
+    {
+	if ( Backend->Spared )
+	    COUNT( SpareConnectionMisses, 1 );
+
+	rc = Backend_Open( Set, Backend, Server );
+    }
+
+    Backend_Set_Put( Set );
+
+    if ( rc == -1 )
+	return( -1 );
+
+    Backend_Count( Server->conn->Backend, 1, 0 );
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Backend_Least_Loaded
+ *
+ * Purpose:	Find the backend with the fewest connections.
+ *
+ * Parameters:	ptr to the backend set
+ *		unsigned int -- index of the backend to start looking at
+ *
+ * Returns:	ptr to the backend
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Backends that are down only get picked if they all are.
+ *		Ties go round robin, so an idle pool is spread evenly.  The
+ *		counts are read without their mutexes; a slightly stale
+ *		count does no harm here.
+ *--
+ */
+static struct Backend *Backend_Least_Loaded( struct BackendSet *Set,
+					     unsigned int Start )
+{
+    struct Backend *Backend;
+    struct Backend *Best = NULL;
+    unsigned int i;
+    time_t Now;
+
+    Now = time( 0 );
+
+    for ( i = 0; i < Set->Count; i++ )
+    {
+	Backend = Set->Backend[ ( Start + i ) % Set->Count ];
+
+	if ( ! Best ||
+	     ( ( Best->DownUntil > Now ) && ( Backend->DownUntil <= Now ) ) ||
+	     ( ( ( Best->DownUntil > Now ) == ( Backend->DownUntil > Now ) ) &&
+	       ( Backend->Connections < Best->Connections ) ) )
+	    Best = Backend;
+    }
+
+    return( Best );
+}
+
+
+
+/*++
+ * Function:	Backend_Count
+ *
+ * Purpose:	Keep a backend's connection counts up to date.
+ *
+ * Parameters:	ptr to the backend (NULL is ok, and ignored)
+ *		int -- change in open connections
+ *		int -- change in active connections
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern void Backend_Count( struct Backend *Backend, int Connections,
+			   int Active )
+{
+    if ( ! Backend )
+	return;
+
+    LockMutex( &Backend->mutex );
+    Backend->Connections += Connections;
+    Backend->Active += Active;
+    UnLockMutex( &Backend->mutex );
+}
+
+
+
+/*++
+ * Function:	Backend_Metrics
+ *
+ * Purpose:	Add the state of every server address to a metrics page.
+ *
+ * Parameters:	ptr to the page
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Addresses DNS has dropped are listed until their last
+ *		connection is gone, with backend_in_dns 0.
+ *--
+ */
+extern void Backend_Metrics( struct MetricsPage *Page )
+{
+    static char *Families[][ 2 ] =
+    {
+	{ "backend_up", "Whether new logins go to this server address; 0 while it is backed off." },
+	{ "backend_in_dns", "Whether the last DNS lookup still gave this address." },
+	{ "backend_connections", "Server connections to this address, cached or in use." },
+	{ "backend_active_connections", "Server connections to this address in use by a client." },
+	{ "backend_spare_connections", "Spare connections open to this address." },
+	{ "backend_connect_failures", "Connects to this address that have failed in a row." }
+    };
+    struct Backend *Backend;
+    unsigned int Value = 0;
+    unsigned int Skip;
+    unsigned int i;
+    time_t Now;
+
+    Now = time( 0 );
+
+    for ( i = 0; i < sizeof Families / sizeof Families[ 0 ]; i++ )
+    {
+	Metrics_Printf( Page, "# HELP imapproxy_%s %s\n# TYPE imapproxy_%s gauge\n",
+			Families[ i ][ 0 ], Families[ i ][ 1 ], Families[ i ][ 0 ] );
+
+	for ( Backend = ISD.AllBackends; Backend; Backend = Backend->anext )
+	{
+	    LockMutex( &Backend->mutex );
+	    Skip = ( Backend->Retired && ! Backend->Connections );
+	    switch ( i )
+	    {
+	    case 0:
+		Value = ( Backend->DownUntil <= Now );
+		break;
+	    case 1:
+		Value = ! Backend->Retired;
+		break;
+	    case 2:
+		Value = Backend->Connections;
+		break;
+	    case 3:
+		Value = Backend->Active;
+		break;
+	    case 4:
+		Value = Backend->Spares;
+		break;
+	    case 5:
+		Value = Backend->Failures;
+		break;
+	    }
+	    UnLockMutex( &Backend->mutex );
+
+	    if ( Skip )
+		continue;
+
+	    Metrics_Printf( Page, "imapproxy_%s{backend=\"%s\"} %u\n",
+			    Families[ i ][ 0 ], Backend->Name, Value );
+	}
+    }
+}
+
+
+
+/*++
+ * Function:	Backend_Open
+ *
+ * Purpose:	Open a connection to the server, read its banner and do
+ *		STARTTLS if we're configured to.
+ *
+ * Parameters:	ptr to the backend set to fall back on, or NULL not to
+ *		ptr to the backend to try first
+ *		ptr to the server ITD, whose conn gets filled in
+ *
+ * Returns:	0 on success
+ *		-1 on failure, with nothing left open
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static int Backend_Open( struct BackendSet *Set, struct Backend *First,
+			 ITD_Struct *Server )
+{
+    char *fn = "Backend_Open()";
+    struct Backend *Backend = First;
+    struct timeval tv;
+
+    Server->conn = ( ICD_Struct * ) malloc( sizeof ( ICD_Struct ) );
+    if (Server->conn == NULL) {
+	syslog( LOG_ERR, "%s: malloc() failed: %s -- Exiting.", fn,
+		strerror( errno ) );
+	exit( 1 );
+    }
+    memset( Server->conn, 0, sizeof ( ICD_Struct ) );
+
+    /* As a new connection, the ICD is not 'reused' */
+    Server->conn->reused = 0;
+
+    Server->conn->sd = Backend_Dial( Set, First, &Backend );
+    if ( Server->conn->sd == -1 )
+	goto fail;
+
+    Server->conn->Backend = Backend;
+
+    if ( PC_Struct.send_tcp_keepalives )
+    {
+	int onoff = 1;
+	setsockopt( Server->conn->sd, SOL_SOCKET, SO_KEEPALIVE, &onoff, sizeof onoff );
+    }
+
+
+    /*
+     * Read & throw away the banner line from the server.  A server that
+     * takes the connect but never says hello is no more use than one
+     * that refuses it, so the banner gets the connect timeout too.
+     */
+    tv.tv_sec = PC_Struct.server_connect_timeout ?
+	PC_Struct.server_connect_timeout : DEFAULT_SERVER_CONNECT_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt( Server->conn->sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv );
+
+    if ( IMAP_Line_Read( Server ) == -1 )
+    {
+	syslog( LOG_INFO, "%s: No banner line received from IMAP server",
+		fn );
+	Backend_Mark( Backend, 0 );
+	goto fail;
+    }
+
+    /*
+     * Sanity check.  We don't deal with literal responses in the
+     * banner string.
+     */
+    if ( Server->LiteralBytesRemaining )
+    {
+	syslog(LOG_ERR, "%s: Unexpected string literal in server banner response.", fn );
+	Backend_Mark( Backend, 0 );
+	goto fail;
+
+    }
+
+    if ( strncasecmp( ITD_LINE( Server ), "* OK", 4 ) &&
+	 strncasecmp( ITD_LINE( Server ), "* PREAUTH", 9 ) )
+    {
+	syslog( LOG_INFO, "%s: No greeting from backend %s.", fn,
+		Backend->Name );
+	Backend_Mark( Backend, 0 );
+	goto fail;
+    }
+
+    Backend_Mark( Backend, 1 );
+
+
+    /*
+     * Do STARTTLS if necessary.
+     */
+#if HAVE_LIBSSL
+    if ( PC_Struct.login_disabled || PC_Struct.force_tls )
+    {
+	if ( Attempt_STARTTLS( Server, Backend ) != 0 )
+	{
+	    goto fail;
+	}
+    }
+#endif /* HAVE_LIBSSL */
+
+    /* from here on the client decides how long we wait */
+    tv.tv_sec = 0;
+    setsockopt( Server->conn->sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv );
+
+    return( 0 );
+
+  fail:
+#if HAVE_LIBSSL
+    if ( Server->conn->tls )
+    {
+	SSL_shutdown( Server->conn->tls );
+	SSL_free( Server->conn->tls );
+    }
+#endif
+    if ( Server->conn->sd != -1 )
+	close( Server->conn->sd );
+    free( Server->conn );
+    Server->conn = NULL;
+    return( -1 );
+}
+
+
+
+/*++
+ * Function:	Backend_Dial
+ *
+ * Purpose:	Connect a socket to the server.
+ *
+ * Parameters:	ptr to the backend set to fall back on, or NULL not to
+ *		ptr to the backend to try first
+ *		ptr to where to put the backend we got through to
+ *
+ * Returns:	connected (blocking) socket descriptor
+ *		-1 on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Happy eyeballs (RFC 8305), more or less.  The backends are
+ *		tried in order, starting with First, with the ones that are
+ *		down last and address families taking turns.  Connects are
+ *		non-blocking; each one gets BACKEND_EYEBALL_DELAY ms on its
+ *		own before the next one is started alongside it, and the
+ *		first to connect wins.  Those that failed, or were beaten
+ *		despite their head start, are marked down.  We give up on
+ *		all of them after connect_timeout seconds.  The winner is
+ *		not marked up here; a TCP connect says nothing about the
+ *		IMAP server behind it, so that's left to the caller once it
+ *		has a greeting.
+ *--
+ */
+static int Backend_Dial( struct BackendSet *Set, struct Backend *First,
+			 struct Backend **Used )
+{
+    char *fn = "Backend_Dial()";
+    struct Backend **Order;
+    struct pollfd *pfd;
+    struct Backend *Backend;
+    unsigned int Max = Set ? Set->Count : 1;
+    unsigned int Count = 0;
+    unsigned int Up = 0;
+    unsigned int Started = 0;
+    unsigned int Pending = 0;
+    unsigned int i, j, s;
+    struct timeval Start;
+    long Now, Deadline, NextStart;
+    unsigned int Timeout;
+    int Wait;
+    int Error;
+    socklen_t ErrorLen;
+    int sd = -1;
+    int Winner = -1;
+    time_t Time;
+
+    Order = (struct Backend **)malloc( Max * sizeof ( struct Backend * ) );
+    pfd = (struct pollfd *)malloc( Max * sizeof ( struct pollfd ) );
+    if ( ! Order || ! pfd )
+    {
+	syslog( LOG_ERR, "%s: malloc() failed: %s -- Exiting.", fn,
+		strerror( errno ) );
+	exit( 1 );
+    }
+
+    /*
+     * Line them up: the ones that are up, starting from First, then the
+     * ones that are down, in case that's all there is.
+     */
+    Time = time( 0 );
+    if ( ! Set )
+    {
+	Order[ Count++ ] = First;
+	Up = 1;
+    }
+    for ( s = 0; Set && ( s < Set->Count ); s++ )
+	if ( Set->Backend[ s ] == First )
+	    break;
+    for ( j = 0; Set && ( j < 2 ); j++ )
+    {
+	for ( i = 0; i < Set->Count; i++ )
+	{
+	    Backend = Set->Backend[ ( s + i ) % Set->Count ];
+	    if ( ( Backend->DownUntil > Time ) == j )
+		Order[ Count++ ] = Backend;
+	}
+	if ( ! j )
+	    Up = Count;
+    }
+
+    /* let the address families of the ones that are up take turns */
+    for ( i = 1; i + 1 < Up; i++ )
+    {
+	if ( Order[ i ]->Family != Order[ i - 1 ]->Family )
+	    continue;
+
+	for ( j = i + 1; j < Up; j++ )
+	{
+	    if ( Order[ j ]->Family != Order[ i - 1 ]->Family )
+	    {
+		Backend = Order[ j ];
+		memmove( &Order[ i + 1 ], &Order[ i ],
+			 ( j - i ) * sizeof ( struct Backend * ) );
+		Order[ i ] = Backend;
+		break;
+	    }
+	}
+    }
+
+    Timeout = ( PC_Struct.server_connect_timeout ?
+		PC_Struct.server_connect_timeout :
+		DEFAULT_SERVER_CONNECT_TIMEOUT );
+
+    gettimeofday( &Start, NULL );
+    Now = 0;
+    Deadline = Timeout * 1000L;
+    NextStart = Now;
+
+    while ( sd == -1 )
+    {
+	if ( ( Started < Count ) && ( Now >= NextStart ) )
+	{
+	    Backend = Order[ Started ];
+	    pfd[ Started ].events = POLLOUT;
+	    pfd[ Started ].revents = 0;
+	    pfd[ Started ].fd = socket( Backend->Family,
+					Backend->SockType,
+					Backend->Protocol );
+	    Started++;
+
+	    if ( pfd[ Started - 1 ].fd == -1 )
+	    {
+		syslog( LOG_INFO, "%s: Unable to open server socket: %s",
+			fn, strerror( errno ) );
+		continue;
+	    }
+
+	    fcntl( pfd[ Started - 1 ].fd, F_SETFL,
+		   fcntl( pfd[ Started - 1 ].fd, F_GETFL, 0 ) | O_NONBLOCK );
+
+	    if ( connect( pfd[ Started - 1 ].fd,
+			  (struct sockaddr *)&Backend->Addr,
+			  Backend->AddrLen ) == 0 )
+	    {
+		sd = pfd[ Started - 1 ].fd;
+		pfd[ Started - 1 ].fd = -1;
+		*Used = Backend;
+		Winner = Started - 1;
+		break;
+	    }
+
+	    if ( errno != EINPROGRESS )
+	    {
+		syslog( LOG_INFO, "%s: Unable to connect to IMAP server: %s",
+			fn, strerror( errno ) );
+		close( pfd[ Started - 1 ].fd );
+		pfd[ Started - 1 ].fd = -1;
+		Backend_Mark( Backend, 0 );
+		continue;
+	    }
+
+	    Pending++;
+	    NextStart = Now + BACKEND_EYEBALL_DELAY;
+	}
+
+	if ( ! Pending && ( Started == Count ) )
+	    break;
+
+	if ( Now >= Deadline )
+	{
+	    syslog( LOG_INFO, "%s: Unable to connect to IMAP server: timed out after %d seconds", fn, Timeout );
+	    for ( i = 0; i < Started; i++ )
+		if ( pfd[ i ].fd != -1 )
+		    Backend_Mark( Order[ i ], 0 );
+	    break;
+	}
+
+	Wait = Deadline - Now;
+	if ( ( Started < Count ) && ( NextStart - Now < Wait ) )
+	    Wait = ( Pending ? NextStart - Now : 0 );
+	if ( Wait < 0 )
+	    Wait = 0;
+
+	if ( poll( pfd, Started, Wait ) == -1 && errno != EINTR )
+	{
+	    syslog( LOG_ERR, "%s: poll() failed: %s", fn, strerror( errno ) );
+	    break;
+	}
+
+	for ( i = 0; i < Started; i++ )
+	{
+	    if ( ( pfd[ i ].fd == -1 ) || ! pfd[ i ].revents )
+		continue;
+
+	    Error = 0;
+	    ErrorLen = sizeof Error;
+	    getsockopt( pfd[ i ].fd, SOL_SOCKET, SO_ERROR, &Error, &ErrorLen );
+
+	    if ( ! Error )
+	    {
+		sd = pfd[ i ].fd;
+		pfd[ i ].fd = -1;
+		*Used = Order[ i ];
+		Winner = i;
+		break;
+	    }
+
+	    syslog( LOG_INFO, "%s: Unable to connect to IMAP server: %s",
+		    fn, strerror( Error ) );
+	    close( pfd[ i ].fd );
+	    pfd[ i ].fd = -1;
+	    Pending--;
+	    Backend_Mark( Order[ i ], 0 );
+
+	    /* no sense waiting on a failure; start the next one now */
+	    NextStart = Now;
+	}
+
+	Now = Backend_Msecs( &Start );
+    }
+
+    /*
+     * The losers.  One that was started before the winner and still
+     * hasn't connected is no better than down.
+     */
+    for ( i = 0; i < Started; i++ )
+    {
+	if ( pfd[ i ].fd == -1 )
+	    continue;
+
+	close( pfd[ i ].fd );
+
+	if ( ( sd != -1 ) && ( Order[ i ] != *Used ) &&
+	     ( (int)i < Winner ) )
+	    Backend_Mark( Order[ i ], 0 );
+    }
+
+    free( Order );
+    free( pfd );
+
+    if ( sd == -1 )
+	return( -1 );
+
+    fcntl( sd, F_SETFL, fcntl( sd, F_GETFL, 0 ) & ~O_NONBLOCK );
+    Counter_Latency( LATENCY_CONNECT, &Start );
+
+    return( sd );
+}
+
+
+
+/*++
+ * Function:	Backend_Mark
+ *
+ * Purpose:	Keep track of whether a backend is up.
+ *
+ * Parameters:	ptr to the backend
+ *		int -- nonzero if it just greeted us, zero if we just
+ *		failed to get a greeting out of it
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Each failure in a row doubles the time the backend is left
+ *		out of new logins, up to BACKEND_MAX_BACKOFF seconds.  It's
+ *		still tried when nothing else is up.
+ *--
+ */
+static void Backend_Mark( struct Backend *Backend, int Up )
+{
+    char *fn = "Backend_Mark()";
+    unsigned int Backoff = 0;
+
+    LockMutex( &Backend->mutex );
+
+    if ( Up )
+    {
+	if ( Backend->Failures )
+	    Backoff = 1;
+	Backend->Failures = 0;
+	Backend->DownUntil = 0;
+    }
+    else if ( Backend->DownUntil <= time( 0 ) )
+    {
+	/* logins failing together count once */
+	Backoff = 1 << ( Backend->Failures < 6 ? Backend->Failures : 6 );
+	if ( Backoff > BACKEND_MAX_BACKOFF )
+	    Backoff = BACKEND_MAX_BACKOFF;
+	Backend->Failures++;
+	Backend->DownUntil = time( 0 ) + Backoff;
+    }
+
+    UnLockMutex( &Backend->mutex );
+
+    if ( Up && Backoff )
+	syslog( LOG_INFO, "%s: Backend %s is back up.", fn, Backend->Name );
+    else if ( Backoff )
+	syslog( LOG_WARNING, "%s: Backend %s is down; skipping it for %d seconds.", fn,
+		Backend->Name, Backoff );
+}
+
+
+
+/*++
+ * Function:	Backend_Msecs
+ *
+ * Purpose:	Tell the time in milliseconds, for connect timing.
+ *
+ * Parameters:	ptr to the time we started timing at
+ *
+ * Returns:	milliseconds since then
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static long Backend_Msecs( struct timeval *Since )
+{
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+
+    return( ( tv.tv_sec - Since->tv_sec ) * 1000L +
+	    ( tv.tv_usec - Since->tv_usec ) / 1000 );
+}
+
+
+
+/*++
+ * Function:	Backend_New_Session
+ *
+ * Purpose:	Remember a TLS session the IMAP server gave us, so that the
+ *		next connection to the same backend can resume it.
+ *
+ * Parameters:	ptr to the SSL connection the session came in on
+ *		ptr to the new session
+ *
+ * Returns:	1 if we kept the session (and the reference to it)
+ *		0 if not
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Installed with SSL_CTX_sess_set_new_cb().  With TLS 1.3 the
+ *		tickets come after the handshake, so this can run on any
+ *		thread that reads from a server connection.
+ *--
+ */
+#if HAVE_LIBSSL
+extern int Backend_New_Session( SSL *tls, SSL_SESSION *Session )
+{
+    struct Backend *Backend = (struct Backend *)SSL_get_app_data( tls );
+    SSL_SESSION *Old;
+
+    /* not one of ours (the startup CAPABILITY check) */
+    if ( ! Backend )
+	return( 0 );
+
+    LockMutex( &Backend->mutex );
+    Old = Backend->Session;
+    Backend->Session = Session;
+    UnLockMutex( &Backend->mutex );
+
+    if ( Old )
+	SSL_SESSION_free( Old );
+
+    return( 1 );
+}
+#endif
+
+
+
+/*++
+ * Function:	Backend_Take_Spare
+ *
+ * Purpose:	Hand out one of a backend's spare connections.
+ *
+ * Parameters:	ptr to the backend
+ *		ptr to the server ITD, whose conn gets filled in
+ *
+ * Returns:	0 on success
+ *		-1 if there's no usable spare
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Takes the newest spare, which is the least likely to have
+ *		been timed out by the server.  We still check, the same way
+ *		Get_Server_conn() checks a cached connection.
+ *--
+ */
+static int Backend_Take_Spare( struct Backend *Backend, ITD_Struct *Server )
+{
+    char *fn = "Backend_Take_Spare()";
+    ICD_Struct *conn;
+    int rc;
+
+    for ( ; ; )
+    {
+	LockMutex( &Backend->mutex );
+	conn = NULL;
+	if ( Backend->Spares )
+	    conn = Backend->Spare[ --Backend->Spares ].conn;
+	pthread_cond_signal( &Backend->cond );
+	UnLockMutex( &Backend->mutex );
+
+	if ( ! conn )
+	    return( -1 );
+
+	fcntl( conn->sd, F_SETFL, fcntl( conn->sd, F_GETFL, 0 ) | O_NONBLOCK );
+
+	while ( ( rc = IMAP_Read( conn, Server->ReadBuf,
+				  sizeof Server->ReadBuf ) ) > 0 );
+
+	if ( rc == -1 && errno == EWOULDBLOCK )
+	{
+	    fcntl( conn->sd, F_SETFL, fcntl( conn->sd, F_GETFL, 0 ) & ~O_NONBLOCK );
+	    Server->conn = conn;
+	    return( 0 );
+	}
+
+	syslog( LOG_INFO, "%s: Discarding spare server sd [%d]: closed by server.",
+		fn, conn->sd );
+	Backend_Close( conn );
+    }
+}
+
+
+
+/*++
+ * Function:	Backend_Close
+ *
+ * Purpose:	Log out of and close an unauthenticated server connection.
+ *
+ * Parameters:	ptr to the ICD
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Backend_Close( ICD_Struct *conn )
+{
+    IMAP_Write( conn, "VIC20 LOGOUT\r\n", strlen( "VIC20 LOGOUT\r\n" ) );
+
+#if HAVE_LIBSSL
+    if ( conn->tls )
+    {
+	SSL_shutdown( conn->tls );
+	SSL_free( conn->tls );
+    }
+#endif
+    close( conn->sd );
+    free( conn );
+}
+
+
+
+/*++
+ * Function:	Backend_Spare_Loop
+ *
+ * Purpose:	Keep a backend's supply of spare connections topped up.
+ *		This function is intended to be run continuously as one
+ *		thread per backend.
+ *
+ * Parameters:	ptr to the backend
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Servers don't let unauthenticated connections sit around
+ *		for long, so a spare that's been open for
+ *		BACKEND_SPARE_MAX_AGE seconds is replaced with a new one.
+ *		When the backend stops being Spared, we close its spares
+ *		and quit; Backend_Spares_Update() starts us again if need
+ *		be.
+ *--
+ */
+static void *Backend_Spare_Loop( void *arg )
+{
+    char *fn = "Backend_Spare_Loop()";
+    struct Backend *Backend = (struct Backend *)arg;
+    struct timespec Wake;
+    ITD_Struct Server;
+    ICD_Struct *Stale;
+
+    for ( ; ; )
+    {
+	Stale = NULL;
+
+	LockMutex( &Backend->mutex );
+
+	/*
+	 * Sleep until somebody takes a spare or the oldest one is due to
+	 * be replaced.
+	 */
+	while ( Backend->Spared &&
+		( Backend->Spares >= PC_Struct.spare_server_connections ) )
+	{
+	    if ( time( 0 ) >= Backend->Spare[ 0 ].Opened + BACKEND_SPARE_MAX_AGE )
+	    {
+		Stale = Backend->Spare[ 0 ].conn;
+		Backend->Spares--;
+		memmove( &Backend->Spare[ 0 ], &Backend->Spare[ 1 ],
+			 Backend->Spares * sizeof ( struct BackendSpare ) );
+		break;
+	    }
+
+	    Wake.tv_sec = Backend->Spare[ 0 ].Opened + BACKEND_SPARE_MAX_AGE;
+	    Wake.tv_nsec = 0;
+	    pthread_cond_timedwait( &Backend->cond, &Backend->mutex, &Wake );
+	}
+
+	if ( ! Backend->Spared )
+	{
+	    if ( ! Backend->Spares )
+	    {
+		Backend->SpareThread = 0;
+		UnLockMutex( &Backend->mutex );
+		return( NULL );
+	    }
+
+	    Stale = Backend->Spare[ --Backend->Spares ].conn;
+	}
+
+	UnLockMutex( &Backend->mutex );
+
+	if ( Stale )
+	{
+	    Backend_Close( Stale );
+	    continue;
+	}
+
+	memset( &Server, 0, sizeof Server );
+
+	if ( Backend_Open( NULL, Backend, &Server ) == -1 )
+	{
+	    syslog( LOG_WARNING, "%s: Unable to open a spare server connection.  Sleeping %d seconds to retry...", fn, PC_Struct.server_connect_delay );
+	    sleep( PC_Struct.server_connect_delay ? PC_Struct.server_connect_delay : 1 );
+	    continue;
+	}
+
+	LockMutex( &Backend->mutex );
+	Backend->Spare[ Backend->Spares ].conn = Server.conn;
+	Backend->Spare[ Backend->Spares ].Opened = time( 0 );
+	Backend->Spares++;
+	UnLockMutex( &Backend->mutex );
+    }
+
+    return( NULL );
+}
+
+
+
+
+/*++
+ * Function:	Backend_Probe
+ *
+ * Purpose:	Check that a backend is up: connect to it and wait for a
+ *		greeting.
+ *
+ * Parameters:	ptr to the backend
+ *
+ * Returns:	0 if it's up (and it's been marked up)
+ *		-1 if not (and it's been marked down)
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	We don't wait any longer for the banner than we would for
+ *		the connect.
+ *--
+ */
+static int Backend_Probe( struct Backend *Backend )
+{
+    char *fn = "Backend_Probe()";
+    struct Backend *Used;
+    struct timeval tv;
+    ICD_Struct conn;
+    ITD_Struct Server;
+    int rc;
+
+    memset( &conn, 0, sizeof conn );
+    memset( &Server, 0, sizeof Server );
+    Server.conn = &conn;
+
+    conn.sd = Backend_Dial( NULL, Backend, &Used );
+    if ( conn.sd == -1 )
+	return( -1 );
+
+    tv.tv_sec = PC_Struct.server_connect_timeout ?
+	PC_Struct.server_connect_timeout : DEFAULT_SERVER_CONNECT_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt( conn.sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv );
+
+    rc = IMAP_Line_Read( &Server );
+
+    if ( ( rc == -1 ) ||
+	 ( strncasecmp( ITD_LINE( &Server ), "* OK", 4 ) &&
+	   strncasecmp( ITD_LINE( &Server ), "* PREAUTH", 9 ) ) )
+    {
+	syslog( LOG_WARNING, "%s: No greeting from backend %s.", fn, Backend->Name );
+	close( conn.sd );
+	Backend_Mark( Backend, 0 );
+	return( -1 );
+    }
+
+    Backend_Mark( Backend, 1 );
+
+    IMAP_Write( &conn, "H0001 LOGOUT\r\n", strlen( "H0001 LOGOUT\r\n" ) );
+    close( conn.sd );
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Backend_Health_Loop
+ *
+ * Purpose:	Probe every backend every health_check_interval seconds.
+ *		This function is intended to be run continuously as a
+ *		single thread.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	A backend that fails is marked down, which keeps it out of
+ *		new logins until its backoff runs out; one that passes is
+ *		marked up again right away.
+ *--
+ */
+static void *Backend_Health_Loop( void *arg )
+{
+    struct BackendSet *Set;
+    struct Backend *Backend;
+    unsigned int i;
+
+    for ( ; ; )
+    {
+	sleep( PC_Struct.health_check_interval );
+
+	Set = Backend_Set_Get( NULL );
+
+	for ( i = 0; i < Set->Count; i++ )
+	{
+	    Backend = Set->Backend[ i ];
+
+	    Backend_Probe( Backend );
+
+	    syslog( LOG_DEBUG, "Backend %s: %d connections, %d active%s",
+		    Backend->Name, Backend->Connections, Backend->Active,
+		    ( Backend->DownUntil > time( 0 ) ) ? ", down" : "" );
+	}
+
+	Backend_Set_Put( Set );
+    }
+
+    return( NULL );
+}
+
+
+
+/*++
+ * Function:	Backend_Spares_Update
+ *
+ * Purpose:	Start or stop the spare connection threads to match the
+ *		current backend set.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Called by Backend_Init() and then only by the DNS refresh
+ *		thread, after it swaps in a new set.
+ *--
+ */
+static void Backend_Spares_Update( void )
+{
+    char *fn = "Backend_Spares_Update()";
+    struct Backend *Backend;
+    struct Backend *Primary;
+    pthread_attr_t attr;
+    pthread_t ThreadId;
+    unsigned int Want;
+    unsigned int Start;
+    int rc;
+
+    if ( ! PC_Struct.spare_server_connections )
+	return;
+
+    LockMutex( &aimtx );
+    Primary = ISD.Backends->Backend[ ISD.NextBackend ];
+    UnLockMutex( &aimtx );
+
+    rc = pthread_attr_init( &attr );
+    if ( ! rc )
+	rc = pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if ( rc )
+    {
+	syslog(LOG_ERR, "%s: pthread_attr setup failed: [%d] -- Exiting.", fn, rc);
+	exit( 1 );
+    }
+
+    for ( Backend = ISD.AllBackends; Backend; Backend = Backend->anext )
+    {
+	Want = ! Backend->Retired &&
+	    ( PC_Struct.dnsrr || ISD.LeastConnections || Backend == Primary );
+
+	if ( Want && ! Backend->Spare )
+	{
+	    Backend->Spare = (struct BackendSpare *)calloc( PC_Struct.spare_server_connections, sizeof ( struct BackendSpare ) );
+	    if ( ! Backend->Spare )
+	    {
+		syslog(LOG_ERR, "%s: calloc() failed to allocate [%d] spare server connections: %s -- Exiting.", fn, PC_Struct.spare_server_connections, strerror( errno ) );
+		exit( 1 );
+	    }
+	}
+
+	LockMutex( &Backend->mutex );
+	Backend->Spared = Want;
+	Start = Want && ! Backend->SpareThread;
+	if ( Start )
+	    Backend->SpareThread = 1;
+	pthread_cond_signal( &Backend->cond );
+	UnLockMutex( &Backend->mutex );
+
+	if ( ! Start )
+	    continue;
+
+	rc = pthread_create( &ThreadId, &attr, Backend_Spare_Loop, (void *)Backend );
+	if ( rc )
+	{
+	    syslog(LOG_ERR, "%s: pthread_create() returned error [%d] for Backend_Spare_Loop", fn, rc );
+	    LockMutex( &Backend->mutex );
+	    Backend->SpareThread = 0;
+	    UnLockMutex( &Backend->mutex );
+	}
+    }
+
+    pthread_attr_destroy( &attr );
+}
+
+
+
+/*++
+ * Function:	Backend_Refresh_Loop
+ *
+ * Purpose:	Look the server up again every dns_refresh_interval seconds
+ *		and switch to the new addresses if they've changed.  This
+ *		function is intended to be run continuously as a single
+ *		thread.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	getaddrinfo() doesn't tell us the TTL, so we go by the
+ *		interval.  A lookup that fails leaves things as they are;
+ *		so does one that only gives the same addresses in another
+ *		order.  Without DNS round robin, the backend we were using
+ *		stays first if it's still there.
+ *--
+ */
+static void *Backend_Refresh_Loop( void *arg )
+{
+    char *fn = "Backend_Refresh_Loop()";
+    struct addrinfo aihints, *ai;
+    struct BackendSet *Set;
+    struct BackendSet *Old;
+    struct Backend *Primary;
+    unsigned int Added, Removed;
+    unsigned int i;
+    int gaierrnum;
+
+    memset( &aihints, 0, sizeof aihints );
+    switch ( PC_Struct.ipversion )
+    {
+         case 4: aihints.ai_family = AF_INET;
+                 break;
+         case 6: aihints.ai_family = AF_INET6;
+                 break;
+         default: aihints.ai_family = AF_UNSPEC;
+    }
+    aihints.ai_socktype = SOCK_STREAM;
+
+    for ( ; ; )
+    {
+	sleep( PC_Struct.dns_refresh_interval );
+
+	if ( ( gaierrnum = getaddrinfo( PC_Struct.server_hostname,
+					PC_Struct.server_port,
+					&aihints, &ai ) ) )
+	{
+	    syslog( LOG_WARNING, "%s: getaddrinfo() failed to resolve hostname of remote IMAP server: %s -- keeping the addresses we have", fn, gai_strerror( gaierrnum ) );
+	    continue;
+	}
+
+	Set = Backend_Set_Build( ai );
+	freeaddrinfo( ai );
+
+	/* nobody else replaces the current set, so it's safe to look at */
+	Old = ISD.Backends;
+
+	Added = 0;
+	for ( i = 0; i < Set->Count; i++ )
+	    if ( ! Backend_Set_Has( Old, Set->Backend[ i ] ) )
+		Added++;
+
+	if ( ! Added && ( Set->Count == Old->Count ) )
+	{
+	    free( Set->Backend );
+	    free( Set );
+	    continue;
+	}
+
+	Removed = 0;
+	for ( i = 0; i < Old->Count; i++ )
+	{
+	    if ( ! Backend_Set_Has( Set, Old->Backend[ i ] ) )
+	    {
+		Old->Backend[ i ]->Retired = 1;
+		Removed++;
+	    }
+	}
+	for ( i = 0; i < Set->Count; i++ )
+	    Set->Backend[ i ]->Retired = 0;
+
+	/* publish it */
+	Set->Refs = 1;
+	LockMutex( &aimtx );
+	Primary = Old->Backend[ ISD.NextBackend ];
+	ISD.NextBackend = 0;
+	for ( i = 0; i < Set->Count; i++ )
+	    if ( Set->Backend[ i ] == Primary )
+		ISD.NextBackend = i;
+	ISD.Backends = Set;
+	UnLockMutex( &aimtx );
+
+	Backend_Set_Put( Old );
+
+	syslog( LOG_INFO, "%s: '%s' now has %d addresses: %d added, %d removed.", fn, PC_Struct.server_hostname, Set->Count, Added, Removed );
+
+	Backend_Spares_Update();
+
+	if ( Removed )
+	    ICC_Drain_Retired();
+    }
+
+    return( NULL );
+}
+
+/*
+ *                            _________
+ *                           /        |
+ *                          /         |
+ *                         /    ______|
+ *                        /    /       ________
+ *                       |    |        |      /
+ *                       |    |        |_____/
+ *                       |    |        ______
+ *                       |    |        |     \
+ *                       |    |        |______\
+ *                        \    \_______
+ *                         \           |
+ *                          \          |
+ *                           \_________|
+ */
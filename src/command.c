@@ -0,0 +1,283 @@
+/*
+**
+** Copyright (c) 2010-2016 The SquirrelMail Project Team
+**
+** Licensed under the GNU GPL. For full terms see the file COPYING.
+**
+** This file is part of SquirrelMail IMAP Proxy.
+**
+**  Facility:
+**
+**	command.c
+**
+**  Abstract:
+**
+**	Tell what IMAP command a client sent, and what the proxy needs to
+**	know about it: whether it leaves the SELECT cache valid, whether it
+**	changes the selected mailbox or which mailbox is selected, and so
+**	on.  The login dispatch, the relays and the SELECT cache all ask
+**	here rather than each comparing command names of their own.
+**
+**	The commands are in one table, fixed at compile time and sorted by
+**	name, and a command is looked up by its whole name with bsearch(),
+**	so a word that merely starts like a command isn't taken for it.
+**
+**  Authors:
+**
+**      The SquirrelMail Project Team
+**
+**  Version:
+**
+**      $Id$
+**
+**  Modification History:
+**
+**      $Log$
+**
+*/
+
+
+#define _REENTRANT
+
+#include <config.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "imapproxy.h"
+
+/*
+ * Only in the table below: the command can be sent as UID <command>.
+ */
+#define UID_FORM	0x100
+
+#define COMMAND_NAME_MAX	24	/* longer than any we know */
+
+struct IMAPCommand
+{
+    const char *Name;
+    unsigned int Id;
+    unsigned int Flags;
+};
+
+/*
+ * COMMAND_SAFE commands leave the SELECT cache entry of the selected
+ * mailbox valid.  EXAMINE isn't safe: it changes which mailbox the
+ * server has selected, and the cache has to know that.  STORE, EXPUNGE
+ * and MOVE are, because the server tells the client what they changed
+ * and Select_Cache_Observe() patches the cache to match.  SELECT is
+ * handled by the cache itself.  APPEND, COPY, MOVE, DELETE and RENAME
+ * are safe for the selected mailbox, but Select_Cache_Command() drops
+ * the entries of the mailboxes they name.
+ *
+ * Keep it sorted by name.
+ */
+static const struct IMAPCommand Commands[] =
+{
+    { "APPEND",			CMD_APPEND,
+      COMMAND_SAFE | COMMAND_LITERAL },
+    { "AUTHENTICATE",		CMD_AUTHENTICATE,	COMMAND_SAFE },
+    { "CAPABILITY",		CMD_CAPABILITY,		COMMAND_SAFE },
+    { "CHECK",			CMD_CHECK,		COMMAND_SAFE },
+    { "CLOSE",			CMD_CLOSE,
+      COMMAND_SELECTS | COMMAND_MUTATING },
+    { "COPY",			CMD_COPY,
+      COMMAND_SAFE | UID_FORM },
+    { "CREATE",			CMD_CREATE,		COMMAND_SAFE },
+    { "DELETE",			CMD_DELETE,		COMMAND_SAFE },
+    { "ENABLE",			CMD_ENABLE,		0 },
+    { "EXAMINE",		CMD_EXAMINE,		COMMAND_SELECTS },
+    { "EXPUNGE",		CMD_EXPUNGE,
+      COMMAND_SAFE | COMMAND_MUTATING | UID_FORM },
+    { "FETCH",			CMD_FETCH,
+      COMMAND_SAFE | UID_FORM },
+    { "ID",			CMD_ID,			COMMAND_SAFE },
+    { "IDLE",			CMD_IDLE,		0 },
+    { "LIST",			CMD_LIST,		COMMAND_SAFE },
+    { "LOGIN",			CMD_LOGIN,		COMMAND_SAFE },
+    { "LOGOUT",			CMD_LOGOUT,		COMMAND_SAFE },
+    { "LSUB",			CMD_LSUB,		COMMAND_SAFE },
+    { "MOVE",			CMD_MOVE,
+      COMMAND_SAFE | COMMAND_MUTATING | UID_FORM },
+    { "NAMESPACE",		CMD_NAMESPACE,		COMMAND_SAFE },
+    { "NOOP",			CMD_NOOP,		COMMAND_SAFE },
+    { "RENAME",			CMD_RENAME,		COMMAND_SAFE },
+    { "SEARCH",			CMD_SEARCH,
+      COMMAND_SAFE | UID_FORM },
+    { "SELECT",			CMD_SELECT,
+      COMMAND_SAFE | COMMAND_SELECTS },
+    { "STARTTLS",		CMD_STARTTLS,		COMMAND_SAFE },
+    { "STATUS",			CMD_STATUS,		COMMAND_SAFE },
+    { "STORE",			CMD_STORE,
+      COMMAND_SAFE | COMMAND_MUTATING | UID_FORM },
+    { "SUBSCRIBE",		CMD_SUBSCRIBE,		COMMAND_SAFE },
+    { "UNSELECT",		CMD_UNSELECT,		COMMAND_SELECTS },
+    { "UNSUBSCRIBE",		CMD_UNSUBSCRIBE,	COMMAND_SAFE },
+    { "XPROXY_DUMPICC",		CMD_XPROXY_DUMPICC,	COMMAND_ADMIN },
+    { "XPROXY_NEWLOG",		CMD_XPROXY_NEWLOG,	COMMAND_ADMIN },
+    { "XPROXY_RESETCOUNTERS",	CMD_XPROXY_RESETCOUNTERS, COMMAND_ADMIN },
+    { "XPROXY_TRACE",		CMD_XPROXY_TRACE,	COMMAND_ADMIN },
+    { "XPROXY_UNTRACE",		CMD_XPROXY_UNTRACE,	COMMAND_ADMIN },
+    { "XPROXY_VERSION",		CMD_XPROXY_VERSION,	COMMAND_ADMIN }
+};
+
+#define COMMANDS	( sizeof Commands / sizeof Commands[ 0 ] )
+
+/*
+ * Internal prototypes
+ */
+static const struct IMAPCommand *Command_Lookup( const char *, unsigned int, unsigned int * );
+static int Command_Compare( const void *, const void * );
+
+
+
+/*++
+ * Function:	Command_Classify
+ *
+ * Purpose:	Tell what command a client sent.
+ *
+ * Parameters:	char ptr -- the command, just past the tag
+ *		unsigned int -- bytes from there to the end of the line
+ *		ptr to unsigned int -- set to the command's COMMAND_ flags,
+ *				       or NULL if they aren't wanted
+ *
+ * Returns:	the command's CMD_ id
+ *		CMD_UNKNOWN, with no flags, if we don't know it
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The line needn't be NUL terminated.  UID FETCH and the like
+ *		come back as FETCH, with COMMAND_UID set.  STORE isn't
+ *		COMMAND_SAFE in its .SILENT forms, which don't report the
+ *		new flags.
+ *--
+ */
+extern unsigned int Command_Classify( const char *Command, unsigned int Len,
+				      unsigned int *Flags )
+{
+    const struct IMAPCommand *C;
+    unsigned int Found = 0;
+    unsigned int Used;
+    unsigned int i;
+
+    if ( Flags )
+	*Flags = 0;
+
+    C = Command_Lookup( Command, Len, &Used );
+
+    if ( ! C && Used == 3 && Len > 4 && Command[ 3 ] == ' ' &&
+	 ! strncasecmp( Command, "UID", 3 ) )
+    {
+	Command += 4;
+	Len -= 4;
+	C = Command_Lookup( Command, Len, &Used );
+	if ( ! C || ! ( C->Flags & UID_FORM ) )
+	    return( CMD_UNKNOWN );
+	Found = COMMAND_UID;
+    }
+
+    if ( ! C )
+	return( CMD_UNKNOWN );
+
+    Found |= C->Flags & ~UID_FORM;
+
+    if ( C->Id == CMD_STORE )
+    {
+	for ( i = Used; i + 7 <= Len && Command[ i ] != '\r'; i++ )
+	{
+	    if ( ! strncasecmp( Command + i, ".SILENT", 7 ) )
+	    {
+		Found &= ~COMMAND_SAFE;
+		break;
+	    }
+	}
+    }
+
+    if ( Flags )
+	*Flags = Found;
+
+    return( C->Id );
+}
+
+
+
+/*++
+ * Function:	Command_Lookup
+ *
+ * Purpose:	Find the first word of a line in the command table.
+ *
+ * Parameters:	char ptr -- the word
+ *		unsigned int -- bytes from there to the end of the line
+ *		ptr to unsigned int -- set to the length of the word
+ *
+ * Returns:	ptr to the table entry
+ *		NULL if it isn't there
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static const struct IMAPCommand *Command_Lookup( const char *Word,
+						 unsigned int Len,
+						 unsigned int *Used )
+{
+    char Name[ COMMAND_NAME_MAX ];
+    unsigned int i;
+
+    for ( i = 0; i < Len && Word[ i ] != ' ' &&
+	      Word[ i ] != '\r' && Word[ i ] != '\n'; i++ )
+    {
+	if ( i == sizeof Name - 1 )
+	{
+	    *Used = i;
+	    return( NULL );
+	}
+	Name[ i ] = toupper( (unsigned char)Word[ i ] );
+    }
+    Name[ i ] = '\0';
+    *Used = i;
+
+    return( bsearch( Name, Commands, COMMANDS, sizeof Commands[ 0 ],
+		     Command_Compare ) );
+}
+
+
+
+/*++
+ * Function:	Command_Compare
+ *
+ * Purpose:	bsearch() comparison for the command table.
+ *
+ * Parameters:	ptr to the name being looked for
+ *		ptr to a table entry
+ *
+ * Returns:	as strcmp()
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static int Command_Compare( const void *Name, const void *Entry )
+{
+    return( strcmp( (const char *)Name,
+		    ( (const struct IMAPCommand *)Entry )->Name ) );
+}
+
+
+/*
+ *                            _________
+ *                           /        |
+ *                          /         |
+ *                         /    ______|
+ *                        /    /       ________
+ *                       |    |        |      /
+ *                       |    |        |_____/
+ *                       |    |        ______
+ *                       |    |        |     \
+ *                       |    |        |______\
+ *                        \    \_______
+ *                         \           |
+ *                          \          |
+ *                           \_________|
+ */
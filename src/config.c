@@ -328,6 +328,7 @@ void SetDefaultConfigValues(ProxyConfig_Struct *PC_Struct)
 {
     PC_Struct->server_connect_retries = DEFAULT_SERVER_CONNECT_RETRIES;
     PC_Struct->server_connect_delay = DEFAULT_SERVER_CONNECT_DELAY;
+    PC_Struct->server_connect_timeout = DEFAULT_SERVER_CONNECT_TIMEOUT;
     PC_Struct->ipversion = 0;
     PC_Struct->dnsrr = 0;
 
@@ -381,6 +382,18 @@ extern void SetConfigOptions( char *ConfigFile )
     ADD_TO_TABLE( "listen_address", SetStringValue,
 		  &PC_Struct.listen_addr, index );
 
+    ADD_TO_TABLE( "listen_backlog", SetNumericValue,
+		  &PC_Struct.listen_backlog, index );
+
+    ADD_TO_TABLE( "listen_sockets", SetNumericValue,
+		  &PC_Struct.listen_sockets, index );
+    
+    ADD_TO_TABLE( "metrics_listen_port", SetStringValue,
+		  &PC_Struct.metrics_port, index );
+    
+    ADD_TO_TABLE( "metrics_listen_address", SetStringValue,
+		  &PC_Struct.metrics_addr, index );
+
     ADD_TO_TABLE( "server_port", SetStringValue, 
 		  &PC_Struct.server_port, index );
 
@@ -388,10 +401,27 @@ extern void SetConfigOptions( char *ConfigFile )
 		  &PC_Struct.server_connect_retries, index );
     ADD_TO_TABLE( "connect_delay", SetNumericValue,
 		  &PC_Struct.server_connect_delay, index );
+    ADD_TO_TABLE( "connect_timeout", SetNumericValue,
+		  &PC_Struct.server_connect_timeout, index );
+
+    ADD_TO_TABLE( "backend_policy", SetStringValue,
+		  &PC_Struct.backend_policy, index );
+
+    ADD_TO_TABLE( "health_check_interval", SetNumericValue,
+		  &PC_Struct.health_check_interval, index );
+
+    ADD_TO_TABLE( "dns_refresh_interval", SetNumericValue,
+		  &PC_Struct.dns_refresh_interval, index );
 
     ADD_TO_TABLE( "cache_size", SetNumericValue, 
 		  &PC_Struct.cache_size, index );
 
+    ADD_TO_TABLE( "max_connections_per_user", SetNumericValue,
+		  &PC_Struct.max_connections_per_user, index );
+
+    ADD_TO_TABLE( "spare_server_connections", SetNumericValue,
+		  &PC_Struct.spare_server_connections, index );
+
     ADD_TO_TABLE( "cache_expiration_time", SetNumericValue, 
 		  &PC_Struct.cache_expiration_time, index );
 
@@ -461,6 +491,12 @@ extern void SetConfigOptions( char *ConfigFile )
     ADD_TO_TABLE( "enable_select_cache", SetBooleanValue,
 		  &PC_Struct.enable_select_cache, index );
 
+    ADD_TO_TABLE( "select_cache_size", SetNumericValue,
+		  &PC_Struct.select_cache_size, index );
+
+    ADD_TO_TABLE( "select_cache_lifetime", SetNumericValue,
+		  &PC_Struct.select_cache_lifetime, index );
+
     ADD_TO_TABLE( "foreground_mode", SetBooleanValue,
 		  &PC_Struct.foreground_mode, index );
 
@@ -476,6 +512,15 @@ extern void SetConfigOptions( char *ConfigFile )
     ADD_TO_TABLE( "dns_rr", SetBooleanValue,
 		  &PC_Struct.dnsrr, index );
     
+    ADD_TO_TABLE( "io_engine", SetStringValue,
+		  &PC_Struct.io_engine, index );
+    
+    ADD_TO_TABLE( "io_engine_threads", SetNumericValue,
+		  &PC_Struct.io_engine_threads, index );
+    
+    ADD_TO_TABLE( "io_engine_helper_threads", SetNumericValue,
+		  &PC_Struct.io_engine_helper_threads, index );
+    
     ConfigTable[index].Keyword[0] = '\0';
     
     FP = fopen( ConfigFile, "r" );
@@ -0,0 +1,732 @@
+/*
+**
+** Copyright (c) 2010-2016 The SquirrelMail Project Team
+**
+** Licensed under the GNU GPL. For full terms see the file COPYING.
+**
+** This file is part of SquirrelMail IMAP Proxy.
+**
+**  Facility:
+**
+**	counter.c
+**
+**  Abstract:
+**
+**	Routines to keep the usage counters that pimpstat shows.  Every
+**	thread that counts something gets an IMAPCounterBlock of its own,
+**	on a cache line of its own, so counting is a plain add to memory
+**	nobody else writes.  The recycle thread adds all the blocks up into
+**	the stat file once a second.
+**
+**	The latency histograms are kept the same way.
+**
+**	The stat file starts with a description of itself (see
+**	IMAPStatHeader), laid out here from the tables below.  A counter
+**	that pimpstat should see needs a line in StatFields.
+**
+**	A block outlives its thread: when the thread exits, the block goes
+**	on a free list for the next new thread to take over, counts and
+**	all.  So there are never more blocks than there have been threads
+**	at once, and nothing that was counted is ever lost.
+**
+**  Authors:
+**
+**      The SquirrelMail Project Team
+**
+**  Version:
+**
+**      $Id$
+**
+**  Modification History:
+**
+**      $Log$
+**
+*/
+
+
+#define _REENTRANT
+
+#include <config.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "imapproxy.h"
+
+/*
+ * External globals
+ */
+extern IMAPCounter_Struct *IMAPCount;
+
+/*
+ * Globals private to this file.  CounterMutex covers the block lists and
+ * the baseline; the counts in the blocks belong to their threads.
+ */
+static pthread_key_t CounterKey;
+static pthread_mutex_t CounterMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct IMAPCounterBlock *CounterBlocks = NULL;
+static struct IMAPCounterBlock *CounterFree = NULL;
+static struct IMAPCounterBlock CounterBase;
+
+/*
+ * What the stat file says about the counters in it.
+ */
+#define STAT_FIELD( Name, Type, Member, Help ) \
+    { Name, Help, Type, sizeof ( (IMAPCounter_Struct *)0 )->Member, \
+      offsetof( IMAPCounter_Struct, Member ) }
+
+static struct
+{
+    char *Name;
+    char *Help;
+    unsigned int Type;
+    unsigned int Size;
+    unsigned int Offset;
+} StatFields[] =
+{
+    STAT_FIELD( "start_time_seconds", STAT_TIME, StartTime,
+		"When the proxy started." ),
+    STAT_FIELD( "count_time_seconds", STAT_TIME, CountTime,
+		"When the counters were last reset." ),
+    STAT_FIELD( "client_connections", STAT_GAUGE, CurrentClientConnections,
+		"Client connections open now." ),
+    STAT_FIELD( "client_connections_peak", STAT_GAUGE, PeakClientConnections,
+		"Most client connections open at once." ),
+    STAT_FIELD( "server_connections_in_use", STAT_GAUGE, InUseServerConnections,
+		"Server connections in use by a client now." ),
+    STAT_FIELD( "server_connections_in_use_peak", STAT_GAUGE, PeakInUseServerConnections,
+		"Most server connections in use at once." ),
+    STAT_FIELD( "server_connections_cached", STAT_GAUGE, RetainedServerConnections,
+		"Server connections cached for reuse now." ),
+    STAT_FIELD( "server_connections_cached_peak", STAT_GAUGE, PeakRetainedServerConnections,
+		"Most server connections cached at once." ),
+    STAT_FIELD( "client_connections_accepted_total", STAT_COUNTER, TotalClientConnectionsAccepted,
+		"Client connections accepted." ),
+    STAT_FIELD( "client_logins_total", STAT_COUNTER, TotalClientLogins,
+		"Successful client logins." ),
+    STAT_FIELD( "server_connections_created_total", STAT_COUNTER, TotalServerConnectionsCreated,
+		"Server connections opened and logged in." ),
+    STAT_FIELD( "server_connections_reused_total", STAT_COUNTER, TotalServerConnectionsReused,
+		"Client logins given a cached server connection." ),
+    STAT_FIELD( "server_connections_evicted_total", STAT_COUNTER, TotalServerConnectionsEvicted,
+		"Cached server connections closed to make room." ),
+    STAT_FIELD( "select_commands_total", STAT_COUNTER, TotalSelectCommands,
+		"SELECT commands from clients." ),
+    STAT_FIELD( "select_cache_hits_total", STAT_COUNTER, SelectCacheHits,
+		"SELECT commands answered from the cache." ),
+    STAT_FIELD( "select_cache_misses_total", STAT_COUNTER, SelectCacheMisses,
+		"SELECT commands sent on to the server." ),
+    STAT_FIELD( "select_cache_revalidations_total", STAT_COUNTER, SelectCacheRevalidations,
+		"SELECT commands answered from the cache after a STATUS check." ),
+    STAT_FIELD( "icc_hash_chains", STAT_GAUGE, ICCBuckets,
+		"Connection cache hash chains." ),
+    STAT_FIELD( "icc_hash_chains_in_use", STAT_GAUGE, ICCChainsInUse,
+		"Connection cache hash chains with anything on them." ),
+    STAT_FIELD( "icc_longest_chain", STAT_GAUGE, ICCLongestChain,
+		"Longest connection cache hash chain." ),
+    STAT_FIELD( "icc_user_pools", STAT_GAUGE, ICCPools,
+		"Users with server connections." ),
+    STAT_FIELD( "spare_connection_hits_total", STAT_COUNTER, SpareConnectionHits,
+		"New server connections taken from the spares." ),
+    STAT_FIELD( "spare_connection_misses_total", STAT_COUNTER, SpareConnectionMisses,
+		"New server connections opened on the spot." ),
+    STAT_FIELD( "tls_sessions_resumed_total", STAT_COUNTER, TLSSessionsResumed,
+		"Server STARTTLS handshakes that resumed a session." ),
+    STAT_FIELD( "tls_full_handshakes_total", STAT_COUNTER, TLSFullHandshakes,
+		"Server STARTTLS handshakes done in full." ),
+    STAT_FIELD( "trace_records_dropped_total", STAT_COUNTER, TraceRecordsDropped,
+		"Protocol log records dropped because the writer was behind." ),
+    STAT_FIELD( "relay_writes_saved_total", STAT_COUNTER, RelayWritesSaved,
+		"Server writes saved by sending pipelined client commands together." )
+};
+
+#define STAT_FIELDS	( sizeof StatFields / sizeof StatFields[ 0 ] )
+
+/* indexed by the LATENCY_ defines */
+static struct
+{
+    char *Name;
+    char *Help;
+} StatHistograms[ LATENCY_KINDS ] =
+{
+    { "client_login", "Client LOGIN or AUTHENTICATE to our OK." },
+    { "server_connect", "connect() to the IMAP server." },
+    { "server_starttls", "STARTTLS to the server, through the handshake." },
+    { "server_login", "Our login to the server, to its OK." },
+    { "select_cached", "SELECT answered from the cache." },
+    { "select_uncached", "SELECT sent on to the server." },
+    { "command", "Command relayed to the first bytes of reply." }
+};
+
+/*
+ * internal prototypes
+ */
+static void Counter_Release( void * );
+static void Counter_Sum( struct IMAPCounterBlock * );
+static unsigned int Latency_Bucket( unsigned long );
+
+
+
+/*++
+ * Function:	Counter_Init
+ *
+ * Purpose:	Get ready to hand out counter blocks.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Must be called before anything is counted.
+ *--
+ */
+extern void Counter_Init( void )
+{
+    char *fn = "Counter_Init()";
+    int rc;
+
+    rc = pthread_key_create( &CounterKey, Counter_Release );
+    if ( rc )
+    {
+	syslog(LOG_ERR, "%s: pthread_key_create() returned error [%d] -- Exiting.", fn, rc );
+	exit( 1 );
+    }
+
+    memset( &CounterBase, 0, sizeof CounterBase );
+}
+
+
+
+/*++
+ * Function:	Counter_Stat_Size
+ *
+ * Purpose:	Work out how big the stat file is.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	the size in bytes
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The header, the two tables and the bucket bounds come
+ *		first, then the counters on an 8 byte boundary.
+ *--
+ */
+extern unsigned int Counter_Stat_Size( void )
+{
+    unsigned int Size;
+
+    Size = sizeof ( struct IMAPStatHeader ) +
+	STAT_FIELDS * sizeof ( struct IMAPStatField ) +
+	LATENCY_KINDS * sizeof ( struct IMAPStatHistogram ) +
+	LATENCY_BUCKETS * sizeof ( unsigned int );
+
+    Size = ( Size + 7 ) & ~7U;
+
+    return( Size + sizeof ( IMAPCounter_Struct ) );
+}
+
+
+
+/*++
+ * Function:	Counter_Stat_Init
+ *
+ * Purpose:	Lay out a new stat file.
+ *
+ * Parameters:	ptr to the mapped file, Counter_Stat_Size() bytes of it
+ *
+ * Returns:	ptr to the counters in it
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The counters are zeroed and the start time set.
+ *--
+ */
+extern IMAPCounter_Struct *Counter_Stat_Init( void *Map )
+{
+    struct IMAPStatHeader *Header = Map;
+    struct IMAPStatField *Field;
+    struct IMAPStatHistogram *Histogram;
+    unsigned int *Bucket;
+    IMAPCounter_Struct *Counters;
+    unsigned int Size;
+    unsigned int i;
+
+    Size = Counter_Stat_Size();
+    memset( Map, 0, Size );
+
+    Header->Version = STAT_VERSION;
+    Header->HeaderSize = sizeof ( struct IMAPStatHeader );
+    Header->FileSize = Size;
+    Header->FieldCount = STAT_FIELDS;
+    Header->FieldOffset = sizeof ( struct IMAPStatHeader );
+    Header->FieldSize = sizeof ( struct IMAPStatField );
+    Header->HistogramCount = LATENCY_KINDS;
+    Header->HistogramOffset = Header->FieldOffset +
+	STAT_FIELDS * sizeof ( struct IMAPStatField );
+    Header->HistogramSize = sizeof ( struct IMAPStatHistogram );
+    Header->BucketCount = LATENCY_BUCKETS;
+    Header->BucketOffset = Header->HistogramOffset +
+	LATENCY_KINDS * sizeof ( struct IMAPStatHistogram );
+    Header->DataOffset = Size - sizeof ( IMAPCounter_Struct );
+
+    Field = (struct IMAPStatField *)( (char *)Map + Header->FieldOffset );
+    for ( i = 0; i < STAT_FIELDS; i++ )
+    {
+	strncpy( Field[ i ].Name, StatFields[ i ].Name, STAT_NAME_LEN - 1 );
+	strncpy( Field[ i ].Help, StatFields[ i ].Help, STAT_HELP_LEN - 1 );
+	Field[ i ].Type = StatFields[ i ].Type;
+	Field[ i ].Size = StatFields[ i ].Size;
+	Field[ i ].Offset = Header->DataOffset + StatFields[ i ].Offset;
+    }
+
+    Histogram = (struct IMAPStatHistogram *)( (char *)Map + Header->HistogramOffset );
+    for ( i = 0; i < LATENCY_KINDS; i++ )
+    {
+	strncpy( Histogram[ i ].Name, StatHistograms[ i ].Name, STAT_NAME_LEN - 1 );
+	strncpy( Histogram[ i ].Help, StatHistograms[ i ].Help, STAT_HELP_LEN - 1 );
+	Histogram[ i ].Offset = Header->DataOffset +
+	    offsetof( IMAPCounter_Struct, Latency[ i ] );
+	Histogram[ i ].SumOffset = Header->DataOffset +
+	    offsetof( IMAPCounter_Struct, LatencySum[ i ] );
+    }
+
+    Bucket = (unsigned int *)( (char *)Map + Header->BucketOffset );
+    for ( i = 0; i < LATENCY_BUCKETS; i++ )
+	Bucket[ i ] = LATENCY_BUCKET_LOW( i );
+
+    Counters = (IMAPCounter_Struct *)( (char *)Map + Header->DataOffset );
+    Counters->StartTime = time( 0 );
+    Counters->CountTime = Counters->StartTime;
+
+    /* and only now is it a stat file */
+    memcpy( Header->Magic, STAT_MAGIC, sizeof Header->Magic );
+
+    return( Counters );
+}
+
+
+
+/*++
+ * Function:	Counter_Block
+ *
+ * Purpose:	Find this thread's counter block.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	ptr to the block -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The first time a thread counts something, it takes a block
+ *		off the free list or makes a new one.  That's the only time
+ *		CounterMutex is taken on its account.
+ *--
+ */
+extern struct IMAPCounterBlock *Counter_Block( void )
+{
+    char *fn = "Counter_Block()";
+    struct IMAPCounterBlock *Block;
+    size_t Size;
+
+    Block = (struct IMAPCounterBlock *)pthread_getspecific( CounterKey );
+    if ( Block )
+	return( Block );
+
+    LockMutex( &CounterMutex );
+
+    Block = CounterFree;
+    if ( Block )
+    {
+	CounterFree = Block->fnext;
+    }
+    else
+    {
+	/* a whole number of cache lines, so no two blocks share one */
+	Size = ( sizeof ( struct IMAPCounterBlock ) + COUNTER_ALIGN - 1 ) &
+	    ~( COUNTER_ALIGN - 1 );
+
+	if ( posix_memalign( (void **)&Block, COUNTER_ALIGN, Size ) )
+	{
+	    syslog(LOG_ERR, "%s: posix_memalign() failed to allocate a counter block -- Exiting.", fn );
+	    exit( 1 );
+	}
+
+	memset( Block, 0, Size );
+	Block->next = CounterBlocks;
+	CounterBlocks = Block;
+    }
+
+    UnLockMutex( &CounterMutex );
+
+    pthread_setspecific( CounterKey, Block );
+
+    return( Block );
+}
+
+
+
+/*++
+ * Function:	Counter_Release
+ *
+ * Purpose:	Put an exiting thread's counter block on the free list.
+ *
+ * Parameters:	ptr to the block
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Run by pthreads as the destructor of CounterKey.
+ *--
+ */
+static void Counter_Release( void *arg )
+{
+    struct IMAPCounterBlock *Block = (struct IMAPCounterBlock *)arg;
+
+    LockMutex( &CounterMutex );
+    Block->fnext = CounterFree;
+    CounterFree = Block;
+    UnLockMutex( &CounterMutex );
+}
+
+
+
+/*++
+ * Function:	Counter_Sum
+ *
+ * Purpose:	Add up all the counter blocks.
+ *
+ * Parameters:	ptr to where to put the totals
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	CounterMutex must be held.  The counts are read while their
+ *		threads may be adding to them; each is a single aligned
+ *		word, so what we read is either the old value or the new.
+ *--
+ */
+static void Counter_Sum( struct IMAPCounterBlock *Sum )
+{
+    struct IMAPCounterBlock *Block;
+    unsigned int i, j;
+
+    memset( Sum, 0, sizeof ( struct IMAPCounterBlock ) );
+
+    for ( Block = CounterBlocks; Block; Block = Block->next )
+    {
+	Sum->CurrentClientConnections += Block->CurrentClientConnections;
+	Sum->InUseServerConnections += Block->InUseServerConnections;
+	Sum->RetainedServerConnections += Block->RetainedServerConnections;
+	Sum->TotalClientConnectionsAccepted += Block->TotalClientConnectionsAccepted;
+	Sum->TotalClientLogins += Block->TotalClientLogins;
+	Sum->TotalServerConnectionsCreated += Block->TotalServerConnectionsCreated;
+	Sum->TotalServerConnectionsReused += Block->TotalServerConnectionsReused;
+	Sum->TotalServerConnectionsEvicted += Block->TotalServerConnectionsEvicted;
+	Sum->TotalSelectCommands += Block->TotalSelectCommands;
+	Sum->SelectCacheHits += Block->SelectCacheHits;
+	Sum->SelectCacheMisses += Block->SelectCacheMisses;
+	Sum->SelectCacheRevalidations += Block->SelectCacheRevalidations;
+	Sum->SpareConnectionHits += Block->SpareConnectionHits;
+	Sum->SpareConnectionMisses += Block->SpareConnectionMisses;
+	Sum->TLSSessionsResumed += Block->TLSSessionsResumed;
+	Sum->TLSFullHandshakes += Block->TLSFullHandshakes;
+	Sum->TraceRecordsDropped += Block->TraceRecordsDropped;
+	Sum->RelayWritesSaved += Block->RelayWritesSaved;
+
+	for ( i = 0; i < LATENCY_KINDS; i++ )
+	{
+	    for ( j = 0; j < LATENCY_BUCKETS; j++ )
+		Sum->Latency[ i ][ j ] += Block->Latency[ i ][ j ];
+	    Sum->LatencySum[ i ] += Block->LatencySum[ i ];
+	}
+    }
+}
+
+
+
+/*++
+ * Function:	Counter_Sync
+ *
+ * Purpose:	Bring the counters in the stat file up to date.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Called once a second by the recycle thread.  The totals
+ *		are shown less the baseline Counter_Reset() took.
+ *--
+ */
+extern void Counter_Sync( void )
+{
+    struct IMAPCounterBlock Sum;
+    unsigned int i, j;
+
+    LockMutex( &CounterMutex );
+
+    Counter_Sum( &Sum );
+
+    IMAPCount->CurrentClientConnections = Sum.CurrentClientConnections;
+    IMAPCount->InUseServerConnections = Sum.InUseServerConnections;
+    IMAPCount->RetainedServerConnections = Sum.RetainedServerConnections;
+
+    if ( IMAPCount->CurrentClientConnections >
+	 IMAPCount->PeakClientConnections )
+	IMAPCount->PeakClientConnections = IMAPCount->CurrentClientConnections;
+
+    if ( IMAPCount->InUseServerConnections >
+	 IMAPCount->PeakInUseServerConnections )
+	IMAPCount->PeakInUseServerConnections = IMAPCount->InUseServerConnections;
+
+    if ( IMAPCount->RetainedServerConnections >
+	 IMAPCount->PeakRetainedServerConnections )
+	IMAPCount->PeakRetainedServerConnections = IMAPCount->RetainedServerConnections;
+
+    IMAPCount->TotalClientConnectionsAccepted = Sum.TotalClientConnectionsAccepted - CounterBase.TotalClientConnectionsAccepted;
+    IMAPCount->TotalClientLogins = Sum.TotalClientLogins - CounterBase.TotalClientLogins;
+    IMAPCount->TotalServerConnectionsCreated = Sum.TotalServerConnectionsCreated - CounterBase.TotalServerConnectionsCreated;
+    IMAPCount->TotalServerConnectionsReused = Sum.TotalServerConnectionsReused - CounterBase.TotalServerConnectionsReused;
+    IMAPCount->TotalServerConnectionsEvicted = Sum.TotalServerConnectionsEvicted - CounterBase.TotalServerConnectionsEvicted;
+    IMAPCount->TotalSelectCommands = Sum.TotalSelectCommands - CounterBase.TotalSelectCommands;
+    IMAPCount->SelectCacheHits = Sum.SelectCacheHits - CounterBase.SelectCacheHits;
+    IMAPCount->SelectCacheMisses = Sum.SelectCacheMisses - CounterBase.SelectCacheMisses;
+    IMAPCount->SelectCacheRevalidations = Sum.SelectCacheRevalidations - CounterBase.SelectCacheRevalidations;
+    IMAPCount->SpareConnectionHits = Sum.SpareConnectionHits - CounterBase.SpareConnectionHits;
+    IMAPCount->SpareConnectionMisses = Sum.SpareConnectionMisses - CounterBase.SpareConnectionMisses;
+    IMAPCount->TLSSessionsResumed = Sum.TLSSessionsResumed - CounterBase.TLSSessionsResumed;
+    IMAPCount->TLSFullHandshakes = Sum.TLSFullHandshakes - CounterBase.TLSFullHandshakes;
+    IMAPCount->TraceRecordsDropped = Sum.TraceRecordsDropped - CounterBase.TraceRecordsDropped;
+    IMAPCount->RelayWritesSaved = Sum.RelayWritesSaved - CounterBase.RelayWritesSaved;
+
+    for ( i = 0; i < LATENCY_KINDS; i++ )
+    {
+	for ( j = 0; j < LATENCY_BUCKETS; j++ )
+	    IMAPCount->Latency[ i ][ j ] = Sum.Latency[ i ][ j ] - CounterBase.Latency[ i ][ j ];
+	IMAPCount->LatencySum[ i ] = Sum.LatencySum[ i ] - CounterBase.LatencySum[ i ];
+    }
+
+    UnLockMutex( &CounterMutex );
+}
+
+
+
+/*++
+ * Function:	Counter_Reset
+ *
+ * Purpose:	Start the totals and peaks over, for the RESET admin
+ *		command.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The blocks belong to their threads, so rather than zero
+ *		them we remember where they are now and count from there.
+ *		The same totals are reset as always were, and the latency
+ *		histograms.
+ *--
+ */
+extern void Counter_Reset( void )
+{
+    struct IMAPCounterBlock Sum;
+
+    LockMutex( &CounterMutex );
+
+    Counter_Sum( &Sum );
+
+    CounterBase.TotalClientConnectionsAccepted = Sum.TotalClientConnectionsAccepted;
+    CounterBase.TotalServerConnectionsCreated = Sum.TotalServerConnectionsCreated;
+    CounterBase.TotalServerConnectionsReused = Sum.TotalServerConnectionsReused;
+    CounterBase.TotalClientLogins = Sum.TotalClientLogins;
+    memcpy( CounterBase.Latency, Sum.Latency, sizeof CounterBase.Latency );
+    memcpy( CounterBase.LatencySum, Sum.LatencySum, sizeof CounterBase.LatencySum );
+
+    IMAPCount->CountTime = time( 0 );
+    IMAPCount->PeakClientConnections = 0;
+    IMAPCount->PeakInUseServerConnections = 0;
+    IMAPCount->PeakRetainedServerConnections = 0;
+
+    UnLockMutex( &CounterMutex );
+
+    Counter_Sync();
+}
+
+
+
+
+/*++
+ * Function:	Counter_Latency
+ *
+ * Purpose:	Count how long something took in its latency histogram.
+ *
+ * Parameters:	unsigned int -- which LATENCY_ timing this is
+ *		ptr to when it started
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern void Counter_Latency( unsigned int Kind, struct timeval *Since )
+{
+    struct IMAPCounterBlock *Block;
+    struct timeval Now;
+    long Usecs;
+
+    gettimeofday( &Now, NULL );
+
+    Usecs = ( Now.tv_sec - Since->tv_sec ) * 1000000L +
+	( Now.tv_usec - Since->tv_usec );
+
+    /* the clock went backwards */
+    if ( Usecs < 0 )
+	Usecs = 0;
+
+    Block = Counter_Block();
+    Block->Latency[ Kind ][ Latency_Bucket( Usecs ) ]++;
+    Block->LatencySum[ Kind ] += Usecs;
+}
+
+
+
+/*++
+ * Function:	Counter_Metrics
+ *
+ * Purpose:	Add the counters and latency histograms to a metrics page.
+ *
+ * Parameters:	ptr to the page
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The same names and types as the stat file, so this reads
+ *		just like pimpstat -p.  The select cache hit rate and how
+ *		full the connection cache hash table is are worked out
+ *		here too.
+ *--
+ */
+extern void Counter_Metrics( struct MetricsPage *Page )
+{
+    char *Data = (char *)IMAPCount;
+    unsigned int Value32;
+    unsigned long long Value64;
+    unsigned long long Seen;
+    unsigned int Answered;
+    unsigned int i, j;
+
+    for ( i = 0; i < STAT_FIELDS; i++ )
+    {
+	if ( StatFields[ i ].Size == sizeof Value32 )
+	{
+	    memcpy( &Value32, Data + StatFields[ i ].Offset, sizeof Value32 );
+	    Value64 = Value32;
+	}
+	else
+	    memcpy( &Value64, Data + StatFields[ i ].Offset, sizeof Value64 );
+
+	Metrics_Printf( Page, "# HELP imapproxy_%s %s\n# TYPE imapproxy_%s %s\nimapproxy_%s %llu\n",
+			StatFields[ i ].Name, StatFields[ i ].Help,
+			StatFields[ i ].Name,
+			StatFields[ i ].Type == STAT_COUNTER ? "counter" : "gauge",
+			StatFields[ i ].Name, Value64 );
+    }
+
+    Answered = IMAPCount->SelectCacheHits + IMAPCount->SelectCacheRevalidations;
+    Metrics_Printf( Page, "# HELP imapproxy_select_cache_hit_ratio SELECT commands answered from the cache, of all cacheable ones.\n# TYPE imapproxy_select_cache_hit_ratio gauge\nimapproxy_select_cache_hit_ratio %g\n",
+		    Answered + IMAPCount->SelectCacheMisses ?
+		    (double)Answered /
+		    ( Answered + IMAPCount->SelectCacheMisses ) : 0.0 );
+
+    Metrics_Printf( Page, "# HELP imapproxy_icc_hash_chains_in_use_ratio Connection cache hash chains with anything on them, of all of them.\n# TYPE imapproxy_icc_hash_chains_in_use_ratio gauge\nimapproxy_icc_hash_chains_in_use_ratio %g\n",
+		    IMAPCount->ICCBuckets ?
+		    (double)IMAPCount->ICCChainsInUse / IMAPCount->ICCBuckets : 0.0 );
+
+    for ( i = 0; i < LATENCY_KINDS; i++ )
+    {
+	Metrics_Printf( Page, "# HELP imapproxy_%s_latency_seconds %s\n# TYPE imapproxy_%s_latency_seconds histogram\n",
+			StatHistograms[ i ].Name, StatHistograms[ i ].Help,
+			StatHistograms[ i ].Name );
+
+	Seen = 0;
+	for ( j = 0; j < LATENCY_BUCKETS - 1; j++ )
+	{
+	    Seen += IMAPCount->Latency[ i ][ j ];
+	    Metrics_Printf( Page, "imapproxy_%s_latency_seconds_bucket{le=\"%g\"} %llu\n",
+			    StatHistograms[ i ].Name,
+			    LATENCY_BUCKET_LOW( j + 1 ) / 1000000.0, Seen );
+	}
+	Seen += IMAPCount->Latency[ i ][ j ];
+
+	Metrics_Printf( Page, "imapproxy_%s_latency_seconds_bucket{le=\"+Inf\"} %llu\nimapproxy_%s_latency_seconds_sum %g\nimapproxy_%s_latency_seconds_count %llu\n",
+			StatHistograms[ i ].Name, Seen,
+			StatHistograms[ i ].Name,
+			IMAPCount->LatencySum[ i ] / 1000000.0,
+			StatHistograms[ i ].Name, Seen );
+    }
+}
+
+
+
+/*++
+ * Function:	Latency_Bucket
+ *
+ * Purpose:	Find the histogram bucket for a time.
+ *
+ * Parameters:	unsigned long -- microseconds
+ *
+ * Returns:	the bucket index (the inverse of LATENCY_BUCKET_LOW())
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The top bit gives the doubling, the two bits under it the
+ *		quarter within it.
+ *--
+ */
+static unsigned int Latency_Bucket( unsigned long Usecs )
+{
+    unsigned int Top = 0;
+    unsigned int Bucket;
+
+    if ( Usecs < 4 )
+	return( Usecs );
+
+    while ( Usecs >> ( Top + 1 ) )
+	Top++;
+
+    Bucket = 4 * ( Top - 1 ) + ( ( Usecs >> ( Top - 2 ) ) & 3 );
+
+    return( Bucket < LATENCY_BUCKETS ? Bucket : LATENCY_BUCKETS - 1 );
+}
+
+
+/*
+ *                            _________
+ *                           /        |
+ *                          /         |
+ *                         /    ______|
+ *                        /    /       ________
+ *                       |    |        |      /
+ *                       |    |        |_____/
+ *                       |    |        ______
+ *                       |    |        |     \
+ *                       |    |        |______\
+ *                        \    \_______
+ *                         \           |
+ *                          \          |
+ *                           \_________|
+ */
@@ -0,0 +1,1609 @@
+/*
+**
+** Copyright (c) 2010-2016 The SquirrelMail Project Team
+**
+** Licensed under the GNU GPL. For full terms see the file COPYING.
+**
+** This file is part of SquirrelMail IMAP Proxy.
+**
+**  Facility:
+**
+**	engine.c
+**
+**  Abstract:
+**
+**	Event driven I/O engine ("io_engine epoll").  Instead of running
+**	one thread per client, a small fixed set of worker threads each
+**	run an edge-triggered epoll loop over their client and server
+**	sockets and drive the pre-authentication command parser and the
+**	post-login relay as non-blocking state machines.
+**
+**	The few steps that have to talk to the IMAP server or wait on the
+**	client synchronously (LOGIN, AUTHENTICATE, admin commands, string
+**	literals, SELECT caching and LOGOUT handling) are handed to a small
+**	pool of helper threads, which run the regular blocking code for
+**	just that step and then hand the session back to its worker.
+**
+**  Authors:
+**
+**      The SquirrelMail Project Team
+**
+**  Version:
+**
+**      $Id$
+**
+**  Modification History:
+**
+**      $Log$
+**
+*/
+
+
+#define _REENTRANT
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "common.h"
+#include "imapproxy.h"
+
+/*
+ * External globals
+ */
+extern char Banner[BUFSIZE];
+extern unsigned int BannerLen;
+extern IMAPCounter_Struct *IMAPCount;
+extern ProxyConfig_Struct PC_Struct;
+#if HAVE_LIBSSL
+extern SSL_CTX *tls_ctx;
+#endif
+
+
+#if HAVE_SYS_EPOLL_H
+
+#define ENGINE_MAX_EVENTS       256           /* events per epoll_wait()  */
+#define ENGINE_HIGH_WATER       ( 4 * BUFSIZE ) /* stop reading a peer when */
+                                              /* this much is queued      */
+#define ENGINE_SWEEP_INTERVAL   60            /* seconds between sweeps   */
+#define ENGINE_DEFAULT_HELPERS  16            /* default helper threads   */
+
+/*
+ * Session states
+ */
+#define ES_PREAUTH              0             /* not logged in yet        */
+#define ES_RELAY                1             /* proxying to the server   */
+
+/*
+ * Who currently owns a session.  Only the owner may touch it.
+ */
+#define ES_NEW                  0             /* queued to its worker     */
+#define ES_WORKER               1             /* its worker thread        */
+#define ES_HELPER               2             /* a helper thread          */
+#define ES_DEAD                 3             /* closed, free at end of   */
+                                              /* the current event batch  */
+
+/*
+ * Return codes of the pump routines.
+ */
+#define ENGINE_WAIT             0             /* wait for more events     */
+#define ENGINE_HELPER           1             /* hand to a helper thread  */
+#define ENGINE_CLOSE            2             /* the session is over      */
+
+
+/*
+ * Data that could not be written to a socket yet.
+ */
+struct EngineBuffer
+{
+    char *Data;
+    unsigned int Size;                /* allocated size of Data           */
+    unsigned int Start;               /* first byte not yet written       */
+    unsigned int End;                 /* one past the last queued byte    */
+    int Retry;                        /* length of an SSL_write() that    */
+                                      /* has to be repeated               */
+};
+
+
+struct EngineWorker;
+
+/*
+ * One EngineSession per client connection.
+ */
+struct EngineSession
+{
+    int State;                        /* ES_PREAUTH or ES_RELAY           */
+    int Owner;                        /* ES_NEW, ES_WORKER, ...           */
+    int Done;                         /* a helper finished the session    */
+    int Result;                       /* relay return code (Raw_Proxy())  */
+    int ClientEOF;                    /* client closed its side           */
+    time_t LastActivity;              /* for idle timeouts                */
+    struct EngineWorker *Worker;      /* worker that owns our sockets     */
+    struct EngineSession *Prev;       /* worker session list              */
+    struct EngineSession *Next;
+    struct EngineSession *NextJob;    /* helper queue or dead list link   */
+    ITD_Struct Client;
+    ICD_Struct ClientConn;
+    ITD_Struct *Server;               /* NULL until the client logs in    */
+    char *QueuedPreauthCommand;       /* see Handle_Preauth_Line()        */
+    int Splice;                       /* server data goes through Pipe    */
+    int Pipe[2];                      /* see IMAP_Splice_Open()           */
+    unsigned int InPipe;              /* bytes waiting in Pipe            */
+    struct EngineBuffer ToClient;
+    struct EngineBuffer ToServer;
+};
+
+
+struct EngineWorker
+{
+    pthread_t Thread;
+    int epfd;                         /* epoll descriptor                 */
+    int NotifyPipe[2];                /* new and returning sessions       */
+    struct EngineSession *Sessions;   /* every session we own             */
+    struct EngineSession *Dead;       /* sessions to free after a batch   */
+    time_t LastSweep;                 /* last idle sweep                  */
+};
+
+
+static struct EngineWorker *Workers;
+static unsigned int NumWorkers;
+static unsigned int NextWorker;
+
+static pthread_mutex_t HelperMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t HelperCond = PTHREAD_COND_INITIALIZER;
+static struct EngineSession *HelperHead;
+static struct EngineSession *HelperTail;
+
+
+/*
+ * internal prototypes
+ */
+static int Set_Blocking( int, int );
+static void Engine_Watch( struct EngineWorker *, int, struct EngineSession * );
+static void Engine_Unwatch( struct EngineWorker *, int );
+static void Engine_Notify( struct EngineWorker *, struct EngineSession * );
+static int Engine_Write( struct EngineBuffer *, ICD_Struct *, const char *, int );
+static int Engine_Read( ICD_Struct *, char *, int );
+static int Buffer_Append( struct EngineBuffer *, const char *, unsigned int );
+static int Buffer_Flush( struct EngineBuffer *, ICD_Struct * );
+static int Engine_Send( struct EngineBuffer *, ICD_Struct *, const char *, int );
+static int Engine_Fill( struct EngineSession * );
+static int Line_Ready( ITD_Struct * );
+static void Relay_Answered( ITD_Struct * );
+static int Preauth_Needs_Helper( ITD_Struct * );
+static int Pump_Preauth( struct EngineSession * );
+static int Pump_Relay( struct EngineSession * );
+static void Engine_Service( struct EngineWorker *, struct EngineSession * );
+static void Engine_Close( struct EngineWorker *, struct EngineSession * );
+static void Engine_Drain_Notify( struct EngineWorker * );
+static void Engine_Sweep( struct EngineWorker *, time_t );
+static void Engine_Run_Blocking( struct EngineSession * );
+static void *Engine_Worker( void * );
+static void *Engine_Helper( void * );
+
+
+
+/*++
+ * Function:	Set_Blocking
+ *
+ * Purpose:	Turn O_NONBLOCK off or on for a socket.
+ *
+ * Parameters:	int socket descriptor
+ *		int -- 1 for blocking mode, 0 for non-blocking mode
+ *
+ * Returns:	0 on success
+ *		-1 on failure
+ *--
+ */
+static int Set_Blocking( int sd, int Blocking )
+{
+    int flags;
+
+    flags = fcntl( sd, F_GETFL, 0 );
+    if ( flags < 0 )
+	return( -1 );
+
+    if ( Blocking )
+	flags &= ~O_NONBLOCK;
+    else
+	flags |= O_NONBLOCK;
+
+    return( fcntl( sd, F_SETFL, flags ) );
+}
+
+
+
+/*++
+ * Function:	Engine_Watch / Engine_Unwatch
+ *
+ * Purpose:	Add a socket to, or remove it from, a worker's epoll set.
+ *		Sockets are always watched for both directions in edge
+ *		triggered mode, so an idle session costs no wakeups.
+ *
+ * Parameters:	ptr to the worker
+ *		int socket descriptor
+ *		ptr to the session the socket belongs to
+ *
+ * Returns:	nada
+ *--
+ */
+static void Engine_Watch( struct EngineWorker *W, int sd,
+			  struct EngineSession *ES )
+{
+    char *fn = "Engine_Watch()";
+    struct epoll_event ev;
+
+    memset( &ev, 0, sizeof ev );
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = ES;
+
+    if ( epoll_ctl( W->epfd, EPOLL_CTL_ADD, sd, &ev ) < 0 )
+	syslog( LOG_ERR, "%s: epoll_ctl() failed to add sd [%d]: %s", fn, sd, strerror( errno ) );
+}
+
+
+static void Engine_Unwatch( struct EngineWorker *W, int sd )
+{
+    struct epoll_event ev;
+
+    /* pre 2.6.9 kernels want a non-NULL event, even for a delete */
+    memset( &ev, 0, sizeof ev );
+    epoll_ctl( W->epfd, EPOLL_CTL_DEL, sd, &ev );
+}
+
+
+
+/*++
+ * Function:	Engine_Notify
+ *
+ * Purpose:	Hand a session to a worker thread, either because it was
+ *		just accepted or because a helper is done with it.
+ *
+ * Parameters:	ptr to the worker
+ *		ptr to the session
+ *
+ * Returns:	nada
+ *
+ * Notes:	Session pointers are sent down a pipe.  They are far smaller
+ *		than PIPE_BUF, so the writes are atomic.
+ *--
+ */
+static void Engine_Notify( struct EngineWorker *W, struct EngineSession *ES )
+{
+    char *fn = "Engine_Notify()";
+    int rc;
+
+    for ( ;; )
+    {
+	rc = write( W->NotifyPipe[1], &ES, sizeof ES );
+	if ( rc == sizeof ES )
+	    return;
+
+	if ( rc < 0 && errno == EINTR )
+	    continue;
+
+	/* nothing we can do to recover from this one */
+	syslog( LOG_ERR, "%s: write() to worker notify pipe failed: %s -- Exiting.", fn, strerror( errno ) );
+	exit( 1 );
+    }
+}
+
+
+
+/*++
+ * Function:	Engine_Write
+ *
+ * Purpose:	non-blocking write to a client or server connection.
+ *
+ * Parameters:	ptr to the EngineBuffer of that direction (for TLS retries)
+ *		ptr to the connection
+ *		ptr to the data
+ *		int length of the data
+ *
+ * Returns:	number of bytes written, 0 if the write would block
+ *		-1 on failure
+ *
+ * Notes:	SSL_write() has to be repeated with the same length after
+ *		a WANT_READ or WANT_WRITE, so we remember that length.
+ *--
+ */
+static int Engine_Write( struct EngineBuffer *EB, ICD_Struct *ICD,
+			 const char *Data, int Len )
+{
+    int rc;
+
+#if HAVE_LIBSSL
+    if ( ICD->tls )
+    {
+	rc = SSL_write( ICD->tls, Data, Len );
+	if ( rc > 0 )
+	{
+	    EB->Retry = 0;
+	    return( rc );
+	}
+
+	switch ( SSL_get_error( ICD->tls, rc ) )
+	{
+	    case SSL_ERROR_WANT_READ:
+	    case SSL_ERROR_WANT_WRITE:
+		EB->Retry = Len;
+		return( 0 );
+
+	    default:
+		return( -1 );
+	}
+    }
+#endif
+
+    for ( ;; )
+    {
+	rc = write( ICD->sd, Data, Len );
+	if ( rc >= 0 )
+	    return( rc );
+
+	if ( errno == EINTR )
+	    continue;
+
+	if ( errno == EAGAIN || errno == EWOULDBLOCK )
+	    return( 0 );
+
+	return( -1 );
+    }
+}
+
+
+
+/*++
+ * Function:	Engine_Read
+ *
+ * Purpose:	non-blocking read from a server connection.
+ *
+ * Parameters:	ptr to the connection
+ *		ptr to the buffer
+ *		int size of the buffer
+ *
+ * Returns:	number of bytes read, 0 if there is nothing to read
+ *		-1 if the connection was closed or failed
+ *--
+ */
+static int Engine_Read( ICD_Struct *ICD, char *Buf, int Len )
+{
+    int rc;
+
+#if HAVE_LIBSSL
+    if ( ICD->tls )
+    {
+	rc = SSL_read( ICD->tls, Buf, Len );
+	if ( rc > 0 )
+	    return( rc );
+
+	switch ( SSL_get_error( ICD->tls, rc ) )
+	{
+	    case SSL_ERROR_WANT_READ:
+	    case SSL_ERROR_WANT_WRITE:
+		return( 0 );
+
+	    default:
+		return( -1 );
+	}
+    }
+#endif
+
+    for ( ;; )
+    {
+	rc = read( ICD->sd, Buf, Len );
+	if ( rc > 0 )
+	    return( rc );
+
+	if ( rc == 0 )
+	    return( -1 );
+
+	if ( errno == EINTR )
+	    continue;
+
+	if ( errno == EAGAIN || errno == EWOULDBLOCK )
+	    return( 0 );
+
+	return( -1 );
+    }
+}
+
+
+
+/*++
+ * Function:	Buffer_Append
+ *
+ * Purpose:	Queue data that could not be written yet.
+ *
+ * Parameters:	ptr to the EngineBuffer
+ *		ptr to the data
+ *		unsigned int length of the data
+ *
+ * Returns:	0 on success
+ *		-1 on failure
+ *--
+ */
+static int Buffer_Append( struct EngineBuffer *EB, const char *Data,
+			  unsigned int Len )
+{
+    char *fn = "Buffer_Append()";
+    unsigned int NewSize;
+    char *NewData;
+
+    if ( ! Len )
+	return( 0 );
+
+    if ( EB->End + Len > EB->Size )
+    {
+	/* slide what's left to the front before we grow */
+	if ( EB->Start )
+	{
+	    memmove( EB->Data, EB->Data + EB->Start, EB->End - EB->Start );
+	    EB->End -= EB->Start;
+	    EB->Start = 0;
+	}
+
+	if ( EB->End + Len > EB->Size )
+	{
+	    NewSize = ( EB->Size ? EB->Size * 2 : BUFSIZE );
+	    while ( NewSize < EB->End + Len )
+		NewSize *= 2;
+
+	    NewData = realloc( EB->Data, NewSize );
+	    if ( ! NewData )
+	    {
+		syslog( LOG_ERR, "%s: realloc() failed: %s", fn, strerror( errno ) );
+		return( -1 );
+	    }
+	    EB->Data = NewData;
+	    EB->Size = NewSize;
+	}
+    }
+
+    memcpy( EB->Data + EB->End, Data, Len );
+    EB->End += Len;
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Buffer_Flush
+ *
+ * Purpose:	Write as much queued data as the socket will take.
+ *
+ * Parameters:	ptr to the EngineBuffer
+ *		ptr to the connection
+ *
+ * Returns:	0 on success (there may still be data queued)
+ *		-1 on failure
+ *--
+ */
+static int Buffer_Flush( struct EngineBuffer *EB, ICD_Struct *ICD )
+{
+    int Len;
+    int rc;
+
+    while ( EB->Start < EB->End )
+    {
+	Len = ( EB->Retry ? EB->Retry : EB->End - EB->Start );
+
+	rc = Engine_Write( EB, ICD, EB->Data + EB->Start, Len );
+	if ( rc < 0 )
+	    return( -1 );
+
+	if ( rc == 0 )
+	    return( 0 );
+
+	EB->Start += rc;
+    }
+
+    EB->Start = EB->End = 0;
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Engine_Send
+ *
+ * Purpose:	Write data to a connection, queueing whatever the socket
+ *		won't take right now.
+ *
+ * Parameters:	ptr to the EngineBuffer of that direction
+ *		ptr to the connection
+ *		ptr to the data
+ *		int length of the data
+ *
+ * Returns:	0 on success
+ *		-1 on failure
+ *--
+ */
+static int Engine_Send( struct EngineBuffer *EB, ICD_Struct *ICD,
+			const char *Data, int Len )
+{
+    int rc = 0;
+
+    /* keep things in order if something is already queued */
+    if ( EB->Start == EB->End )
+    {
+	rc = Engine_Write( EB, ICD, Data, Len );
+	if ( rc < 0 )
+	    return( -1 );
+
+	if ( rc == Len )
+	    return( 0 );
+    }
+
+    return( Buffer_Append( EB, Data + rc, Len - rc ) );
+}
+
+
+
+/*++
+ * Function:	Engine_Fill
+ *
+ * Purpose:	Read whatever the client has sent into the client ITD
+ *		read buffer, where IMAP_Line_Read() will find it.
+ *
+ * Parameters:	ptr to the session
+ *
+ * Returns:	1 if any data was read
+ *		0 if there was nothing to read (or no room)
+ *		-1 on failure
+ *
+ * Notes:	End of file is recorded in ClientEOF so that any complete
+ *		lines still in the buffer get processed first.
+ *--
+ */
+static int Engine_Fill( struct EngineSession *ES )
+{
+    ITD_Struct *ITD = &ES->Client;
+    int Got = 0;
+    int rc;
+
+    if ( ES->ClientEOF )
+	return( 0 );
+
+    if ( ITD->ReadBytesProcessed == ITD->BytesInReadBuffer )
+	ITD->BytesInReadBuffer = ITD->ReadBytesProcessed = ITD->LineStart = 0;
+
+    for ( ; ; )
+    {
+	/*
+	 * Same rule as IMAP_Line_Read(): only slide the unread data down
+	 * when we're short of room at the end of the buffer.
+	 */
+	if ( ( sizeof ITD->ReadBuf - ITD->BytesInReadBuffer ) < ITD_MIN_READ )
+	    IMAP_Buffer_Compact( ITD );
+
+	if ( ITD->BytesInReadBuffer == sizeof ITD->ReadBuf )
+	    break;
+
+	rc = read( ITD->conn->sd, &ITD->ReadBuf[ ITD->BytesInReadBuffer ],
+		   sizeof ITD->ReadBuf - ITD->BytesInReadBuffer );
+	if ( rc > 0 )
+	{
+	    ITD->BytesInReadBuffer += rc;
+	    Got = 1;
+	    continue;
+	}
+
+	if ( rc == 0 )
+	{
+	    ES->ClientEOF = 1;
+	    break;
+	}
+
+	if ( errno == EINTR )
+	    continue;
+
+	if ( errno == EAGAIN || errno == EWOULDBLOCK )
+	    break;
+
+	return( -1 );
+    }
+
+    return( Got );
+}
+
+
+
+/*++
+ * Function:	Line_Ready
+ *
+ * Purpose:	Tell whether IMAP_Line_Read() can return a line without
+ *		having to read from the socket.
+ *
+ * Parameters:	ptr to the ITD
+ *
+ * Returns:	1 if it can
+ *		0 if not
+ *--
+ */
+static int Line_Ready( ITD_Struct *ITD )
+{
+    unsigned int Avail;
+
+    if ( ITD->BytesInReadBuffer <= ITD->ReadBytesProcessed )
+	return( 0 );
+
+    Avail = ITD->BytesInReadBuffer - ITD->ReadBytesProcessed;
+
+    if ( memchr( ITD->ReadBuf + ITD->ReadBytesProcessed, '\n', Avail ) )
+	return( 1 );
+
+    /* a full buffer with no end of line, IMAP_Line_Read() hands it out */
+    if ( Avail == sizeof ITD->ReadBuf )
+	return( 1 );
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Relay_Answered
+ *
+ * Purpose:	Record the command round trip once the server has sent
+ *		something back.
+ *
+ * Parameters:	ptr to the server ITD
+ *
+ * Returns:	nada
+ *
+ * Notes:	The relay does not follow tags, so this is the time from
+ *		the oldest unanswered command to the first bytes of reply.
+ *--
+ */
+static void Relay_Answered( ITD_Struct *Server )
+{
+    if ( ! Server->CommandSent.tv_sec )
+	return;
+
+    Counter_Latency( LATENCY_COMMAND, &Server->CommandSent );
+    Server->CommandSent.tv_sec = 0;
+}
+
+
+
+/*++
+ * Function:	Preauth_Needs_Helper
+ *
+ * Purpose:	Decide whether the next unauthenticated command line can be
+ *		handled by a worker or has to go to a helper thread.
+ *
+ * Parameters:	ptr to the client ITD (Line_Ready() must be true)
+ *
+ * Returns:	1 if it needs a helper
+ *		0 if not
+ *
+ * Notes:	LOGIN and AUTHENTICATE talk to the IMAP server, the admin
+ *		commands can produce a lot of output or touch the trace
+ *		file, and string literals have to be waited for.
+ *--
+ */
+static int Preauth_Needs_Helper( ITD_Struct *ITD )
+{
+    char *Line;
+    char *EOL;
+    char *CP;
+    unsigned int Command;
+    unsigned int Flags;
+
+    Line = ITD->ReadBuf + ITD->ReadBytesProcessed;
+    EOL = memchr( Line, '\n', ITD->BytesInReadBuffer - ITD->ReadBytesProcessed );
+
+    /* too long -- Handle_Preauth_Line() will drop the client */
+    if ( ! EOL )
+	return( 0 );
+
+    if ( ( EOL - Line > 2 ) && ( *(EOL - 1) == '\r' ) && ( *(EOL - 2) == '}' ) )
+	return( 1 );
+
+    CP = memchr( Line, ' ', EOL - Line );
+    if ( ! CP )
+	return( 0 );
+    CP++;
+
+    Command = Command_Classify( CP, EOL - CP, &Flags );
+
+    if ( Command == CMD_LOGIN || Command == CMD_AUTHENTICATE )
+	return( 1 );
+
+    if ( Flags & COMMAND_ADMIN )
+	return( 1 );
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Pump_Preauth
+ *
+ * Purpose:	Process whatever an unauthenticated client has sent.
+ *
+ * Parameters:	ptr to the session
+ *
+ * Returns:	ENGINE_WAIT, ENGINE_HELPER or ENGINE_CLOSE
+ *--
+ */
+static int Pump_Preauth( struct EngineSession *ES )
+{
+    int rc;
+
+    for ( ;; )
+    {
+	if ( Engine_Fill( ES ) < 0 )
+	    return( ENGINE_CLOSE );
+
+	if ( ! Line_Ready( &ES->Client ) )
+	    return( ES->ClientEOF ? ENGINE_CLOSE : ENGINE_WAIT );
+
+	ES->LastActivity = time( 0 );
+
+	if ( Preauth_Needs_Helper( &ES->Client ) )
+	    return( ENGINE_HELPER );
+
+	rc = Handle_Preauth_Line( &ES->Client, ES->QueuedPreauthCommand );
+	if ( rc != 0 )
+	    return( ENGINE_CLOSE );
+    }
+}
+
+
+
+/*++
+ * Function:	Pump_Relay
+ *
+ * Purpose:	Move data between a logged in client and its server until
+ *		both sockets would block.
+ *
+ * Parameters:	ptr to the session
+ *
+ * Returns:	ENGINE_WAIT, ENGINE_HELPER or ENGINE_CLOSE.  On ENGINE_CLOSE,
+ *		Result holds the relay return code as Raw_Proxy() would
+ *		have returned it.
+ *
+ * Notes:	We stop reading from one side while more than
+ *		ENGINE_HIGH_WATER bytes are queued for the other.  Since both
+ *		sockets are watched for writability, the pump runs again as
+ *		soon as the queue drains.
+ *--
+ */
+static int Pump_Relay( struct EngineSession *ES )
+{
+    char *fn = "Pump_Relay()";
+    ITD_Struct *Client = &ES->Client;
+    ITD_Struct *Server = ES->Server;
+    unsigned int Command;
+    unsigned int Flags;
+    int Progress;
+    int status;
+    int Len;
+    char *Line;
+    char *CP;
+
+    for ( ;; )
+    {
+	Progress = 0;
+
+	/*
+	 * server to client
+	 */
+	if ( Buffer_Flush( &ES->ToClient, Client->conn ) < 0 )
+	{
+	    syslog( LOG_ERR, "%s: write failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
+	    ES->Result = -1;
+	    return( ENGINE_CLOSE );
+	}
+
+	/* plaintext and untraced, the kernel moves it for us */
+	while ( ES->Splice )
+	{
+	    status = IMAP_Splice( Server->conn, Client->conn,
+				  ES->Pipe, &ES->InPipe );
+	    if ( status == 0 )
+		break;
+
+	    if ( status == -1 )
+	    {
+		syslog( LOG_ERR, "%s: IMAP server unexpectedly closed the connection on sd %d", fn, Server->conn->sd );
+		ES->Result = -2;
+		return( ENGINE_CLOSE );
+	    }
+
+	    if ( status == -2 )
+	    {
+		syslog( LOG_ERR, "%s: splice() failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
+		ES->Result = -1;
+		return( ENGINE_CLOSE );
+	    }
+
+	    Progress = 1;
+	    Relay_Answered( Server );
+	}
+
+	while ( ! ES->Splice &&
+		( ES->ToClient.End - ES->ToClient.Start < ENGINE_HIGH_WATER ) )
+	{
+	    status = Engine_Read( Server->conn, Server->ReadBuf,
+				  sizeof Server->ReadBuf );
+	    if ( status < 0 )
+	    {
+		syslog( LOG_ERR, "%s: IMAP server unexpectedly closed the connection on sd %d", fn, Server->conn->sd );
+		ES->Result = -2;
+		return( ENGINE_CLOSE );
+	    }
+
+	    if ( status == 0 )
+		break;
+
+	    Progress = 1;
+	    Relay_Answered( Server );
+
+	    if ( Server->TraceOn )
+		Trace_Data( Server, TRACE_SERVER, Server->ReadBuf, status );
+
+	    if ( PC_Struct.enable_select_cache )
+		Select_Cache_Observe( &Server->conn->ISC, Server->ReadBuf,
+				      status );
+
+	    if ( Engine_Send( &ES->ToClient, Client->conn,
+			      Server->ReadBuf, status ) < 0 )
+	    {
+		syslog( LOG_ERR, "%s: write failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
+		ES->Result = -1;
+		return( ENGINE_CLOSE );
+	    }
+	}
+
+	/*
+	 * client to server
+	 */
+	if ( Buffer_Flush( &ES->ToServer, Server->conn ) < 0 )
+	{
+	    syslog( LOG_ERR, "%s: write failed sending data to server on sd [%d]: %s", fn, Server->conn->sd, strerror( errno ) );
+	    ES->Result = -2;
+	    return( ENGINE_CLOSE );
+	}
+
+	status = Engine_Fill( ES );
+	if ( status < 0 )
+	{
+	    syslog( LOG_NOTICE, "%s: Failed to read from client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
+	    ES->Result = -1;
+	    return( ENGINE_CLOSE );
+	}
+	if ( status > 0 )
+	    Progress = 1;
+
+	while ( ( ES->ToServer.End - ES->ToServer.Start < ENGINE_HIGH_WATER ) &&
+		Line_Ready( Client ) )
+	{
+	    /* anything Relay_Client_Command() has to look after */
+	    if ( ! Relay_Line_Plain( Client, &Server->conn->ISC ) )
+	    {
+		ES->LastActivity = time( 0 );
+		return( ENGINE_HELPER );
+	    }
+
+	    Progress = 1;
+
+	    /* the whole line is buffered, so this can't block */
+	    status = IMAP_Line_Read( Client );
+	    if ( status == -1 )
+	    {
+		syslog( LOG_NOTICE, "%s: Failed to read line from client on sd [%d]", fn, Client->conn->sd );
+		ES->Result = -1;
+		return( ENGINE_CLOSE );
+	    }
+
+	    if ( Client->TraceOn )
+		Trace_Data( Client, TRACE_CLIENT, ITD_LINE( Client ), status );
+
+	    if ( PC_Struct.enable_select_cache )
+	    {
+		CP = memchr( ITD_LINE( Client ), ' ', status );
+		if ( CP )
+		{
+		    CP++;
+		    Command = Command_Classify( CP,
+						status - ( CP - ITD_LINE( Client ) ),
+						&Flags );
+		    if ( ! ( Flags & COMMAND_SAFE ) )
+			Invalidate_Cache_Entry( &Server->conn->ISC );
+		    Select_Cache_Command( &Server->conn->ISC, Command, Flags, CP,
+					  status - ( CP - ITD_LINE( Client ) ) );
+		}
+	    }
+
+	    /* and whatever was pipelined behind it, in the same write */
+	    Line = ITD_LINE( Client );
+	    Len = Relay_Gather( Client, &Server->conn->ISC );
+	    if ( Len == -1 )
+	    {
+		ES->Result = -1;
+		return( ENGINE_CLOSE );
+	    }
+	    Len += status;
+
+	    if ( Engine_Send( &ES->ToServer, Server->conn, Line, Len ) < 0 )
+	    {
+		syslog( LOG_ERR, "%s: write failed sending data to server on sd [%d]: %s", fn, Server->conn->sd, strerror( errno ) );
+		ES->Result = -2;
+		return( ENGINE_CLOSE );
+	    }
+
+	    if ( ! Server->CommandSent.tv_sec )
+		gettimeofday( &Server->CommandSent, NULL );
+	}
+
+	if ( ES->ClientEOF && ! Line_Ready( Client ) )
+	{
+	    syslog( LOG_NOTICE, "%s: client on sd [%d] closed the connection", fn, Client->conn->sd );
+	    ES->Result = -1;
+	    return( ENGINE_CLOSE );
+	}
+
+	if ( ! Progress )
+	    return( ENGINE_WAIT );
+
+	ES->LastActivity = time( 0 );
+    }
+}
+
+
+
+/*++
+ * Function:	Engine_Service
+ *
+ * Purpose:	Run the state machine of a session after an event.
+ *
+ * Parameters:	ptr to the worker
+ *		ptr to the session
+ *
+ * Returns:	nada
+ *--
+ */
+static void Engine_Service( struct EngineWorker *W, struct EngineSession *ES )
+{
+    int rc;
+
+    if ( ES->State == ES_PREAUTH )
+	rc = Pump_Preauth( ES );
+    else
+	rc = Pump_Relay( ES );
+
+    switch ( rc )
+    {
+	case ENGINE_HELPER:
+	    /*
+	     * Stop watching the sockets while a helper owns the session.
+	     * Its worker re-adds them when the helper hands it back.
+	     */
+	    Engine_Unwatch( W, ES->ClientConn.sd );
+	    if ( ES->Server )
+		Engine_Unwatch( W, ES->Server->conn->sd );
+
+	    ES->Owner = ES_HELPER;
+	    ES->NextJob = NULL;
+
+	    LockMutex( &HelperMutex );
+	    if ( HelperTail )
+		HelperTail->NextJob = ES;
+	    else
+		HelperHead = ES;
+	    HelperTail = ES;
+	    pthread_cond_signal( &HelperCond );
+	    UnLockMutex( &HelperMutex );
+	    break;
+
+	case ENGINE_CLOSE:
+	    Engine_Close( W, ES );
+	    break;
+
+	default:
+	    break;
+    }
+}
+
+
+
+/*++
+ * Function:	Engine_Close
+ *
+ * Purpose:	End a session:  finish the relay (if any), close the client
+ *		and retire the session.
+ *
+ * Parameters:	ptr to the worker
+ *		ptr to the session
+ *
+ * Returns:	nada
+ *
+ * Notes:	The session itself is freed at the end of the current event
+ *		batch, since a later event in the batch may still point at it.
+ *--
+ */
+static void Engine_Close( struct EngineWorker *W, struct EngineSession *ES )
+{
+    int rc;
+
+    Engine_Unwatch( W, ES->ClientConn.sd );
+
+    if ( ES->Server )
+    {
+	/*
+	 * The server connection goes back to the cache, so it has to
+	 * be out of our epoll set and back in blocking mode first.
+	 */
+	Engine_Unwatch( W, ES->Server->conn->sd );
+	Set_Blocking( ES->Server->conn->sd, 1 );
+
+	/* best effort -- don't let a stalled client hold up the worker */
+	Buffer_Flush( &ES->ToClient, &ES->ClientConn );
+
+	if ( ES->Splice )
+	{
+	    IMAP_Splice_Flush( &ES->ClientConn, ES->Pipe, &ES->InPipe );
+	    close( ES->Pipe[0] );
+	    close( ES->Pipe[1] );
+	}
+
+	rc = Relay_Finish( &ES->Client, ES->Server, ES->Result );
+
+	if ( ( rc == 1 ) && ( ES->ToClient.Start == ES->ToClient.End ) &&
+	     ! ES->InPipe )
+	    Answer_Caught_Logout( &ES->Client );
+    }
+
+    COUNT( CurrentClientConnections, -1 );
+    close( ES->ClientConn.sd );
+
+    if ( ES->Prev )
+	ES->Prev->Next = ES->Next;
+    else
+	W->Sessions = ES->Next;
+    if ( ES->Next )
+	ES->Next->Prev = ES->Prev;
+
+    ES->Owner = ES_DEAD;
+    ES->NextJob = W->Dead;
+    W->Dead = ES;
+}
+
+
+
+/*++
+ * Function:	Engine_Drain_Notify
+ *
+ * Purpose:	Pick up new sessions and sessions handed back by helpers.
+ *
+ * Parameters:	ptr to the worker
+ *
+ * Returns:	nada
+ *--
+ */
+static void Engine_Drain_Notify( struct EngineWorker *W )
+{
+    struct EngineSession *Batch[ 64 ];
+    struct EngineSession *ES;
+    int rc;
+    int i;
+
+    for ( ;; )
+    {
+	rc = read( W->NotifyPipe[0], Batch, sizeof Batch );
+	if ( rc <= 0 )
+	{
+	    if ( rc < 0 && errno == EINTR )
+		continue;
+	    return;
+	}
+
+	for ( i = 0; i < rc / (int)sizeof Batch[0]; i++ )
+	{
+	    ES = Batch[ i ];
+
+	    if ( ES->Owner == ES_NEW )
+	    {
+		ES->Prev = NULL;
+		ES->Next = W->Sessions;
+		if ( W->Sessions )
+		    W->Sessions->Prev = ES;
+		W->Sessions = ES;
+	    }
+
+	    ES->Owner = ES_WORKER;
+
+	    if ( ES->Done )
+	    {
+		Engine_Close( W, ES );
+		continue;
+	    }
+
+	    Engine_Watch( W, ES->ClientConn.sd, ES );
+	    if ( ES->Server )
+		Engine_Watch( W, ES->Server->conn->sd, ES );
+
+	    /* there may already be complete lines in the buffer */
+	    Engine_Service( W, ES );
+	}
+    }
+}
+
+
+
+/*++
+ * Function:	Engine_Sweep
+ *
+ * Purpose:	Drop sessions that have been idle for longer than the
+ *		client poll timeout used by the threaded code.
+ *
+ * Parameters:	ptr to the worker
+ *		time_t current time
+ *
+ * Returns:	nada
+ *--
+ */
+static void Engine_Sweep( struct EngineWorker *W, time_t Now )
+{
+    char *fn = "Engine_Sweep()";
+    struct EngineSession *ES;
+    struct EngineSession *Next;
+
+    W->LastSweep = Now;
+
+    for ( ES = W->Sessions; ES; ES = Next )
+    {
+	Next = ES->Next;
+
+	if ( ES->Owner != ES_WORKER )
+	    continue;
+
+	if ( Now - ES->LastActivity < POLL_TIMEOUT / 1000 )
+	    continue;
+
+	syslog( LOG_WARNING, "%s: no data received on client sd [%d] for %d minutes.  Closing connection.", fn, ES->ClientConn.sd, POLL_TIMEOUT_MINUTES );
+
+	/* same as a poll() timeout in Raw_Proxy() */
+	ES->Result = -2;
+	Engine_Close( W, ES );
+    }
+}
+
+
+
+/*++
+ * Function:	Engine_Worker
+ *
+ * Purpose:	epoll event loop of one worker thread.
+ *
+ * Parameters:	ptr to the worker
+ *
+ * Returns:	never
+ *--
+ */
+static void *Engine_Worker( void *arg )
+{
+    char *fn = "Engine_Worker()";
+    struct EngineWorker *W = arg;
+    struct epoll_event Events[ ENGINE_MAX_EVENTS ];
+    struct EngineSession *ES;
+    time_t Now;
+    int n;
+    int i;
+
+    W->LastSweep = time( 0 );
+
+    for ( ;; )
+    {
+	n = epoll_wait( W->epfd, Events, ENGINE_MAX_EVENTS, 1000 );
+
+	if ( n < 0 )
+	{
+	    if ( errno != EINTR )
+	    {
+		syslog( LOG_ERR, "%s: epoll_wait() failed: %s", fn, strerror( errno ) );
+		sleep( 1 );
+	    }
+	    continue;
+	}
+
+	for ( i = 0; i < n; i++ )
+	{
+	    ES = Events[ i ].data.ptr;
+
+	    if ( ! ES )
+	    {
+		Engine_Drain_Notify( W );
+		continue;
+	    }
+
+	    /* a helper has it, or it was closed earlier in this batch */
+	    if ( ES->Owner != ES_WORKER )
+		continue;
+
+	    Engine_Service( W, ES );
+	}
+
+	Now = time( 0 );
+	if ( Now - W->LastSweep >= ENGINE_SWEEP_INTERVAL )
+	    Engine_Sweep( W, Now );
+
+	while ( W->Dead )
+	{
+	    ES = W->Dead;
+	    W->Dead = ES->NextJob;
+
+	    free( ES->ToClient.Data );
+	    free( ES->ToServer.Data );
+	    free( ES->QueuedPreauthCommand );
+	    free( ES->Server );
+	    free( ES );
+	}
+    }
+
+    return( NULL );
+}
+
+
+
+/*++
+ * Function:	Engine_Run_Blocking
+ *
+ * Purpose:	Run one blocking step of a session on a helper thread.
+ *
+ * Parameters:	ptr to the session
+ *
+ * Returns:	nada -- sets Done (and Result) if the session is over.
+ *--
+ */
+static void Engine_Run_Blocking( struct EngineSession *ES )
+{
+    int rc;
+
+    Set_Blocking( ES->ClientConn.sd, 1 );
+    if ( ES->Server )
+	Set_Blocking( ES->Server->conn->sd, 1 );
+
+    if ( ES->State == ES_PREAUTH )
+    {
+	rc = Handle_Preauth_Line( &ES->Client, ES->QueuedPreauthCommand );
+
+	if ( rc == 2 )
+	{
+	    /* Engine_Adopt_Relay() moved us to ES_RELAY */
+	    free( ES->QueuedPreauthCommand );
+	    ES->QueuedPreauthCommand = NULL;
+	}
+	else if ( rc != 0 )
+	{
+	    ES->Done = 1;
+	}
+    }
+    else
+    {
+	/* anything still queued has to go out before this command */
+	if ( Buffer_Flush( &ES->ToClient, ES->Client.conn ) < 0 )
+	    rc = -1;
+	else if ( ES->Splice &&
+		  IMAP_Splice_Flush( ES->Client.conn, ES->Pipe, &ES->InPipe ) < 0 )
+	    rc = -1;
+	else if ( Buffer_Flush( &ES->ToServer, ES->Server->conn ) < 0 )
+	    rc = -2;
+	else
+	    rc = Relay_Client_Command( &ES->Client, ES->Server,
+				       &ES->Server->conn->ISC );
+
+	if ( rc != 0 )
+	{
+	    ES->Done = 1;
+	    ES->Result = rc;
+	}
+    }
+
+    Set_Blocking( ES->ClientConn.sd, 0 );
+    if ( ES->Server )
+	Set_Blocking( ES->Server->conn->sd, 0 );
+
+    ES->LastActivity = time( 0 );
+}
+
+
+
+/*++
+ * Function:	Engine_Helper
+ *
+ * Purpose:	Helper thread main loop.
+ *
+ * Parameters:	unused
+ *
+ * Returns:	never
+ *--
+ */
+static void *Engine_Helper( void *arg )
+{
+    struct EngineSession *ES;
+
+    for ( ;; )
+    {
+	LockMutex( &HelperMutex );
+
+	while ( ! HelperHead )
+	    pthread_cond_wait( &HelperCond, &HelperMutex );
+
+	ES = HelperHead;
+	HelperHead = ES->NextJob;
+	if ( ! HelperHead )
+	    HelperTail = NULL;
+
+	UnLockMutex( &HelperMutex );
+
+	Engine_Run_Blocking( ES );
+
+	Engine_Notify( ES->Worker, ES );
+    }
+
+    return( NULL );
+}
+
+
+
+/*++
+ * Function:	Engine_Init
+ *
+ * Purpose:	Start the worker and helper threads.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada -- exit()s on failure.
+ *--
+ */
+extern void Engine_Init( void )
+{
+    char *fn = "Engine_Init()";
+    pthread_attr_t attr;
+    pthread_t ThreadId;
+    struct epoll_event ev;
+    unsigned int NumHelpers;
+    unsigned int i;
+    long ncpu;
+    int rc;
+
+    NumWorkers = PC_Struct.io_engine_threads;
+    if ( ! NumWorkers )
+    {
+	ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+	NumWorkers = ( ncpu > 0 ? ncpu : 1 );
+    }
+
+    NumHelpers = PC_Struct.io_engine_helper_threads;
+    if ( ! NumHelpers )
+	NumHelpers = ENGINE_DEFAULT_HELPERS;
+
+    Workers = calloc( NumWorkers, sizeof( struct EngineWorker ) );
+    if ( ! Workers )
+    {
+	syslog( LOG_ERR, "%s: calloc() failed: %s -- Exiting.", fn, strerror( errno ) );
+	exit( 1 );
+    }
+
+#if HAVE_LIBSSL
+    /*
+     * Queued data can move around in memory between SSL_write() retries.
+     */
+    SSL_CTX_set_mode( tls_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+#endif
+
+    rc = pthread_attr_init( &attr );
+    if ( rc == 0 )
+	rc = pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if ( rc )
+    {
+	syslog( LOG_ERR, "%s: pthread_attr setup failed: [%d] -- Exiting.", fn, rc );
+	exit( 1 );
+    }
+
+    for ( i = 0; i < NumWorkers; i++ )
+    {
+#if HAVE_EPOLL_CREATE1
+	Workers[ i ].epfd = epoll_create1( EPOLL_CLOEXEC );
+#else
+	Workers[ i ].epfd = epoll_create( ENGINE_MAX_EVENTS );
+#endif
+	if ( Workers[ i ].epfd < 0 )
+	{
+	    syslog( LOG_ERR, "%s: epoll_create() failed: %s -- Exiting.", fn, strerror( errno ) );
+	    exit( 1 );
+	}
+
+	if ( pipe( Workers[ i ].NotifyPipe ) < 0 )
+	{
+	    syslog( LOG_ERR, "%s: pipe() failed: %s -- Exiting.", fn, strerror( errno ) );
+	    exit( 1 );
+	}
+	Set_Blocking( Workers[ i ].NotifyPipe[0], 0 );
+
+	/* the notify pipe is the only thing we watch level triggered */
+	memset( &ev, 0, sizeof ev );
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if ( epoll_ctl( Workers[ i ].epfd, EPOLL_CTL_ADD,
+			Workers[ i ].NotifyPipe[0], &ev ) < 0 )
+	{
+	    syslog( LOG_ERR, "%s: epoll_ctl() failed: %s -- Exiting.", fn, strerror( errno ) );
+	    exit( 1 );
+	}
+
+	rc = pthread_create( &Workers[ i ].Thread, &attr, Engine_Worker,
+			     &Workers[ i ] );
+	if ( rc )
+	{
+	    syslog( LOG_ERR, "%s: pthread_create() returned error [%d] for Engine_Worker -- Exiting.", fn, rc );
+	    exit( 1 );
+	}
+    }
+
+    for ( i = 0; i < NumHelpers; i++ )
+    {
+	rc = pthread_create( &ThreadId, &attr, Engine_Helper, NULL );
+	if ( rc )
+	{
+	    syslog( LOG_ERR, "%s: pthread_create() returned error [%d] for Engine_Helper -- Exiting.", fn, rc );
+	    exit( 1 );
+	}
+    }
+
+    syslog( LOG_INFO, "%s: epoll engine started with %u worker and %u helper threads.", fn, NumWorkers, NumHelpers );
+}
+
+
+
+/*++
+ * Function:	Engine_Add_Client
+ *
+ * Purpose:	Greet a newly accepted client and hand it to a worker.
+ *
+ * Parameters:	int client socket descriptor
+ *
+ * Returns:	nada
+ *--
+ */
+extern void Engine_Add_Client( int clientsd )
+{
+    char *fn = "Engine_Add_Client()";
+    struct EngineSession *ES;
+    ICD_Struct conn;
+
+    /* the banner always fits in an empty socket buffer */
+    memset( &conn, 0, sizeof conn );
+    conn.sd = clientsd;
+    if ( IMAP_Write( &conn, Banner, BannerLen ) == -1 )
+    {
+	syslog( LOG_ERR, "%s: IMAP_Write() failed: %s.  Closing client connection.", fn, strerror( errno ) );
+	COUNT( CurrentClientConnections, -1 );
+	close( clientsd );
+	return;
+    }
+
+    ES = calloc( 1, sizeof( struct EngineSession ) );
+    if ( ES )
+	ES->QueuedPreauthCommand = calloc( 1, BUFSIZE );
+
+    if ( ! ES || ! ES->QueuedPreauthCommand )
+    {
+	syslog( LOG_ERR, "%s: calloc() failed: %s.  Closing client connection.", fn, strerror( errno ) );
+	if ( ES )
+	    free( ES );
+	COUNT( CurrentClientConnections, -1 );
+	close( clientsd );
+	return;
+    }
+
+    ES->ClientConn.sd = clientsd;
+    ES->Client.conn = &ES->ClientConn;
+    ES->Client.Session = ES;
+    ES->State = ES_PREAUTH;
+    ES->Owner = ES_NEW;
+    ES->LastActivity = time( 0 );
+
+#if ! HAVE_ACCEPT4
+    /* otherwise Accept_Loop() got it from accept4() this way */
+    Set_Blocking( clientsd, 0 );
+#endif
+
+    ES->Worker = &Workers[ NextWorker++ % NumWorkers ];
+    Engine_Notify( ES->Worker, ES );
+}
+
+
+
+/*++
+ * Function:	Engine_Adopt_Relay
+ *
+ * Purpose:	Called by cmd_login() and cmd_authenticate_login() on a
+ *		helper thread once the client is logged in, instead of
+ *		entering Raw_Proxy().
+ *
+ * Parameters:	ptr to the session
+ *		ptr to the server ITD (copied)
+ *
+ * Returns:	0 on success
+ *		-1 on failure
+ *--
+ */
+extern int Engine_Adopt_Relay( struct EngineSession *ES, ITD_Struct *Server )
+{
+    char *fn = "Engine_Adopt_Relay()";
+
+    ES->Server = malloc( sizeof( ITD_Struct ) );
+    if ( ! ES->Server )
+    {
+	syslog( LOG_ERR, "%s: malloc() failed: %s", fn, strerror( errno ) );
+	return( -1 );
+    }
+
+    memcpy( ES->Server, Server, sizeof( ITD_Struct ) );
+    ES->State = ES_RELAY;
+    ES->Splice = ( IMAP_Splice_Open( ES->Server, ES->Pipe ) == 0 );
+
+    return( 0 );
+}
+
+
+#else /* HAVE_SYS_EPOLL_H */
+
+
+extern void Engine_Init( void )
+{
+    char *fn = "Engine_Init()";
+
+    syslog( LOG_ERR, "%s: io_engine epoll is not supported on this platform -- Exiting.", fn );
+    exit( 1 );
+}
+
+
+extern void Engine_Add_Client( int clientsd )
+{
+    COUNT( CurrentClientConnections, -1 );
+    close( clientsd );
+}
+
+
+extern int Engine_Adopt_Relay( struct EngineSession *ES, ITD_Struct *Server )
+{
+    return( -1 );
+}
+
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+/*
+ *                            _________
+ *                           /        |
+ *                          /         |
+ *                         /    ______|
+ *                        /    /       ________
+ *                       |    |        |      /
+ *                       |    |        |_____/
+ *                       |    |        ______
+ *                       |    |        |     \
+ *                       |    |        |______\
+ *                        \    \_______
+ *                         \           |
+ *                          \          |
+ *                           \_________|
+ */
@@ -15,6 +15,7 @@
 **  Abstract:
 **
 **	Routines to provide an easy interface to hashing functions.
+**	Hash() is a keyed SipHash-2-4; see Hash_Seed().
 **
 **  Authors:
 **
@@ -37,58 +38,147 @@
 */
 
 
+#include <config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_STDINT_H
+#include <stdint.h>
+#elif HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
 #include "common.h"
 
+/*
+ * Key for the keyed hash.  Filled in with random bytes at startup by
+ * Hash_Seed() so that nobody can pick usernames that pile up on a
+ * single hash chain.
+ */
+static uint64_t Hash_Key[2];
+
+#define ROTL64( x, b )  ( ( (x) << (b) ) | ( (x) >> ( 64 - (b) ) ) )
+
+#define SIPROUND					\
+    do							\
+    {							\
+	v0 += v1; v1 = ROTL64( v1, 13 ); v1 ^= v0;	\
+	v0 = ROTL64( v0, 32 );				\
+	v2 += v3; v3 = ROTL64( v3, 16 ); v3 ^= v2;	\
+	v0 += v3; v3 = ROTL64( v3, 21 ); v3 ^= v0;	\
+	v2 += v1; v1 = ROTL64( v1, 17 ); v1 ^= v2;	\
+	v2 = ROTL64( v2, 32 );				\
+    } while ( 0 )
+
+
+
+/*++
+ * Function:	Hash_Seed
+ *
+ * Purpose:	Pick a random key for Hash().
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Must be called once, before the first call to Hash().  Falls
+ *		back to the time and pid if /dev/urandom can't be read, which
+ *		still keeps the key from being known in advance.
+ *--
+ */
+void Hash_Seed( void )
+{
+    int fd;
+    int rc = 0;
+
+    fd = open( "/dev/urandom", O_RDONLY );
+    if ( fd != -1 )
+    {
+	rc = read( fd, Hash_Key, sizeof Hash_Key );
+	close( fd );
+    }
+
+    if ( rc != sizeof Hash_Key )
+    {
+	syslog( LOG_WARNING, "Hash_Seed(): unable to read /dev/urandom -- seeding from the clock instead" );
+	Hash_Key[0] ^= (uint64_t)time( 0 ) * 0x9e3779b97f4a7c15ULL;
+	Hash_Key[1] ^= (uint64_t)getpid() * 0xc2b2ae3d27d4eb4fULL;
+    }
+}
+
+
+
 /*++
  * Function:	Hash
  *
  * Purpose:	Generate a hash key.
  *
  * Parameters:	pointer to char -- input key
- *		unsigned int -- maximum length of the input key
- *		unsigned int -- hash table size
  *
  * Returns:	unsigned int -- hash key
  *
  * Authors:	bhc
+ *
+ * Notes:	SipHash-2-4 keyed with Hash_Key, folded to 32 bits.  Callers
+ *		reduce it to their own table size.  Keys of any length are
+ *		fine.
  *--
  */
-unsigned int Hash(char *Input_Key, unsigned int	Table_Size )
+unsigned int Hash( const char *Input_Key )
 {
-  unsigned int	i;
-  unsigned int  Size;
-  unsigned int	Longwords;
-  unsigned int	*I_Pointer;
-  unsigned int	Hash_Value=0;
-  char	Hash_Buffer[1024];
-  Size = strlen( Input_Key );
-
-  if ( Size > sizeof Hash_Buffer )
-  {
-    syslog(LOG_ERR, "Hash(): Maximum of %d for '%s' exceeds architectural limit of %d", Size, Input_Key, sizeof Hash_Buffer );
-    exit(1);
-  }
-
-  Longwords = ( ( Size + 3 ) / 4 );
-  memset( Hash_Buffer, 0, Longwords*4 );
-  memcpy( Hash_Buffer, Input_Key, Size );
-  I_Pointer = (unsigned int *) Hash_Buffer;
-  
-  for ( i=0; i<Longwords; i++ )
-  {
-    Hash_Value = Hash_Value + *I_Pointer;
-    I_Pointer++;
-  }
-  
-  Hash_Value = Hash_Value + Size;
-  
-  Hash_Value = Hash_Value % Table_Size;
-  
-  return(Hash_Value);
+    const unsigned char *CP = (const unsigned char *)Input_Key;
+    size_t Size;
+    size_t Left;
+    uint64_t v0, v1, v2, v3;
+    uint64_t m;
+    int i;
+
+    Size = strlen( Input_Key );
+
+    v0 = Hash_Key[0] ^ 0x736f6d6570736575ULL;
+    v1 = Hash_Key[1] ^ 0x646f72616e646f6dULL;
+    v2 = Hash_Key[0] ^ 0x6c7967656e657261ULL;
+    v3 = Hash_Key[1] ^ 0x7465646279746573ULL;
+
+    for ( Left = Size; Left >= 8; Left -= 8, CP += 8 )
+    {
+	m = 0;
+	for ( i = 7; i >= 0; i-- )
+	    m = ( m << 8 ) | CP[ i ];
+
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+    }
+
+    /* the last 0 to 7 bytes, with the length in the top byte */
+    m = (uint64_t)Size << 56;
+    for ( i = Left - 1; i >= 0; i-- )
+	m |= (uint64_t)CP[ i ] << ( 8 * i );
+
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    m = v0 ^ v1 ^ v2 ^ v3;
+
+    return( (unsigned int)( m ^ ( m >> 32 ) ) );
 }
 
 
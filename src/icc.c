@@ -60,6 +60,7 @@
 #include <config.h>
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #if HAVE_UNISTD_H
@@ -72,144 +73,1043 @@
 /*
  * External globals
  */
-extern ICC_Struct *ICC_free;
-extern ICC_Struct *ICC_HashTable[ HASH_TABLE_SIZE ];
-extern pthread_mutex_t mp;
+extern struct ICCShard ICC_Shards[ ICC_SHARDS ];
 extern IMAPCounter_Struct *IMAPCount;
 extern ProxyConfig_Struct PC_Struct;
 
 /*
  * internal prototypes
  */
-static void _ICC_Recycle( unsigned int );
+static ICC_Struct *ICC_Tick( struct ICCShard *, time_t );
+static void ICC_Reap( struct ICCShard *, ICC_Struct * );
+static void ICC_Close( ICC_Struct * );
+static ICC_Struct *ICC_Evict( void );
+static void ICC_LRU_Remove( struct ICCShard *, ICC_Struct * );
+static void ICC_Update_Stats( void );
+static void ICC_Pool_Leave( struct ICCShard *, ICC_Struct * );
+static void ICC_Idle_Remove( ICC_Struct * );
+static void ICC_Unschedule( ICC_Struct * );
+static void ICC_Migrate( struct ICCShard *, unsigned int );
+static void ICC_Grow( struct ICCShard * );
 
 
 
 /*++
- * Function:	_ICC_Recycle
+ * Function:	ICC_Init
  *
- * Purpose:	core logic to implement the ICC_Recycle() & ICC_Recycle_Loop()
- *              functions.
+ * Purpose:	Allocate the ICC structures and set up the cache shards.
  *
- * Parameters:	unsigned int -- ICC expiration time
+ * Parameters:	unsigned int -- number of ICC structures (cache_size)
  *
- * Returns:	nada
- *	
- * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
+ * Returns:	nada -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The structures, and as many user pools, are dealt out to the
+ *		shard free lists round robin, and each shard's chain table
+ *		is sized for its share, so that an evenly spread cache never
+ *		has to grow.
  *--
  */
-static void _ICC_Recycle( unsigned int Expiration )
+extern void ICC_Init( unsigned int CacheSize )
 {
-    time_t CurrentTime;
-    unsigned int HashIndex;
-    ICC_Struct *HashEntry;
-    ICC_Struct *Previous;
-    
-    CurrentTime = time(0);
+    char *fn = "ICC_Init()";
+    ICC_Struct *ICC;
+    struct ICCPool *Pool;
+    struct ICCShard *Shard;
+    unsigned int Buckets;
+    unsigned int i;
+    int rc;
 
-    LockMutex( &mp );
+    ICC = (ICC_Struct *)malloc( ( sizeof ( ICC_Struct ) ) * CacheSize );
     
+    if ( ! ICC )
+    {
+	syslog(LOG_ERR, "%s: malloc() failed to allocate [%d] IMAPConnectionContext structures: %s", fn, CacheSize, strerror( errno ) );
+	exit( 1 );
+    }
+    
+    memset( ICC, 0, sizeof ( ICC_Struct ) * CacheSize );
+
+    Pool = (struct ICCPool *)calloc( CacheSize, sizeof ( struct ICCPool ) );
+
+    if ( ! Pool )
+    {
+	syslog(LOG_ERR, "%s: calloc() failed to allocate [%d] ICC user pools: %s", fn, CacheSize, strerror( errno ) );
+	exit( 1 );
+    }
+
+    memset( ICC_Shards, 0, sizeof ICC_Shards );
+
+    for ( Buckets = ICC_MIN_BUCKETS; Buckets < CacheSize / ICC_SHARDS; Buckets *= 2 )
+	;
+
+    for ( i = 0; i < ICC_SHARDS; i++ )
+    {
+	Shard = &ICC_Shards[ i ];
+
+	rc = pthread_mutex_init( &Shard->mutex, NULL );
+	if ( rc )
+	{
+	    syslog(LOG_ERR, "%s: pthread_mutex_init() returned error [%d] initializing ICC shard mutex.  Exiting.", fn, rc );
+	    exit( 1 );
+	}
+
+	Shard->HashTable = (struct ICCPool **)calloc( Buckets, sizeof ( struct ICCPool * ) );
+	if ( ! Shard->HashTable )
+	{
+	    syslog(LOG_ERR, "%s: calloc() failed to allocate [%d] ICC hash chains: %s", fn, Buckets, strerror( errno ) );
+	    exit( 1 );
+	}
+	Shard->Buckets = Buckets;
+	Shard->WheelTime = time( 0 );
+    }
+
+    for ( i = 0; i < CacheSize; i++ )
+    {
+	ICC[ i ].shard = i % ICC_SHARDS;
+	ICC[ i ].next = ICC_Shards[ i % ICC_SHARDS ].free;
+	ICC_Shards[ i % ICC_SHARDS ].free = &ICC[ i ];
+
+	Pool[ i ].next = ICC_Shards[ i % ICC_SHARDS ].PoolFree;
+	ICC_Shards[ i % ICC_SHARDS ].PoolFree = &Pool[ i ];
+    }
+}
+
+
+
+/*++
+ * Function:	ICC_Chain
+ *
+ * Purpose:	Find the hash chain the pool for a given username hash
+ *		lives on.
+ *
+ * Parameters:	ptr to the shard (its mutex must be held)
+ *		unsigned int -- Hash() of the username
+ *
+ * Returns:	ptr to the head of the chain
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	If the shard is in the middle of growing, this moves a few
+ *		more chains to the new table first.  Old chains are moved
+ *		whole, so a pool is on the old table's chain until that
+ *		chain has been moved and on the new table's after.
+ *--
+ */
+extern struct ICCPool **ICC_Chain( struct ICCShard *Shard, unsigned int HashValue )
+{
+    unsigned int Index;
+
+    ICC_Migrate( Shard, ICC_MIGRATE_STEP );
+
+    Index = HashValue / ICC_SHARDS;
+
+    if ( Shard->OldTable &&
+	 ( ( Index & ( Shard->OldBuckets - 1 ) ) >= Shard->Migrated ) )
+	return( &Shard->OldTable[ Index & ( Shard->OldBuckets - 1 ) ] );
+
+    return( &Shard->HashTable[ Index & ( Shard->Buckets - 1 ) ] );
+}
+
+
+
+/*++
+ * Function:	ICC_Pool_Find
+ *
+ * Purpose:	Find the pool of server connections of a user.
+ *
+ * Parameters:	ptr to the shard (its mutex must be held)
+ *		unsigned int -- Hash() of the username
+ *		char ptr to the username
+ *
+ * Returns:	ptr to the pool
+ *		NULL if the user has no server connections
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern struct ICCPool *ICC_Pool_Find( struct ICCShard *Shard,
+				      unsigned int HashValue,
+				      const char *Username )
+{
+    struct ICCPool *Pool;
+
+    for ( Pool = *ICC_Chain( Shard, HashValue ); Pool; Pool = Pool->next )
+    {
+	if ( ( Pool->hash == HashValue ) &&
+	     ( strcmp( Username, Pool->Members->username ) == 0 ) )
+	    return( Pool );
+    }
+
+    return( NULL );
+}
+
+
+
+/*++
+ * Function:	ICC_Pick_Idle
+ *
+ * Purpose:	Choose which of a user's cached server connections a new
+ *		login should get.
+ *
+ * Parameters:	ptr to the pool (its shard mutex must be held)
+ *
+ * Returns:	ptr to a cached ICC, still on the idle list
+ *		NULL if all of the user's connections are in use
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	We can't know at LOGIN what the client is going to select,
+ *		so bet on whatever this user selected last: a connection
+ *		whose select cache still holds that mailbox can answer the
+ *		SELECT without going to the server.  Otherwise take the
+ *		most recently cached one, which is the least likely to have
+ *		been dropped by the server.  The caller claims it with
+ *		ICC_Set_Logout().
+ *--
+ */
+extern ICC_Struct *ICC_Pick_Idle( struct ICCPool *Pool )
+{
+    ICC_Struct *ICC;
+    ISC_Struct *ISC;
+    time_t Now;
+
+    if ( ! Pool->Idle || ! Pool->Idle->inext )
+	return( Pool->Idle );
+
+    Now = time( 0 );
+
+    for ( ICC = Pool->Idle; ICC; ICC = ICC->inext )
+    {
+	if ( ICC->server_conn->sd == -1 )
+	    continue;
+
+	ISC = &ICC->server_conn->ISC;
+
+	if ( Select_Cache_Holds( ISC, Pool->LastMailbox, Now ) )
+	    return( ICC );
+    }
+
+    return( Pool->Idle );
+}
+
+
+
+/*++
+ * Function:	ICC_Note_Select
+ *
+ * Purpose:	Remember the mailbox a user selected, for ICC_Pick_Idle().
+ *
+ * Parameters:	ptr to the (active) ICC
+ *		char ptr to the mailbox name as the client sent it
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Only a hint, so it's stored without the shard mutex.  The
+ *		pool can't go away while one of its connections is active.
+ *--
+ */
+extern void ICC_Note_Select( ICC_Struct *ICC, const char *Mailbox )
+{
+    if ( ICC && ICC->pool )
+	ICC->pool->LastMailbox = Hash( Mailbox );
+}
+
+
+
+/*++
+ * Function:	ICC_Settle
+ *
+ * Purpose:	Finish any growth of a shard's chain table that is still
+ *		in progress, so that every entry is on Shard->HashTable.
+ *
+ * Parameters:	ptr to the shard (its mutex must be held)
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern void ICC_Settle( struct ICCShard *Shard )
+{
+    ICC_Migrate( Shard, Shard->OldBuckets );
+}
+
+
+
+/*++
+ * Function:	ICC_Migrate
+ *
+ * Purpose:	Move chains from the old table of a growing shard to the
+ *		new one.
+ *
+ * Parameters:	ptr to the shard (its mutex must be held)
+ *		unsigned int -- how many old chains to move at most
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void ICC_Migrate( struct ICCShard *Shard, unsigned int Count )
+{
+    struct ICCPool *HashEntry;
+    struct ICCPool *Next;
+    struct ICCPool **Chain;
+
+    while ( Shard->OldTable && Count-- )
+    {
+	for ( HashEntry = Shard->OldTable[ Shard->Migrated ];
+	      HashEntry;
+	      HashEntry = Next )
+	{
+	    Next = HashEntry->next;
+	    Chain = &Shard->HashTable[ ( HashEntry->hash / ICC_SHARDS ) &
+				       ( Shard->Buckets - 1 ) ];
+	    HashEntry->next = *Chain;
+	    *Chain = HashEntry;
+	}
+
+	if ( ++Shard->Migrated == Shard->OldBuckets )
+	{
+	    free( Shard->OldTable );
+	    Shard->OldTable = NULL;
+	    Shard->OldBuckets = 0;
+	    Shard->Migrated = 0;
+	}
+    }
+}
+
+
+
+/*++
+ * Function:	ICC_Grow
+ *
+ * Purpose:	Start doubling the chain table of a shard.
+ *
+ * Parameters:	ptr to the shard (its mutex must be held)
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Only allocates the new table; ICC_Migrate() does the moving
+ *		a few chains at a time.  If the allocation fails we carry on
+ *		with longer chains and try again on the next insert.
+ *--
+ */
+static void ICC_Grow( struct ICCShard *Shard )
+{
+    char *fn = "ICC_Grow()";
+    struct ICCPool **Table;
+
+    if ( Shard->OldTable )
+	return;
+
+    Table = (struct ICCPool **)calloc( Shard->Buckets * 2, sizeof ( struct ICCPool * ) );
+    if ( ! Table )
+    {
+	syslog(LOG_WARNING, "%s: calloc() failed to allocate [%d] ICC hash chains: %s", fn, Shard->Buckets * 2, strerror( errno ) );
+	return;
+    }
+
+    Shard->OldTable = Shard->HashTable;
+    Shard->OldBuckets = Shard->Buckets;
+    Shard->Migrated = 0;
+    Shard->HashTable = Table;
+    Shard->Buckets *= 2;
+
+    syslog(LOG_INFO, "%s: ICC shard %d grown to %d hash chains for %d user pools",
+	   fn, (int)( Shard - ICC_Shards ), Shard->Buckets, Shard->Entries );
+}
+
+
+
+/*++
+ * Function:	ICC_Tick
+ *
+ * Purpose:	Advance a shard's expiry timing wheel up to the current
+ *		second and unhook everything that has come due.
+ *
+ * Parameters:	ptr to the shard
+ *		time_t -- the current time
+ *
+ * Returns:	list of the unhooked ICCs, for ICC_Reap()
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Each slot holds the ICCs due on that second modulo
+ *		ICC_WHEEL_SLOTS, so anything due on a later lap is left
+ *		where it is.
+ *--
+ */
+static ICC_Struct *ICC_Tick( struct ICCShard *Shard, time_t Now )
+{
+    ICC_Struct *Expired;
+    ICC_Struct *ICC;
+    ICC_Struct *Next;
+
+    Expired = NULL;
+
+    LockMutex( &Shard->mutex );
+
     /*
-     * Need to iterate through every single item in our hash table
-     * to decide if we can free it or not.
+     * If we fell more than a whole lap behind (or the clock moved),
+     * one lap is enough to look at every slot.
      */
-    for ( HashIndex = 0; HashIndex < HASH_TABLE_SIZE; HashIndex++ )
+    if ( ( Now - Shard->WheelTime >= ICC_WHEEL_SLOTS ) ||
+	 ( Shard->WheelTime > Now + 1 ) )
+	Shard->WheelTime = Now - ICC_WHEEL_SLOTS + 1;
+
+    for ( ; Shard->WheelTime <= Now; Shard->WheelTime++ )
     {
-	
-	Previous = NULL;
-	HashEntry = ICC_HashTable[ HashIndex ];
-	
-	while ( HashEntry )
+	for ( ICC = Shard->Wheel[ Shard->WheelTime % ICC_WHEEL_SLOTS ];
+	      ICC;
+	      ICC = Next )
 	{
-	    /*
-	     * If the last logout time is non-zero, and it's been logged 
-	     * out for longer than our default expiration time, free it.
-	     * Note that this allows for the logouttime to be explicitly
-	     * set to 1 (such as in the Get_Server_conn code) if we want to
-	     * reap a connection before waiting the normal expiration
-	     * cycle.
-	     */
-	    if ( HashEntry->logouttime &&
-		 ( ( CurrentTime - HashEntry->logouttime ) > 
-		   Expiration ) )
-	    {
-		syslog(LOG_INFO, "Expiring server sd [%d]", HashEntry->server_conn->sd);
-		/* Logout of the IMAP server and close the server socket. */
+	    Next = ICC->wnext;
+
+	    if ( ICC->expires > Now )
+		continue;
+
+	    ICC_Unschedule( ICC );
+	    ICC_LRU_Remove( Shard, ICC );
+	    ICC_Idle_Remove( ICC );
+	    ICC_Pool_Leave( Shard, ICC );
+	    ICC->next = Expired;
+	    Expired = ICC;
+	}
+    }
 
-		if (HashEntry->server_conn->sd != -1)
-		{
-		    IMAP_Write( HashEntry->server_conn, "VIC20 LOGOUT\r\n",
-		    	        strlen( "VIC20 LOGOUT\r\n" ) );
+    UnLockMutex( &Shard->mutex );
+
+    return( Expired );
+}
+
+
+
+/*++
+ * Function:	ICC_Reap
+ *
+ * Purpose:	Log out of and close the server connections of ICCs that
+ *		have been unhooked from a shard, and give the structures
+ *		back to its free list.
+ *
+ * Parameters:	ptr to the shard
+ *		list of unhooked ICCs (may be NULL)
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Runs without the shard mutex; nobody else can see the
+ *		unhooked entries.
+ *--
+ */
+static void ICC_Reap( struct ICCShard *Shard, ICC_Struct *Expired )
+{
+    ICC_Struct *HashEntry;
+    ICC_Struct *Last = NULL;
+
+    if ( ! Expired )
+	return;
+
+    for ( HashEntry = Expired; HashEntry; HashEntry = HashEntry->next )
+    {
+	ICC_Close( HashEntry );
+	Last = HashEntry;
+    }
+
+    /* hand the whole lot back to this shard's free list */
+    LockMutex( &Shard->mutex );
+    Last->next = Shard->free;
+    Shard->free = Expired;
+    UnLockMutex( &Shard->mutex );
+}
+
+
+
+/*++
+ * Function:	ICC_Close
+ *
+ * Purpose:	Log out of and close the server connection of a cached ICC
+ *		that has been unhooked from its shard.
+ *
+ * Parameters:	ptr to the ICC
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void ICC_Close( ICC_Struct *ICC )
+{
+    Backend_Count( ICC->server_conn->Backend, -1, 0 );
+
+    syslog(LOG_INFO, "Expiring server sd [%d]", ICC->server_conn->sd);
+    /* Logout of the IMAP server and close the server socket. */
+
+    if (ICC->server_conn->sd != -1)
+    {
+	IMAP_Write( ICC->server_conn, "VIC20 LOGOUT\r\n",
+		    strlen( "VIC20 LOGOUT\r\n" ) );
 
 #if HAVE_LIBSSL
-		    if ( HashEntry->server_conn->tls )
-		    {
-		        SSL_shutdown( HashEntry->server_conn->tls );
-		        SSL_free( HashEntry->server_conn->tls );
-		    }
+	if ( ICC->server_conn->tls )
+	{
+	    SSL_shutdown( ICC->server_conn->tls );
+	    SSL_free( ICC->server_conn->tls );
+	}
 #endif
-		    close( HashEntry->server_conn->sd );
-		    free( HashEntry->server_conn );
-		}
-		else
-		{
-		    syslog(LOG_INFO, "Expiring invalidated server sd");
-		}
-		
-		/*
-		 * This was being counted as a "retained" connection.  It was
-		 * open, but not in use.  Now that we're closing it, we have
-		 * to decrement the number of retained connections.
-		 */
-		IMAPCount->RetainedServerConnections--;
-		
-
-		if ( Previous )
-		{
-		    Previous->next = HashEntry->next;
-		    HashEntry->next = ICC_free;
-		    ICC_free = HashEntry;
-		    HashEntry = Previous->next;
-		}
-		else
-		{
-		    ICC_HashTable[ HashIndex ] = HashEntry->next;
-		    HashEntry->next = ICC_free;
-		    ICC_free = HashEntry;
-		    HashEntry = ICC_HashTable[ HashIndex ];
-		}
-	    }
-	    else
+	close( ICC->server_conn->sd );
+    }
+    else
+    {
+	syslog(LOG_INFO, "Expiring invalidated server sd");
+    }
+
+    /*
+     * An invalidated connection has only lost its socket; the ICD and
+     * its SELECT cache are still ours to free.
+     */
+    Select_Cache_Free( &ICC->server_conn->ISC );
+    free( ICC->server_conn );
+    
+    /*
+     * This was being counted as a "retained" connection.  It was
+     * open, but not in use.  Now that we're closing it, we have
+     * to decrement the number of retained connections.
+     */
+    COUNT( RetainedServerConnections, -1 );
+}
+
+
+
+/*++
+ * Function:	ICC_Evict
+ *
+ * Purpose:	Take the least recently used cached ICC out of the cache
+ *		so that its structure can be used for a new login.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	ICC_Struct * that's off every list and ready for reuse
+ *		NULL if there are no cached ICCs at all
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Each shard keeps its cached ICCs in logout order, so the
+ *		oldest one overall is at the head of one of the shard LRU
+ *		lists.  Shard mutexes are taken one at a time.
+ *--
+ */
+static ICC_Struct *ICC_Evict( void )
+{
+    struct ICCShard *Shard;
+    struct ICCShard *Oldest;
+    time_t OldestTime = 0;
+    ICC_Struct *ICC;
+    unsigned int i;
+
+    for ( ; ; )
+    {
+	Oldest = NULL;
+
+	for ( i = 0; i < ICC_SHARDS; i++ )
+	{
+	    Shard = &ICC_Shards[ i ];
+
+	    LockMutex( &Shard->mutex );
+	    if ( Shard->LRU &&
+		 ( ! Oldest || ( Shard->LRU->logouttime < OldestTime ) ) )
 	    {
-		Previous = HashEntry;
-		HashEntry = HashEntry->next;
+		Oldest = Shard;
+		OldestTime = Shard->LRU->logouttime;
 	    }
+	    UnLockMutex( &Shard->mutex );
+	}
+
+	if ( ! Oldest )
+	    return( NULL );
+
+	LockMutex( &Oldest->mutex );
+	ICC = Oldest->LRU;
+	if ( ICC )
+	{
+	    ICC_Unschedule( ICC );
+	    ICC_LRU_Remove( Oldest, ICC );
+	    ICC_Idle_Remove( ICC );
+	    ICC_Pool_Leave( Oldest, ICC );
 	}
+	UnLockMutex( &Oldest->mutex );
+
+	/* somebody beat us to it; look again */
+	if ( ! ICC )
+	    continue;
+
+	syslog(LOG_INFO, "Evicting cached server sd [%d] for '%s' to make room for a new login", ICC->server_conn->sd, ICC->username );
+
+	ICC_Close( ICC );
+	COUNT( TotalServerConnectionsEvicted, 1 );
+
+	return( ICC );
     }
-    
-    UnLockMutex( &mp );
 }
 
 
 
 /*++
- * Function:	ICC_Recycle
+ * Function:	ICC_Update_Stats
  *
- * Purpose:	Reclaim dormant ICC structures.  This function is intended to
- *              be called any time a free ICC is needed, but none exist.  It
- *              can be passed shorter than default expiration durations to try
- *              to free more ICCs if necessary.
+ * Purpose:	Publish what the ICC hash chains look like for pimpstat.
  *
- * Parameters:	unsigned int -- ICC expiration duration
+ * Parameters:	nada
  *
  * Returns:	nada
  *
- * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void ICC_Update_Stats( void )
+{
+    struct ICCShard *Shard;
+    struct ICCPool *HashEntry;
+    unsigned int Buckets = 0;
+    unsigned int InUse = 0;
+    unsigned int Longest = 0;
+    unsigned int Entries = 0;
+    unsigned int Length;
+    unsigned int HashIndex;
+    unsigned int i;
+
+    for ( i = 0; i < ICC_SHARDS; i++ )
+    {
+	Shard = &ICC_Shards[ i ];
+
+	LockMutex( &Shard->mutex );
+
+	ICC_Settle( Shard );
+
+	for ( HashIndex = 0; HashIndex < Shard->Buckets; HashIndex++ )
+	{
+	    Length = 0;
+	    for ( HashEntry = Shard->HashTable[ HashIndex ];
+		  HashEntry;
+		  HashEntry = HashEntry->next )
+		Length++;
+
+	    if ( Length )
+		InUse++;
+
+	    if ( Length > Longest )
+		Longest = Length;
+	}
+
+	Buckets += Shard->Buckets;
+	Entries += Shard->Entries;
+
+	UnLockMutex( &Shard->mutex );
+    }
+
+    IMAPCount->ICCBuckets = Buckets;
+    IMAPCount->ICCChainsInUse = InUse;
+    IMAPCount->ICCLongestChain = Longest;
+    IMAPCount->ICCPools = Entries;
+}
+
+
+
+/*++
+ * Function:	ICC_Pool_Leave
+ *
+ * Purpose:	Take an ICC out of its user's pool, and the pool off its
+ *		hash chain when that was the last one.
+ *
+ * Parameters:	ptr to the shard (its mutex must be held)
+ *		ptr to the ICC, already off the idle list
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void ICC_Pool_Leave( struct ICCShard *Shard, ICC_Struct *ICC )
+{
+    struct ICCPool *Pool = ICC->pool;
+    struct ICCPool **PoolLink;
+    ICC_Struct **Link;
+
+    for ( Link = &Pool->Members; *Link; Link = &(*Link)->next )
+    {
+	if ( *Link == ICC )
+	{
+	    *Link = ICC->next;
+	    break;
+	}
+    }
+
+    ICC->pool = NULL;
+
+    if ( --Pool->Connections )
+	return;
+
+    for ( PoolLink = ICC_Chain( Shard, Pool->hash );
+	  *PoolLink;
+	  PoolLink = &(*PoolLink)->next )
+    {
+	if ( *PoolLink == Pool )
+	{
+	    *PoolLink = Pool->next;
+	    Shard->Entries--;
+	    break;
+	}
+    }
+
+    Pool->next = Shard->PoolFree;
+    Shard->PoolFree = Pool;
+}
+
+
+
+/*++
+ * Function:	ICC_Idle_Remove
+ *
+ * Purpose:	Take an ICC off its pool's idle list, if it's on it.
+ *
+ * Parameters:	ptr to the ICC (its shard mutex must be held)
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void ICC_Idle_Remove( ICC_Struct *ICC )
+{
+    struct ICCPool *Pool = ICC->pool;
+
+    if ( ! ICC->iprev && ! ICC->inext && Pool->Idle != ICC )
+	return;
+
+    if ( ICC->iprev )
+	ICC->iprev->inext = ICC->inext;
+    else
+	Pool->Idle = ICC->inext;
+
+    if ( ICC->inext )
+	ICC->inext->iprev = ICC->iprev;
+
+    Pool->Cached--;
+
+    ICC->inext = NULL;
+    ICC->iprev = NULL;
+}
+
+
+
+/*++
+ * Function:	ICC_Set_Logout
+ *
+ * Purpose:	Set the logout time of an ICC, (re)schedule its expiry
+ *		on the shard's timing wheel and keep the shard's LRU list
+ *		and the pool's idle list of cached ICCs up to date.
+ *
+ * Parameters:	ptr to the shard (its mutex must be held)
+ *		ptr to the ICC
+ *		time_t -- logout time: 0 for active, 1 to expire it as soon
+ *		as possible, otherwise the time the user logged out
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern void ICC_Set_Logout( struct ICCShard *Shard, ICC_Struct *ICC,
+			    time_t LogoutTime )
+{
+    time_t When;
+    ICC_Struct **Slot;
+
+    ICC_Unschedule( ICC );
+    ICC_LRU_Remove( Shard, ICC );
+    ICC_Idle_Remove( ICC );
+
+    /* keep the backend's count of connections in use right */
+    if ( ! ICC->logouttime != ! LogoutTime )
+	Backend_Count( ICC->server_conn->Backend, 0, LogoutTime ? -1 : 1 );
+
+    ICC->logouttime = LogoutTime;
+
+    if ( ! LogoutTime )
+	return;
+
+    /* only a real logout leaves something a new login can check out */
+    if ( LogoutTime > 1 )
+    {
+	ICC->iprev = NULL;
+	ICC->inext = ICC->pool->Idle;
+	if ( ICC->pool->Idle )
+	    ICC->pool->Idle->iprev = ICC;
+	ICC->pool->Idle = ICC;
+	ICC->pool->Cached++;
+    }
+
+    /*
+     * The LRU list is kept in logout order.  Ones we want rid of go to
+     * the front, to be evicted first.
+     */
+    if ( LogoutTime == 1 )
+    {
+	ICC->lprev = NULL;
+	ICC->lnext = Shard->LRU;
+	if ( Shard->LRU )
+	    Shard->LRU->lprev = ICC;
+	else
+	    Shard->LRUTail = ICC;
+	Shard->LRU = ICC;
+    }
+    else
+    {
+	ICC->lnext = NULL;
+	ICC->lprev = Shard->LRUTail;
+	if ( Shard->LRUTail )
+	    Shard->LRUTail->lnext = ICC;
+	else
+	    Shard->LRU = ICC;
+	Shard->LRUTail = ICC;
+    }
+
+    /* same test the old sweep used: logged out for longer than that */
+    ICC->expires = LogoutTime + PC_Struct.cache_expiration_time + 1;
+
+    /* anything already due goes in the next slot the wheel looks at */
+    When = ( ICC->expires < Shard->WheelTime ) ? Shard->WheelTime : ICC->expires;
+
+    Slot = &Shard->Wheel[ When % ICC_WHEEL_SLOTS ];
+    ICC->wnext = *Slot;
+    if ( *Slot )
+	(*Slot)->wprev = &ICC->wnext;
+    ICC->wprev = Slot;
+    *Slot = ICC;
+}
+
+
+
+/*++
+ * Function:	ICC_Unschedule
+ *
+ * Purpose:	Take an ICC off the timing wheel, if it's on it.
+ *
+ * Parameters:	ptr to the ICC (its shard mutex must be held)
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
  *--
  */
-extern void ICC_Recycle( unsigned int Expiration )
+static void ICC_Unschedule( ICC_Struct *ICC )
 {
-    _ICC_Recycle( Expiration );
+    if ( ! ICC->wprev )
+	return;
+
+    *ICC->wprev = ICC->wnext;
+    if ( ICC->wnext )
+	ICC->wnext->wprev = ICC->wprev;
+
+    ICC->wnext = NULL;
+    ICC->wprev = NULL;
+}
+
+
+
+/*++
+ * Function:	ICC_LRU_Remove
+ *
+ * Purpose:	Take an ICC off its shard's LRU list, if it's on it.
+ *
+ * Parameters:	ptr to the shard (its mutex must be held)
+ *		ptr to the ICC
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void ICC_LRU_Remove( struct ICCShard *Shard, ICC_Struct *ICC )
+{
+    if ( ! ICC->lprev && ! ICC->lnext && Shard->LRU != ICC )
+	return;
+
+    if ( ICC->lprev )
+	ICC->lprev->lnext = ICC->lnext;
+    else
+	Shard->LRU = ICC->lnext;
+
+    if ( ICC->lnext )
+	ICC->lnext->lprev = ICC->lprev;
+    else
+	Shard->LRUTail = ICC->lprev;
+
+    ICC->lnext = NULL;
+    ICC->lprev = NULL;
+}
+
+
+
+/*++
+ * Function:	ICC_New
+ *
+ * Purpose:	Take a free ICC structure and add it to a user's pool as an
+ *		active connection.
+ *
+ * Parameters:	char ptr to the username
+ *		char ptr to the md5 hash of the password
+ *		ptr to the server connection
+ *
+ * Returns:	ICC_Struct * on success
+ *		NULL if every structure belongs to an active session
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Prefers the free lists of the user's own shard and borrows
+ *		from the others only when those are empty.  When there are
+ *		no free structures at all, the least recently used cached
+ *		connection is evicted.  At most one shard mutex is held at
+ *		any time.
+ *--
+ */
+extern ICC_Struct *ICC_New( char *Username, char *md5pw, ICD_Struct *conn )
+{
+    unsigned int HashValue;
+    unsigned int i;
+    struct ICCShard *Shard;
+    struct ICCShard *Other;
+    ICC_Struct *ICC;
+    struct ICCPool *Pool;
+    struct ICCPool *Spare = NULL;
+    struct ICCPool **Chain;
+
+    HashValue = Hash( Username );
+    Shard = ICC_SHARD( HashValue );
+
+    LockMutex( &Shard->mutex );
+
+    ICC = Shard->free;
+    if ( ICC )
+    {
+	Shard->free = ICC->next;
+    }
+    else
+    {
+	UnLockMutex( &Shard->mutex );
+
+	for ( i = 1; ( i < ICC_SHARDS ) && ( ! ICC ); i++ )
+	{
+	    Other = &ICC_Shards[ ( ( Shard - ICC_Shards ) + i ) % ICC_SHARDS ];
+
+	    LockMutex( &Other->mutex );
+	    ICC = Other->free;
+	    if ( ICC )
+		Other->free = ICC->next;
+	    UnLockMutex( &Other->mutex );
+	}
+
+	if ( ! ICC )
+	    ICC = ICC_Evict();
+
+	if ( ! ICC )
+	    return( NULL );
+
+	LockMutex( &Shard->mutex );
+    }
+
+    /*
+     * First connection for this user?  Then we need a pool too.  There
+     * are as many pools as structures, so one is free somewhere.
+     */
+    while ( ! ( Pool = ICC_Pool_Find( Shard, HashValue, Username ) ) &&
+	    ! Spare )
+    {
+	Spare = Shard->PoolFree;
+	if ( Spare )
+	{
+	    Shard->PoolFree = Spare->next;
+	    break;
+	}
+
+	UnLockMutex( &Shard->mutex );
+
+	for ( i = 1; ( i < ICC_SHARDS ) && ( ! Spare ); i++ )
+	{
+	    Other = &ICC_Shards[ ( ( Shard - ICC_Shards ) + i ) % ICC_SHARDS ];
+
+	    LockMutex( &Other->mutex );
+	    Spare = Other->PoolFree;
+	    if ( Spare )
+		Other->PoolFree = Spare->next;
+	    UnLockMutex( &Other->mutex );
+	}
+
+	LockMutex( &Shard->mutex );
+
+	if ( ! Spare )
+	{
+	    /* can't happen; give the structure back rather than leak it */
+	    ICC->next = Shard->free;
+	    Shard->free = ICC;
+	    UnLockMutex( &Shard->mutex );
+	    return( NULL );
+	}
+    }
+
+    if ( ! Pool )
+    {
+	Pool = Spare;
+	Spare = NULL;
+
+	memset( Pool, 0, sizeof ( struct ICCPool ) );
+	Pool->hash = HashValue;
+
+	Chain = ICC_Chain( Shard, HashValue );
+	Pool->next = *Chain;
+	*Chain = Pool;
+
+	if ( ++Shard->Entries > Shard->Buckets * ICC_MAX_LOAD )
+	    ICC_Grow( Shard );
+    }
+    else if ( Spare )
+    {
+	/* somebody else made the pool while we were out looking */
+	Spare->next = Shard->PoolFree;
+	Shard->PoolFree = Spare;
+    }
+
+    /* fill in the newest used (oxymoron?) structure */
+    strncpy( ICC->username, Username, sizeof ICC->username );
+    ICC->username[ sizeof ICC->username - 1 ] = '\0';
+    memcpy( ICC->hashedpw, md5pw, sizeof ICC->hashedpw );
+    ICC->logouttime = 0;    /* zero means, "it's active". */
+    ICC->wnext = NULL;
+    ICC->wprev = NULL;
+    ICC->lnext = NULL;
+    ICC->lprev = NULL;
+    ICC->inext = NULL;
+    ICC->iprev = NULL;
+    ICC->server_conn = conn;
+    ICC->shard = Shard - ICC_Shards;
+    ICC->pool = Pool;
+
+    Backend_Count( conn->Backend, 0, 1 );
+
+    ICC->next = Pool->Members;
+    Pool->Members = ICC;
+    Pool->Connections++;
+
+    UnLockMutex( &Shard->mutex );
+
+    return( ICC );
 }
 
 
@@ -226,16 +1126,36 @@ extern void ICC_Recycle( unsigned int Expiration )
  *
  * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
  *
- * Notes:       Relies on global copy of ProxyConfig_Struct "PC_Struct" for
- *              expiration time.
+ * Notes:       Wakes up every second and turns each shard's timing wheel,
+ *		so expiries are spread out instead of all landing on one
+ *		sweep.  The expiration time itself was fixed when each ICC
+ *		was scheduled (see ICC_Set_Logout()).  It also adds up the
+ *		threads' counters for pimpstat.
  *--
  */
 extern void ICC_Recycle_Loop( void )
 {
+    struct ICCShard *Shard;
+    unsigned int Ticks = 0;
+    unsigned int i;
+    time_t Now;
+
     for( ;; )
     {
-	sleep( 60 );
-	_ICC_Recycle( PC_Struct.cache_expiration_time );
+	sleep( 1 );
+
+	Now = time( 0 );
+
+	for ( i = 0; i < ICC_SHARDS; i++ )
+	{
+	    Shard = &ICC_Shards[ i ];
+	    ICC_Reap( Shard, ICC_Tick( Shard, Now ) );
+	}
+
+	if ( ! ( ++Ticks % 60 ) )
+	    ICC_Update_Stats();
+
+	Counter_Sync();
     }
 }
 
@@ -256,17 +1176,45 @@ extern void ICC_Recycle_Loop( void )
  */
 extern void ICC_Logout( ICC_Struct *ICC )
 {
-    IMAPCount->InUseServerConnections--;
-    IMAPCount->RetainedServerConnections++;
+    struct ICCShard *Shard = &ICC_Shards[ ICC->shard ];
+    struct Backend *Backend = ICC->server_conn->Backend;
+    unsigned int Surplus = 0;
+    int sd = ICC->server_conn->sd;
 
-    if ( IMAPCount->RetainedServerConnections > 
-	 IMAPCount->PeakRetainedServerConnections )
-	IMAPCount->PeakRetainedServerConnections = IMAPCount->RetainedServerConnections;
+    COUNT( InUseServerConnections, -1 );
+    COUNT( RetainedServerConnections, 1 );
     
-    ICC->logouttime = time(0);
-
     syslog(LOG_INFO, "LOGOUT: '%s' from server sd [%d]", ICC->username, ICC->server_conn->sd );
     
+    LockMutex( &Shard->mutex );
+
+    /*
+     * Don't keep more idle connections for one user than we were told
+     * to, or any to a server address DNS has dropped.  They go to the
+     * front of the line to be closed.
+     */
+    if ( Backend && Backend->Retired )
+    {
+	ICC_Set_Logout( Shard, ICC, 1 );
+    }
+    else if ( PC_Struct.max_connections_per_user &&
+	      ( ICC->pool->Cached >= PC_Struct.max_connections_per_user ) )
+    {
+	Surplus = ICC->pool->Cached;
+	ICC_Set_Logout( Shard, ICC, 1 );
+    }
+    else
+    {
+	ICC_Set_Logout( Shard, ICC, time(0) );
+    }
+
+    UnLockMutex( &Shard->mutex );
+
+    if ( Surplus )
+	syslog(LOG_INFO, "Not caching server sd [%d]: user already has %d cached connections", sd, Surplus );
+    else if ( Backend && Backend->Retired )
+	syslog(LOG_INFO, "Not caching server sd [%d]: backend %s is no longer in DNS", sd, Backend->Name );
+
     return;
 }
 
@@ -284,17 +1232,79 @@ void _ICC_Invalidate ( ICC_Struct *ICC )
     syslog(LOG_INFO, "Invalidating server sd [%d]", ICC->server_conn->sd);
 
     ICC->server_conn->sd = -1; /* make sure this can't be reused */
-    ICC->logouttime = 1;
 }
 
 extern void ICC_Invalidate ( ICC_Struct *ICC )
 {
-    LockMutex( &mp );
+    struct ICCShard *Shard = &ICC_Shards[ ICC->shard ];
+
+    /*
+     * The connection is still ours (logouttime is 0), so nobody else
+     * will touch it while we shut it down without the mutex.
+     */
     _ICC_Invalidate ( ICC );
-    UnLockMutex( &mp );
+
+    LockMutex( &Shard->mutex );
+    ICC_Set_Logout( Shard, ICC, 1 );
+    UnLockMutex( &Shard->mutex );
 }
 
 
+
+
+/*++
+ * Function:	ICC_Drain_Retired
+ *
+ * Purpose:	Close the cached connections to server addresses that DNS
+ *		no longer returns.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Connections in use are left alone; ICC_Logout() won't
+ *		cache them.  The idle ones are moved to the front of the
+ *		LRU and left for the recycle thread to close on its next
+ *		tick, the same as any other expired connection.
+ *--
+ */
+extern void ICC_Drain_Retired( void )
+{
+    struct ICCShard *Shard;
+    struct Backend *Backend;
+    ICC_Struct *ICC;
+    ICC_Struct *Next;
+    unsigned int Drained = 0;
+    unsigned int i;
+
+    for ( i = 0; i < ICC_SHARDS; i++ )
+    {
+	Shard = &ICC_Shards[ i ];
+
+	LockMutex( &Shard->mutex );
+
+	/* ones we've moved go in front of us, so we don't see them twice */
+	for ( ICC = Shard->LRU; ICC; ICC = Next )
+	{
+	    Next = ICC->lnext;
+	    Backend = ICC->server_conn->Backend;
+
+	    if ( ( ICC->logouttime > 1 ) && Backend && Backend->Retired )
+	    {
+		ICC_Set_Logout( Shard, ICC, 1 );
+		Drained++;
+	    }
+	}
+
+	UnLockMutex( &Shard->mutex );
+    }
+
+    if ( Drained )
+	syslog(LOG_INFO, "Draining %d cached server connections to addresses no longer in DNS", Drained );
+}
+
 /*
  *                            _________
  *                           /        |
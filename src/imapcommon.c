@@ -125,6 +125,7 @@
 
 
 #define _REENTRANT
+#define _GNU_SOURCE                  /* for splice() */
 
 #include <config.h>
 
@@ -154,12 +155,9 @@
 /*
  * External globals
  */
-extern ICC_Struct *ICC_free;
-extern ICC_Struct *ICC_HashTable[ HASH_TABLE_SIZE ];
+extern struct ICCShard ICC_Shards[ ICC_SHARDS ];
 extern ISD_Struct ISD;
-extern pthread_mutex_t mp;
 extern pthread_mutex_t trace;
-extern pthread_mutex_t aimtx;
 extern IMAPCounter_Struct *IMAPCount;
 extern ProxyConfig_Struct PC_Struct;
 
@@ -167,6 +165,7 @@ extern ProxyConfig_Struct PC_Struct;
  *  * Function prototypes for internal entry points.
  *   */
 static int send_queued_preauth_commands( char *, ITD_Struct * );
+static int IMAP_Literal_Chunk( ITD_Struct * );
 
 #if HAVE_LIBSSL
 extern SSL_CTX *tls_ctx;
@@ -351,6 +350,7 @@ extern void UnLockMutex( pthread_mutex_t *mutex )
  * Purpose:	Upgrade plain text connection/negotiate STARTTLS
  *
  * Parameters:	ptr to an IMAPTransactionDescriptor structure
+ *		ptr to the backend the connection is to, or NULL
  *
  * Returns:	0 on success
  *         	-1 on failure
@@ -359,6 +359,10 @@ extern void UnLockMutex( pthread_mutex_t *mutex )
  *
  * Notes: 	This function assumes that SSL support has already
  *       	been initialized.
+ *
+ *		Given a backend, we try to resume its last TLS session, and
+ *		new sessions from this connection are remembered for it by
+ *		Backend_New_Session().
  * 
  *        	This function is a result of re-factoring of existing
  *       	code resulting from a patch submitted by Martin B.
@@ -366,7 +370,7 @@ extern void UnLockMutex( pthread_mutex_t *mutex )
  *--
  */
 #if HAVE_LIBSSL
-extern int Attempt_STARTTLS( ITD_Struct *Server )
+extern int Attempt_STARTTLS( ITD_Struct *Server, struct Backend *Backend )
 {
     char *fn = "Attempt_STARTTLS()";
 
@@ -376,10 +380,13 @@ extern int Attempt_STARTTLS( ITD_Struct *Server )
     char *endptr;
     char *last;
     int rc;
+    struct timeval Start;
 
 
     syslog( LOG_INFO, "%s: Enabling STARTTLS.", fn );
 
+    gettimeofday( &Start, NULL );
+
 	snprintf( SendBuf, BufLen, "S0001 STARTTLS\r\n" );
 	if ( IMAP_Write( Server->conn, SendBuf, strlen(SendBuf) ) == -1 )
 	{
@@ -406,9 +413,9 @@ extern int Attempt_STARTTLS( ITD_Struct *Server )
 	/*
 	 * Try to match up the tag in the server response to the client tag.
 	 */
-	endptr = Server->ReadBuf + rc;
+	endptr = ITD_LINE( Server ) + rc;
 
-	tokenptr = memtok( Server->ReadBuf, endptr, &last );
+	tokenptr = memtok( ITD_LINE( Server ), endptr, &last );
 
 	if ( !tokenptr )
 	{
@@ -471,6 +478,16 @@ extern int Attempt_STARTTLS( ITD_Struct *Server )
 	    goto fail;
 	}
 
+	if ( Backend )
+	{
+	    SSL_set_app_data( Server->conn->tls, Backend );
+
+	    LockMutex( &Backend->mutex );
+	    if ( Backend->Session )
+		SSL_set_session( Server->conn->tls, Backend->Session );
+	    UnLockMutex( &Backend->mutex );
+	}
+
 	SSL_set_connect_state( Server->conn->tls );
 	rc = SSL_connect( Server->conn->tls );
 	if ( rc <= 0 )
@@ -481,6 +498,16 @@ extern int Attempt_STARTTLS( ITD_Struct *Server )
 	    goto fail;
 	}
 
+	if ( Backend )
+	{
+	    if ( SSL_session_reused( Server->conn->tls ) )
+		COUNT( TLSSessionsResumed, 1 );
+	    else
+		COUNT( TLSFullHandshakes, 1 );
+
+	    Counter_Latency( LATENCY_STARTTLS, &Start );
+	}
+
 	return 0;
 
   fail:
@@ -488,6 +515,7 @@ extern int Attempt_STARTTLS( ITD_Struct *Server )
     {
 	SSL_shutdown( Server->conn->tls );
 	SSL_free( Server->conn->tls );
+	Server->conn->tls = NULL;
     }
     return -1;
 }
@@ -534,7 +562,7 @@ extern ICD_Struct *Get_Server_conn( char *Username,
 				    char *queued_preauth_command )
 {
     char *fn = "Get_Server_conn()";
-    unsigned int HashIndex;
+    unsigned int HashValue;
     ICC_Struct *HashEntry = NULL;
     char SendBuf[BUFSIZE];
 
@@ -548,16 +576,15 @@ extern ICD_Struct *Get_Server_conn( char *Username,
     char *endptr;
     char *last;
     ICC_Struct *ICC_Active;
-    ICC_Struct *ICC_tptr;
+    struct ICCShard *Shard;
+    struct ICCPool *Pool;
     ITD_Struct Server;
     int rc;
-    unsigned int Expiration;
-    struct addrinfo *useai;
+    struct timeval LoginStart;
 
     EVP_MD_CTX mdctx;
     int md_len;
 
-    Expiration = PC_Struct.cache_expiration_time;
     memset( &Server, 0, sizeof Server );
     
     /* need to md5 the passwd regardless, so do that now */
@@ -566,126 +593,135 @@ extern ICD_Struct *Get_Server_conn( char *Username,
     EVP_DigestFinal(&mdctx, md5pw, &md_len);
     
     /* see if we have a reusable connection available */
-    ICC_Active = NULL;
-    HashIndex = Hash( Username, HASH_TABLE_SIZE );
+    HashValue = Hash( Username );
+    Shard = ICC_SHARD( HashValue );
     
-    LockMutex( &mp );
-        
-    /*
-     * Now we just iterate through the linked list at this hash index until
-     * we either find the string we're looking for or we find a NULL.
-     */
-    for ( HashEntry = ICC_HashTable[ HashIndex ]; 
-	  HashEntry; 
-	  HashEntry = HashEntry->next )
+    for ( ; ; )
     {
-	if ( ( strcmp( Username, HashEntry->username ) == 0 ) &&
-	     ( HashEntry->logouttime > 1 ) )
+	ICC_Active = NULL;
+
+	LockMutex( &Shard->mutex );
+
+	/*
+	 * All of this user's server connections are in one pool.  See
+	 * if it has an idle one we can hand out.
+	 */
+	Pool = ICC_Pool_Find( Shard, HashValue, Username );
+	HashEntry = Pool ? ICC_Pick_Idle( Pool ) : NULL;
+
+	if ( HashEntry )
 	{
-	    ICC_Active = HashEntry;
 	    /*
-	     * we found this username in our hash table.  Need to know if
-	     * the password matches.
+	     * Need to know if the password matches.  If it doesn't, it's
+	     * no good to anyone, so get rid of it and look again.
 	     */
-	    if ( memcmp( md5pw, ICC_Active->hashedpw, sizeof md5pw ) )
+	    if ( memcmp( md5pw, HashEntry->hashedpw, sizeof md5pw ) )
 	    {
 		syslog( LOG_NOTICE,
 			"%s: Unable to reuse server sd [%d] for user '%s' (%s:%s) because password doesn't match.",
-			fn, ICC_Active->server_conn->sd, Username,
+			fn, HashEntry->server_conn->sd, Username,
 			ClientAddr, portstr );
-		ICC_Active->logouttime = 1;
+		ICC_Set_Logout( Shard, HashEntry, 1 );
+		UnLockMutex( &Shard->mutex );
+		continue;
 	    }
-	    else
-	    {
-		/*
-		 * We found a matching password on an inactive server socket.
-		 * We can use this guy.  Before we release the mutex, set the
-		 * logouttime such that we mark this connection as "active"
-		 * again.
-		 */
-		ICC_Active->logouttime = 0;
-	
-		/*
-		 * The fact that we have this stored in a table as an open
-		 * server socket doesn't really mean that it's open.  The
-		 * server could've closed it on us.
-		 * We need a speedy way to make sure this is still open.
-		 * We'll set the fd to non-blocking and try to read from it.
-		 * If we get a zero back, the connection is closed.  If we get
-		 * EWOULDBLOCK (or some data) we know it's still open.  If we
-		 * do read data, make sure we read all the data so we "drain"
-		 * any puss that may be left on this socket.
-		 */
-		fcntl( ICC_Active->server_conn->sd, F_SETFL,
-		       fcntl( ICC_Active->server_conn->sd, F_GETFL, 0) | O_NONBLOCK );
-		
-		while ( ( rc = IMAP_Read( ICC_Active->server_conn, Server.ReadBuf, 
-				     sizeof Server.ReadBuf ) ) > 0 );
-		
-		if ( !rc )
-		{
-		    syslog( LOG_NOTICE,
-			    "%s: Unable to reuse server sd [%d] for user '%s' (%s:%s).  Connection closed by server.",
-			    fn, ICC_Active->server_conn->sd, Username,
-			    ClientAddr, portstr );
-		    ICC_Active->logouttime = 1;
-		    continue;
-		}
-	    
-		if ( errno != EWOULDBLOCK )
-		{
-		    syslog( LOG_NOTICE,
-			    "%s: Unable to reuse server sd [%d] for user '%s' (%s:%s). IMAP_read() error: %s",
-			    fn, ICC_Active->server_conn->sd, Username, 
-			    ClientAddr, portstr, strerror( errno ) );
-		    ICC_Active->logouttime = 1;
-		    continue;
-		}
-		
-		fcntl( ICC_Active->server_conn->sd, F_SETFL, 
-		       fcntl( ICC_Active->server_conn->sd, F_GETFL, 0) & ~O_NONBLOCK );
-		
-		/* now release the mutex and return the sd to the caller */
-		UnLockMutex( &mp );
 
-		/*
-		 * We're reusing an existing server socket.  There are a few
-		 * counters we have to deal with.
-		 */
-		IMAPCount->RetainedServerConnections--;
-		IMAPCount->InUseServerConnections++;
-		IMAPCount->TotalServerConnectionsReused++;
-		
-		if ( IMAPCount->InUseServerConnections >
-		     IMAPCount->PeakInUseServerConnections )
-		    IMAPCount->PeakInUseServerConnections = IMAPCount->InUseServerConnections;
-	    
-		syslog( LOG_INFO,
-			"LOGIN: '%s' (%s:%s) on existing sd [%d]",
-			Username, ClientAddr, portstr,
-			ICC_Active->server_conn->sd );
-
-		/* Set the ICD as 'reused' */
-		ICC_Active->server_conn->reused = 1;
+	    /*
+	     * We found a matching password on an inactive server socket.
+	     * We can use this guy.  Before we release the mutex, set the
+	     * logouttime such that we mark this connection as "active"
+	     * again.  Nobody else will hand it out or reap it after that,
+	     * so it's safe to check it over without holding the mutex.
+	     */
+	    ICC_Set_Logout( Shard, HashEntry, 0 );
+	    ICC_Active = HashEntry;
+	}
 
-		// send queued pre-auth commands
-		Server.conn = ICC_Active->server_conn;
-		if ( send_queued_preauth_commands( queued_preauth_command, &Server ) )
-		{
-			syslog( LOG_INFO,
-				"LOGIN: '%s' (%s:%s) failed: Unable to send queued pre-auth commands",
-				Username, ClientAddr, portstr );
-			goto fail;
-		}
+	UnLockMutex( &Shard->mutex );
 
-		return( ICC_Active->server_conn );
-	    }
+	if ( ! ICC_Active )
+	    break;
+	
+	/*
+	 * The fact that we have this stored in a table as an open
+	 * server socket doesn't really mean that it's open.  The
+	 * server could've closed it on us.
+	 * We need a speedy way to make sure this is still open.
+	 * We'll set the fd to non-blocking and try to read from it.
+	 * If we get a zero back, the connection is closed.  If we get
+	 * EWOULDBLOCK (or some data) we know it's still open.  If we
+	 * do read data, make sure we read all the data so we "drain"
+	 * any puss that may be left on this socket.
+	 */
+	fcntl( ICC_Active->server_conn->sd, F_SETFL,
+	       fcntl( ICC_Active->server_conn->sd, F_GETFL, 0) | O_NONBLOCK );
+	
+	while ( ( rc = IMAP_Read( ICC_Active->server_conn, Server.ReadBuf, 
+				  sizeof Server.ReadBuf ) ) > 0 );
+	
+	if ( !rc )
+	{
+	    syslog( LOG_NOTICE,
+		    "%s: Unable to reuse server sd [%d] for user '%s' (%s:%s).  Connection closed by server.",
+		    fn, ICC_Active->server_conn->sd, Username,
+		    ClientAddr, portstr );
+	    LockMutex( &Shard->mutex );
+	    ICC_Set_Logout( Shard, ICC_Active, 1 );
+	    UnLockMutex( &Shard->mutex );
+	    continue;
 	}
+	
+	if ( errno != EWOULDBLOCK )
+	{
+	    syslog( LOG_NOTICE,
+		    "%s: Unable to reuse server sd [%d] for user '%s' (%s:%s). IMAP_read() error: %s",
+		    fn, ICC_Active->server_conn->sd, Username, 
+		    ClientAddr, portstr, strerror( errno ) );
+	    LockMutex( &Shard->mutex );
+	    ICC_Set_Logout( Shard, ICC_Active, 1 );
+	    UnLockMutex( &Shard->mutex );
+	    continue;
+	}
+	
+	fcntl( ICC_Active->server_conn->sd, F_SETFL, 
+	       fcntl( ICC_Active->server_conn->sd, F_GETFL, 0) & ~O_NONBLOCK );
+	
+	/*
+	 * We're reusing an existing server socket.  There are a few
+	 * counters we have to deal with.
+	 */
+	COUNT( RetainedServerConnections, -1 );
+	COUNT( InUseServerConnections, 1 );
+	COUNT( TotalServerConnectionsReused, 1 );
+	
+	syslog( LOG_INFO,
+		"LOGIN: '%s' (%s:%s) on existing sd [%d]",
+		Username, ClientAddr, portstr,
+		ICC_Active->server_conn->sd );
+	
+	/* Set the ICD as 'reused' */
+	ICC_Active->server_conn->reused = 1;
+	
+	// send queued pre-auth commands
+	Server.conn = ICC_Active->server_conn;
+	if ( send_queued_preauth_commands( queued_preauth_command, &Server ) )
+	{
+	    syslog( LOG_INFO,
+		    "LOGIN: '%s' (%s:%s) failed: Unable to send queued pre-auth commands",
+		    Username, ClientAddr, portstr );
+	    /*
+	     * The connection belongs to the ICC, so it's closed through
+	     * that rather than at fail, which would leave the ICC
+	     * pointing at freed memory.
+	     */
+	    COUNT( InUseServerConnections, -1 );
+	    ICC_Invalidate( ICC_Active );
+	    return( NULL );
+	}
+	
+	return( ICC_Active->server_conn );
     }
     
-    
-    UnLockMutex( &mp );
-    
     syslog( LOG_INFO,
 	    "LOGIN: '%s' (%s:%s) no previous connection: creating a new one",
 	    Username, ClientAddr, portstr);
@@ -693,96 +729,16 @@ extern ICD_Struct *Get_Server_conn( char *Username,
     /*
      * We don't have an active connection for this user, or the password
      * didn't match.
-     * Open a connection to the IMAP server so we can attempt to login 
+     * Get a connection to the IMAP server so we can attempt to login.
+     * If we keep spares, it's already connected and past STARTTLS.
      */
-    Server.conn = ( ICD_Struct * ) malloc( sizeof ( ICD_Struct ) );
-    if (Server.conn == NULL) {
-	syslog( LOG_ERR, "%s: malloc() failed: %s -- Exiting.", __func__,
-		strerror( errno ) );
-	exit( 1 );
-    }
-    memset( Server.conn, 0, sizeof ( ICD_Struct ) );
-
-    /* As a new connection, the ICD is not 'reused' */
-    Server.conn->reused = 0;
-
-    if (PC_Struct.dnsrr)
-    {
-        LockMutex( &aimtx );
-        /* cycle through returned hosts */
-        if ( ISD.srv->ai_next )
-            ISD.srv = ISD.srv->ai_next;
-        else
-            ISD.srv = ISD.airesults;
-    
-        useai = ISD.srv;
-        UnLockMutex( &aimtx );
-    }
-    else
-        useai = ISD.srv;
-
-    Server.conn->sd = socket( useai->ai_family, useai->ai_socktype, 
-			      useai->ai_protocol );
-    if ( Server.conn->sd == -1 )
-    {
-	syslog( LOG_INFO,
-		"LOGIN: '%s' (%s:%s) failed: Unable to open server socket: %s",
-		Username, ClientAddr, portstr, strerror( errno ) );
-	goto fail;
-    }
-
-    if ( PC_Struct.send_tcp_keepalives )
-    {
-	int onoff = 1;
-	setsockopt( Server.conn->sd, SOL_SOCKET, SO_KEEPALIVE, &onoff, sizeof onoff );
-    }
-    
-    if ( connect( Server.conn->sd, (struct sockaddr *)useai->ai_addr, 
-		  useai->ai_addrlen ) == -1 )
-    {
-	syslog( LOG_INFO,
-		"LOGIN: '%s' (%s:%s) failed: Unable to connect to IMAP server: %s",
-		Username, ClientAddr, portstr, strerror( errno ) );
-	goto fail;
-    }
-    
-    
-    /* Read & throw away the banner line from the server */
-    
-    if ( IMAP_Line_Read( &Server ) == -1 )
+    if ( Backend_Connect( &Server ) == -1 )
     {
 	syslog( LOG_INFO,
-		"LOGIN: '%s' (%s:%s) failed: No banner line received from IMAP server",
- 		Username, ClientAddr, portstr );
-	goto fail;
-    }
-
-    /*
-     * Sanity check.  We don't deal with literal responses in the
-     * banner string.
-     */
-    if ( Server.LiteralBytesRemaining )
-    {
-	syslog(LOG_ERR, "%s: Unexpected string literal in server banner response.", fn );
-	goto fail;
-	
-    }
-    
-
-    /*
-     * Do STARTTLS if necessary.
-     */
-#if HAVE_LIBSSL
-    if ( PC_Struct.login_disabled || PC_Struct.force_tls )
-    {
-	if ( Attempt_STARTTLS( &Server ) != 0 )
-	{
-	    goto fail;
-	}
-
-	/* XXX Should we grab the session id for later reuse? */
+		"LOGIN: '%s' (%s:%s) failed: Unable to open a connection to the IMAP server",
+		Username, ClientAddr, portstr );
+	return( NULL );
     }
-#endif /* HAVE_LIBSSL */
 
 
     // send queued pre-auth commands
@@ -828,16 +784,16 @@ extern ICD_Struct *Get_Server_conn( char *Username,
 		goto fail;
 	    }
 	
-	    if ( Server.ReadBuf[0] != '*' )
+	    if ( ITD_LINE( &Server )[0] != '*' )
 		break;
 	}
     
     
 	// Try to match up the tag in the server response to the client tag.
 	//
-	endptr = Server.ReadBuf + rc;
+	endptr = ITD_LINE( &Server ) + rc;
     
-	tokenptr = memtok( Server.ReadBuf, endptr, &last );
+	tokenptr = memtok( ITD_LINE( &Server ), endptr, &last );
     
 	if ( !tokenptr )
 	{
@@ -905,6 +861,8 @@ extern ICD_Struct *Get_Server_conn( char *Username,
     }
     
 
+    gettimeofday( &LoginStart, NULL );
+
     /*
      * If configured to do so, execute SASL PLAIN authentication
      * using the static authentication username and password from
@@ -1032,7 +990,7 @@ extern ICD_Struct *Get_Server_conn( char *Username,
 	    
 	}
 	
-	if ( Server.ReadBuf[0] != '+' )
+	if ( ITD_LINE( &Server )[0] != '+' )
 	{
 	    syslog( LOG_INFO,
 		    "LOGIN: '%s' (%s:%s) failed: bad response from server after sending string literal specifier",
@@ -1105,7 +1063,7 @@ extern ICD_Struct *Get_Server_conn( char *Username,
 	    
 	}
 	
-	if ( Server.ReadBuf[0] != '*' )
+	if ( ITD_LINE( &Server )[0] != '*' )
 	    break;
     }
     
@@ -1113,9 +1071,9 @@ extern ICD_Struct *Get_Server_conn( char *Username,
     /*
      * Try to match up the tag in the server response to the client tag.
      */
-    endptr = Server.ReadBuf + rc;
+    endptr = ITD_LINE( &Server ) + rc;
     
-    tokenptr = memtok( Server.ReadBuf, endptr, &last );
+    tokenptr = memtok( ITD_LINE( &Server ), endptr, &last );
     
     if ( !tokenptr )
     {
@@ -1191,85 +1149,38 @@ extern ICD_Struct *Get_Server_conn( char *Username,
 		Username, ClientAddr, portstr, fullResponse );
 	goto fail;
     }
+
+    Counter_Latency( LATENCY_SERVER_LOGIN, &LoginStart );
     
     /*
-     * put this in our used list and remove it from the free list
+     * put this in our used list and remove it from the free list.  If
+     * there aren't any free ones left, ICC_New() evicts the least
+     * recently used cached connection to make room.
      */
-    for( ; ; )
+    ICC_Active = ICC_New( Username, md5pw, Server.conn );
+    
+    if ( ICC_Active )
     {
-	LockMutex( &mp );
-	
-	if ( ICC_free->next )
-	{
-	    /* generate the hash index */
-	    HashIndex = Hash( Username, HASH_TABLE_SIZE );
-	    
-	    /* temporarily store the address of the next free structure */
-	    ICC_tptr = ICC_free->next;
-	    
-	    /*
-	     * We want to add the newest "used" structure at the front of
-	     * the list at the hash index.
-	     */
-	    ICC_free->next = ICC_HashTable[ HashIndex ];
-	    ICC_HashTable[ HashIndex ] = ICC_free;
-	    
-	    /* 
-	     * less typing and more readability, set an "active" pointer.
-	     */
-	    ICC_Active = ICC_free;
-	    
-	    /* now point the free listhead to the next available free struct */
-	    ICC_free = ICC_tptr;
-	    
-	    /* fill in the newest used (oxymoron?) structure */
-	    strncpy( ICC_Active->username, Username, 
-		     sizeof ICC_Active->username );
-	    ICC_Active->username[ sizeof ICC_Active->username - 1 ] = '\0';
-	    memcpy( ICC_Active->hashedpw, md5pw, sizeof ICC_Active->hashedpw );
-	    ICC_Active->logouttime = 0;    /* zero means, "it's active". */
-	    ICC_Active->server_conn = Server.conn;
-	    
-	    Server.conn->ICC = ICC_Active;
+	Server.conn->ICC = ICC_Active;
 
-	    UnLockMutex( &mp );
-	    
-	    IMAPCount->InUseServerConnections++;
-	    IMAPCount->TotalServerConnectionsCreated++;
+	COUNT( InUseServerConnections, 1 );
+	COUNT( TotalServerConnectionsCreated, 1 );
 
-	    if ( IMAPCount->InUseServerConnections >
-		 IMAPCount->PeakInUseServerConnections )
-		IMAPCount->PeakInUseServerConnections = IMAPCount->InUseServerConnections;
-	    syslog( LOG_INFO,
-		    "LOGIN: '%s' (%s:%s) on new sd [%d]",
-		    Username, ClientAddr, portstr, Server.conn->sd );
-	    return( Server.conn );
-	}
-	
-	/*
-	 * There weren't any free ICC structs.  Try to free one.  Make sure
-	 * we unlock the mutex, since ICC_Recycle needs to obtain it.
-	 */
-	UnLockMutex( &mp );
-	
-	Expiration = abs( Expiration / 2 );
-	
-	/*
-	 * Eventually, we have to fail
-	 */
-	if ( Expiration <= 2 )
-	{
-	    syslog( LOG_INFO,
-		    "LOGIN: '%s' (%s:%s) failed: Out of free ICC structs.",
-		    Username, ClientAddr, portstr );
-	    goto fail;
-	}
-	
-	ICC_Recycle( Expiration );
-	
+	syslog( LOG_INFO,
+		"LOGIN: '%s' (%s:%s) on new sd [%d]",
+		Username, ClientAddr, portstr, Server.conn->sd );
+	return( Server.conn );
     }
     
+    /*
+     * Every ICC struct belongs to an active session.
+     */
+    syslog( LOG_INFO,
+	    "LOGIN: '%s' (%s:%s) failed: Out of free ICC structs.",
+	    Username, ClientAddr, portstr );
+    
   fail:
+    Backend_Count( Server.conn->Backend, -1, 0 );
 #if HAVE_LIBSSL
     if ( Server.conn->tls )
     {
@@ -1300,6 +1211,8 @@ TODO: change this in the future to be a linked list:
  * Returns:	non-zero if any of the commands failed
  *
  * Authors:	Paul Lesniewski
+ *
+ * Notes:	The caller closes the connection if they did.
  *--
  */
 static int send_queued_preauth_commands( char *queued_preauth_command, ITD_Struct *Server )
@@ -1345,16 +1258,16 @@ if ( strlen( queued_preauth_command ) )
 		goto fail;
 	    }
 	
-	    if ( Server->ReadBuf[0] != '*' )
+	    if ( ITD_LINE( Server )[0] != '*' )
 		break;
 	}
     
     
 	// Try to match up the tag in the server response to the client tag.
 	//
-	endptr = Server->ReadBuf + rc;
+	endptr = ITD_LINE( Server ) + rc;
     
-	tokenptr = memtok( Server->ReadBuf, endptr, &last );
+	tokenptr = memtok( ITD_LINE( Server ), endptr, &last );
     
 	if ( !tokenptr )
 	{
@@ -1430,15 +1343,6 @@ if ( strlen( queued_preauth_command ) )
 
 
   fail:
-#if HAVE_LIBSSL
-    if ( Server->conn->tls )
-    {
-	SSL_shutdown( Server->conn->tls );
-	SSL_free( Server->conn->tls );
-    }
-#endif
-    close( Server->conn->sd );
-    free( Server->conn );
     return 1;
 }
 
@@ -1615,6 +1519,167 @@ extern int IMAP_Read( ICD_Struct *ICD, void *buf, int count )
 
 
 
+/*++
+ * Function:	IMAP_Splice_Open
+ *
+ * Purpose:	Set up a pipe for relaying server data to the client with
+ *		IMAP_Splice(), if we can.  We can't if the server connection
+ *		uses TLS or is being traced, or if the SELECT cache is on,
+ *		since then we have to see the data.
+ *
+ * Parameters:	ptr to the server ITD
+ *		ptr to 2 ints for the pipe descriptors
+ * 
+ * Returns:	0 if the pipe is ready
+ *		-1 if the data has to be copied the usual way
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	
+ *--
+ */
+extern int IMAP_Splice_Open( ITD_Struct *Server, int *Pipe )
+{
+#if HAVE_SPLICE
+    if ( Server->TraceOn || PC_Struct.enable_select_cache )
+	return( -1 );
+
+#if HAVE_LIBSSL
+    if ( Server->conn->tls )
+	return( -1 );
+#endif
+
+    /* out of descriptors is not fatal, we just copy */
+    if ( pipe( Pipe ) < 0 )
+	return( -1 );
+
+    fcntl( Pipe[0], F_SETFD, FD_CLOEXEC );
+    fcntl( Pipe[1], F_SETFD, FD_CLOEXEC );
+    return( 0 );
+#else
+    return( -1 );
+#endif
+}
+
+
+
+/*++
+ * Function:	IMAP_Splice
+ *
+ * Purpose:	Move whatever can be read from one connection to another
+ *		through a pipe with splice(), so the data never gets copied
+ *		to user space.
+ *
+ * Parameters:	ptr to the source ICD
+ *		ptr to the destination ICD
+ *		ptr to the pipe from IMAP_Splice_Open()
+ *		ptr to the number of bytes sitting in the pipe
+ * 
+ * Returns:	number of bytes read from the source
+ *		0 if nothing was read (non-blocking sockets only)
+ *		-1 if the source was closed or failed
+ *		-2 if the destination failed
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	With a non-blocking destination, data can be left in the
+ *		pipe.  It goes out with the next call, or IMAP_Splice_Flush(),
+ *		and has to before anything else is written to the destination.
+ *--
+ */
+extern int IMAP_Splice( ICD_Struct *From, ICD_Struct *To, int *Pipe,
+			unsigned int *InPipe )
+{
+#if HAVE_SPLICE
+    ssize_t rc;
+
+    if ( IMAP_Splice_Flush( To, Pipe, InPipe ) < 0 )
+	return( -2 );
+
+    /* the client is slow, leave the data with the server for now */
+    if ( *InPipe )
+	return( 0 );
+
+    for ( ; ; )
+    {
+	rc = splice( From->sd, NULL, Pipe[1], NULL, SPLICE_CHUNK,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+	if ( rc > 0 )
+	    break;
+
+	if ( rc == 0 )
+	    return( -1 );
+
+	if ( errno == EINTR )
+	    continue;
+
+	if ( errno == EAGAIN )
+	    return( 0 );
+
+	return( -1 );
+    }
+
+    *InPipe += rc;
+
+    if ( IMAP_Splice_Flush( To, Pipe, InPipe ) < 0 )
+	return( -2 );
+
+    return( rc );
+#else
+    errno = ENOSYS;
+    return( -1 );
+#endif
+}
+
+
+
+/*++
+ * Function:	IMAP_Splice_Flush
+ *
+ * Purpose:	Write out data left in a pipe by IMAP_Splice().
+ *
+ * Parameters:	ptr to the destination ICD
+ *		ptr to the pipe
+ *		ptr to the number of bytes sitting in the pipe
+ * 
+ * Returns:	0 on success (data may be left if the destination would block)
+ *		-1 on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	
+ *--
+ */
+extern int IMAP_Splice_Flush( ICD_Struct *To, int *Pipe,
+			      unsigned int *InPipe )
+{
+#if HAVE_SPLICE
+    ssize_t rc;
+
+    while ( *InPipe )
+    {
+	rc = splice( Pipe[0], NULL, To->sd, NULL, *InPipe,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+	if ( rc > 0 )
+	{
+	    *InPipe -= rc;
+	    continue;
+	}
+
+	if ( rc < 0 && errno == EINTR )
+	    continue;
+
+	if ( rc < 0 && errno == EAGAIN )
+	    return( 0 );
+
+	return( -1 );
+    }
+#endif
+    return( 0 );
+}
+
+
+
 /*++
  * Function:	IMAP_Literal_Read
  *
@@ -1634,7 +1699,6 @@ extern int IMAP_Literal_Read( ITD_Struct *ITD )
 {
     char *fn = "IMAP_Literal_Read()";
     int Status;
-    unsigned int i, j;
     struct pollfd fds[2];
     nfds_t nfds;
     int pollstatus;
@@ -1646,34 +1710,20 @@ extern int IMAP_Literal_Read( ITD_Struct *ITD )
 	return( 0 );
 
     
-    /* scoot the buffer */
-    for ( i = ITD->ReadBytesProcessed, j = 0; 
-	  i <= ITD->BytesInReadBuffer; 
-	  i++, j++ )
-    {
-	ITD->ReadBuf[j] = ITD->ReadBuf[i];
-    }
-    ITD->BytesInReadBuffer -= ITD->ReadBytesProcessed;
-    ITD->ReadBytesProcessed = 0;
+    /*
+     * Drop whatever we handed out last time.  There's no need to move
+     * anything, the next chunk just starts where the last one ended.
+     */
+    ITD->LineStart = ITD->ReadBytesProcessed;
 
     /*
      * If we have any data in our buffer, return what we have.
      */
-    if ( ITD->BytesInReadBuffer > 0 )
-    {
-	if ( ITD->BytesInReadBuffer >= ITD->LiteralBytesRemaining )
-	{
-	    ITD->ReadBytesProcessed = ITD->LiteralBytesRemaining;
-	    ITD->LiteralBytesRemaining = 0;
-	    return( ITD->ReadBytesProcessed );
-	}
-	else
-	{
-	    ITD->ReadBytesProcessed += ITD->BytesInReadBuffer;
-	    ITD->LiteralBytesRemaining -= ITD->BytesInReadBuffer;
-	    return( ITD->ReadBytesProcessed );
-	}
-    }
+    if ( ITD->BytesInReadBuffer > ITD->LineStart )
+	return( IMAP_Literal_Chunk( ITD ) );
+
+    /* empty, so we can start over at the front */
+    ITD->BytesInReadBuffer = ITD->ReadBytesProcessed = ITD->LineStart = 0;
 	
     /*
      * No data left in the buffer.  Have to call read.  Read either
@@ -1723,18 +1773,37 @@ extern int IMAP_Literal_Read( ITD_Struct *ITD )
      */
     ITD->BytesInReadBuffer += Status;
     
-    if ( ITD->BytesInReadBuffer >= ITD->LiteralBytesRemaining )
-    {
-	ITD->ReadBytesProcessed = ITD->LiteralBytesRemaining;
-	ITD->LiteralBytesRemaining = 0;
-	return( ITD->ReadBytesProcessed );
-    }
-    else
-    {
-	ITD->ReadBytesProcessed += ITD->BytesInReadBuffer;
-	ITD->LiteralBytesRemaining -= ITD->BytesInReadBuffer;
-	return( ITD->ReadBytesProcessed );
-    }
+    return( IMAP_Literal_Chunk( ITD ) );
+}
+
+
+
+/*++
+ * Function:	IMAP_Literal_Chunk
+ *
+ * Purpose:	Hand out as much of a string literal as we have buffered.
+ *
+ * Parameters:	ptr to a IMAPTransactionDescriptor structure
+ * 
+ * Returns:	number of bytes handed out, starting at ITD_LINE( ITD )
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	
+ *--
+ */
+static int IMAP_Literal_Chunk( ITD_Struct *ITD )
+{
+    unsigned int Count;
+
+    Count = ITD->BytesInReadBuffer - ITD->LineStart;
+
+    if ( Count > ITD->LiteralBytesRemaining )
+	Count = ITD->LiteralBytesRemaining;
+
+    ITD->ReadBytesProcessed = ITD->LineStart + Count;
+    ITD->LiteralBytesRemaining -= Count;
+    return( Count );
 }
 
 
@@ -1761,11 +1830,10 @@ extern int IMAP_Literal_Read( ITD_Struct *ITD )
 extern int IMAP_Line_Read( ITD_Struct *ITD )
 {
     char *CP;
+    char *Line;
     int Status;
-    unsigned int i, j;
     int rc;
     char *fn = "IMAP_Line_Read()";
-    char *EndOfBuffer;
 
     /*
      * Sanity check.  This function should never be called if there are
@@ -1784,30 +1852,26 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
     }
     
 
-    /* Point End to the end of our buffer */
-    EndOfBuffer = &ITD->ReadBuf[sizeof ITD->ReadBuf - 1];
-
-
     /* 
-     * Shift the contents of our buffer.  This will erase any previous
-     * line that we already gave to a caller.
+     * Drop any previous line that we already gave to a caller.  We used
+     * to shift the rest of the buffer down over it on every call; now the
+     * next line simply starts where the last one ended, and the buffer only
+     * gets compacted when we run short of room to read into.
      */
-    for ( i = ITD->ReadBytesProcessed, j = 0; 
-	  i <= ITD->BytesInReadBuffer; 
-	  i++, j++ )
-    {
-	ITD->ReadBuf[j] = ITD->ReadBuf[i];
-    }
-    ITD->BytesInReadBuffer -= ITD->ReadBytesProcessed;
-    ITD->ReadBytesProcessed = 0;
+    ITD->LineStart = ITD->ReadBytesProcessed;
+
+    if ( ITD->LineStart == ITD->BytesInReadBuffer )
+	ITD->BytesInReadBuffer = ITD->ReadBytesProcessed = ITD->LineStart = 0;
 
     for (;;)
     {
+	Line = &ITD->ReadBuf[ ITD->LineStart ];
+
 	/*
 	 * If we've been called before, we may already have another line
 	 * in the buffer that we can return to the caller.
 	 */
-	CP = (char *)memchr( ITD->ReadBuf, '\n', ITD->BytesInReadBuffer );
+	CP = (char *)memchr( Line, '\n', ITD->BytesInReadBuffer - ITD->LineStart );
 	
 	if ( CP )
 	{
@@ -1817,7 +1881,7 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 	     * character sent.  If we find this, it could be the result
 	     * of a "more data" scenerio.
 	     */
-	    if ( CP != ITD->ReadBuf )
+	    if ( CP != Line )
 	    {
 		/* reset the moredata flag */
 		ITD->MoreData = 0;
@@ -1825,10 +1889,8 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 		if ( *(CP - 1) == '\r' )
 		{
 		    /*
-		     * Set ReadBytesProcessed to the length of the line
-		     * we just found.  Just subtract the address of the
-		     * beginning of the buffer from the address of our
-		     * "/n" in the buffer.  Always need to add one.
+		     * Set ReadBytesProcessed to the end of the line we just
+		     * found.  Always need to add one.
 		     */
 		    ITD->ReadBytesProcessed = ( CP - ITD->ReadBuf + 1);
 		    
@@ -1838,7 +1900,7 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 		     * string literal is coming next.  How do we know?
 		     * If it is, the line will end with {bytecount}.
 		     */
-		    if ( ((CP - ITD->ReadBuf + 1) > 2 ) && ( *(CP - 2) == '}' ))
+		    if ( ((CP - Line + 1) > 2 ) && ( *(CP - 2) == '}' ))
 		    {
 			char *LiteralEnd;
 			char *LiteralStart;
@@ -1847,19 +1909,23 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 			
 			/*
 			 * Found a '}' as the last character on the line.
-			 * Save it's place and then look for the
-			 * beginning '{'.
+			 * Save it's place and then look for the beginning
+			 * '{'.  Only a byte count (and maybe a '+') can be
+			 * in between, so there's no need to look further
+			 * back than that.
 			 */
 			LiteralEnd = CP - 2;
-			CP -= 2;
 			
-			for ( ; CP >= ITD->ReadBuf; CP-- )
+			for ( CP = LiteralEnd - 1; CP >= Line; CP-- )
 			{
 			    if ( *CP == '{' )
 			    {
 				LiteralStart = CP;
 				break;
 			    }
+
+			    if ( ( *CP < '0' || *CP > '9' ) && *CP != '+' )
+				break;
 			}
 			
 			if ( LiteralStart )
@@ -1884,7 +1950,7 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 				 * would ever send this, but just pretend
 				 * we never saw it.
 				 */
-				return( ITD->ReadBytesProcessed );
+				return( ITD->ReadBytesProcessed - ITD->LineStart );
 			    }
 			    else
 			    {
@@ -1917,7 +1983,7 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 		    /*
 		     * This looks redundant, huh?
 		     */
-		    return( ITD->ReadBytesProcessed );
+		    return( ITD->ReadBytesProcessed - ITD->LineStart );
 		}
 		else
 		{
@@ -1944,8 +2010,8 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 		     * we can't be sure that this is the case, but the client
 		     * and the server can fight it out if it's not.
 		     */
-		    ITD->ReadBytesProcessed = 1;
-		    return( ITD->ReadBytesProcessed );
+		    ITD->ReadBytesProcessed = ITD->LineStart + 1;
+		    return( 1 );
 		}
 		
 		else
@@ -1962,6 +2028,13 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 	 * from the server.  Ultimately, we'll want to call IMAP_Read and
 	 * add on to the end of the existing buffer.  
 	 *
+	 * If we're short of room at the end of the buffer, this is the time
+	 * to slide the partial line down to the front.
+	 */
+	if ( ( sizeof ITD->ReadBuf - ITD->BytesInReadBuffer ) < ITD_MIN_READ )
+	    IMAP_Buffer_Compact( ITD );
+
+	/*
 	 * Before we go off and wildly start calling IMAP_Read() we should
 	 * really make sure that we have space left in our buffer.  If not,
 	 * set the "more to come" flag and return what we have to the caller.
@@ -1980,14 +2053,13 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
 	     * problem.
 	     */
 	    ITD->MoreData = 1;
-	    CP = EndOfBuffer - 20;
 	    
 	    /*
-	     * Set ReadBytesProcessed to the length of the line
-	     * we're gonna return.
+	     * Set ReadBytesProcessed to the end of the "line" we're gonna
+	     * return.
 	     */
-	    ITD->ReadBytesProcessed = ( CP - ITD->ReadBuf + 1);
-	    return( ITD->ReadBytesProcessed );
+	    ITD->ReadBytesProcessed = sizeof ITD->ReadBuf - 20;
+	    return( ITD->ReadBytesProcessed - ITD->LineStart );
 	}
 	
 	Status = IMAP_Read(ITD->conn, &ITD->ReadBuf[ITD->BytesInReadBuffer],
@@ -2012,6 +2084,35 @@ extern int IMAP_Line_Read( ITD_Struct *ITD )
     }
 }
 
+
+
+/*++
+ * Function:	IMAP_Buffer_Compact
+ *
+ * Purpose:	Make room at the end of an ITD read buffer by sliding the
+ *		data that hasn't been handed out yet down to the front.
+ *
+ * Parameters:	ptr to a IMAPTransactionDescriptor structure
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Whatever was last handed out (ITD_LINE()) is gone afterwards.
+ *--
+ */
+extern void IMAP_Buffer_Compact( ITD_Struct *ITD )
+{
+    if ( ! ITD->ReadBytesProcessed )
+	return;
+
+    memmove( ITD->ReadBuf, &ITD->ReadBuf[ ITD->ReadBytesProcessed ],
+	     ITD->BytesInReadBuffer - ITD->ReadBytesProcessed );
+    ITD->BytesInReadBuffer -= ITD->ReadBytesProcessed;
+    ITD->ReadBytesProcessed = 0;
+    ITD->LineStart = 0;
+}
+
 /*
  *                            _________
  *                           /        |
@@ -192,6 +192,7 @@ static char *sourceVersion = "$Id: main.c 14573 2016-09-14 02:55:23Z pdontthink
 static char *sourceAuthor = "$Author: pdontthink $";
 
 #define _REENTRANT
+#define _GNU_SOURCE                  /* for accept4() */
 
 #include <config.h>
 
@@ -241,13 +242,10 @@ unsigned int BannerLen;
 char Capability[BUFSIZE];            /* IMAP capability line from server */
 unsigned int CapabilityLen;
 ISD_Struct ISD;                      /* global IMAP server descriptor */
-ICC_Struct *ICC_free;                /* ICC free listhead */
-ICC_Struct *ICC_HashTable[ HASH_TABLE_SIZE ];
+struct ICCShard ICC_Shards[ ICC_SHARDS ]; /* ICC cache, see imapproxy.h */
 IMAPCounter_Struct *IMAPCount;       /* global IMAP counter struct */
-pthread_mutex_t mp;                  /* "main" mutex used for ICC sync */
 pthread_mutex_t trace;               /* mutex used for username tracing */
 pthread_mutex_t aimtx;               /* mutex used for DNS RR */
-char TraceUser[MAXUSERNAMELEN];      /* username we want to trace */
 int Tracefd;                         /* fd of our trace file (always open) */
 ProxyConfig_Struct PC_Struct;        /* Global configuration data */
 
@@ -266,6 +264,8 @@ int deny_severity = LOG_ERR;
 char *service;
 #endif
 
+static int UseEngine;                /* io_engine epoll */
+
 /*
  * Internal Prototypes
  */
@@ -276,6 +276,8 @@ static void ServerInit( void );
 static int TestServerAlive( struct addrinfo *ai );
 static void Daemonize( const char* );
 static void Usage( void );
+static int Open_Listener( struct addrinfo *, int );
+static void *Accept_Loop( void * );
 
 
 
@@ -283,33 +285,27 @@ int main( int argc, char *argv[] )
 {
     const char *fn = "main()";
     char f_randfile[ PATH_MAX ];
-    int listensd;                      /* socket descriptor we'll bind to */
-    long clientsd;                     /* incoming socket descriptor */
-    int sockaddrlen;                       
-    struct sockaddr_storage srvaddr;
-    struct sockaddr_storage cliaddr;
-    pthread_t ThreadId;                /* thread id of each incoming conn */
+    long *listensd;                    /* socket descriptors we bind to */
+    unsigned int NumListeners;         /* how many of them */
+    int Backlog;                       /* listen() backlog */
+    pthread_t ThreadId;                /* thread id of each accept thread */
     pthread_t RecycleThread;           /* used just for the recycle thread */
     pthread_attr_t attr;               /* generic thread attribute struct */
     int rc, i, fd;
     unsigned int ui;
-    struct linger lingerstruct;        /* for the socket reuse stuff */
-    int flag;                          /* for the socket reuse stuff */
-    ICC_Struct *ICC_tptr;             
+    unsigned int StatSize;             /* how big the stat file is */
+    void *StatMap;                     /* ...and where it's mapped */
+    int MetricsSd = -1;                /* metrics page listen socket */
     extern char *optarg;
     extern int optind;
     char ConfigFile[ MAXPATHLEN ];     /* path to our config file */
     char PidFile[ MAXPATHLEN ];		/* path to our pidfile */
-#ifdef HAVE_LIBWRAP
-    struct request_info r;             /* request struct for libwrap */
-#endif
 #if HAVE_LIBSSL
     int tls_options;
 #endif
     struct addrinfo aihints, *ai;
     int gaierrnum;
 
-    flag = 1;
     ConfigFile[0] = '\0';
     strncpy( PidFile, DEFAULT_PID_FILE, sizeof PidFile -1 );
 
@@ -398,13 +394,6 @@ int main( int argc, char *argv[] )
     /*
      * Initialize some stuff.
      */
-    rc = pthread_mutex_init(&mp, NULL);
-    if ( rc )
-    {
-	syslog(LOG_ERR, "%s: pthread_mutex_init() returned error [%d] initializing main mutex.  Exiting.", fn, rc );
-	exit( 1 );
-    }
-
     rc = pthread_mutex_init(&trace, NULL);
     if ( rc )
     {
@@ -419,37 +408,12 @@ int main( int argc, char *argv[] )
 	exit( 1 );
     }
 
-    TraceUser[0] = '\0';
     
     syslog( LOG_INFO, "%s: Allocating %d IMAP connection structures.", 
 	    fn, PC_Struct.cache_size );
 
-    ICC_free = (ICC_Struct *)malloc( ( sizeof ( ICC_Struct ) ) 
-		       * PC_Struct.cache_size );
-    
-    if ( ! ICC_free )
-    {
-	syslog(LOG_ERR, "%s: malloc() failed to allocate [%d] IMAPConnectionContext structures: %s", fn, PC_Struct.cache_size, strerror( errno ) );
-	exit( 1 );
-    }
-    
-    memset( ICC_free, 0, sizeof ( ICC_Struct ) * PC_Struct.cache_size );
-    
-    ICC_tptr = ICC_free;
-
-    /*
-     * Bug fixed by Gary Mills <mills@cc.UManitoba.CA>.  I was pre-incrementing
-     * ICC_tptr and then assigning.  I guess gcc evaluates the expression
-     * incorrectly, since I never had a problem with this.  Gary had the
-     * problem with cc, so it's fixed here.
-     */
-    for ( ui = 0; ui < PC_Struct.cache_size - 1; ui++ )
-    {
-	ICC_tptr->next = ICC_tptr + 1;
-	ICC_tptr++;
-    }
-    
-    memset( ICC_HashTable, 0, sizeof ICC_HashTable );
+    Hash_Seed();
+    ICC_Init( PC_Struct.cache_size );
 
 
 #if HAVE_LIBSSL
@@ -500,6 +464,16 @@ int main( int argc, char *argv[] )
 #endif
 
     SSL_CTX_set_options( tls_ctx, tls_options );
+
+    /*
+     * Keep the sessions the IMAP server gives us (session ids and TLS
+     * 1.3 tickets alike come through the callback) so that new server
+     * connections can resume them instead of doing a full handshake.
+     * Backend_New_Session() keeps the newest one per server address.
+     */
+    SSL_CTX_set_session_cache_mode( tls_ctx, SSL_SESS_CACHE_CLIENT |
+				    SSL_SESS_CACHE_NO_INTERNAL_STORE );
+    SSL_CTX_sess_set_new_cb( tls_ctx, Backend_New_Session );
  
     if ( PC_Struct.tls_ca_file != NULL || PC_Struct.tls_ca_path != NULL )
     {
@@ -597,36 +571,27 @@ int main( int argc, char *argv[] )
 	    PC_Struct.listen_addr ? PC_Struct.listen_addr : "*",
 	    PC_Struct.listen_port );
 
-    for ( ; ai != NULL; ai = ai->ai_next )
-    {
-	listensd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
-    if ( listensd == -1 )
+    NumListeners = ( PC_Struct.listen_sockets > 1 ? PC_Struct.listen_sockets : 1 );
+#ifndef SO_REUSEPORT
+    if ( NumListeners > 1 )
     {
-	    syslog(LOG_WARNING, "%s: socket() failed: %s", fn, strerror(errno));
-	    continue;
+	syslog( LOG_WARNING, "%s: SO_REUSEPORT is not supported on this platform.  Using a single listen socket.", fn );
+	NumListeners = 1;
     }
+#endif
 
-    setsockopt(listensd, SOL_SOCKET, SO_REUSEADDR, (void *)&flag, 
-	       sizeof(flag));
-    lingerstruct.l_onoff = 1;
-    lingerstruct.l_linger = 5;
-    setsockopt(listensd, SOL_SOCKET, SO_LINGER, (void *)&lingerstruct, 
-	       sizeof(lingerstruct));
-
-    if ( PC_Struct.send_tcp_keepalives )
+    listensd = malloc( NumListeners * sizeof( long ) );
+    if ( ! listensd )
     {
-	lingerstruct.l_onoff = 1;
-	syslog( LOG_INFO, "%s: Enabling SO_KEEPALIVE.", fn );
-	setsockopt( listensd, SOL_SOCKET, SO_KEEPALIVE, (void *)&lingerstruct.l_onoff, sizeof lingerstruct.l_onoff );
+	syslog( LOG_ERR, "%s: malloc() failed: %s -- Exiting.", fn, strerror( errno ) );
+	exit( 1 );
     }
 
-	memcpy( &srvaddr, ai->ai_addr, ai->ai_addrlen );
-	if ( bind( listensd, (struct sockaddr *)&srvaddr, ai->ai_addrlen ) < 0 )
+    for ( ; ai != NULL; ai = ai->ai_next )
     {
-	    syslog(LOG_WARNING, "%s: bind() failed: %s", fn, strerror(errno) );
-	    continue;
-	}
-	else break;
+	listensd[0] = Open_Listener( ai, NumListeners > 1 );
+	if ( listensd[0] != -1 )
+	    break;
     }
     if ( ai == NULL )
     {
@@ -634,6 +599,51 @@ int main( int argc, char *argv[] )
 	exit( EXIT_FAILURE);
     }
 
+    /*
+     * With SO_REUSEPORT, every listen socket gets its own accept queue
+     * and the kernel spreads new connections across them.
+     */
+    for ( ui = 1; ui < NumListeners; ui++ )
+    {
+	listensd[ ui ] = Open_Listener( ai, 1 );
+	if ( listensd[ ui ] == -1 )
+	{
+	    syslog( LOG_ERR, "%s: unable to open listen socket %u of %u -- Exiting.", fn, ui + 1, NumListeners );
+	    exit( 1 );
+	}
+    }
+
+    if ( NumListeners > 1 )
+	syslog( LOG_INFO, "%s: Using %u SO_REUSEPORT listen sockets.", fn, NumListeners );
+
+    /*
+     * The metrics page gets a listen socket of its own, bound now for
+     * the same reason.  It's not authenticated, so it stays on the
+     * loopback unless told otherwise.
+     */
+    if ( PC_Struct.metrics_port )
+    {
+	if ( ( gaierrnum = getaddrinfo( PC_Struct.metrics_addr ? PC_Struct.metrics_addr : "127.0.0.1",
+					PC_Struct.metrics_port,
+					&aihints, &ai ) ) )
+	{
+	    syslog( LOG_ERR, "%s: bad metrics address: '%s' port '%s' specified in config file: %s -- Exiting.", fn, PC_Struct.metrics_addr ? PC_Struct.metrics_addr : "127.0.0.1", PC_Struct.metrics_port, gai_strerror( gaierrnum ) );
+	    exit( 1 );
+	}
+
+	for ( ; ai != NULL; ai = ai->ai_next )
+	{
+	    MetricsSd = Open_Listener( ai, 0 );
+	    if ( MetricsSd != -1 )
+		break;
+	}
+	if ( ai == NULL )
+	{
+	    syslog( LOG_ERR, "%s: unable to bind the metrics port -- Exiting.", fn );
+	    exit( 1 );
+	}
+    }
+
     /*
      * Create and mmap() our stat file while we're still root.  Since it's
      * configurable, we want to make sure we do this as root so there's the
@@ -651,26 +661,36 @@ int main( int argc, char *argv[] )
 	exit( 1 );
     }
     
-    if ( ( ftruncate( fd, sizeof( IMAPCounter_Struct ) ) ) == -1 )
+    StatSize = Counter_Stat_Size();
+
+    if ( ( ftruncate( fd, StatSize ) ) == -1 )
     {
 	syslog(LOG_ERR, "%s: ftruncate() failed: %s -- Exiting.", 
 	       fn, strerror( errno ) );
 	exit( 1 );
     }
     
-    IMAPCount = ( IMAPCounter_Struct *)mmap( 0, sizeof( IMAPCounter_Struct ), 
-		    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    StatMap = mmap( 0, StatSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
     
-    if ( IMAPCount == MAP_FAILED )
+    if ( StatMap == MAP_FAILED )
     {
 	syslog(LOG_ERR, "%s: mmap() failed: %s -- Exiting.", 
 	       fn, strerror( errno ) );
 	exit( 1 );
     }
     
-    memset( IMAPCount, 0, sizeof( IMAPCounter_Struct ) );
-    IMAPCount->StartTime = time( 0 );
-    IMAPCount->CountTime = time( 0 );
+    IMAPCount = Counter_Stat_Init( StatMap );
+    Counter_Init();
+
+    if ( PC_Struct.io_engine && strcasecmp( PC_Struct.io_engine, "threads" ) )
+    {
+	if ( strcasecmp( PC_Struct.io_engine, "epoll" ) )
+	{
+	    syslog( LOG_ERR, "%s: Unknown io_engine '%s' in config file.  Exiting.", fn, PC_Struct.io_engine );
+	    exit( 1 );
+	}
+	UseEngine = 1;
+    }
 
     /*
      * Daemonize as late as possible, so that connection failures can be caught
@@ -703,21 +723,160 @@ int main( int argc, char *argv[] )
     syslog(LOG_INFO, "%s: Launched ICC recycle thread with id %lu", 
 	   fn, (unsigned long int)RecycleThread );
 
+    Trace_Init();
+
+    Backend_Init();
+
+    if ( UseEngine )
+	Engine_Init();
+
+    if ( MetricsSd != -1 )
+	Metrics_Init( MetricsSd );
+
     /*
      * Now start listening and accepting connections.
      */
-    if ( listen(listensd, MAX_CONN_BACKLOG) < 0)
+    Backlog = ( PC_Struct.listen_backlog ? PC_Struct.listen_backlog : MAX_CONN_BACKLOG );
+
+    for ( ui = 0; ui < NumListeners; ui++ )
     {
-	syslog( LOG_ERR, "%s: listen() failed: %s -- Exiting", 
-	       fn, strerror(errno));
-	exit( 1 );
+	if ( listen( listensd[ ui ], Backlog ) < 0 )
+	{
+	    syslog( LOG_ERR, "%s: listen() failed: %s -- Exiting", 
+		   fn, strerror(errno));
+	    exit( 1 );
+	}
     }
 
     syslog( LOG_INFO, "%s: squirrelmail-imap_proxy version %s normal server startup.", fn, IMAP_PROXY_VERSION );
 
     /*
-     * Main server loop
+     * One accept thread for each extra listen socket.  We take care of
+     * the first one ourselves.
      */
+    for ( ui = 1; ui < NumListeners; ui++ )
+    {
+	rc = pthread_create( &ThreadId, &attr, Accept_Loop, (void *)listensd[ ui ] );
+	if ( rc )
+	{
+	    syslog( LOG_ERR, "%s: pthread_create() returned error [%d] for Accept_Loop -- Exiting.", fn, rc );
+	    exit( 1 );
+	}
+    }
+
+    Accept_Loop( (void *)listensd[ 0 ] );
+
+    return( 0 );
+}
+
+	
+    
+    
+	
+/*
+ * Function definitions.
+ */
+
+
+
+/*++
+ * Function:	Open_Listener
+ *
+ * Purpose:	Create a listen socket and bind it to a local address.
+ *
+ * Parameters:	ptr to the addrinfo to bind to
+ *		int -- nonzero to set SO_REUSEPORT, so that several sockets
+ *		       can share the address
+ *
+ * Returns:	socket descriptor on success
+ *		-1 on failure
+ *--
+ */
+static int Open_Listener( struct addrinfo *ai, int ReusePort )
+{
+    const char *fn = "Open_Listener()";
+    struct linger lingerstruct;        /* for the socket reuse stuff */
+    int flag = 1;                      /* for the socket reuse stuff */
+    int sd;
+
+    sd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+    if ( sd == -1 )
+    {
+	syslog(LOG_WARNING, "%s: socket() failed: %s", fn, strerror(errno));
+	return( -1 );
+    }
+
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (void *)&flag, 
+	       sizeof(flag));
+    lingerstruct.l_onoff = 1;
+    lingerstruct.l_linger = 5;
+    setsockopt(sd, SOL_SOCKET, SO_LINGER, (void *)&lingerstruct, 
+	       sizeof(lingerstruct));
+
+    if ( PC_Struct.send_tcp_keepalives )
+    {
+	lingerstruct.l_onoff = 1;
+	syslog( LOG_INFO, "%s: Enabling SO_KEEPALIVE.", fn );
+	setsockopt( sd, SOL_SOCKET, SO_KEEPALIVE, (void *)&lingerstruct.l_onoff, sizeof lingerstruct.l_onoff );
+    }
+
+#ifdef SO_REUSEPORT
+    if ( ReusePort &&
+	 setsockopt( sd, SOL_SOCKET, SO_REUSEPORT, (void *)&flag, sizeof flag ) < 0 )
+    {
+	syslog( LOG_WARNING, "%s: setsockopt() failed for SO_REUSEPORT: %s", fn, strerror( errno ) );
+	close( sd );
+	return( -1 );
+    }
+#endif
+
+    if ( bind( sd, ai->ai_addr, ai->ai_addrlen ) < 0 )
+    {
+	syslog(LOG_WARNING, "%s: bind() failed: %s", fn, strerror(errno) );
+	close( sd );
+	return( -1 );
+    }
+
+    return( sd );
+}
+
+
+
+/*++
+ * Function:	Accept_Loop
+ *
+ * Purpose:	Accept client connections on one listen socket and hand
+ *		each one off to a HandleRequest() thread, or to the event
+ *		engine.
+ *
+ * Parameters:	listen socket descriptor, cast to a void ptr
+ *
+ * Returns:	never
+ *--
+ */
+static void *Accept_Loop( void *arg )
+{
+    const char *fn = "Accept_Loop()";
+    int listensd = (long)arg;
+    long clientsd;                     /* incoming socket descriptor */
+    socklen_t sockaddrlen;
+    struct sockaddr_storage cliaddr;
+    pthread_t ThreadId;                /* thread id of each incoming conn */
+    pthread_attr_t attr;
+    int rc;
+#ifdef HAVE_LIBWRAP
+    struct request_info r;             /* request struct for libwrap */
+#endif
+
+    rc = pthread_attr_init( &attr );
+    if ( rc == 0 )
+	rc = pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if ( rc )
+    {
+	syslog(LOG_ERR, "%s: pthread_attr setup failed: [%d] -- Exiting.", fn, rc);
+	exit( 1 );
+    }
+
     for ( ;; )
     {
 	/*
@@ -725,8 +884,18 @@ int main( int argc, char *argv[] )
 	 * to initialize sockaddrlen.
 	 */
 	sockaddrlen = sizeof cliaddr;
+#if HAVE_ACCEPT4
+	/*
+	 * The event engine runs its client sockets non-blocking, so let
+	 * accept4() set that up instead of an extra fcntl() per client.
+	 */
+	clientsd = accept4( listensd, (struct sockaddr *)&cliaddr,
+			    &sockaddrlen,
+			    SOCK_CLOEXEC | ( UseEngine ? SOCK_NONBLOCK : 0 ) );
+#else
 	clientsd = accept( listensd, (struct sockaddr *)&cliaddr,
 			   &sockaddrlen );
+#endif
 	if ( clientsd == -1 )
 	{
 	    syslog(LOG_WARNING, "%s: accept() failed: %s -- retrying", 
@@ -748,13 +917,15 @@ int main( int argc, char *argv[] )
 	}
 #endif
 
-	IMAPCount->TotalClientConnectionsAccepted++;
-	IMAPCount->CurrentClientConnections++;
-	
-	if ( IMAPCount->CurrentClientConnections > 
-	     IMAPCount->PeakClientConnections )
-	    IMAPCount->PeakClientConnections = IMAPCount->CurrentClientConnections;
+	COUNT( TotalClientConnectionsAccepted, 1 );
+	COUNT( CurrentClientConnections, 1 );
 	
+	if ( UseEngine )
+	{
+	    Engine_Add_Client( clientsd );
+	    continue;
+	}
+
 	rc = pthread_create( &ThreadId, &attr, (void *)HandleRequest, (void *)clientsd );
 	if (rc != 0) {
 	    syslog(LOG_ERR, "%s: pthread_create() returned error [%d] for HandleRequest.", fn, rc );
@@ -762,15 +933,9 @@ int main( int argc, char *argv[] )
 	}
 	
     }
-}
 
-	
-    
-    
-	
-/*
- * Function definitions.
- */
+    return( NULL );
+}
 
 
 
@@ -824,8 +989,9 @@ static void ServerInit( void )
     syslog( LOG_INFO, "%s: Using '%s' for global protocol logging file.",
 	    fn, PC_Struct.protocol_log_filename );
     
+    /* O_APPEND, so the writer thread carries on at the top after XPROXY_NEWLOG */
     Tracefd = open( PC_Struct.protocol_log_filename,
-		    O_RDWR | O_CREAT | O_TRUNC, 0600 );
+		    O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600 );
     
     if ( Tracefd == -1 )
     {
@@ -854,14 +1020,14 @@ static void ServerInit( void )
      * This number on the number of simultaneous connections we allow.
      * Also allow stdin, stdout, stderr and a few misc pipes and doors.
      */
-    rl.rlim_cur = ( PC_Struct.cache_size * 2 ) + 10;
-    rl.rlim_max = ( PC_Struct.cache_size * 2 ) + 10;
+    rl.rlim_cur = ( PC_Struct.cache_size * FDS_PER_CONN ) + 10;
+    rl.rlim_max = ( PC_Struct.cache_size * FDS_PER_CONN ) + 10;
 
     rc = setrlimit( RLIMIT_NOFILE, &rl );
 
     if ( rc )
     {
-	syslog(LOG_ERR, "%s: setrlimit() failed to set max number of open file descriptors to %d: %s", fn, ( PC_Struct.cache_size * 2 + 10), strerror( errno ) );
+	syslog(LOG_ERR, "%s: setrlimit() failed to set max number of open file descriptors to %d: %s", fn, ( PC_Struct.cache_size * FDS_PER_CONN + 10), strerror( errno ) );
 	exit(1);
     }
     
@@ -1133,6 +1299,11 @@ static int ParseBannerAndCapability( char *DestBuf,
      */
     PC_Struct.support_unselect = UNSELECT_NOT_SUPPORTED;
 
+    /*
+     * ...or CONDSTORE.
+     */
+    PC_Struct.support_condstore = CONDSTORE_NOT_SUPPORTED;
+
     /*
      * initially assume that the server doesn't support STARTTLS.
      */
@@ -1199,6 +1370,15 @@ static int ParseBannerAndCapability( char *DestBuf,
 	    {
 	        PC_Struct.support_unselect = UNSELECT_SUPPORTED;
 	    }
+
+	    /*
+	     * QRESYNC implies CONDSTORE.
+	     */
+	    if ( !strncasecmp( CP, "CONDSTORE", strlen( "CONDSTORE" ) ) ||
+	         !strncasecmp( CP, "QRESYNC", strlen( "QRESYNC" ) ) )
+	    {
+	        PC_Struct.support_condstore = CONDSTORE_SUPPORTED;
+	    }
 	
 	    /*
 	     * If this token happens to be an auth mechanism, we want to
@@ -1348,7 +1528,7 @@ static void SetBannerAndCapability( void )
     
 
     BannerLen = ParseBannerAndCapability( Banner, sizeof Banner - 1,
-					  itd.ReadBuf, BytesRead, 0 );
+					  ITD_LINE( &itd ), BytesRead, 0 );
     
     /*
      * See if the string we got back starts with "* OK" by comparing the
@@ -1398,7 +1578,7 @@ static void SetBannerAndCapability( void )
     }
     
     CapabilityLen = ParseBannerAndCapability( Capability, sizeof Capability - 1,
-					      itd.ReadBuf, BytesRead, 1 );
+					      ITD_LINE( &itd ), BytesRead, 1 );
     
     /* Now read the tagged response and make sure it's OK */
     BytesRead = IMAP_Line_Read( &itd );
@@ -1415,7 +1595,7 @@ static void SetBannerAndCapability( void )
 	exit( 1 );
     }
     
-    if ( strncasecmp( itd.ReadBuf, IMAP_TAGGED_OK, strlen(IMAP_TAGGED_OK) ) )
+    if ( strncasecmp( ITD_LINE( &itd ), IMAP_TAGGED_OK, strlen(IMAP_TAGGED_OK) ) )
     {
 	syslog(LOG_ERR, "%s: Received non-OK tagged reponse from IMAP server on CAPABILITY command -- exiting.", fn );
 	close( itd.conn->sd );
@@ -1431,7 +1611,7 @@ static void SetBannerAndCapability( void )
 #if HAVE_LIBSSL
 	if ( PC_Struct.support_starttls != STARTTLS_NOT_SUPPORTED )
 	{
-	    if ( Attempt_STARTTLS( &itd ) != 0 )
+	    if ( Attempt_STARTTLS( &itd, NULL ) != 0 )
 	    {
 		syslog(LOG_ERR, "%s: STARTTLS failed for CAPABILITY check -- exiting.", fn );
 		close( itd.conn->sd );
@@ -1478,7 +1658,7 @@ static void SetBannerAndCapability( void )
 		}
 
 		CapabilityLen = ParseBannerAndCapability( Capability, sizeof Capability - 1,
-		itd.ReadBuf, BytesRead, 1 );
+		ITD_LINE( &itd ), BytesRead, 1 );
 
 		/* Now read the tagged response and make sure it's OK */
 		BytesRead = IMAP_Line_Read( &itd );
@@ -1495,7 +1675,7 @@ static void SetBannerAndCapability( void )
 		    exit( 1 );
 		}
 
-		if ( strncasecmp( itd.ReadBuf, IMAP_TAGGED_OK, strlen(IMAP_TAGGED_OK) ) )
+		if ( strncasecmp( ITD_LINE( &itd ), IMAP_TAGGED_OK, strlen(IMAP_TAGGED_OK) ) )
 		{
 		    syslog(LOG_ERR, "%s: Received non-OK tagged reponse from imap server on CAPABILITY command -- exiting.", fn );
 		    close( itd.conn->sd );
@@ -0,0 +1,536 @@
+/*
+**
+** Copyright (c) 2010-2016 The SquirrelMail Project Team
+**
+** Licensed under the GNU GPL. For full terms see the file COPYING.
+**
+** This file is part of SquirrelMail IMAP Proxy.
+**
+**  Facility:
+**
+**	metrics.c
+**
+**  Abstract:
+**
+**	A small HTTP server for the metrics_listen_port page: the usage
+**	counters and latency histograms, and the state of each address of
+**	the IMAP server, in the Prometheus text format.
+**
+**	One thread does it all with poll(), so a scrape costs no thread of
+**	its own and a slow scraper holds up nobody but itself.  Every
+**	connection gets one answer and is closed.  The page is built when
+**	it's asked for, from the same numbers pimpstat reads, which the
+**	recycle thread brings up to date once a second.
+**
+**  Authors:
+**
+**      The SquirrelMail Project Team
+**
+**  Version:
+**
+**      $Id$
+**
+**  Modification History:
+**
+**      $Log$
+**
+*/
+
+
+#define _REENTRANT
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "imapproxy.h"
+
+/*
+ * External globals
+ */
+extern ProxyConfig_Struct PC_Struct;
+
+/*
+ * How many scrapes we serve at once and how many more can wait, how long
+ * one gets, and how much of a request we look at.
+ */
+#define METRICS_CLIENTS		8
+#define METRICS_BACKLOG		64
+#define METRICS_TIMEOUT		10
+#define METRICS_REQUEST_LEN	1024
+#define METRICS_PAGE_LEN	65536	/* to start with; it grows */
+
+struct MetricsClient
+{
+    int sd;                             /* -1 if the slot is free */
+    time_t Started;
+    char Request[ METRICS_REQUEST_LEN ];
+    unsigned int RequestLen;
+    struct MetricsPage Reply;           /* empty till the request is in */
+    unsigned int Sent;
+};
+
+/*
+ * Globals private to this file.  Only the metrics thread touches them.
+ */
+static int MetricsSd;
+static struct MetricsClient MetricsClients[ METRICS_CLIENTS ];
+
+/*
+ * internal prototypes
+ */
+static void *Metrics_Loop( void * );
+static void Metrics_Accept( void );
+static void Metrics_Read( struct MetricsClient * );
+static void Metrics_Answer( struct MetricsClient * );
+static void Metrics_Write( struct MetricsClient * );
+static void Metrics_Close( struct MetricsClient * );
+
+
+
+/*++
+ * Function:	Metrics_Init
+ *
+ * Purpose:	Start serving the metrics page.
+ *
+ * Parameters:	int -- the bound metrics listen socket
+ *
+ * Returns:	nada -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The socket is bound by main() with the client listeners,
+ *		while we're still root.
+ *--
+ */
+extern void Metrics_Init( int sd )
+{
+    char *fn = "Metrics_Init()";
+    pthread_attr_t attr;
+    pthread_t ThreadId;
+    unsigned int i;
+    int rc;
+
+    MetricsSd = sd;
+
+    for ( i = 0; i < METRICS_CLIENTS; i++ )
+	MetricsClients[ i ].sd = -1;
+
+    if ( fcntl( sd, F_SETFL, fcntl( sd, F_GETFL, 0 ) | O_NONBLOCK ) < 0 ||
+	 listen( sd, METRICS_BACKLOG ) < 0 )
+    {
+	syslog( LOG_ERR, "%s: unable to listen on the metrics socket: %s -- Exiting.", fn, strerror( errno ) );
+	exit( 1 );
+    }
+
+    rc = pthread_attr_init( &attr );
+    if ( ! rc )
+	rc = pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if ( ! rc )
+	rc = pthread_create( &ThreadId, &attr, Metrics_Loop, NULL );
+    if ( rc )
+    {
+	syslog( LOG_ERR, "%s: pthread_create() returned error [%d] for Metrics_Loop -- Exiting.", fn, rc );
+	exit( 1 );
+    }
+
+    pthread_attr_destroy( &attr );
+
+    syslog( LOG_INFO, "%s: Serving metrics on tcp %s:%s", fn,
+	    PC_Struct.metrics_addr ? PC_Struct.metrics_addr : "127.0.0.1",
+	    PC_Struct.metrics_port );
+}
+
+
+
+/*++
+ * Function:	Metrics_Printf
+ *
+ * Purpose:	Add to a metrics page.
+ *
+ * Parameters:	ptr to the page
+ *		printf() style format, and its arguments
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The page grows as needed.  If it can't, it's marked
+ *		Failed and nothing more is added.
+ *--
+ */
+extern void Metrics_Printf( struct MetricsPage *Page, const char *Format, ... )
+{
+    char *fn = "Metrics_Printf()";
+    va_list ap;
+    unsigned int Size;
+    char *Buf;
+    int Len;
+
+    for ( ;; )
+    {
+	if ( Page->Failed )
+	    return;
+
+	va_start( ap, Format );
+	Len = vsnprintf( Page->Buf + Page->Len, Page->Size - Page->Len,
+			 Format, ap );
+	va_end( ap );
+
+	if ( Len < 0 )
+	{
+	    Page->Failed = 1;
+	    return;
+	}
+
+	if ( Page->Len + Len < Page->Size )
+	{
+	    Page->Len += Len;
+	    return;
+	}
+
+	Size = ( Page->Size ? Page->Size * 2 : METRICS_PAGE_LEN );
+	while ( Size <= Page->Len + Len )
+	    Size *= 2;
+
+	Buf = realloc( Page->Buf, Size );
+	if ( ! Buf )
+	{
+	    syslog( LOG_WARNING, "%s: realloc() failed for a %u byte metrics page: %s", fn, Size, strerror( errno ) );
+	    Page->Failed = 1;
+	    return;
+	}
+
+	Page->Buf = Buf;
+	Page->Size = Size;
+    }
+}
+
+
+
+/*++
+ * Function:	Metrics_Loop
+ *
+ * Purpose:	Serve the metrics page, forever.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	never
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Once all the slots are taken, the listen socket is left
+ *		out of the poll() until one frees up, so new scrapes wait
+ *		in the kernel's queue.
+ *--
+ */
+static void *Metrics_Loop( void *arg )
+{
+    char *fn = "Metrics_Loop()";
+    struct pollfd fds[ METRICS_CLIENTS + 1 ];
+    struct MetricsClient *Slot[ METRICS_CLIENTS + 1 ];
+    struct MetricsClient *MC;
+    unsigned int nfds;
+    unsigned int Free;
+    unsigned int i;
+    time_t Now;
+
+    for ( ;; )
+    {
+	nfds = 0;
+	Free = 0;
+	Now = time( 0 );
+
+	for ( i = 0; i < METRICS_CLIENTS; i++ )
+	{
+	    MC = &MetricsClients[ i ];
+
+	    if ( MC->sd == -1 )
+	    {
+		Free++;
+		continue;
+	    }
+
+	    if ( Now - MC->Started > METRICS_TIMEOUT )
+	    {
+		Metrics_Close( MC );
+		Free++;
+		continue;
+	    }
+
+	    fds[ nfds ].fd = MC->sd;
+	    fds[ nfds ].events = ( MC->Reply.Buf ? POLLOUT : POLLIN );
+	    fds[ nfds ].revents = 0;
+	    Slot[ nfds++ ] = MC;
+	}
+
+	if ( Free )
+	{
+	    fds[ nfds ].fd = MetricsSd;
+	    fds[ nfds ].events = POLLIN;
+	    fds[ nfds ].revents = 0;
+	    Slot[ nfds++ ] = NULL;
+	}
+
+	if ( poll( fds, nfds, 1000 ) < 0 )
+	{
+	    if ( errno != EINTR )
+	    {
+		syslog( LOG_WARNING, "%s: poll() failed: %s", fn, strerror( errno ) );
+		sleep( 1 );
+	    }
+	    continue;
+	}
+
+	for ( i = 0; i < nfds; i++ )
+	{
+	    if ( ! fds[ i ].revents )
+		continue;
+
+	    if ( ! Slot[ i ] )
+		Metrics_Accept();
+	    else if ( Slot[ i ]->Reply.Buf )
+		Metrics_Write( Slot[ i ] );
+	    else
+		Metrics_Read( Slot[ i ] );
+	}
+    }
+
+    return( NULL );
+}
+
+
+
+/*++
+ * Function:	Metrics_Accept
+ *
+ * Purpose:	Take new scrapes, as many as there are free slots for.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Metrics_Accept( void )
+{
+    char *fn = "Metrics_Accept()";
+    struct MetricsClient *MC;
+    unsigned int i;
+    int sd;
+
+    for ( i = 0; i < METRICS_CLIENTS; i++ )
+    {
+	MC = &MetricsClients[ i ];
+	if ( MC->sd != -1 )
+	    continue;
+
+	sd = accept( MetricsSd, NULL, NULL );
+	if ( sd == -1 )
+	{
+	    if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+		syslog( LOG_WARNING, "%s: accept() failed: %s", fn, strerror( errno ) );
+	    return;
+	}
+
+	if ( fcntl( sd, F_SETFL, fcntl( sd, F_GETFL, 0 ) | O_NONBLOCK ) < 0 )
+	{
+	    close( sd );
+	    continue;
+	}
+
+	memset( MC, 0, sizeof *MC );
+	MC->sd = sd;
+	MC->Started = time( 0 );
+    }
+}
+
+
+
+/*++
+ * Function:	Metrics_Read
+ *
+ * Purpose:	Read what there is of a request, and answer it once it's
+ *		all in.
+ *
+ * Parameters:	ptr to the client
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	A request too long for the buffer is answered on what
+ *		fits; only the request line matters.
+ *--
+ */
+static void Metrics_Read( struct MetricsClient *MC )
+{
+    int Len;
+
+    Len = recv( MC->sd, MC->Request + MC->RequestLen,
+		sizeof MC->Request - 1 - MC->RequestLen, 0 );
+
+    if ( Len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+	return;
+
+    if ( Len <= 0 )
+    {
+	Metrics_Close( MC );
+	return;
+    }
+
+    MC->RequestLen += Len;
+    MC->Request[ MC->RequestLen ] = '\0';
+
+    if ( strstr( MC->Request, "\r\n\r\n" ) || strstr( MC->Request, "\n\n" ) ||
+	 MC->RequestLen == sizeof MC->Request - 1 )
+	Metrics_Answer( MC );
+}
+
+
+
+/*++
+ * Function:	Metrics_Answer
+ *
+ * Purpose:	Build the reply to a request.
+ *
+ * Parameters:	ptr to the client, with the request read
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	GET /metrics (or /) gets the page, anything else an error.
+ *		The body is built first, into its own page, so the header
+ *		can give its length.
+ *--
+ */
+static void Metrics_Answer( struct MetricsClient *MC )
+{
+    struct MetricsPage Body;
+    char *Status = "200 OK";
+
+    memset( &Body, 0, sizeof Body );
+
+    if ( strncmp( MC->Request, "GET ", 4 ) )
+    {
+	Status = "405 Method Not Allowed";
+	Metrics_Printf( &Body, "Only GET is supported.\n" );
+    }
+    else if ( strncmp( MC->Request + 4, "/metrics ", 9 ) &&
+	      strncmp( MC->Request + 4, "/ ", 2 ) )
+    {
+	Status = "404 Not Found";
+	Metrics_Printf( &Body, "Try /metrics.\n" );
+    }
+    else
+    {
+	Counter_Metrics( &Body );
+	Backend_Metrics( &Body );
+	Select_Metrics( &Body );
+    }
+
+    if ( Body.Failed )
+    {
+	Status = "500 Internal Server Error";
+	Body.Len = 0;
+    }
+
+    Metrics_Printf( &MC->Reply, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: %u\r\nConnection: close\r\n\r\n%.*s",
+		    Status, Body.Len, (int)Body.Len, Body.Buf ? Body.Buf : "" );
+
+    free( Body.Buf );
+
+    if ( MC->Reply.Failed )
+	Metrics_Close( MC );
+}
+
+
+
+/*++
+ * Function:	Metrics_Write
+ *
+ * Purpose:	Send what the socket will take of a reply, and close the
+ *		connection when it's all gone.
+ *
+ * Parameters:	ptr to the client
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Metrics_Write( struct MetricsClient *MC )
+{
+    int Len;
+
+    Len = send( MC->sd, MC->Reply.Buf + MC->Sent, MC->Reply.Len - MC->Sent,
+		MSG_NOSIGNAL );
+
+    if ( Len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+	return;
+
+    if ( Len < 0 )
+    {
+	Metrics_Close( MC );
+	return;
+    }
+
+    MC->Sent += Len;
+
+    if ( MC->Sent == MC->Reply.Len )
+	Metrics_Close( MC );
+}
+
+
+
+/*++
+ * Function:	Metrics_Close
+ *
+ * Purpose:	Be done with a client and free its slot.
+ *
+ * Parameters:	ptr to the client
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Metrics_Close( struct MetricsClient *MC )
+{
+    close( MC->sd );
+    free( MC->Reply.Buf );
+    memset( MC, 0, sizeof *MC );
+    MC->sd = -1;
+}
+
+
+/*
+ *                            _________
+ *                           /        |
+ *                          /         |
+ *                         /    ______|
+ *                        /    /       ________
+ *                       |    |        |      /
+ *                       |    |        |_____/
+ *                       |    |        ______
+ *                       |    |        |     \
+ *                       |    |        |______\
+ *                        \    \_______
+ *                         \           |
+ *                          \          |
+ *                           \_________|
+ */
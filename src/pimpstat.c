@@ -87,10 +87,23 @@ extern WINDOW *stdscr;
 static void Exit( int );
 static void Handler();
 static void Usage( void );
+static void Stat_Open( char * );
+static struct IMAPStatField *Stat_Field( unsigned int );
+static struct IMAPStatHistogram *Stat_Histogram( unsigned int );
+static unsigned long long Stat_Read( unsigned int, unsigned int );
+static unsigned long Stat_Value( char * );
+static unsigned int Latency_Count( struct IMAPStatHistogram * );
+static double Latency_Percentile( struct IMAPStatHistogram *, unsigned int, double );
+static void Print_JSON( void );
+static void Print_Prometheus( void );
 
 
 ProxyConfig_Struct PC_Struct;
 
+static char *StatMap;                  /* the stat file, mapped */
+static struct IMAPStatHeader *StatHeader;
+static unsigned int StatSize;          /* how much of it is mapped */
+
 
 /*++
  * Function:	Exit
@@ -138,8 +151,7 @@ static void Handler()
 
 int main( int argc, char *argv[] )
 {
-    IMAPCounter_Struct *IMAPCount;
-    int fd;
+    struct IMAPStatHistogram *Histogram;
     char *fn = "pimpstat";
     int i, command;
     char ccc[DIGITS+1];  /* current client conns */
@@ -152,13 +164,26 @@ int main( int argc, char *argv[] )
     char tcl[DIGITS+1];  /* total client logins */
     char tscc[DIGITS+1]; /* total server conns created */
     char tscr[DIGITS+1]; /* total server conns reused */
+    char tsce[DIGITS+1]; /* total server conns evicted */
     char ssrr[DIGITS+4]; /* server socket reuse ration */
     char tsch[DIGITS+1]; /* total select cache hits */
     char tscm[DIGITS+1]; /* total select cache misses */
+    char icb[DIGITS+1];  /* ICC hash chains */
+    char icu[DIGITS+1];  /* ICC hash chains in use */
+    char icl[DIGITS+1];  /* longest ICC hash chain */
+    char ice[DIGITS+1];  /* ICC user pools */
+    char tsph[DIGITS+1]; /* total spare connection hits */
+    char tspm[DIGITS+1]; /* total spare connection misses */
+    char ttsr[DIGITS+1]; /* total TLS sessions resumed */
+    char ttfh[DIGITS+1]; /* total full TLS handshakes */
+    char lat[64];        /* one latency row */
+    unsigned int Count;
     float Ratio;
     char stimebuf[64];
     char ctimebuf[64];
     char *CP;
+    time_t StartTime;
+    time_t CountTime;
     extern char *optarg;
     extern int optind;
     char ConfigFile[ MAXPATHLEN ];
@@ -169,7 +194,7 @@ int main( int argc, char *argv[] )
     
     command = 0;
     
-    while (( i = getopt( argc, argv, "f:ch" ) ) != EOF )
+    while (( i = getopt( argc, argv, "f:chjp" ) ) != EOF )
     {
 	
         switch( i )
@@ -185,6 +210,16 @@ int main( int argc, char *argv[] )
 	    command=1;
 	    break;
 	    
+	case 'j':
+	    /* JSON, for scripts */
+	    command=2;
+	    break;
+	    
+	case 'p':
+	    /* Prometheus text exposition format */
+	    command=3;
+	    break;
+	    
         case 'h':
             Usage();
             exit( 0 );
@@ -206,23 +241,7 @@ int main( int argc, char *argv[] )
 
     SetConfigOptions( ConfigFile );
         
-    fd = open( PC_Struct.stat_filename, O_RDONLY );
-    if ( fd == -1 )
-    {
-        printf("%s: open() failed for '%s': %s -- Exiting.\n", fn, 
-               PC_Struct.stat_filename, strerror( errno ) ); 
-        exit( 1 );
-    }
-    
-
-    IMAPCount = ( IMAPCounter_Struct *)mmap( 0, sizeof( IMAPCounter_Struct ),
-                                             PROT_READ, MAP_SHARED, fd, 0 );
-    
-    if ( IMAPCount == MAP_FAILED )
-    {
-        printf("%s: mmap() failed: %s -- Exiting.\n", fn, strerror( errno ) );
-        exit( 1 );
-    }
+    Stat_Open( PC_Struct.stat_filename );
     
 
     if ( command == 0 )
@@ -253,6 +272,7 @@ int main( int argc, char *argv[] )
 	mvaddstr( 21, 5, "server connections created:" );
 	mvaddstr( 22, 5, "server connection reuses:" );
 	mvaddstr( 23, 5, "client login to server login ratio:" );
+	mvaddstr( 24, 5, "cached connections evicted:" );
 	if ( PC_Struct.enable_select_cache )
 	{
 	    mvaddstr( 25, 2, "SELECT CACHE TOTALS" );
@@ -264,7 +284,34 @@ int main( int argc, char *argv[] )
 	    mvaddstr( 25, 2, "SELECT CACHE NOT ENABLED" );
 	}
 	
-	mvaddstr( 29, 2, "CTRL-C to quit." );
+	mvaddstr( 29, 2, "CONNECTION CACHE HASH CHAINS" );
+	mvaddstr( 31, 5, "chains:" );
+	mvaddstr( 31, 40, "in use:" );
+	mvaddstr( 32, 7, "pools:" );
+	mvaddstr( 32, 40, "longest:" );
+	
+	mvaddstr( 34, 2, "NEW SERVER CONNECTIONS" );
+	if ( PC_Struct.spare_server_connections )
+	{
+	    mvaddstr( 36, 5, "spare hit:" );
+	    mvaddstr( 36, 40, "spare miss:" );
+	}
+	else
+	{
+	    mvaddstr( 36, 5, "spare connections not enabled" );
+	}
+	mvaddstr( 37, 5, "tls resumed:" );
+	mvaddstr( 37, 40, "tls full:" );
+	
+	mvaddstr( 39, 2, "LATENCY (ms)" );
+	mvaddstr( 39, 24, "count" );
+	mvaddstr( 39, 36, "p50" );
+	mvaddstr( 39, 46, "p90" );
+	mvaddstr( 39, 56, "p99" );
+	for ( i = 0; ( Histogram = Stat_Histogram( i ) ); i++ )
+	    mvaddnstr( 41 + i, 5, Histogram->Name, 14 );
+	
+	mvaddstr( 42 + i, 2, "CTRL-C to quit." );
 	
 	for ( ; ; )
 	{
@@ -275,14 +322,14 @@ int main( int argc, char *argv[] )
 	     * I'd guess there's a printf equivalent in curses, but I dunno.
 	     */
 	    
-	    if ( IMAPCount->TotalServerConnectionsCreated == 0 )
+	    if ( Stat_Value( "server_connections_created_total" ) == 0 )
 	    {
 		snprintf( ssrr, DIGITS + 3, "          N/A" );
 	    }
 	    else
 	    {
-		Ratio = (float)IMAPCount->TotalClientLogins /
-		    (float)IMAPCount->TotalServerConnectionsCreated;
+		Ratio = (float)Stat_Value( "client_logins_total" ) /
+		    (float)Stat_Value( "server_connections_created_total" );
 		snprintf( ssrr, DIGITS + 3, "%9.2f : 1", Ratio );
 	    }
 	    
@@ -293,10 +340,10 @@ int main( int argc, char *argv[] )
 	     * copy ctime's strings into my own buffers and get rid of the
 	     * \n.
 	     */
-	    strncpy( stimebuf, ctime( &IMAPCount->StartTime ),
-		     sizeof stimebuf - 1 );
-	    strncpy( ctimebuf, ctime( &IMAPCount->CountTime ),
-		     sizeof ctimebuf - 1 );
+	    StartTime = Stat_Value( "start_time_seconds" );
+	    CountTime = Stat_Value( "count_time_seconds" );
+	    strncpy( stimebuf, ctime( &StartTime ), sizeof stimebuf - 1 );
+	    strncpy( ctimebuf, ctime( &CountTime ), sizeof ctimebuf - 1 );
 	    
 	    CP = strrchr( stimebuf, '\n' );
 	    if (CP)
@@ -306,18 +353,27 @@ int main( int argc, char *argv[] )
 	    if (CP)
 		*CP ='\0';
 	    
-	    snprintf( ccc, DIGITS, "%9d", IMAPCount->CurrentClientConnections );
-	    snprintf( pcc, DIGITS, "%9d", IMAPCount->PeakClientConnections );
-	    snprintf( asc, DIGITS, "%9d", IMAPCount->InUseServerConnections );
-	    snprintf( psc, DIGITS, "%9d", IMAPCount->PeakInUseServerConnections );
-	    snprintf( rsc, DIGITS, "%9d", IMAPCount->RetainedServerConnections );
-	    snprintf( prsc, DIGITS, "%9d", IMAPCount->PeakRetainedServerConnections );
-	    snprintf( tcca, DIGITS, "%9d", IMAPCount->TotalClientConnectionsAccepted );
-	    snprintf( tcl, DIGITS, "%9d", IMAPCount->TotalClientLogins );
-	    snprintf( tscr, DIGITS, "%9d", IMAPCount->TotalServerConnectionsReused );
-	    snprintf( tscc, DIGITS, "%9d", IMAPCount->TotalServerConnectionsCreated );
-	    snprintf( tsch, DIGITS, "%9d", IMAPCount->SelectCacheHits );
-	    snprintf( tscm, DIGITS, "%9d", IMAPCount->SelectCacheMisses );
+	    snprintf( ccc, DIGITS, "%9lu", Stat_Value( "client_connections" ) );
+	    snprintf( pcc, DIGITS, "%9lu", Stat_Value( "client_connections_peak" ) );
+	    snprintf( asc, DIGITS, "%9lu", Stat_Value( "server_connections_in_use" ) );
+	    snprintf( psc, DIGITS, "%9lu", Stat_Value( "server_connections_in_use_peak" ) );
+	    snprintf( rsc, DIGITS, "%9lu", Stat_Value( "server_connections_cached" ) );
+	    snprintf( prsc, DIGITS, "%9lu", Stat_Value( "server_connections_cached_peak" ) );
+	    snprintf( tcca, DIGITS, "%9lu", Stat_Value( "client_connections_accepted_total" ) );
+	    snprintf( tcl, DIGITS, "%9lu", Stat_Value( "client_logins_total" ) );
+	    snprintf( tscr, DIGITS, "%9lu", Stat_Value( "server_connections_reused_total" ) );
+	    snprintf( tscc, DIGITS, "%9lu", Stat_Value( "server_connections_created_total" ) );
+	    snprintf( tsce, DIGITS, "%9lu", Stat_Value( "server_connections_evicted_total" ) );
+	    snprintf( tsch, DIGITS, "%9lu", Stat_Value( "select_cache_hits_total" ) );
+	    snprintf( tscm, DIGITS, "%9lu", Stat_Value( "select_cache_misses_total" ) );
+	    snprintf( icb, DIGITS, "%9lu", Stat_Value( "icc_hash_chains" ) );
+	    snprintf( icu, DIGITS, "%9lu", Stat_Value( "icc_hash_chains_in_use" ) );
+	    snprintf( icl, DIGITS, "%9lu", Stat_Value( "icc_longest_chain" ) );
+	    snprintf( ice, DIGITS, "%9lu", Stat_Value( "icc_user_pools" ) );
+	    snprintf( tsph, DIGITS, "%9lu", Stat_Value( "spare_connection_hits_total" ) );
+	    snprintf( tspm, DIGITS, "%9lu", Stat_Value( "spare_connection_misses_total" ) );
+	    snprintf( ttsr, DIGITS, "%9lu", Stat_Value( "tls_sessions_resumed_total" ) );
+	    snprintf( ttfh, DIGITS, "%9lu", Stat_Value( "tls_full_handshakes_total" ) );
 	    
 	    mvaddstr( 2, 31, stimebuf );
 	    mvaddstr( 3, 31, ctimebuf );
@@ -332,11 +388,33 @@ int main( int argc, char *argv[] )
 	    mvaddstr( 21, 46, tscc );
 	    mvaddstr( 22, 46, tscr );
 	    mvaddstr( 23, 42, ssrr );
+	    mvaddstr( 24, 46, tsce );
 	    if ( PC_Struct.enable_select_cache )
 	    {
 		mvaddstr( 27, 14, tsch );
 		mvaddstr( 27, 46, tscm );
 	    }
+	    mvaddstr( 31, 14, icb );
+	    mvaddstr( 31, 48, icu );
+	    mvaddstr( 32, 14, ice );
+	    mvaddstr( 32, 48, icl );
+	    if ( PC_Struct.spare_server_connections )
+	    {
+		mvaddstr( 36, 18, tsph );
+		mvaddstr( 36, 52, tspm );
+	    }
+	    mvaddstr( 37, 18, ttsr );
+	    mvaddstr( 37, 52, ttfh );
+	    
+	    for ( i = 0; ( Histogram = Stat_Histogram( i ) ); i++ )
+	    {
+		Count = Latency_Count( Histogram );
+		snprintf( lat, sizeof lat, "%9u %9.1f %9.1f %9.1f", Count,
+			  Latency_Percentile( Histogram, Count, 0.50 ),
+			  Latency_Percentile( Histogram, Count, 0.90 ),
+			  Latency_Percentile( Histogram, Count, 0.99 ) );
+		mvaddstr( 41 + i, 20, lat );
+	    }
 	    
 	    refresh();
 	    
@@ -344,23 +422,52 @@ int main( int argc, char *argv[] )
 	}
 	
     }
+    else if ( command == 2 )
+    {
+	Print_JSON();
+	exit( 0 );
+    }
+    else if ( command == 3 )
+    {
+	Print_Prometheus();
+	exit( 0 );
+    }
     else
     {
 	/*
 	 * We only get here if command is non-zero.
 	 */
-	printf( " %d Current Client Connections\n %d Peak Client Connections\n %d In Use Connections\n %d Peak In Use Connections\n %d Retained Server Connections\n %d Peak Retained Server Connections\n %d Total Client Connections\n %d Total Client Logins\n %d Total Reused Connections\n %d Total Created Connections\n %d Cache Hits\n %d Cache Misses\n", IMAPCount->CurrentClientConnections,
-		IMAPCount->PeakClientConnections, 
-		IMAPCount->InUseServerConnections,
-		IMAPCount->PeakInUseServerConnections,
-		IMAPCount->RetainedServerConnections,
-		IMAPCount->PeakRetainedServerConnections,
-		IMAPCount->TotalClientConnectionsAccepted,
-		IMAPCount->TotalClientLogins,
-		IMAPCount->TotalServerConnectionsReused,
-		IMAPCount->TotalServerConnectionsCreated, 
-		IMAPCount->SelectCacheHits,
-		IMAPCount->SelectCacheMisses );
+	printf( " %lu Current Client Connections\n %lu Peak Client Connections\n %lu In Use Connections\n %lu Peak In Use Connections\n %lu Retained Server Connections\n %lu Peak Retained Server Connections\n %lu Total Client Connections\n %lu Total Client Logins\n %lu Total Reused Connections\n %lu Total Created Connections\n %lu Total Evicted Connections\n %lu Cache Hits\n %lu Cache Misses\n %lu ICC Hash Chains\n %lu ICC Hash Chains In Use\n %lu Longest ICC Hash Chain\n %lu ICC User Pools\n %lu Spare Connection Hits\n %lu Spare Connection Misses\n %lu TLS Sessions Resumed\n %lu Full TLS Handshakes\n", Stat_Value( "client_connections" ),
+		Stat_Value( "client_connections_peak" ), 
+		Stat_Value( "server_connections_in_use" ),
+		Stat_Value( "server_connections_in_use_peak" ),
+		Stat_Value( "server_connections_cached" ),
+		Stat_Value( "server_connections_cached_peak" ),
+		Stat_Value( "client_connections_accepted_total" ),
+		Stat_Value( "client_logins_total" ),
+		Stat_Value( "server_connections_reused_total" ),
+		Stat_Value( "server_connections_created_total" ), 
+		Stat_Value( "server_connections_evicted_total" ),
+		Stat_Value( "select_cache_hits_total" ),
+		Stat_Value( "select_cache_misses_total" ),
+		Stat_Value( "icc_hash_chains" ),
+		Stat_Value( "icc_hash_chains_in_use" ),
+		Stat_Value( "icc_longest_chain" ),
+		Stat_Value( "icc_user_pools" ),
+		Stat_Value( "spare_connection_hits_total" ),
+		Stat_Value( "spare_connection_misses_total" ),
+		Stat_Value( "tls_sessions_resumed_total" ),
+		Stat_Value( "tls_full_handshakes_total" ) );
+
+	for ( i = 0; ( Histogram = Stat_Histogram( i ) ); i++ )
+	{
+	    Count = Latency_Count( Histogram );
+	    printf( " %u %.*s latency samples (ms): p50 %.1f p90 %.1f p99 %.1f\n",
+		    Count, STAT_NAME_LEN, Histogram->Name,
+		    Latency_Percentile( Histogram, Count, 0.50 ),
+		    Latency_Percentile( Histogram, Count, 0.90 ),
+		    Latency_Percentile( Histogram, Count, 0.99 ) );
+	}
 
 	exit( 0 );
     }
@@ -384,12 +491,430 @@ int main( int argc, char *argv[] )
  */
 void Usage( void )
 {
-    printf( "Usage: pimpstat [-f config filename] [-h] [-c]\n" );
+    printf( "Usage: pimpstat [-f config filename] [-h] [-c | -j | -p]\n" );
     printf( " -c is for simple command line output format instead of curses.\n" );
+    printf( " -j prints the counters and latency histograms as JSON.\n" );
+    printf( " -p prints them in the Prometheus text exposition format.\n" );
     
     return;
 }
 
+
+
+/*++
+ * Function:	Stat_Open
+ *
+ * Purpose:	Map the stat file and make sure it's one we can read.
+ *
+ * Parameters:	char ptr -- the stat file name
+ *
+ * Returns:	nada -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The tables are checked against the size of the file here,
+ *		the offsets in them as they're used.
+ *--
+ */
+static void Stat_Open( char *Filename )
+{
+    char *fn = "pimpstat";
+    struct stat st;
+    struct IMAPStatHeader *H;
+    int fd;
+
+    fd = open( Filename, O_RDONLY );
+    if ( fd == -1 )
+    {
+        printf("%s: open() failed for '%s': %s -- Exiting.\n", fn,
+               Filename, strerror( errno ) );
+        exit( 1 );
+    }
+
+    if ( fstat( fd, &st ) == -1 )
+    {
+        printf("%s: fstat() failed for '%s': %s -- Exiting.\n", fn,
+               Filename, strerror( errno ) );
+        exit( 1 );
+    }
+
+    if ( st.st_size < (off_t)sizeof ( struct IMAPStatHeader ) )
+    {
+	printf("%s: '%s' is too short to be a stat file -- Exiting.\n", fn,
+	       Filename );
+	exit( 1 );
+    }
+
+    StatSize = st.st_size;
+    StatMap = mmap( 0, StatSize, PROT_READ, MAP_SHARED, fd, 0 );
+
+    if ( StatMap == MAP_FAILED )
+    {
+        printf("%s: mmap() failed: %s -- Exiting.\n", fn, strerror( errno ) );
+        exit( 1 );
+    }
+
+    close( fd );
+
+    H = StatHeader = (struct IMAPStatHeader *)StatMap;
+
+    if ( memcmp( H->Magic, STAT_MAGIC, sizeof H->Magic ) )
+    {
+	printf("%s: '%s' is not a stat file, or was written by an older proxy -- Exiting.\n", fn, Filename );
+	exit( 1 );
+    }
+
+    if ( H->Version != STAT_VERSION )
+    {
+	printf("%s: '%s' is a version %u stat file, and this pimpstat reads version %d -- Exiting.\n", fn, Filename, H->Version, STAT_VERSION );
+	exit( 1 );
+    }
+
+    if ( H->FileSize > StatSize ||
+	 H->FieldSize < sizeof ( struct IMAPStatField ) ||
+	 H->HistogramSize < sizeof ( struct IMAPStatHistogram ) ||
+	 H->FieldOffset > H->FileSize ||
+	 H->FieldCount > ( H->FileSize - H->FieldOffset ) / H->FieldSize ||
+	 H->HistogramOffset > H->FileSize ||
+	 H->HistogramCount > ( H->FileSize - H->HistogramOffset ) / H->HistogramSize ||
+	 H->BucketOffset > H->FileSize ||
+	 H->BucketCount > ( H->FileSize - H->BucketOffset ) / sizeof ( unsigned int ) )
+    {
+	printf("%s: '%s' is damaged -- Exiting.\n", fn, Filename );
+	exit( 1 );
+    }
+
+    return;
+}
+
+
+
+/*++
+ * Function:	Stat_Field
+ *
+ * Purpose:	Find a counter's description in the stat file.
+ *
+ * Parameters:	unsigned int -- which one
+ *
+ * Returns:	ptr to it, or NULL past the last one
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:
+ *--
+ */
+static struct IMAPStatField *Stat_Field( unsigned int i )
+{
+    if ( i >= StatHeader->FieldCount )
+	return( NULL );
+
+    return( (struct IMAPStatField *)( StatMap + StatHeader->FieldOffset +
+				       i * StatHeader->FieldSize ) );
+}
+
+
+
+/*++
+ * Function:	Stat_Histogram
+ *
+ * Purpose:	Find a latency histogram's description in the stat file.
+ *
+ * Parameters:	unsigned int -- which one
+ *
+ * Returns:	ptr to it, or NULL past the last one
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:
+ *--
+ */
+static struct IMAPStatHistogram *Stat_Histogram( unsigned int i )
+{
+    if ( i >= StatHeader->HistogramCount )
+	return( NULL );
+
+    return( (struct IMAPStatHistogram *)( StatMap + StatHeader->HistogramOffset +
+					   i * StatHeader->HistogramSize ) );
+}
+
+
+
+/*++
+ * Function:	Stat_Read
+ *
+ * Purpose:	Read a number out of the stat file.
+ *
+ * Parameters:	unsigned int -- offset from the start of the file
+ *		unsigned int -- its size, 4 or 8 bytes
+ *
+ * Returns:	the number, or 0 if it isn't in the file
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:
+ *--
+ */
+static unsigned long long Stat_Read( unsigned int Offset, unsigned int Size )
+{
+    unsigned int Value32;
+    unsigned long long Value64;
+
+    if ( Offset > StatHeader->FileSize || Size > StatHeader->FileSize - Offset )
+	return( 0 );
+
+    if ( Size == sizeof Value32 )
+    {
+	memcpy( &Value32, StatMap + Offset, sizeof Value32 );
+	return( Value32 );
+    }
+
+    if ( Size == sizeof Value64 )
+    {
+	memcpy( &Value64, StatMap + Offset, sizeof Value64 );
+	return( Value64 );
+    }
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Stat_Value
+ *
+ * Purpose:	Look up a counter by name.
+ *
+ * Parameters:	char ptr -- its name
+ *
+ * Returns:	the count, or 0 if the proxy doesn't keep it
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:
+ *--
+ */
+static unsigned long Stat_Value( char *Name )
+{
+    struct IMAPStatField *Field;
+    unsigned int i;
+
+    for ( i = 0; ( Field = Stat_Field( i ) ); i++ )
+    {
+	if ( ! strncmp( Field->Name, Name, STAT_NAME_LEN ) )
+	    return( (unsigned long)Stat_Read( Field->Offset, Field->Size ) );
+    }
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Latency_Count
+ *
+ * Purpose:	Add up the samples in one latency histogram.
+ *
+ * Parameters:	ptr to the histogram
+ *
+ * Returns:	the number of samples
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:
+ *--
+ */
+static unsigned int Latency_Count( struct IMAPStatHistogram *Histogram )
+{
+    unsigned int Count = 0;
+    unsigned int i;
+
+    for ( i = 0; i < StatHeader->BucketCount; i++ )
+	Count += Stat_Read( Histogram->Offset + i * sizeof ( unsigned int ),
+			    sizeof ( unsigned int ) );
+
+    return( Count );
+}
+
+
+
+/*++
+ * Function:	Latency_Percentile
+ *
+ * Purpose:	Estimate a percentile from a latency histogram.
+ *
+ * Parameters:	ptr to the histogram
+ *		unsigned int -- the number of samples in it
+ *		double -- the fraction wanted, 0.99 for p99
+ *
+ * Returns:	the percentile in milliseconds, 0 if there are no samples
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The answer is the upper edge of the bucket the sample
+ *		falls in, so it can be up to a quarter too high.
+ *--
+ */
+static double Latency_Percentile( struct IMAPStatHistogram *Histogram,
+				  unsigned int Count, double Fraction )
+{
+    double Want;
+    unsigned int Seen = 0;
+    unsigned int i;
+
+    if ( ! Count || ! StatHeader->BucketCount )
+	return( 0.0 );
+
+    Want = Fraction * Count;
+
+    for ( i = 0; i < StatHeader->BucketCount - 1; i++ )
+    {
+	Seen += Stat_Read( Histogram->Offset + i * sizeof ( unsigned int ),
+			   sizeof ( unsigned int ) );
+	if ( Seen >= Want )
+	    break;
+    }
+
+    /* the last bucket has no upper edge, so go by its lower one */
+    if ( i < StatHeader->BucketCount - 1 )
+	i++;
+
+    return( Stat_Read( StatHeader->BucketOffset + i * sizeof ( unsigned int ),
+		       sizeof ( unsigned int ) ) / 1000.0 );
+}
+
+
+
+/*++
+ * Function:	Print_JSON
+ *
+ * Purpose:	Print everything in the stat file as one JSON object.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Histogram buckets are keyed by their lower bound in
+ *		microseconds, and only the ones with samples are listed.
+ *		The names in the stat file are plain identifiers, so they
+ *		need no quoting.
+ *--
+ */
+static void Print_JSON( void )
+{
+    struct IMAPStatField *Field;
+    struct IMAPStatHistogram *Histogram;
+    unsigned int i, j;
+    unsigned int Count, Samples;
+    char *Sep;
+
+    printf( "{\n  \"version\": %u,\n  \"counters\": {", StatHeader->Version );
+
+    for ( i = 0; ( Field = Stat_Field( i ) ); i++ )
+	printf( "%s\n    \"%.*s\": %llu", i ? "," : "", STAT_NAME_LEN,
+		Field->Name, Stat_Read( Field->Offset, Field->Size ) );
+
+    printf( "\n  },\n  \"latency\": {" );
+
+    for ( i = 0; ( Histogram = Stat_Histogram( i ) ); i++ )
+    {
+	Count = Latency_Count( Histogram );
+
+	printf( "%s\n    \"%.*s\": {\n      \"count\": %u,\n      \"sum_us\": %llu,\n      \"p50_ms\": %.3f,\n      \"p90_ms\": %.3f,\n      \"p99_ms\": %.3f,\n      \"buckets\": {",
+		i ? "," : "", STAT_NAME_LEN, Histogram->Name, Count,
+		Stat_Read( Histogram->SumOffset, 8 ),
+		Latency_Percentile( Histogram, Count, 0.50 ),
+		Latency_Percentile( Histogram, Count, 0.90 ),
+		Latency_Percentile( Histogram, Count, 0.99 ) );
+
+	Sep = "";
+	for ( j = 0; j < StatHeader->BucketCount; j++ )
+	{
+	    Samples = Stat_Read( Histogram->Offset + j * sizeof ( unsigned int ),
+				 sizeof ( unsigned int ) );
+	    if ( ! Samples )
+		continue;
+
+	    printf( "%s \"%llu\": %u", Sep,
+		    Stat_Read( StatHeader->BucketOffset + j * sizeof ( unsigned int ),
+			       sizeof ( unsigned int ) ), Samples );
+	    Sep = ",";
+	}
+
+	printf( " }\n    }" );
+    }
+
+    printf( "\n  }\n}\n" );
+}
+
+
+
+/*++
+ * Function:	Print_Prometheus
+ *
+ * Purpose:	Print everything in the stat file in the Prometheus text
+ *		exposition format.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Every metric is prefixed with "imapproxy_".  The latency
+ *		histograms are in seconds, with one "le" bucket for the
+ *		upper edge of each of ours.
+ *--
+ */
+static void Print_Prometheus( void )
+{
+    struct IMAPStatField *Field;
+    struct IMAPStatHistogram *Histogram;
+    unsigned int i, j;
+    unsigned long long Seen;
+
+    for ( i = 0; ( Field = Stat_Field( i ) ); i++ )
+    {
+	printf( "# HELP imapproxy_%.*s %.*s\n", STAT_NAME_LEN, Field->Name,
+		STAT_HELP_LEN, Field->Help );
+	printf( "# TYPE imapproxy_%.*s %s\n", STAT_NAME_LEN, Field->Name,
+		Field->Type == STAT_COUNTER ? "counter" : "gauge" );
+	printf( "imapproxy_%.*s %llu\n", STAT_NAME_LEN, Field->Name,
+		Stat_Read( Field->Offset, Field->Size ) );
+    }
+
+    for ( i = 0; ( Histogram = Stat_Histogram( i ) ); i++ )
+    {
+	printf( "# HELP imapproxy_%.*s_latency_seconds %.*s\n",
+		STAT_NAME_LEN, Histogram->Name, STAT_HELP_LEN, Histogram->Help );
+	printf( "# TYPE imapproxy_%.*s_latency_seconds histogram\n",
+		STAT_NAME_LEN, Histogram->Name );
+
+	Seen = 0;
+	for ( j = 0; j < StatHeader->BucketCount; j++ )
+	{
+	    Seen += Stat_Read( Histogram->Offset + j * sizeof ( unsigned int ),
+			       sizeof ( unsigned int ) );
+
+	    if ( j + 1 < StatHeader->BucketCount )
+		printf( "imapproxy_%.*s_latency_seconds_bucket{le=\"%g\"} %llu\n",
+			STAT_NAME_LEN, Histogram->Name,
+			Stat_Read( StatHeader->BucketOffset + ( j + 1 ) * sizeof ( unsigned int ),
+				   sizeof ( unsigned int ) ) / 1000000.0, Seen );
+	    else
+		printf( "imapproxy_%.*s_latency_seconds_bucket{le=\"+Inf\"} %llu\n",
+			STAT_NAME_LEN, Histogram->Name, Seen );
+	}
+
+	printf( "imapproxy_%.*s_latency_seconds_sum %g\n", STAT_NAME_LEN,
+		Histogram->Name, Stat_Read( Histogram->SumOffset, 8 ) / 1000000.0 );
+	printf( "imapproxy_%.*s_latency_seconds_count %llu\n", STAT_NAME_LEN,
+		Histogram->Name, Seen );
+    }
+}
+
+
 /*
  *                            _________
  *                           /        |
@@ -0,0 +1,991 @@
+/*
+**
+** Copyright (c) 2010-2016 The SquirrelMail Project Team
+**
+** Licensed under the GNU GPL. For full terms see the file COPYING.
+**
+** This file is part of SquirrelMail IMAP Proxy.
+**
+**  Facility:
+**
+**	pimptrace.c
+**
+**  Abstract:
+**
+**	Polling Imap Mail Proxy TRACE decoder.  Reads the protocol log
+**	(see TraceFrame in imapproxy.h) and lists the sessions in it,
+**	prints each session's transcript on its own, or adds up how long
+**	the server took to answer each kind of command.
+**
+**	The whole log is mapped and indexed by session first, so the
+**	sessions can be pulled apart however they were interleaved.  If a
+**	frame is damaged, the rest of the log is scanned for the next
+**	thing that looks like a frame.
+**
+**  Authors:
+**
+**      The SquirrelMail Project Team
+**
+**  Version:
+**
+**      $Id$
+**
+**  Modification History:
+**
+**      $Log$
+**
+*/
+
+
+#include "imapproxy.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ctype.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if HAVE_SYS_PARAM_H
+#include <sys/param.h>
+#endif
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define SESSION_HASH	4096		/* buckets, a power of two */
+#define MAX_PENDING	64		/* commands awaiting a reply, per session */
+#define MAX_COMMANDS	128		/* distinct command names timed */
+#define TAG_LEN		64
+#define COMMAND_LEN	32
+
+/*
+ * Everything we know about one session: who it was, and where each of
+ * its frames starts in the log.
+ */
+struct Session
+{
+    unsigned int Id;
+    int Next;                           /* hash chain, -1 at the end */
+    const char *User;                   /* all three point into the log */
+    const char *Client;
+    const char *Server;
+    double Start;                       /* time of its first frame */
+    double End;                         /* and of its last */
+    unsigned int Closed;
+    unsigned long Bytes[ 2 ];           /* from the client, from the server */
+    unsigned long *Frames;              /* offsets */
+    unsigned long FrameCount;
+    unsigned long FrameSize;
+};
+
+/*
+ * The start of a line being gathered for timing.  Only the tag and the
+ * command matter, and the last few bytes, to spot a literal.
+ */
+struct Line
+{
+    char Text[ 128 ];
+    unsigned int Len;
+    char Tail[ 24 ];
+    unsigned int TailLen;
+    unsigned long Literal;              /* literal bytes still to skip */
+    unsigned int Continued;             /* the next line follows a literal */
+};
+
+struct Pending
+{
+    char Tag[ TAG_LEN ];
+    char Command[ COMMAND_LEN ];
+    double Sent;
+};
+
+struct CommandTime
+{
+    char Command[ COMMAND_LEN ];
+    unsigned long Count;
+    double Total;
+    double Max;
+};
+
+static void Usage( void );
+static void Trace_Open( char * );
+static void Trace_Index( void );
+static struct Session *Session_Find( unsigned int, int );
+static double Frame_Time( const struct TraceFrame * );
+static void Frame_Read( unsigned long, struct TraceFrame * );
+static void Print_List( void );
+static void Print_Transcript( struct Session * );
+static void Time_Session( struct Session * );
+static void Time_Line( struct Line *, int, double, struct Pending *, unsigned int * );
+static void Time_Add( const char *, double );
+static void Print_Times( void );
+static int Command_Compare( const void *, const void * );
+
+
+ProxyConfig_Struct PC_Struct;
+
+static char *TraceMap;                 /* the protocol log, mapped */
+static unsigned long TraceSize;
+static unsigned long TraceSkipped;     /* damaged bytes passed over */
+static struct Session *Sessions;       /* in order of first appearance */
+static unsigned int SessionCount;
+static unsigned int SessionSize;
+static int SessionHash[ SESSION_HASH ];
+static struct CommandTime Commands[ MAX_COMMANDS ];
+static unsigned int CommandCount;
+static unsigned long Unanswered;
+
+
+int main( int argc, char *argv[] )
+{
+    char *fn = "pimptrace";
+    struct Session *S;
+    unsigned int Only = 0;
+    unsigned int i;
+    int c, command;
+    extern char *optarg;
+    extern int optind;
+    char ConfigFile[ MAXPATHLEN ];
+    char *TraceFile;
+
+    ConfigFile[0] = '\0';
+    command = 0;
+
+    while (( c = getopt( argc, argv, "f:s:lth" ) ) != EOF )
+    {
+
+        switch( c )
+        {
+
+        case 'f':
+            /* user specified a config filename */
+            strncpy( ConfigFile, optarg, sizeof ConfigFile -1 );
+            break;
+
+	case 's':
+	    /* just this session */
+	    Only = strtoul( optarg, NULL, 10 );
+	    if ( ! Only )
+	    {
+		Usage();
+		exit( 1 );
+	    }
+	    break;
+
+	case 'l':
+	    /* list the sessions */
+	    command=1;
+	    break;
+
+	case 't':
+	    /* per command timings */
+	    command=2;
+	    break;
+
+        case 'h':
+            Usage();
+            exit( 0 );
+
+        case '?':
+            Usage();
+
+            exit( 1 );
+
+        }
+
+    }
+
+    if ( optind < argc )
+    {
+	TraceFile = argv[ optind ];
+    }
+    else
+    {
+	if ( ! ConfigFile[0] )
+	    strncpy( ConfigFile, DEFAULT_CONFIG_FILE, sizeof ConfigFile -1 );
+
+	SetConfigOptions( ConfigFile );
+
+	if ( ! PC_Struct.protocol_log_filename )
+	{
+	    printf( "%s: no protocol_log_filename in '%s' -- Exiting.\n", fn, ConfigFile );
+	    exit( 1 );
+	}
+	TraceFile = PC_Struct.protocol_log_filename;
+    }
+
+    Trace_Open( TraceFile );
+    Trace_Index();
+
+    if ( Only && ! Session_Find( Only, 0 ) )
+    {
+	printf( "%s: there is no session %u in '%s'.\n", fn, Only, TraceFile );
+	exit( 1 );
+    }
+
+    if ( command == 1 )
+    {
+	Print_List();
+    }
+    else
+    {
+	for ( i = 0; i < SessionCount; i++ )
+	{
+	    S = &Sessions[ i ];
+	    if ( Only && S->Id != Only )
+		continue;
+
+	    if ( command == 2 )
+	    {
+		if ( S->Id )
+		    Time_Session( S );
+	    }
+	    else
+		Print_Transcript( S );
+	}
+
+	if ( command == 2 )
+	    Print_Times();
+    }
+
+    if ( TraceSkipped )
+	fprintf( stderr, "%s: skipped %lu bytes of damaged log.\n", fn, TraceSkipped );
+
+    exit( 0 );
+}
+
+
+
+/*++
+ * Function:    Usage
+ *
+ * Purpose:     Display a usage string to stdout
+ *
+ * Parameters:  None.
+ *
+ * Returns:     nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Usage( void )
+{
+    printf( "Usage: pimptrace [-f config filename] [-h] [-l | -t] [-s session] [trace file]\n" );
+    printf( " -l lists the sessions in the trace.\n" );
+    printf( " -t shows how long the server took to answer each command.\n" );
+    printf( " -s limits the transcript or the timings to one session.\n" );
+    printf( " Without -l or -t, the transcript of each session is printed.\n" );
+    printf( " The trace file defaults to protocol_log_filename from the config file.\n" );
+
+    return;
+}
+
+
+
+/*++
+ * Function:	Trace_Open
+ *
+ * Purpose:	Map the protocol log.
+ *
+ * Parameters:	char ptr -- the file name
+ *
+ * Returns:	nada -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Trace_Open( char *Filename )
+{
+    char *fn = "pimptrace";
+    struct stat st;
+    int fd;
+
+    fd = open( Filename, O_RDONLY );
+    if ( fd == -1 )
+    {
+        printf("%s: open() failed for '%s': %s -- Exiting.\n", fn,
+               Filename, strerror( errno ) );
+        exit( 1 );
+    }
+
+    if ( fstat( fd, &st ) == -1 )
+    {
+        printf("%s: fstat() failed for '%s': %s -- Exiting.\n", fn,
+               Filename, strerror( errno ) );
+        exit( 1 );
+    }
+
+    /*
+     * The proxy may still be adding to it; we read as much as there was
+     * when we looked.
+     */
+    TraceSize = st.st_size;
+    if ( ! TraceSize )
+    {
+	close( fd );
+	return;
+    }
+
+    TraceMap = mmap( 0, TraceSize, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( TraceMap == MAP_FAILED )
+    {
+        printf("%s: mmap() failed: %s -- Exiting.\n", fn, strerror( errno ) );
+        exit( 1 );
+    }
+
+    close( fd );
+}
+
+
+
+/*++
+ * Function:	Trace_Index
+ *
+ * Purpose:	Walk the protocol log and note where each session's frames
+ *		are.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada -- exits if out of memory
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	A frame is only believed if its magic and version are
+ *		right and it fits in the file; otherwise we move on a byte
+ *		and look again.  A frame cut off at the end of the file is
+ *		one the proxy is still writing, and is left out.
+ *--
+ */
+static void Trace_Index( void )
+{
+    char *fn = "pimptrace";
+    struct TraceFrame F;
+    struct Session *S;
+    unsigned long Offset = 0;
+    const char *Payload;
+    const char *End;
+    double When;
+    unsigned int i;
+
+    for ( i = 0; i < SESSION_HASH; i++ )
+	SessionHash[ i ] = -1;
+
+    while ( Offset + sizeof F <= TraceSize )
+    {
+	Frame_Read( Offset, &F );
+
+	if ( F.Magic != TRACE_MAGIC || F.Version != TRACE_VERSION ||
+	     F.Type > TRACE_CLOSE || F.Nanoseconds >= 1000000000 )
+	{
+	    Offset++;
+	    TraceSkipped++;
+	    continue;
+	}
+
+	if ( F.Length > TraceSize - Offset - sizeof F )
+	    break;
+
+	S = Session_Find( F.Session, 1 );
+	When = Frame_Time( &F );
+	if ( ! S->FrameCount )
+	    S->Start = When;
+	S->End = When;
+
+	if ( S->FrameCount == S->FrameSize )
+	{
+	    S->FrameSize = S->FrameSize ? S->FrameSize * 2 : 64;
+	    S->Frames = realloc( S->Frames, S->FrameSize * sizeof *S->Frames );
+	    if ( ! S->Frames )
+	    {
+		printf( "%s: realloc() failed: %s -- Exiting.\n", fn, strerror( errno ) );
+		exit( 1 );
+	    }
+	}
+	S->Frames[ S->FrameCount++ ] = Offset;
+
+	Payload = TraceMap + Offset + sizeof F;
+	End = Payload + F.Length;
+
+	switch ( F.Type )
+	{
+	case TRACE_OPEN:
+	    /* user, client and server, each with a NUL after it */
+	    S->User = Payload;
+	    S->Client = memchr( Payload, '\0', F.Length );
+	    if ( S->Client && ++S->Client < End )
+		S->Server = memchr( S->Client, '\0', End - S->Client );
+	    if ( S->Server && ++S->Server < End &&
+		 memchr( S->Server, '\0', End - S->Server ) )
+		break;
+	    /* it's damaged; keep what's usable */
+	    S->User = S->Client = S->Server = NULL;
+	    break;
+
+	case TRACE_CLIENT:
+	    S->Bytes[ 0 ] += F.Length;
+	    break;
+
+	case TRACE_SERVER:
+	    S->Bytes[ 1 ] += F.Length;
+	    break;
+
+	case TRACE_CLOSE:
+	    S->Closed = 1;
+	    break;
+	}
+
+	Offset += sizeof F + F.Length;
+    }
+}
+
+
+
+/*++
+ * Function:	Session_Find
+ *
+ * Purpose:	Look up a session by id.
+ *
+ * Parameters:	unsigned int -- the session id
+ *		int -- 1 to add it if it's not there yet
+ *
+ * Returns:	ptr to the session, or NULL if it's not there
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Adding may move every session, so don't hang on to the
+ *		pointer across calls that add.
+ *--
+ */
+static struct Session *Session_Find( unsigned int Id, int Add )
+{
+    char *fn = "pimptrace";
+    struct Session *S;
+    unsigned int Bucket;
+    int i;
+
+    Bucket = Id & ( SESSION_HASH - 1 );
+    for ( i = SessionHash[ Bucket ]; i != -1; i = Sessions[ i ].Next )
+	if ( Sessions[ i ].Id == Id )
+	    return( &Sessions[ i ] );
+
+    if ( ! Add )
+	return( NULL );
+
+    if ( SessionCount == SessionSize )
+    {
+	SessionSize = SessionSize ? SessionSize * 2 : 256;
+	Sessions = realloc( Sessions, SessionSize * sizeof *Sessions );
+	if ( ! Sessions )
+	{
+	    printf( "%s: realloc() failed: %s -- Exiting.\n", fn, strerror( errno ) );
+	    exit( 1 );
+	}
+    }
+
+    S = &Sessions[ SessionCount ];
+    memset( S, 0, sizeof *S );
+    S->Id = Id;
+    S->Next = SessionHash[ Bucket ];
+    SessionHash[ Bucket ] = SessionCount++;
+
+    return( S );
+}
+
+
+
+/*++
+ * Function:	Frame_Read
+ *
+ * Purpose:	Get a frame header out of the log in host byte order.
+ *
+ * Parameters:	unsigned long -- where it starts
+ *		ptr to the TraceFrame to fill in
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Frames aren't aligned, hence the copy.
+ *--
+ */
+static void Frame_Read( unsigned long Offset, struct TraceFrame *F )
+{
+    memcpy( F, TraceMap + Offset, sizeof *F );
+    F->Session = ntohl( F->Session );
+    F->Seconds = ntohl( F->Seconds );
+    F->Nanoseconds = ntohl( F->Nanoseconds );
+    F->Length = ntohl( F->Length );
+}
+
+
+
+/*++
+ * Function:	Frame_Time
+ *
+ * Purpose:	When a frame was read, in seconds since the epoch.
+ *
+ * Parameters:	ptr to the TraceFrame
+ *
+ * Returns:	the time
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static double Frame_Time( const struct TraceFrame *F )
+{
+    return( F->Seconds + F->Nanoseconds / 1e9 );
+}
+
+
+
+/*++
+ * Function:	Print_List
+ *
+ * Purpose:	List the sessions in the log.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Print_List( void )
+{
+    struct Session *S;
+    char When[ 32 ];
+    time_t Start;
+    unsigned int i;
+
+    printf( "%8s  %-19s  %10s  %8s  %10s  %10s  %-24s  %s\n",
+	    "session", "start", "seconds", "frames",
+	    "client", "server", "user", "from" );
+
+    for ( i = 0; i < SessionCount; i++ )
+    {
+	S = &Sessions[ i ];
+	if ( ! S->Id )
+	    continue;
+
+	Start = (time_t)S->Start;
+	strftime( When, sizeof When, "%Y-%m-%d %H:%M:%S", localtime( &Start ) );
+
+	printf( "%8u  %-19s  %10.3f%c %8lu  %10lu  %10lu  %-24s  %s\n",
+		S->Id, When, S->End - S->Start, S->Closed ? ' ' : '+',
+		S->FrameCount, S->Bytes[ 0 ], S->Bytes[ 1 ],
+		S->User ? S->User : "?", S->Client ? S->Client : "?" );
+    }
+}
+
+
+
+/*++
+ * Function:	Print_Transcript
+ *
+ * Purpose:	Print everything one session said, with the time of each
+ *		line since the session started.
+ *
+ * Parameters:	ptr to the session
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Lines from the client start with C:, from the server with
+ *		S:, and notes from the proxy with P:.  A line that spans
+ *		frames is printed as one, unless the other side gets a word
+ *		in first.  Control characters are shown as '.'.
+ *--
+ */
+static void Print_Transcript( struct Session *S )
+{
+    static const char *Prefix[] = { "P", "", "C", "S", "" };
+    struct TraceFrame F;
+    const unsigned char *Data;
+    unsigned long i;
+    unsigned int j;
+    int LastType = -1;
+    int AtStart = 1;
+    char When[ 32 ];
+    time_t Start;
+
+    Start = (time_t)S->Start;
+    strftime( When, sizeof When, "%Y-%m-%d %H:%M:%S", localtime( &Start ) );
+
+    if ( S->Id )
+	printf( "=== session %u: %s from %s to %s, %s ===\n", S->Id,
+		S->User ? S->User : "?", S->Client ? S->Client : "?",
+		S->Server ? S->Server : "?", When );
+    else
+	printf( "=== proxy notes ===\n" );
+
+    for ( i = 0; i < S->FrameCount; i++ )
+    {
+	Frame_Read( S->Frames[ i ], &F );
+	Data = (const unsigned char *)TraceMap + S->Frames[ i ] + sizeof F;
+
+	if ( F.Type == TRACE_OPEN || F.Type == TRACE_CLOSE )
+	{
+	    if ( ! AtStart )
+		putchar( '\n' );
+	    printf( "%12.6f -- %s\n", Frame_Time( &F ) - S->Start,
+		    F.Type == TRACE_OPEN ? "login" : "logout" );
+	    AtStart = 1;
+	    LastType = F.Type;
+	    continue;
+	}
+
+	if ( ! AtStart && F.Type != LastType )
+	{
+	    putchar( '\n' );
+	    AtStart = 1;
+	}
+	LastType = F.Type;
+
+	for ( j = 0; j < F.Length; j++ )
+	{
+	    if ( AtStart )
+	    {
+		printf( "%12.6f %s: ", Frame_Time( &F ) - S->Start, Prefix[ F.Type ] );
+		AtStart = 0;
+	    }
+
+	    if ( Data[ j ] == '\n' )
+	    {
+		putchar( '\n' );
+		AtStart = 1;
+	    }
+	    else if ( Data[ j ] == '\r' )
+		continue;
+	    else if ( Data[ j ] == '\t' || isprint( Data[ j ] ) || Data[ j ] >= 0x80 )
+		putchar( Data[ j ] );
+	    else
+		putchar( '.' );
+	}
+
+	/* notes have no line end of their own */
+	if ( F.Type == TRACE_NOTE && ! AtStart )
+	{
+	    putchar( '\n' );
+	    AtStart = 1;
+	}
+    }
+
+    if ( ! AtStart )
+	putchar( '\n' );
+    putchar( '\n' );
+}
+
+
+
+/*++
+ * Function:	Time_Session
+ *
+ * Purpose:	Time every command in a session, from the frame the client
+ *		finished sending it in (after any literals) to the frame
+ *		holding the tagged reply.
+ *
+ * Parameters:	ptr to the session
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The time is the proxy's view: it includes the server, the
+ *		network to it, and any time the proxy spent on its side.
+ *		Commands the proxy answers itself (a cached SELECT, say)
+ *		never reach the trace as a reply, and are left out.
+ *--
+ */
+static void Time_Session( struct Session *S )
+{
+    struct Pending Pending[ MAX_PENDING ];
+    unsigned int PendingCount = 0;
+    struct Line Lines[ 2 ];
+    struct Line *L;
+    struct TraceFrame F;
+    const char *Data;
+    unsigned long i;
+    unsigned long n;
+    unsigned int j;
+    int Side;
+
+    memset( Lines, 0, sizeof Lines );
+
+    for ( i = 0; i < S->FrameCount; i++ )
+    {
+	Frame_Read( S->Frames[ i ], &F );
+	if ( F.Type != TRACE_CLIENT && F.Type != TRACE_SERVER )
+	    continue;
+
+	Side = ( F.Type == TRACE_SERVER );
+	L = &Lines[ Side ];
+	Data = TraceMap + S->Frames[ i ] + sizeof F;
+
+	for ( j = 0; j < F.Length; j++ )
+	{
+	    if ( L->Literal )
+	    {
+		n = F.Length - j;
+		if ( n > L->Literal )
+		    n = L->Literal;
+		L->Literal -= n;
+		j += n - 1;
+		continue;
+	    }
+
+	    if ( Data[ j ] == '\n' )
+	    {
+		Time_Line( L, Side, Frame_Time( &F ), Pending, &PendingCount );
+		continue;
+	    }
+
+	    if ( L->Len < sizeof L->Text - 1 )
+		L->Text[ L->Len++ ] = Data[ j ];
+
+	    if ( L->TailLen == sizeof L->Tail )
+		memmove( L->Tail, L->Tail + 1, --L->TailLen );
+	    L->Tail[ L->TailLen++ ] = Data[ j ];
+	}
+    }
+
+    Unanswered += PendingCount;
+}
+
+
+
+/*++
+ * Function:	Time_Line
+ *
+ * Purpose:	Deal with one complete line for Time_Session().
+ *
+ * Parameters:	ptr to the line, which is reset
+ *		int -- 0 if it's from the client, 1 from the server
+ *		double -- when the frame that ended it was read
+ *		ptr to the commands awaiting a reply, and how many there are
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Time_Line( struct Line *L, int Side, double When,
+		       struct Pending *Pending, unsigned int *PendingCount )
+{
+    char Tag[ TAG_LEN ];
+    char Command[ COMMAND_LEN ];
+    char Word[ COMMAND_LEN ];
+    unsigned int Continued;
+    unsigned int i;
+    int Words;
+    char *p;
+
+    /* a literal follows a line that ends {n} or {n+} */
+    while ( L->TailLen && L->Tail[ L->TailLen - 1 ] == '\r' )
+	L->TailLen--;
+    if ( L->TailLen > 2 && L->Tail[ L->TailLen - 1 ] == '}' )
+    {
+	i = L->TailLen - 2;
+	if ( L->Tail[ i ] == '+' )
+	    i--;
+	while ( i > 0 && isdigit( (unsigned char)L->Tail[ i ] ) )
+	    i--;
+	if ( L->Tail[ i ] == '{' )
+	    L->Literal = strtoul( L->Tail + i + 1, NULL, 10 );
+    }
+
+    L->Text[ L->Len ] = '\0';
+    Words = sscanf( L->Text, "%63s %31s %31s", Tag, Command, Word );
+    L->Len = 0;
+    L->TailLen = 0;
+
+    /*
+     * The rest of a line that was broken by a literal.  A command isn't
+     * sent until its last line is.
+     */
+    Continued = L->Continued;
+    L->Continued = ( L->Literal != 0 );
+    if ( Continued )
+    {
+	if ( Side == 0 && *PendingCount )
+	    Pending[ *PendingCount - 1 ].Sent = When;
+	return;
+    }
+
+    if ( Words < 2 || Tag[ 0 ] == '*' || Tag[ 0 ] == '+' )
+	return;
+
+    for ( p = Command; *p; p++ )
+	*p = toupper( (unsigned char)*p );
+
+    if ( Side == 0 )
+    {
+	/* UID FETCH and UID STORE are told apart */
+	if ( Words == 3 && ! strcmp( Command, "UID" ) )
+	{
+	    for ( p = Word; *p; p++ )
+		*p = toupper( (unsigned char)*p );
+	    /* Command is copied into Pending, so it has to stay this size */
+	    snprintf( Command, sizeof Command, "UID %.*s",
+		      (int)( sizeof Command - 5 ), Word );
+	}
+
+	if ( *PendingCount == MAX_PENDING )
+	{
+	    memmove( Pending, Pending + 1, --*PendingCount * sizeof *Pending );
+	    Unanswered++;
+	}
+
+	strcpy( Pending[ *PendingCount ].Tag, Tag );
+	strcpy( Pending[ *PendingCount ].Command, Command );
+	Pending[ *PendingCount ].Sent = When;
+	++*PendingCount;
+	return;
+    }
+
+    if ( strcmp( Command, "OK" ) && strcmp( Command, "NO" ) &&
+	 strcmp( Command, "BAD" ) )
+	return;
+
+    for ( i = 0; i < *PendingCount; i++ )
+    {
+	if ( ! strcmp( Pending[ i ].Tag, Tag ) )
+	{
+	    Time_Add( Pending[ i ].Command, When - Pending[ i ].Sent );
+	    memmove( Pending + i, Pending + i + 1,
+		     ( --*PendingCount - i ) * sizeof *Pending );
+	    return;
+	}
+    }
+}
+
+
+
+/*++
+ * Function:	Time_Add
+ *
+ * Purpose:	Add one command's time to the totals.
+ *
+ * Parameters:	char ptr -- the command
+ *		double -- how long it took, in seconds
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The last of the MAX_COMMANDS slots is kept for OTHER, which
+ *		lumps together everything that didn't get one of its own.
+ *--
+ */
+static void Time_Add( const char *Command, double Seconds )
+{
+    struct CommandTime *C;
+    unsigned int i;
+
+    for ( i = 0; i < CommandCount; i++ )
+	if ( ! strcmp( Commands[ i ].Command, Command ) )
+	    break;
+
+    if ( i == CommandCount && CommandCount >= MAX_COMMANDS - 1 )
+    {
+	Command = "OTHER";
+	for ( i = 0; i < CommandCount; i++ )
+	    if ( ! strcmp( Commands[ i ].Command, Command ) )
+		break;
+    }
+
+    if ( i == CommandCount )
+	strcpy( Commands[ CommandCount++ ].Command, Command );
+
+    C = &Commands[ i ];
+    C->Count++;
+    C->Total += Seconds;
+    if ( Seconds > C->Max )
+	C->Max = Seconds;
+}
+
+
+
+/*++
+ * Function:	Print_Times
+ *
+ * Purpose:	Print the per command timings, busiest first.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static void Print_Times( void )
+{
+    struct CommandTime *C;
+    unsigned int i;
+
+    qsort( Commands, CommandCount, sizeof *Commands, Command_Compare );
+
+    printf( "%-20s  %10s  %12s  %12s  %12s\n",
+	    "command", "count", "total (s)", "mean (ms)", "max (ms)" );
+
+    for ( i = 0; i < CommandCount; i++ )
+    {
+	C = &Commands[ i ];
+	printf( "%-20s  %10lu  %12.3f  %12.3f  %12.3f\n", C->Command, C->Count,
+		C->Total, C->Total * 1000 / C->Count, C->Max * 1000 );
+    }
+
+    if ( Unanswered )
+	printf( "\n%lu commands got no tagged reply in the trace.\n", Unanswered );
+}
+
+
+
+/*++
+ * Function:	Command_Compare
+ *
+ * Purpose:	qsort() comparison for Print_Times().
+ *
+ * Parameters:	two CommandTime ptrs
+ *
+ * Returns:	<0, 0 or >0, the most total time first
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static int Command_Compare( const void *a, const void *b )
+{
+    const struct CommandTime *A = a;
+    const struct CommandTime *B = b;
+
+    if ( A->Total > B->Total )
+	return( -1 );
+    if ( A->Total < B->Total )
+	return( 1 );
+    return( strcmp( A->Command, B->Command ) );
+}
+
+
+/*
+ *                            _________
+ *                           /        |
+ *                          /         |
+ *                         /    ______|
+ *                        /    /       ________
+ *                       |    |        |      /
+ *                       |    |        |_____/
+ *                       |    |        ______
+ *                       |    |        |     \
+ *                       |    |        |______\
+ *                        \    \_______
+ *                         \           |
+ *                          \          |
+ *                           \_________|
+ */
@@ -167,11 +167,8 @@ extern char Capability[BUFSIZE];
 extern int CapabilityLen;
 extern IMAPCounter_Struct *IMAPCount;
 extern ISD_Struct ISD;
-extern pthread_mutex_t mp;
-extern pthread_mutex_t trace;
-extern char TraceUser[MAXUSERNAMELEN];
 extern int Tracefd;
-extern ICC_Struct *ICC_HashTable[ HASH_TABLE_SIZE ];
+extern struct ICCShard ICC_Shards[ ICC_SHARDS ];
 extern ProxyConfig_Struct PC_Struct;
 
 /*
@@ -183,11 +180,13 @@ static int cmd_capability( ITD_Struct *, char * );
 static int cmd_authenticate_login( ITD_Struct *, char *, char * );
 static int cmd_login( ITD_Struct *, char *, char *, int, char *, unsigned char, char * );
 static int cmd_trace( ITD_Struct *, char *, char * );
+static int cmd_untrace( ITD_Struct *, char *, char * );
 static int cmd_dumpicc( ITD_Struct *, char * );
 static int cmd_newlog( ITD_Struct *, char * );
 static int cmd_resetcounters( ITD_Struct *, char * );
 static int cmd_version( ITD_Struct *, char * );
 static int Raw_Proxy( ITD_Struct *, ITD_Struct *, ISC_Struct * );
+static int Proxy_Loop( ITD_Struct *, ITD_Struct *, ISC_Struct *, int * );
 
 
 
@@ -320,14 +319,7 @@ static int cmd_resetcounters( ITD_Struct *itd, char *Tag )
      * Bugfix by Geoffrey Hort <g.hort@unsw.edu.au> -- I forgot to zero
      * out TotalClientLogins...
      */
-    IMAPCount->CountTime = time( 0 );
-    IMAPCount->PeakClientConnections = 0;
-    IMAPCount->PeakInUseServerConnections = 0;
-    IMAPCount->PeakRetainedServerConnections = 0;
-    IMAPCount->TotalClientConnectionsAccepted = 0;
-    IMAPCount->TotalServerConnectionsCreated = 0;
-    IMAPCount->TotalServerConnectionsReused = 0;
-    IMAPCount->TotalClientLogins = 0;
+    Counter_Reset();
     
     snprintf( SendBuf, BufLen, "%s OK Counters reset\r\n", Tag );
     
@@ -361,7 +353,10 @@ static int cmd_dumpicc( ITD_Struct *itd, char *Tag )
     char *fn = "cmd_dumpicc";
     char SendBuf[BUFSIZE];
     unsigned int HashIndex;
+    unsigned int i;
     ICC_Struct *HashEntry;
+    struct ICCPool *Pool;
+    struct ICCShard *Shard;
     unsigned int BufLen = BUFSIZE - 1;
     
     SendBuf[BUFSIZE - 1] = '\0';
@@ -377,29 +372,42 @@ static int cmd_dumpicc( ITD_Struct *itd, char *Tag )
 	return( 0 );
     }
     
-    LockMutex( &mp );
-    
-    for ( HashIndex = 0; HashIndex < HASH_TABLE_SIZE; HashIndex++ )
+    /*
+     * Go one shard at a time so that we never hold up more than the
+     * logins of a single shard while we write to the client.
+     */
+    for ( i = 0; i < ICC_SHARDS; i++ )
     {
-	HashEntry = ICC_HashTable[ HashIndex ];
-	
-	while ( HashEntry )
+	Shard = &ICC_Shards[ i ];
+
+	LockMutex( &Shard->mutex );
+
+	ICC_Settle( Shard );
+
+	for ( HashIndex = 0; HashIndex < Shard->Buckets; HashIndex++ )
 	{
-	    snprintf( SendBuf, BufLen, "* XPROXY_DUMPICC %d %s %s\r\n", HashEntry->server_conn->sd,
-		      HashEntry->username,
-		      ( ( HashEntry->logouttime ) ? "Cached" : "Active" ) );
-	    if ( IMAP_Write( itd->conn, SendBuf, strlen(SendBuf) ) == -1 )
+	    for ( Pool = Shard->HashTable[ HashIndex ]; Pool; Pool = Pool->next )
 	    {
-		UnLockMutex( &mp );
-		syslog(LOG_WARNING, "%s: IMAP_Write() failed: %s", fn, strerror(errno) );
-		return( -1 );
+		for ( HashEntry = Pool->Members;
+		      HashEntry;
+		      HashEntry = HashEntry->next )
+		{
+		    snprintf( SendBuf, BufLen, "* XPROXY_DUMPICC %d %s %s\r\n", HashEntry->server_conn->sd,
+			      HashEntry->username,
+			      ( ( HashEntry->logouttime ) ? "Cached" : "Active" ) );
+		    if ( IMAP_Write( itd->conn, SendBuf, strlen(SendBuf) ) == -1 )
+		    {
+			UnLockMutex( &Shard->mutex );
+			syslog(LOG_WARNING, "%s: IMAP_Write() failed: %s", fn, strerror(errno) );
+			return( -1 );
+		    }
+		}
 	    }
-	    HashEntry = HashEntry->next;
 	}
+	
+	UnLockMutex( &Shard->mutex );
     }
     
-    UnLockMutex( &mp );
-    
     snprintf( SendBuf, BufLen, "%s OK Completed\r\n", Tag );
     if ( IMAP_Write( itd->conn, SendBuf, strlen(SendBuf) ) == -1 )
     {
@@ -471,8 +479,8 @@ static int cmd_version( ITD_Struct *itd, char *Tag )
  *
  * Parameters:	ptr to ITD_Struct for client connection.
  *              char ptr to Tag sent with this command.
- *              char ptr to the username we want to trace (NULL to turn
- *              off tracing)
+ *              char ptr to the username or client address we want to
+ *              trace (NULL to turn off all tracing)
  *
  * Returns:	0 on success
  *		-1 on failure
@@ -480,7 +488,7 @@ static int cmd_version( ITD_Struct *itd, char *Tag )
  * Authors:     Dave McMurtrie <davemcmurtrie@hotmail.com>
  *--
  */
-static int cmd_trace( ITD_Struct *itd, char *Tag, char *Username )
+static int cmd_trace( ITD_Struct *itd, char *Tag, char *Target )
 {
     char *fn = "cmd_trace";
     char SendBuf[BUFSIZE];
@@ -502,67 +510,89 @@ static int cmd_trace( ITD_Struct *itd, char *Tag, char *Username )
     /*
      * Here are the tracing semantics:
      *
-     * Tracing is to be limited to only one user at a time.  This decision was
-     * made for a few different reasons.  First, to conserve system resources
-     * such as disk space.  Second, to improve overall server performance --
-     * tracing will slow a thread down.  Third, so a sysadmin doesn't forget
-     * that tracing is turned on for a user (like I commonly do when I enable
-     * tracing in cyrus imapd).  Fourth, it's just easier this way.
-     */    
-    
-    LockMutex( &trace );
-    
-    if ( !Username )
+     * Up to TRACE_TARGETS users and client addresses can be traced at
+     * once.  Each XPROXY_TRACE adds one to the set, XPROXY_UNTRACE takes
+     * one out, and XPROXY_TRACE on its own empties it.  The set is only
+     * checked at login, so a session that's being traced stays traced
+     * until it logs out.  The limit is there to conserve disk space and
+     * so a sysadmin doesn't lose track of what's being traced.
+     */
+    if ( !Target )
     {
-	snprintf( SendBuf, BufLen, "\n\n-----> C= %d %s PROXY: user tracing disabled. Expect further output until client logout.\n", (int)time(0), TraceUser );
-	write( Tracefd, SendBuf, strlen( SendBuf ) );
-	
-	memset( TraceUser, 0, sizeof TraceUser );
+	Trace_Clear();
 	snprintf( SendBuf, BufLen, "%s OK Tracing disabled\r\n", Tag );
-	if ( IMAP_Write( itd->conn, SendBuf, strlen(SendBuf) ) == -1 )
+    }
+    else
+    {
+	switch ( Trace_Add( Target ) )
 	{
-	    syslog(LOG_WARNING, "%s: IMAP_Write() failed: %s", fn, strerror(errno) );
-	    UnLockMutex( &trace );
-	    return( -1 );
+	case 0:
+	    snprintf( SendBuf, BufLen, "%s OK Tracing enabled for %s.\r\n",
+		      Tag, Target );
+	    break;
+
+	case 1:
+	    snprintf( SendBuf, BufLen, "%s OK Tracing already enabled for %s.\r\n",
+		      Tag, Target );
+	    break;
+
+	default:
+	    snprintf( SendBuf, BufLen, "%s BAD Already tracing %d users and addresses\r\n",
+		      Tag, TRACE_TARGETS );
+	    break;
 	}
-
-	UnLockMutex( &trace );
-	return( 0 );
     }
 
-    if ( TraceUser[0] )
+    if ( IMAP_Write( itd->conn, SendBuf, strlen(SendBuf) ) == -1 )
     {
-	/* guarantee no runaway strings */
-	TraceUser[sizeof TraceUser - 1] = '\0';
-	snprintf( SendBuf, BufLen, "%s BAD Tracing already enabled for user %s\r\n", Tag, TraceUser );
-	if ( IMAP_Write( itd->conn, SendBuf, strlen(SendBuf) ) == -1 )
-	{
-	    syslog(LOG_WARNING, "%s: IMAP_Write() failed: %s", fn, strerror(errno) );
-	    UnLockMutex( &trace );
-	    return( -1 );
-	}
-	
-	UnLockMutex( &trace );
-	return( 0 );
-	
+	syslog(LOG_WARNING, "%s: IMAP_Write() failed: %s", fn, strerror(errno) );
+	return( -1 );
     }
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	cmd_untrace
+ *
+ * Purpose:	turn off tracing for one user or client address.
+ *
+ * Parameters:	ptr to ITD_Struct for client connection.
+ *              char ptr to Tag sent with this command.
+ *              char ptr to the username or client address
+ *
+ * Returns:	0 on success
+ *		-1 on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static int cmd_untrace( ITD_Struct *itd, char *Tag, char *Target )
+{
+    char *fn = "cmd_untrace";
+    char SendBuf[BUFSIZE];
+    unsigned int BufLen = BUFSIZE - 1;
     
-    strncpy( TraceUser, Username, sizeof TraceUser - 1 );
-    TraceUser[ sizeof TraceUser - 1 ] = '\0';
-    
-    snprintf( SendBuf, BufLen, "%s OK Tracing enabled for user %s.\r\n",
-		    Tag, TraceUser );
+    SendBuf[BUFSIZE - 1] = '\0';
+
+    if ( ! PC_Struct.enable_admin_commands )
+	snprintf( SendBuf, BufLen, "%s BAD Unrecognized command\r\n", Tag );
+    else if ( !Target )
+	snprintf( SendBuf, BufLen, "%s BAD Missing user or address\r\n", Tag );
+    else if ( Trace_Remove( Target ) )
+	snprintf( SendBuf, BufLen, "%s NO Not tracing %s\r\n", Tag, Target );
+    else
+	snprintf( SendBuf, BufLen, "%s OK Tracing disabled for %s.\r\n",
+		  Tag, Target );
+
     if ( IMAP_Write( itd->conn, SendBuf, strlen(SendBuf) ) == -1 )
     {
 	syslog(LOG_WARNING, "%s: IMAP_Write() failed: %s", fn, strerror(errno) );
-	UnLockMutex( &trace );
 	return( -1 );
     }
 
-    snprintf( SendBuf, BufLen, "\n\n-----> C= %d %s PROXY: user tracing enabled.\n", (int)time(0), TraceUser );
-    write( Tracefd, SendBuf, strlen( SendBuf ) );
-    
-    UnLockMutex( &trace );
     return( 0 );
 }
 
@@ -679,6 +709,7 @@ TODO: change this in the future to be a linked list:
  *
  * Returns:	0 on success prior to authentication
  *              1 on success after authentication (we caught a logout)
+ *              2 if the event engine took over the relay
  *              -1 on failure	
  *
  * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
@@ -704,6 +735,7 @@ static int cmd_authenticate_login( ITD_Struct *Client,
     struct sockaddr_storage cli_addr;
     int sockaddrlen;
     char hostaddr[INET6_ADDRSTRLEN], portstr[NI_MAXSERV];
+    struct timeval Start;
     
     unsigned int BufLen = BUFSIZE - 1;
     memset ( &Server, 0, sizeof Server );
@@ -763,7 +795,7 @@ static int cmd_authenticate_login( ITD_Struct *Client,
     /*
      * copy BytesRead -2 so we don't include the CRLF.
      */
-    memcpy( (void *)EncodedUsername, (const void *)Client->ReadBuf, 
+    memcpy( (void *)EncodedUsername, (const void *)ITD_LINE( Client ), 
 	    BytesRead - 2 );
     
     rc = EVP_DecodeBlock( Username, EncodedUsername, BytesRead - 2 );
@@ -806,11 +838,14 @@ static int cmd_authenticate_login( ITD_Struct *Client,
 	return( -1 );
     }
     
-    memcpy( (void *)EncodedPassword, (const void *)Client->ReadBuf, 
+    memcpy( (void *)EncodedPassword, (const void *)ITD_LINE( Client ), 
 	    BytesRead - 2 );
 
     rc = EVP_DecodeBlock( Password, EncodedPassword, BytesRead - 2 );
     Password[rc] = '\0';
+
+    /* from here on, the client is waiting on us */
+    gettimeofday( &Start, NULL );
     
     if ( getpeername( Client->conn->sd, (struct sockaddr *)&cli_addr, 
 		      &sockaddrlen ) < 0 )
@@ -893,40 +928,32 @@ static int cmd_authenticate_login( ITD_Struct *Client,
 
     if ( IMAP_Write( Client->conn, SendBuf, strlen( SendBuf ) ) == -1 )
     {
-	IMAPCount->InUseServerConnections--;
+	COUNT( InUseServerConnections, -1 );
     ICC_Invalidate(Server.conn->ICC);
 	syslog( LOG_ERR, "%s: Unable to send successful authentication message back to client: %s -- closing connection.", fn, strerror( errno ) );
 	return( -1 );
     }
     
-    IMAPCount->TotalClientLogins++;
+    COUNT( TotalClientLogins, 1 );
+    Counter_Latency( LATENCY_CLIENT_LOGIN, &Start );
     
-    LockMutex ( &trace );
-    if ( ! strcmp( Username, TraceUser ) )
-    {
-	Client->TraceOn = 1;
-	Server.TraceOn = 1;
-    }
-    else
+    Trace_Start( Client, &Server, Username, hostaddr );
+
+    /*
+     * If the event engine owns this client, it drives the relay from
+     * here on instead of us blocking in Raw_Proxy().
+     */
+    if ( Client->Session )
     {
-	Client->TraceOn = 0;
-	Server.TraceOn = 0;
-    }
-    UnLockMutex( &trace );
+	if ( Engine_Adopt_Relay( Client->Session, &Server ) == 0 )
+	    return( 2 );
 
-    rc = Raw_Proxy( Client, &Server, &Server.conn->ISC );
-    
-    if (rc == -2) {
-        ICC_Invalidate( Server.conn->ICC );
-        return ( -1 );
+	return( Relay_Finish( Client, &Server, -2 ) );
     }
 
-    Client->TraceOn = 0;
-    Server.TraceOn = 0;
-    
-    ICC_Logout( Server.conn->ICC );
+    rc = Raw_Proxy( Client, &Server, &Server.conn->ISC );
     
-    return( rc );
+    return( Relay_Finish( Client, &Server, rc ) );
 }
 
 
@@ -949,6 +976,7 @@ TODO: change this in the future to be a linked list:
  *
  * Returns:	0 on success prior to authentication
  *              1 on success after authentication (we caught a logout)
+ *              2 if the event engine took over the relay
  *		-1 on failure
  *
  * Authors:     Dave McMurtrie <davemcmurtrie@hotmail.com>
@@ -981,6 +1009,9 @@ static int cmd_login( ITD_Struct *Client,
     struct sockaddr_storage cli_addr;
     int sockaddrlen;
     char hostaddr[INET6_ADDRSTRLEN], portstr[NI_MAXSERV];
+    struct timeval Start;
+
+    gettimeofday( &Start, NULL );
 
     memset( &Server, 0, sizeof Server );
 
@@ -1071,49 +1102,33 @@ static int cmd_login( ITD_Struct *Client,
 	 * This really sux.  We successfully logged the user in, but now
 	 * we can't communicate with the client...
 	 */
-	IMAPCount->InUseServerConnections--;
+	COUNT( InUseServerConnections, -1 );
     ICC_Invalidate(Server.conn->ICC);
 	syslog(LOG_ERR, "%s: Unable to send successful login message back to client: %s -- closing connection.", fn, strerror(errno) );
 	return( -1 );
     }
 
-    IMAPCount->TotalClientLogins++;
+    COUNT( TotalClientLogins, 1 );
+    Counter_Latency( LATENCY_CLIENT_LOGIN, &Start );
     
     /* turn on tracing for this session if necessary */
-    LockMutex( &trace );
-    if ( ! strcmp( Username, TraceUser ) )
-    {
-	Client->TraceOn = 1;
-	Server.TraceOn = 1;
-    }
-    else
+    Trace_Start( Client, &Server, Username, hostaddr );
+
+    /*
+     * If the event engine owns this client, it drives the relay from
+     * here on instead of us blocking in Raw_Proxy().
+     */
+    if ( Client->Session )
     {
-	Client->TraceOn = 0;
-	Server.TraceOn = 0;
+	if ( Engine_Adopt_Relay( Client->Session, &Server ) == 0 )
+	    return( 2 );
+
+	return( Relay_Finish( Client, &Server, -2 ) );
     }
-    UnLockMutex( &trace );
 
     rc = Raw_Proxy( Client, &Server, &Server.conn->ISC );
 
-    if (rc == -2) {
-        ICC_Invalidate( Server.conn->ICC );
-        return ( -1 );
-    }
-
-    /*
-     * It's not necessary to take out the trace mutex here.  The reason
-     * we take it out when we check above is because the trace username
-     * could change at any time.  When we disable tracing here, we're
-     * doing it regardless of what the trace username is, so we don't 
-     * take out the mutex.
-     */
-    Client->TraceOn = 0;
-    Server.TraceOn = 0;
-    
-    /* update the logout time for this cached connection */
-    ICC_Logout( Server.conn->ICC );
-    
-    return( rc );
+    return( Relay_Finish( Client, &Server, rc ) );
 }
 
 
@@ -1138,15 +1153,51 @@ static int cmd_login( ITD_Struct *Client,
 static int Raw_Proxy( ITD_Struct *Client, ITD_Struct *Server,
 		      ISC_Struct *ISC )
 {
-    char *fn = "Raw_Proxy()";
+    int Pipe[2];
+    int rc;
+
+    /*
+     * Unless we have to look at what the server sends (TLS, tracing, the
+     * SELECT cache), we let the kernel move it to the client through a
+     * pipe.
+     */
+    if ( IMAP_Splice_Open( Server, Pipe ) < 0 )
+	return( Proxy_Loop( Client, Server, ISC, NULL ) );
+
+    rc = Proxy_Loop( Client, Server, ISC, Pipe );
+
+    close( Pipe[0] );
+    close( Pipe[1] );
+    return( rc );
+}
+
+
+
+/*++
+ * Function:	Proxy_Loop
+ *
+ * Purpose:	The poll() loop of Raw_Proxy().
+ *
+ * Parameters:	ptr to client ITD_Struct
+ *		ptr to server ITD_Struct
+ *		ptr to the ISC_Struct
+ *		ptr to a pipe for IMAP_Splice(), or NULL to copy server data
+ *
+ * Returns:	same as Raw_Proxy()
+ *
+ * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
+ *--
+ */
+static int Proxy_Loop( ITD_Struct *Client, ITD_Struct *Server,
+		       ISC_Struct *ISC, int *Pipe )
+{
+    char *fn = "Proxy_Loop()";
     struct pollfd fds[2];
     nfds_t nfds;
     int status, pending;
     unsigned int FailCount;
+    unsigned int InPipe = 0;
     int BytesSent;
-    char *CP;
-    char TraceBuf[ BUFSIZE ];
-    char SendBuf[ BUFSIZE ];
     int rc;
     
 #define SERVER 0
@@ -1249,6 +1300,13 @@ static int Raw_Proxy( ITD_Struct *Client, ITD_Struct *Server,
 	
 	FailCount = 0;
 	
+	/* the first word back from the server since a command went out */
+	if ( ( pending || fds[ SERVER ].revents ) &&
+	     Server->CommandSent.tv_sec )
+	{
+	    Counter_Latency( LATENCY_COMMAND, &Server->CommandSent );
+	    Server->CommandSent.tv_sec = 0;
+	}
 
 	/*
 	 * PROXY LOOPS
@@ -1261,7 +1319,24 @@ static int Raw_Proxy( ITD_Struct *Client, ITD_Struct *Server,
 	 * server is allowed to send unsolicited data and the client has to
 	 * be able to deal with it.
 	 */
-	if ( pending || fds[ SERVER ].revents )
+	if ( Pipe && fds[ SERVER ].revents )
+	{
+	    /* blocking sockets, so this leaves nothing in the pipe */
+	    status = IMAP_Splice( Server->conn, Client->conn, Pipe, &InPipe );
+
+	    if ( status == -1 )
+	    {
+		syslog(LOG_ERR, "%s: IMAP server unexpectedly closed the connection on sd %d", fn, Server->conn->sd );
+		return( -2 );
+	    }
+
+	    if ( status == -2 )
+	    {
+		syslog(LOG_ERR, "%s: splice() failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
+		return( -1 );
+	    }
+	}
+	else if ( pending || fds[ SERVER ].revents )
 	{
 	    for ( ; ; )
 	    {
@@ -1287,12 +1362,10 @@ static int Raw_Proxy( ITD_Struct *Client, ITD_Struct *Server,
 	    }
 	    
 	    if ( Server->TraceOn )
-	    {
-		snprintf( TraceBuf, sizeof TraceBuf - 1, "\n\n-----> C= %d %s SERVER: sd [%d]\n",
-		    (int)time(0), ( (*TraceUser) ? TraceUser : "Null username" ), Server->conn->sd );
-		write( Tracefd, TraceBuf, strlen( TraceBuf ) );
-		write( Tracefd, Server->ReadBuf, status );
-	    }
+		Trace_Data( Server, TRACE_SERVER, Server->ReadBuf, status );
+
+	    if ( PC_Struct.enable_select_cache )
+		Select_Cache_Observe( ISC, Server->ReadBuf, status );
 	    
 	    /* whatever we read from the server, ship off to the client */
 	    for ( ; ; )
@@ -1323,236 +1396,10 @@ static int Raw_Proxy( ITD_Struct *Client, ITD_Struct *Server,
 
 	do
 	{
-	    do 
-	    {
-		status = IMAP_Line_Read( Client );
-		
-		if ( status == -1 )
-		{
-		    syslog(LOG_NOTICE, "%s: Failed to read line from client on sd [%d]", fn, Client->conn->sd );
-		    return( -1 );
-		}
-	    
-		if ( Client->TraceOn )
-		{
-		    snprintf( TraceBuf, sizeof TraceBuf - 1, "\n\n-----> C= %d %s CLIENT: sd [%d]\n", (int)time(0), ( (*TraceUser) ? TraceUser : "Null username" ), Client->conn->sd );
-		    write( Tracefd, TraceBuf, strlen( TraceBuf ) );
-		    write( Tracefd, Client->ReadBuf, status );
-		}
-		
-	    
-		/* 
-		 * This is a command.  What command is it?
-		 */
-		CP = memchr( Client->ReadBuf, ' ',
-			     Client->ReadBytesProcessed );
-	    
-		if ( CP )
-		{
-		    CP++;
-		    
-		    if ( !strncasecmp( CP, "LOGOUT", 6 ) )
-		    {
-			/*
-			 * Since we want to potentially reuse this server
-			 * connection, we want to return it to an unselected 
-			 * state.  Use UNSELECT if the server supports it.
-			 * Otherwise, EXAMINE a null mailbox.  If SELECT
-			 * caching is enabled, don't do this.
-			 */
-			if ( ! PC_Struct.enable_select_cache )
-			{
-			    snprintf( SendBuf, sizeof SendBuf - 1,
-				      "C64 %s\r\n", ( (PC_Struct.support_unselect) ? "UNSELECT" : "EXAMINE \"\"" ) );
-			    
-			    IMAP_Write( Server->conn, SendBuf,
-					strlen(SendBuf) );
-			    /*
-			     * To be more correct, we should send any untagged
-			     * data back to the client before we're done.
-			     */
-			    for( ;; )
-			    {
-				/*
-				 * If the server wants to send a literal for
-				 * some reason, bag it...
-				 */
-				if ( Server->LiteralBytesRemaining )
-				    break;
-				
-				status = IMAP_Line_Read( Server );
-				
-				/*
-				 * If there's an error reading from the server,
-				 * we'll catch it when (if) we try to reuse this
-				 * connection.
-				 */
-				if ( ( status == -1 ) || ( status == 0 ) )
-				    break;
-			    
-				/*
-				 * If it's not untagged data, we're done.
-				 */
-				if ( Server->ReadBuf[0] != '*' )
-				    break;
-				
-				BytesSent = IMAP_Write( Client->conn, 
-							Server->ReadBuf, status );
-				if ( BytesSent == -1 )
-				{
-				    syslog( LOG_ERR, "%s: IMAP_Write() failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
-				}
-			    }
-			} /* if ( ! PC_Struct.enable_select_cache ) */
-
-			memset( Server->ReadBuf, 0, sizeof Server->ReadBuf );
-			
-			return( 1 );
-		    }
-		
-		    /*
-		     * it's some command other than a LOGOUT...
-		     * If we care about SELECT caching, do that now.
-		     */
-		    if ( PC_Struct.enable_select_cache )
-		    {
-			if ( !strncasecmp( CP, "SELECT ", 7 ) )
-			{
-			    rc = Handle_Select_Command( Client, Server,
-							ISC, Client->ReadBuf,
-							status );
-			    
-			    if ( rc == 0 )
-				continue;
-
-			    if ( rc < 0 ) // -1 or -2
-				return( rc );
-
-			    /* 
-			     * if Handle_Select_Command() returned 1,
-			     * fall through the rest of the logic and the
-			     * SELECT command should be proxied without
-			     * looking at the cache.
-			     */
-			    
-			} /* if the command is SELECT */
-
-			/*
-			 * SELECT caching is enabled and we've encountered
-			 * a command other than SELECT.  See if we should
-			 * invalidate the SELECT cache or not.
-			 */
-			if ( ! Is_Safe_Command( CP ) )
-			{
-			    Invalidate_Cache_Entry( ISC );
-			}
-			
-		    } /* if ( PC_Struct.enable_select_cache ) */
-		    
-		} /* if ( CP ) */
-		
-
-		for ( ; ; )
-		{
-		    BytesSent = IMAP_Write( Server->conn, Client->ReadBuf, status );
-		    if ( BytesSent == -1 )
-		    {
-			if ( errno == EINTR )
-			    continue;
-			
-			syslog(LOG_ERR, "%s: IMAP_Write() failed sending data to server on sd [%d]: %s", fn, Server->conn->sd, strerror( errno ) );
-			return( -2 );
-		    }
-		    break;
-		}
-		
-		/*
-		 * Don't just rely on our do/while condition.  There
-		 * may still be stuff in our buffer, but it could be
-		 * literal data.  Check and break out of the loop if that's
-		 * the case.
-		 */
-		if ( Client->LiteralBytesRemaining )
-		    break;
-		
-	    } while ( Client->BytesInReadBuffer > Client->ReadBytesProcessed );
-	    
-	    
-	    /* 
-	     * If there are literal bytes to read, get them and blast them
-	     * off to the server.  Only do this, however, if it's a non
-	     * synchronous literal since the server has to send a "go ahead"
-	     * otherwise.
-	     */
-	    if ( ! Client->LiteralBytesRemaining )
-		continue;
+	    rc = Relay_Client_Command( Client, Server, ISC );
 	    
-	    
-	    /*
-	     * Do we have to wait for a "go-ahead" from the server?
-	     */
-	    if ( ! Client->NonSyncLiteral )
-	    {
-		/* we have to wait for a go-ahead */
-		status = IMAP_Line_Read( Server );
-		if ( Server->TraceOn )
-		{
-		    snprintf( TraceBuf, sizeof TraceBuf - 1, "\n\n-----> C= %d %s SERVER: sd [%d]\n", (int)time(0), ( (*TraceUser) ? TraceUser : "Null username" ), Server->conn->sd );
-		    write( Tracefd, TraceBuf, strlen( TraceBuf ) );
-		    write( Tracefd, Server->ReadBuf, status );
-		}
-
-		if ( Server->ReadBuf[0] != '+' )
-		    Client->LiteralBytesRemaining = 0;
-
-		for ( ; ; )
-		{
-		    BytesSent = IMAP_Write( Client->conn, Server->ReadBuf, status );
-		    if ( BytesSent == -1 )
-		    {
-			if ( errno == EINTR )
-			    continue;
-			
-			syslog(LOG_ERR, "%s: IMAP_Write() failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
-			return( -1 );
-		    } 
-		    break;
-		}
-	    }
-
-	    while ( Client->LiteralBytesRemaining )
-	    {
-		status = IMAP_Literal_Read( Client );
-		
-		if ( status == -1 )
-		{
-		    syslog(LOG_NOTICE, "%s: Failed to read string literal from client on sd [%d]", fn, Client->conn->sd );
-		    return( -1 );
-		}
-
-		if ( Client->TraceOn )
-		{
-		    snprintf( TraceBuf, sizeof TraceBuf - 1, "\n\n-----> C= %d %s CLIENT: sd [%d]\n", (int)time(0), ( (*TraceUser) ? TraceUser : "Null username" ), Client->conn->sd );
-		    write( Tracefd, TraceBuf, strlen( TraceBuf ) );
-		    write( Tracefd, Client->ReadBuf, status );
-		}
-		
-		/* send any literal data back to the server */
-		for ( ; ; )
-		{
-		    BytesSent = IMAP_Write( Server->conn, Client->ReadBuf, status );
-		    if ( BytesSent == -1 )
-		    {
-			if ( errno == EINTR )
-			    continue;
-			
-			syslog(LOG_ERR, "%s: IMAP_Write() failed sending data to server on sd [%d]: %s", fn, Server->conn->sd, strerror( errno ) );
-			return( -2 );
-		    }
-		    break;
-		}
-		
-	    }
+	    if ( rc != 0 )
+		return( rc );
 	    
 	} while ( Client->BytesInReadBuffer > Client->ReadBytesProcessed );
 	
@@ -1562,63 +1409,1098 @@ static int Raw_Proxy( ITD_Struct *Client, ITD_Struct *Server,
 
 
 
-    
-
-
-
-
 /*++
- * Function:	HandleRequest
+ * Function:	Relay_Client_Command
  *
- * Purpose:	Handle incoming IMAP requests (as a thread)
+ * Purpose:	Proxy one command line (and any literal that follows it)
+ *		from a logged in client to the IMAP server, catching
+ *		LOGOUT commands and handling SELECT caching.
  *
- * Parameters:	int, client socket descriptor
+ * Parameters:	ptr to client ITD_Struct
+ *		ptr to server ITD_Struct
+ *		ptr to the select cache of the server connection
  *
- * Returns:	nada
+ * Returns:	0 on success
+ *		1 if we caught a logout
+ *		-1 on failure on client
+ *		-2 on failure on server or fatal
  *
  * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
  *
- * Notes:	This function actually only handles unauthenticated
- *		traffic from an IMAP client.  As such it can only make sense
- *		of the following IMAP commands (rfc 2060):  NOOP, CAPABILITY,
- *		AUTHENTICATE, LOGIN, and LOGOUT.  Also, it handles the
- *              commands that are internal to the proxy server such as
- *              XPROXY_TRACE, XPROXY_NEWLOG, XPROXY_DUMPICC,
- *              XPROXY_RESETCOUNTERS and XPROXY_VERSION.
- *
- *              None of these commands should ever have the need to send
- *              a boatload of data, so we avoid some error checking and
- *              undue complexity in this routine by just making sure that
- *              any given read from the client doesn't fill our read
- *              buffer.  If it does, we just drop the connection.
+ * Notes:	Used by Raw_Proxy() and by the event engine helper threads.
+ *		Both sockets must be in blocking mode.
  *--
  */
-extern void HandleRequest( int clientsd )
+extern int Relay_Client_Command( ITD_Struct *Client, ITD_Struct *Server,
+				 ISC_Struct *ISC )
 {
-    char *fn = "HandleRequest";
-    ITD_Struct Client;
-    ICD_Struct conn;
-    char *Tag;
-    char *Command;
-    char *Username;
-    char *AuthMech;
-    char *Lasts;
-    char *EndOfLine;
+    char *fn = "Relay_Client_Command()";
+    int status;
+    int BytesSent;
     char *CP;
-    char SendBuf[BUFSIZE];
-    char S_QueuedPreauthCommand[BUFSIZE] = "";
-    int BytesRead;
+    char *Line;
+    int Len;
+    char SendBuf[ BUFSIZE ];
+    unsigned int Command;
+    unsigned int Flags;
     int rc;
-    unsigned int BufLen = BUFSIZE - 1;
-    char S_UserName[MAXUSERNAMELEN];
-    char S_Tag[MAXTAGLEN];
-    char S_Password[MAXPASSWDLEN];
-    unsigned char LiteralFlag;          /* flag to deal with passwords sent */
-					/* as string literals */
     
+    status = IMAP_Line_Read( Client );
     
-    struct pollfd fds[1];
-    nfds_t nfds;
+    if ( status == -1 )
+    {
+	syslog(LOG_NOTICE, "%s: Failed to read line from client on sd [%d]", fn, Client->conn->sd );
+	return( -1 );
+    }
+    
+    if ( Client->TraceOn )
+	Trace_Data( Client, TRACE_CLIENT, ITD_LINE( Client ), status );
+    
+    /* 
+     * This is a command.  What command is it?
+     */
+    CP = memchr( ITD_LINE( Client ), ' ', status );
+    
+    if ( CP )
+    {
+	CP++;
+	Command = Command_Classify( CP, status - ( CP - ITD_LINE( Client ) ),
+				    &Flags );
+	
+	if ( Command == CMD_LOGOUT )
+	{
+	    /*
+	     * Since we want to potentially reuse this server
+	     * connection, we want to return it to an unselected 
+	     * state.  Use UNSELECT if the server supports it.
+	     * Otherwise, EXAMINE a null mailbox.  If SELECT
+	     * caching is enabled, don't do this.
+	     */
+	    if ( ! PC_Struct.enable_select_cache )
+	    {
+		snprintf( SendBuf, sizeof SendBuf - 1,
+			  "C64 %s\r\n", ( (PC_Struct.support_unselect) ? "UNSELECT" : "EXAMINE \"\"" ) );
+		
+		IMAP_Write( Server->conn, SendBuf,
+			    strlen(SendBuf) );
+		/*
+		 * To be more correct, we should send any untagged
+		 * data back to the client before we're done.
+		 */
+		for( ;; )
+		{
+		    /*
+		     * If the server wants to send a literal for
+		     * some reason, bag it...
+		     */
+		    if ( Server->LiteralBytesRemaining )
+			break;
+		    
+		    status = IMAP_Line_Read( Server );
+		    
+		    /*
+		     * If there's an error reading from the server,
+		     * we'll catch it when (if) we try to reuse this
+		     * connection.
+		     */
+		    if ( ( status == -1 ) || ( status == 0 ) )
+			break;
+		    
+		    /*
+		     * If it's not untagged data, we're done.
+		     */
+		    if ( *ITD_LINE( Server ) != '*' )
+			break;
+		    
+		    BytesSent = IMAP_Write( Client->conn, 
+					    ITD_LINE( Server ), status );
+		    if ( BytesSent == -1 )
+		    {
+			syslog( LOG_ERR, "%s: IMAP_Write() failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
+		    }
+		}
+	    } /* if ( ! PC_Struct.enable_select_cache ) */
+	    
+	    memset( Server->ReadBuf, 0, sizeof Server->ReadBuf );
+	    
+	    return( 1 );
+	}
+	
+	/*
+	 * it's some command other than a LOGOUT...
+	 * If we care about SELECT caching, do that now.
+	 */
+	if ( PC_Struct.enable_select_cache )
+	{
+	    if ( Command == CMD_SELECT )
+	    {
+		rc = Handle_Select_Command( Client, Server,
+					    ISC, ITD_LINE( Client ),
+					    status );
+		
+		if ( rc == 0 )
+		    return( 0 );
+		
+		if ( rc < 0 ) // -1 or -2
+		    return( rc );
+		
+		/* 
+		 * if Handle_Select_Command() returned 1,
+		 * fall through the rest of the logic and the
+		 * SELECT command should be proxied without
+		 * looking at the cache.  The cache no longer
+		 * knows what the server has selected.
+		 */
+		Invalidate_Cache_Entry( ISC );
+		
+	    } /* if the command is SELECT */
+	    else
+	    {
+		/*
+		 * If the client was answered from the cache for
+		 * a mailbox the server doesn't have selected, the
+		 * server has to catch up before this command.
+		 */
+		rc = Select_Cache_Sync( Client, Server, ISC );
+		if ( rc < 0 )
+		    return( rc );
+	    }
+	    
+	    /*
+	     * SELECT caching is enabled and we've encountered
+	     * a command other than SELECT.  See if we should
+	     * invalidate the SELECT cache or not.
+	     */
+	    if ( ! ( Flags & COMMAND_SAFE ) )
+	    {
+		Invalidate_Cache_Entry( ISC );
+	    }
+	    
+	    /*
+	     * ...and whether it changes some other mailbox.
+	     */
+	    Select_Cache_Command( ISC, Command, Flags, CP,
+				  status - ( CP - ITD_LINE( Client ) ) );
+	    
+	} /* if ( PC_Struct.enable_select_cache ) */
+	
+    } /* if ( CP ) */
+    
+    
+    /*
+     * Commands the client pipelined behind this one go to the server
+     * in the same write.
+     */
+    Line = ITD_LINE( Client );
+    Len = status;
+    
+    if ( ! Client->LiteralBytesRemaining )
+    {
+	rc = Relay_Gather( Client, ISC );
+	if ( rc == -1 )
+	    return( -1 );
+	
+	Len += rc;
+    }
+    
+    for ( ; ; )
+    {
+	BytesSent = IMAP_Write( Server->conn, Line, Len );
+	if ( BytesSent == -1 )
+	{
+	    if ( errno == EINTR )
+		continue;
+	    
+	    syslog(LOG_ERR, "%s: IMAP_Write() failed sending data to server on sd [%d]: %s", fn, Server->conn->sd, strerror( errno ) );
+	    return( -2 );
+	}
+	break;
+    }
+
+    /* time the round trip from the oldest command not yet answered */
+    if ( ! Server->CommandSent.tv_sec )
+	gettimeofday( &Server->CommandSent, NULL );
+    
+    /* 
+     * If there are literal bytes to read, get them and blast them
+     * off to the server.  Only do this, however, if it's a non
+     * synchronous literal since the server has to send a "go ahead"
+     * otherwise.
+     */
+    if ( ! Client->LiteralBytesRemaining )
+	return( 0 );
+    
+    
+    /*
+     * Do we have to wait for a "go-ahead" from the server?
+     */
+    if ( ! Client->NonSyncLiteral )
+    {
+	/* we have to wait for a go-ahead */
+	status = IMAP_Line_Read( Server );
+	if ( Server->TraceOn )
+	    Trace_Data( Server, TRACE_SERVER, ITD_LINE( Server ), status );
+	
+	if ( *ITD_LINE( Server ) != '+' )
+	    Client->LiteralBytesRemaining = 0;
+	
+	for ( ; ; )
+	{
+	    BytesSent = IMAP_Write( Client->conn, ITD_LINE( Server ), status );
+	    if ( BytesSent == -1 )
+	    {
+		if ( errno == EINTR )
+		    continue;
+		
+		syslog(LOG_ERR, "%s: IMAP_Write() failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
+		return( -1 );
+	    } 
+	    break;
+	}
+    }
+    
+    while ( Client->LiteralBytesRemaining )
+    {
+	status = IMAP_Literal_Read( Client );
+	
+	if ( status == -1 )
+	{
+	    syslog(LOG_NOTICE, "%s: Failed to read string literal from client on sd [%d]", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	
+	if ( Client->TraceOn )
+	    Trace_Data( Client, TRACE_CLIENT, ITD_LINE( Client ), status );
+	
+	/* send any literal data back to the server */
+	for ( ; ; )
+	{
+	    BytesSent = IMAP_Write( Server->conn, ITD_LINE( Client ), status );
+	    if ( BytesSent == -1 )
+	    {
+		if ( errno == EINTR )
+		    continue;
+		
+		syslog(LOG_ERR, "%s: IMAP_Write() failed sending data to server on sd [%d]: %s", fn, Server->conn->sd, strerror( errno ) );
+		return( -2 );
+	    }
+	    break;
+	}
+	
+    }
+    
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Relay_Line_Plain
+ *
+ * Purpose:	Tell whether the next command line from a logged in client
+ *		can simply be forwarded to the server.
+ *
+ * Parameters:	ptr to client ITD_Struct
+ *		ptr to the select cache of the server connection
+ *
+ * Returns:	1 if the whole line is buffered and nothing but forwarding
+ *		it is needed
+ *		0 if not, or if there's no line
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Mirrors the checks done in Relay_Client_Command().  A line
+ *		that isn't plain has to go through there.
+ *--
+ */
+extern int Relay_Line_Plain( ITD_Struct *Client, ISC_Struct *ISC )
+{
+    char *Line;
+    char *EOL;
+    char *CP;
+    unsigned int Command;
+
+    if ( Client->BytesInReadBuffer <= Client->ReadBytesProcessed )
+	return( 0 );
+
+    /* the rest of a line too long for the buffer */
+    if ( Client->MoreData )
+	return( 0 );
+
+    Line = Client->ReadBuf + Client->ReadBytesProcessed;
+    EOL = memchr( Line, '\n',
+		  Client->BytesInReadBuffer - Client->ReadBytesProcessed );
+
+    if ( ! EOL || EOL == Line || *(EOL - 1) != '\r' )
+	return( 0 );
+
+    /* the server has a SELECT answered from the cache to catch up on */
+    if ( ISC->Entry && ISC->Wanted != -1 )
+	return( 0 );
+
+    /* a string literal follows, possibly after a server go-ahead */
+    if ( ( EOL - Line > 2 ) && ( *(EOL - 2) == '}' ) )
+	return( 0 );
+
+    CP = memchr( Line, ' ', EOL - Line );
+    if ( ! CP )
+	return( 1 );
+    CP++;
+
+    Command = Command_Classify( CP, EOL - CP, NULL );
+
+    if ( Command == CMD_LOGOUT )
+	return( 0 );
+
+    if ( PC_Struct.enable_select_cache && Command == CMD_SELECT )
+	return( 0 );
+
+    return( 1 );
+}
+
+
+
+/*++
+ * Function:	Relay_Gather
+ *
+ * Purpose:	Take the plain command lines a client has pipelined behind
+ *		the line just read, so that they can all be sent to the
+ *		server in one write.
+ *
+ * Parameters:	ptr to client ITD_Struct
+ *		ptr to the select cache of the server connection
+ *
+ * Returns:	number of bytes taken
+ *		-1 on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The lines taken directly follow the line just read in the
+ *		client's read buffer, so the caller sends from the start of
+ *		that line through to the end of the last one.  Only lines
+ *		that Relay_Line_Plain() passes are taken, so nothing here
+ *		has to read from the socket, and the first line that isn't
+ *		plain is left for Relay_Client_Command().
+ *--
+ */
+extern int Relay_Gather( ITD_Struct *Client, ISC_Struct *ISC )
+{
+    char *fn = "Relay_Gather()";
+    unsigned int Command;
+    unsigned int Flags;
+    unsigned int Lines = 0;
+    int Bytes = 0;
+    int status;
+    char *CP;
+
+    while ( Relay_Line_Plain( Client, ISC ) )
+    {
+	status = IMAP_Line_Read( Client );
+	if ( status == -1 )
+	{
+	    syslog( LOG_NOTICE, "%s: Failed to read line from client on sd [%d]", fn, Client->conn->sd );
+	    return( -1 );
+	}
+
+	if ( Client->TraceOn )
+	    Trace_Data( Client, TRACE_CLIENT, ITD_LINE( Client ), status );
+
+	if ( PC_Struct.enable_select_cache )
+	{
+	    CP = memchr( ITD_LINE( Client ), ' ', status );
+	    if ( CP )
+	    {
+		CP++;
+		Command = Command_Classify( CP,
+					    status - ( CP - ITD_LINE( Client ) ),
+					    &Flags );
+		if ( ! ( Flags & COMMAND_SAFE ) )
+		    Invalidate_Cache_Entry( ISC );
+		Select_Cache_Command( ISC, Command, Flags, CP,
+				      status - ( CP - ITD_LINE( Client ) ) );
+	    }
+	}
+
+	Bytes += status;
+	Lines++;
+    }
+
+    /* each of them would have been a write of its own */
+    if ( Lines )
+	COUNT( RelayWritesSaved, Lines );
+
+    return( Bytes );
+}
+
+
+
+/*++
+ * Function:	Relay_Finish
+ *
+ * Purpose:	Clean up the server side of a proxy session once the relay
+ *		is over.
+ *
+ * Parameters:	ptr to client ITD_Struct
+ *		ptr to server ITD_Struct
+ *		int return code from the relay (see Raw_Proxy())
+ *
+ * Returns:	the relay return code, except that a server failure (-2)
+ *		is turned into -1 once the server connection is invalidated.
+ *
+ * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
+ *--
+ */
+extern int Relay_Finish( ITD_Struct *Client, ITD_Struct *Server, int rc )
+{
+    if ( Server->TraceOn )
+	Trace_End( Server );
+
+    if ( rc == -2 )
+    {
+        ICC_Invalidate( Server->conn->ICC );
+        return ( -1 );
+    }
+
+    /*
+     * It's not necessary to take out the trace mutex here.  The trace
+     * targets are only looked at during login; from then on TraceOn
+     * belongs to this session alone.
+     */
+    Client->TraceOn = 0;
+    Server->TraceOn = 0;
+
+    /* the next user of this connection starts from what the server has */
+    Server->conn->ISC.Wanted = -1;
+    Select_Cache_Observe_Reset( &Server->conn->ISC );
+    
+    /* update the logout time for this cached connection */
+    ICC_Logout( Server->conn->ICC );
+    
+    return( rc );
+}
+
+
+
+
+/*++
+ * Function:	Answer_Caught_Logout
+ *
+ * Purpose:	Respond to a LOGOUT that Raw_Proxy() (or the event engine)
+ *		caught from a logged in client.
+ *
+ * Parameters:	ptr to ITD_Struct for client connection.  The LOGOUT line
+ *		is expected to be the last line read into its buffer.
+ *
+ * Returns:	nada
+ *
+ * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
+ *--
+ */
+extern void Answer_Caught_Logout( ITD_Struct *Client )
+{
+    char *Tag;
+    char *Lasts;
+    char S_Tag[MAXTAGLEN];
+
+    Tag = memtok( ITD_LINE( Client ), Client->ReadBuf + Client->ReadBytesProcessed,
+		  &Lasts );
+    if ( Tag )
+    {
+	strncpy( S_Tag, Tag, MAXTAGLEN - 1 );
+	S_Tag[ MAXTAGLEN - 1 ] = '\0';
+	cmd_logout( Client, S_Tag );
+    }
+}
+
+
+
+/*++
+ * Function:	Handle_Preauth_Line
+ *
+ * Purpose:	Read and act upon one line of unauthenticated traffic from
+ *		an IMAP client.
+ *
+ * Parameters:	ptr to ITD_Struct for client connection.
+ *		ptr to a BUFSIZE buffer holding the queued pre-auth command
+ *		for this client (kept by the caller between calls).
+ *
+ * Returns:	0 if the caller should keep reading commands
+ *		1 if the session is over and the client should be closed
+ *		2 if the session was handed over to the event engine
+ *		-1 on failure (the client should be closed)
+ *
+ * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
+ *
+ * Notes:	This only ever handles the following IMAP commands
+ *		(rfc 2060):  NOOP, CAPABILITY, AUTHENTICATE, LOGIN, and
+ *		LOGOUT.  Also, it handles the commands that are internal
+ *		to the proxy server such as XPROXY_TRACE, XPROXY_UNTRACE,
+ *		XPROXY_NEWLOG, XPROXY_DUMPICC, XPROXY_RESETCOUNTERS and
+ *		XPROXY_VERSION.
+ *
+ *              None of these commands should ever have the need to send
+ *              a boatload of data, so we avoid some error checking and
+ *              undue complexity in this routine by just making sure that
+ *              any given read from the client doesn't fill our read
+ *              buffer.  If it does, we just drop the connection.
+ *
+ *		The event engine only calls this from its worker threads
+ *		once a complete line is buffered, so the simple commands
+ *		never block there.
+ *--
+ */
+extern int Handle_Preauth_Line( ITD_Struct *Client, char *QueuedPreauthCommand )
+{
+    char *fn = "Handle_Preauth_Line";
+    char *Tag;
+    char *Command;
+    char *Username;
+    char *AuthMech;
+    char *Lasts;
+    char *EndOfLine;
+    char *CP;
+    char SendBuf[BUFSIZE];
+    int BytesRead;
+    int rc;
+    unsigned int Id;
+    unsigned int BufLen = BUFSIZE - 1;
+    char S_UserName[MAXUSERNAMELEN];
+    char S_Tag[MAXTAGLEN];
+    char S_Password[MAXPASSWDLEN];
+    unsigned char LiteralFlag;          /* flag to deal with passwords sent */
+					/* as string literals */
+
+    LiteralFlag = NON_LITERAL_PASSWORD;
+
+    BytesRead = IMAP_Line_Read( Client );
+
+    if ( BytesRead == -1 )
+    {
+	return( -1 );
+    }
+
+    if ( Client->MoreData )
+    {
+	syslog( LOG_WARNING, "%s: Too much data read from unauthenticated client.  Dropping the connection.", fn );
+	return( -1 );
+    }
+
+
+    /* First grab the tag */
+
+    EndOfLine = ITD_LINE( Client ) + BytesRead;
+
+    Tag = memtok( ITD_LINE( Client ), EndOfLine, &Lasts );
+    if ( ( !Tag ) ||
+	 ( !imparse_isatom( Tag ) ) ||
+	 ( Tag[0] == '*' && !Tag[1] ) )
+    {
+	snprintf( SendBuf, BufLen, "* BAD Invalid tag\r\n" );
+	if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+	{
+	    return( -1 );
+	}
+	return( 0 );
+    }
+
+
+    Command = memtok( NULL, EndOfLine, &Lasts );
+    if ( !Command )
+    {
+	/* Tag with no command */
+	snprintf( SendBuf, BufLen, "%s BAD Null command\r\n", Tag );
+	if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+	{
+	    return( -1 );
+	}
+	return( 0 );
+    }
+
+    /*
+     * We should have a valid tag and command now.  React as
+     * appropriate...
+     */
+    strncpy( S_Tag, Tag, MAXTAGLEN - 1 );
+    S_Tag[ MAXTAGLEN - 1 ] = '\0';
+
+    Id = Command_Classify( Command, strlen( Command ), NULL );
+
+    if ( Id == CMD_ID )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of ID command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+
+// TODO: in the future, we can capture more than one of these in a linked list, but for now, just use the last one we get
+	// Store the command for later
+	CP = EndOfLine - 2;
+	*CP = '\0';
+	Lasts++;
+
+	// make sure we don't go past end (is this necessary?)
+	if ( Lasts > CP )
+	{
+	    Lasts = CP;
+	}
+	snprintf( QueuedPreauthCommand, BufLen, "ID %s", Lasts );
+
+	// Fake response with a NOOP
+	cmd_noop( Client, S_Tag );
+	return( 0 );
+    }
+    if ( Id == CMD_NOOP )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of NOOP command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+
+	cmd_noop( Client, S_Tag );
+	return( 0 );
+    }
+    else if ( Id == CMD_CAPABILITY )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of CAPABILITY command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	cmd_capability( Client, S_Tag );
+	return( 0 );
+    }
+    else if ( Id == CMD_AUTHENTICATE )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of AUTHENTICATE command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	AuthMech = memtok( NULL, EndOfLine, &Lasts );
+	if ( !AuthMech )
+	{
+	    snprintf( SendBuf, BufLen, "%s BAD Missing required argument to Authenticate\r\n", Tag );
+	    if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+	    {
+		return( -1 );
+	    }
+	    return( 0 );
+	}
+
+	if ( !strcasecmp( (const char *)AuthMech, "LOGIN" ) )
+	{
+	    rc = cmd_authenticate_login( Client, S_Tag, QueuedPreauthCommand );
+
+	    if ( rc == 0 )
+		return( 0 );
+
+	    if ( rc == 2 )
+		return( 2 );
+
+	    if ( rc == 1 )
+	    {
+		/* caught a logout */
+		Answer_Caught_Logout( Client );
+	    }
+
+	    return( 1 );
+	}
+	else if ( !strcasecmp( (const char *)AuthMech, "PLAIN" ) )
+	{
+	    /*
+	     * we handle this mechanism, but internally; not as
+	     * requested by a client
+	     */
+	    snprintf( SendBuf, BufLen, "%s NO no mechanism available, we do something different!\r\n", Tag );
+	    if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+	    {
+		return( -1 );
+	    }
+	    return( 0 );
+	}
+	else
+	{
+	    /*
+	     * an auth mechanism we can't handle.
+	     */
+	    snprintf( SendBuf, BufLen, "%s NO no mechanism available\r\n", Tag );
+	    if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+	    {
+		return( -1 );
+	    }
+	    return( 0 );
+	}
+
+    }
+    else if ( Id == CMD_LOGOUT )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of LOGOUT command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	cmd_logout( Client, S_Tag );
+	return( 1 );
+    }
+    else if ( Id == CMD_XPROXY_TRACE )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_TRACE command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	Username = memtok( NULL, EndOfLine, &Lasts );
+	cmd_trace( Client, S_Tag, Username );
+	return( 0 );
+    }
+    else if ( Id == CMD_XPROXY_UNTRACE )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_UNTRACE command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	Username = memtok( NULL, EndOfLine, &Lasts );
+	cmd_untrace( Client, S_Tag, Username );
+	return( 0 );
+    }
+    else if ( Id == CMD_XPROXY_DUMPICC )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_DUMPICC command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	cmd_dumpicc( Client, S_Tag );
+	return( 0 );
+    }
+    else if ( Id == CMD_XPROXY_RESETCOUNTERS )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_RESETCOUNTERS command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	cmd_resetcounters( Client, S_Tag );
+	return( 0 );
+    }
+    else if ( Id == CMD_XPROXY_NEWLOG )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_NEWLOG command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	cmd_newlog( Client, S_Tag );
+	return( 0 );
+    }
+    else if ( Id == CMD_XPROXY_VERSION )
+    {
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_VERSION command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+	cmd_version( Client, S_Tag );
+	return( 0 );
+    }
+    else if ( Id == CMD_LOGIN )
+    {
+	/*
+	 * Got a LOGIN command.  validate that we got all four required
+	 * tokens (Tag, Command, Username, Password) before we waste
+	 * a connection to the IMAP server.
+	 */
+	Username = memtok( NULL, EndOfLine, &Lasts );
+	if ( !Username )
+	{
+	    /* no username -- complain back to the client */
+	    snprintf( SendBuf, BufLen, "%s BAD Missing required argument to Login\r\n", Tag );
+	    if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+	    {
+		return( -1 );
+	    }
+	    return( 0 );
+	}
+	strncpy( S_UserName, Username, sizeof S_UserName - 1 );
+	S_UserName[ sizeof S_UserName - 1 ] = '\0';
+
+	/*
+	 * Clients can send the username as a literal bytestream.  Check
+	 * for that here (the username we grabbed above will actually
+	 * be the literal token itself (the ONLY token on the line)
+	 * instead of the real username).
+	 */
+	if ( Client->LiteralBytesRemaining
+	 && memtok( NULL, EndOfLine, &Lasts ) == NULL
+	 && S_UserName[ 0 ] == '{' && S_UserName[ strlen( S_UserName ) - 1 ] == '}' )
+	{
+
+	    if ( ( sizeof S_UserName - 1 ) < Client->LiteralBytesRemaining )
+	    {
+		syslog( LOG_ERR, "%s: username length would cause buffer overflow.", fn );
+		/*
+		 * we have to at least eat the literal bytestream because
+		 * of the way our I/O routines work.
+		 */
+		memset( Client->ReadBuf, 0, sizeof Client->ReadBuf );
+		Client->BytesInReadBuffer = 0;
+		Client->ReadBytesProcessed = 0;
+		Client->LineStart = 0;
+		Client->LiteralBytesRemaining = 0;
+		Client->NonSyncLiteral = 0;
+		Client->MoreData = 0;
+
+		snprintf( SendBuf, BufLen, "%s NO LOGIN failed\r\n", S_Tag );
+		if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+		{
+		    return( -1 );
+		}
+		return( 0 );
+	    }
+
+	    CP = S_UserName;
+
+	    if ( ! Client->NonSyncLiteral )
+	    {
+		sprintf( SendBuf, "+ go ahead\r\n" );
+		if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+		{
+		    return( -1 );
+		}
+	    }
+
+	    while ( Client->LiteralBytesRemaining )
+	    {
+		BytesRead = IMAP_Literal_Read( Client );
+
+		if ( BytesRead == -1 )
+		{
+		    syslog( LOG_NOTICE, "%s: Failed to read string literal from client on login.", fn );
+		    snprintf( SendBuf, BufLen, "%s NO LOGIN failed\r\n", S_Tag );
+		    if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+		    {
+			return( -1 );
+		    }
+		    return( 0 );
+		}
+
+		memcpy ( (void *)CP, (const void *)ITD_LINE( Client ), BytesRead );
+		CP += BytesRead;
+	    }
+	    *CP = '\0';
+
+	    /*
+	     * Thankfully, IMAP_Literal_Read() leaves the rest of
+	     * the line in buffer, so we can read the rest now and
+	     * let the code below grab the password as usual, being
+	     * careful to reset our read/token pointers
+	     */
+	    BytesRead = IMAP_Line_Read( Client );
+	    EndOfLine = ITD_LINE( Client ) + BytesRead;
+	    Lasts = ITD_LINE( Client );
+
+	}
+
+	/*
+	 * Clients can send the password as a literal bytestream.  Check
+	 * for that here.
+	 */
+	if ( Client->LiteralBytesRemaining )
+	{
+	    if ( ( sizeof S_Password - 1 ) < Client->LiteralBytesRemaining )
+	    {
+		syslog( LOG_ERR, "%s: password length would cause buffer overflow.", fn );
+		/*
+		 * we have to at least eat the literal bytestream because
+		 * of the way our I/O routines work.
+		 */
+		memset( Client->ReadBuf, 0, sizeof Client->ReadBuf );
+		Client->BytesInReadBuffer = 0;
+		Client->ReadBytesProcessed = 0;
+		Client->LineStart = 0;
+		Client->LiteralBytesRemaining = 0;
+		Client->NonSyncLiteral = 0;
+		Client->MoreData = 0;
+
+		snprintf( SendBuf, BufLen, "%s NO LOGIN failed\r\n", S_Tag );
+		if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+		{
+		    return( -1 );
+		}
+		return( 0 );
+	    }
+
+	    LiteralFlag = LITERAL_PASSWORD;
+
+	    CP = S_Password;
+
+	    if ( ! Client->NonSyncLiteral )
+	    {
+		sprintf( SendBuf, "+ go ahead\r\n" );
+		if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+		{
+		    return( -1 );
+		}
+	    }
+
+	    while ( Client->LiteralBytesRemaining )
+	    {
+		BytesRead = IMAP_Literal_Read( Client );
+
+		if ( BytesRead == -1 )
+		{
+		    syslog( LOG_NOTICE, "%s: Failed to read string literal from client on login.", fn );
+		    snprintf( SendBuf, BufLen, "%s NO LOGIN failed\r\n", S_Tag );
+		    if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+		    {
+			return( -1 );
+		    }
+		    return( 0 );
+		}
+
+		memcpy ( (void *)CP, (const void *)ITD_LINE( Client ), BytesRead );
+		CP += BytesRead;
+	    }
+	    *CP = '\0';
+
+	    /*
+	     * I'm not sure if IMAP_Literal_Read() is written entirely
+	     * in a correct fashion.  There will be a CRLF at the end
+	     * of the literal bytestream that it doesn't deal with.
+	     * If we don't eat that here, it will be read as a separate
+	     * (Null) command...  Reading it here is more of a hack than
+	     * a real solution, but I hesitate to fiddle with 
+	     * IMAP_Literal_Read() right now since it works properly
+	     * otherwise.
+	     * Note: from the perspective of a naive user of this function
+	     * (elsewhere), the fact that it leaves the rest of the line
+	     * in the buffer is very helpful, so I'd say don't change that
+	     * behavior!
+	     */
+	    rc = IMAP_Line_Read( Client );
+	}
+	else
+	{
+	    /*
+	     * The password is just being sent as a plain old string.
+	     * Can't use memtok() because it uses a single space as the
+	     * token delimeter and any password with a space in it would
+	     * break.
+	     */
+	    CP = EndOfLine - 2;
+	    Lasts++;
+
+	    if ( Lasts >= CP )
+	    {
+		/* no password -- complain back to the client */
+		snprintf( SendBuf, BufLen, "%s BAD Missing required argument to Login\r\n", S_Tag );
+		if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+		{
+		    return( -1 );
+		}
+		return( 0 );
+	    }
+
+	    *CP = '\0';
+	    strncpy( S_Password, Lasts, sizeof S_Password - 1 );
+	    S_Password[ sizeof S_Password - 1 ] = '\0';
+	}
+
+
+
+	/*
+	 * wipe out the the client read buffer since a copy of the
+	 * password lives in there.
+	 */
+	memset( Client->ReadBuf, 0, sizeof Client->ReadBuf );
+	Client->BytesInReadBuffer = 0;
+	Client->ReadBytesProcessed = 0;
+	Client->LineStart = 0;
+	Client->LiteralBytesRemaining = 0;
+	Client->NonSyncLiteral = 0;
+	Client->MoreData = 0;
+
+
+	rc = cmd_login( Client, S_UserName, S_Password, sizeof S_Password, S_Tag, LiteralFlag, QueuedPreauthCommand );
+
+	if ( rc == 0)
+	    return( 0 );
+
+	/*
+	 * The event engine took over the relay for this session.
+	 */
+	if ( rc == 2 )
+	    return( 2 );
+
+	if ( rc == 1)
+	{
+	    /*
+	     * We caught a LOGOUT from the client.  Respond with
+	     * a successful logout back to the client.
+	     */
+	    Answer_Caught_Logout( Client );
+	}
+
+	/* 
+	 * tell the caller to close the client side socket.
+	 */
+	return( 1 );
+
+    }
+    else
+    {
+	/*
+	 * We got a command that we don't understand.  Treat this the
+	 * same way the cyrus implementation does -- tell the client to
+	 * log in first.
+	 */
+	if ( Client->LiteralBytesRemaining )
+	{
+	    syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of unknown command -- disconnecting client", fn, Client->conn->sd );
+	    return( -1 );
+	}
+
+	snprintf( SendBuf, BufLen, "%s BAD Please login first\r\n", Tag );
+	if ( IMAP_Write( Client->conn, SendBuf, strlen(SendBuf) ) == -1 )
+	{
+	    return( -1 );
+	}
+	return( 0 );
+
+    }
+}
+
+
+
+/*++
+ * Function:	HandleRequest
+ *
+ * Purpose:	Handle incoming IMAP requests (as a thread)
+ *
+ * Parameters:	int, client socket descriptor
+ *
+ * Returns:	nada
+ *
+ * Authors:	Dave McMurtrie <davemcmurtrie@hotmail.com>
+ *
+ * Notes:	This function actually only handles unauthenticated
+ *		traffic from an IMAP client.  Each command line is passed
+ *		to Handle_Preauth_Line().
+ *--
+ */
+extern void HandleRequest( int clientsd )
+{
+    char *fn = "HandleRequest";
+    ITD_Struct Client;
+    ICD_Struct conn;
+    char S_QueuedPreauthCommand[BUFSIZE] = "";
+    int rc;
+    
+    struct pollfd fds[1];
+    nfds_t nfds;
     int PollFailCount;
     
     PollFailCount = 0;
@@ -1634,7 +2516,7 @@ extern void HandleRequest( int clientsd )
     if ( IMAP_Write( Client.conn, Banner, BannerLen ) == -1 )
     {
 	syslog(LOG_ERR, "%s: IMAP_Write() failed: %s.  Closing client connection.", fn, strerror( errno ) );
-	IMAPCount->CurrentClientConnections--;
+	COUNT( CurrentClientConnections, -1 );
 	close( Client.conn->sd );
 	return;
     }
@@ -1649,8 +2531,6 @@ extern void HandleRequest( int clientsd )
     /* start a command loop */
     for ( ; ; )
     {
-	LiteralFlag = NON_LITERAL_PASSWORD;
-
 	fds[ 0 ].revents = 0;
 	
 	rc = poll( fds, nfds, POLL_TIMEOUT );
@@ -1661,7 +2541,7 @@ extern void HandleRequest( int clientsd )
 	     * our client timeout was exceeded.  Drop this connection.
 	     */
 	    syslog(LOG_ERR, "%s: no data received from client for %d minutes.  Closing client connection.", fn, POLL_TIMEOUT_MINUTES );
-	    IMAPCount->CurrentClientConnections--;
+	    COUNT( CurrentClientConnections, -1 );
 	    close( Client.conn->sd );
 	    return;
 	}
@@ -1683,7 +2563,7 @@ extern void HandleRequest( int clientsd )
 		if ( PollFailCount == 5 )
 		{
 		    syslog(LOG_ERR, "%s: poll() returned EAGAIN.  Exceeded retry limit.  Closing client connection.", fn );
-		    IMAPCount->CurrentClientConnections--;
+		    COUNT( CurrentClientConnections, -1 );
 		    close( Client.conn->sd );
 		    return;
 		}
@@ -1695,568 +2575,26 @@ extern void HandleRequest( int clientsd )
 	    
 	    /* anything else, we're really jacked about it. */
 	    syslog(LOG_ERR, "%s: poll() failed: %s -- Closing connection.", fn, strerror( errno ) );
-	    IMAPCount->CurrentClientConnections--;
+	    COUNT( CurrentClientConnections, -1 );
 	    close( Client.conn->sd );
 	    return;
 	}
 	
 	PollFailCount = 0;
 
-	BytesRead = IMAP_Line_Read( &Client );
-
-	if ( BytesRead == -1 )
-	{
-	    IMAPCount->CurrentClientConnections--;
-	    close( Client.conn->sd );
-	    return;
-	}
-	
-	if ( Client.MoreData )
-	{
-	    syslog( LOG_WARNING, "%s: Too much data read from unauthenticated client.  Dropping the connection.", fn );
-	    IMAPCount->CurrentClientConnections--;
-	    close( Client.conn->sd );
-	    return;
-	}
-	
-	
-    	/* First grab the tag */
-	
-	EndOfLine = Client.ReadBuf + BytesRead;
+	rc = Handle_Preauth_Line( &Client, S_QueuedPreauthCommand );
 
-	Tag = memtok( Client.ReadBuf, EndOfLine, &Lasts );
-	if ( ( !Tag ) ||
-	     ( !imparse_isatom( Tag ) ) ||
-	     ( Tag[0] == '*' && !Tag[1] ) )
-	{
-	    snprintf( SendBuf, BufLen, "* BAD Invalid tag\r\n" );
-	    if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-	    {
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
+	if ( rc == 0 )
 	    continue;
-	}
-	
 
-	Command = memtok( NULL, EndOfLine, &Lasts );
-	if ( !Command )
-	{
-	    /* Tag with no command */
-	    snprintf( SendBuf, BufLen, "%s BAD Null command\r\n", Tag );
-	    if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-	    {
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    continue;
-	}
-	
 	/*
-	 * We should have a valid tag and command now.  React as
-	 * appropriate...
+	 * Either the session is over or something broke.  Close the
+	 * client side socket.
 	 */
-	strncpy( S_Tag, Tag, MAXTAGLEN - 1 );
-	S_Tag[ MAXTAGLEN - 1 ] = '\0';
-	
-	if ( ! strcasecmp( (const char *)Command, "ID" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of ID command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    
-// TODO: in the future, we can capture more than one of these in a linked list, but for now, just use the last one we get
-	    // Store the command for later
-	    CP = EndOfLine - 2;
-	    *CP = '\0';
-	    Lasts++;
-		
-	    // make sure we don't go past end (is this necessary?)
-	    if ( Lasts > CP )
-	    {
-		Lasts = CP;
-	    }
-	    snprintf( S_QueuedPreauthCommand, BufLen, "ID %s", Lasts );
-
-	    // Fake response with a NOOP
-	    cmd_noop( &Client, S_Tag );
-	    continue;
-	}
-	if ( ! strcasecmp( (const char *)Command, "NOOP" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of NOOP command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    
-	    cmd_noop( &Client, S_Tag );
-	    continue;
-	}
-	else if ( ! strcasecmp( (const char *)Command, "CAPABILITY" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of CAPABILITY command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    cmd_capability( &Client, S_Tag );
-	    continue;
-	}
-	else if ( ! strcasecmp( (const char *)Command, "AUTHENTICATE" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of AUTHENTICATE command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    AuthMech = memtok( NULL, EndOfLine, &Lasts );
-	    if ( !AuthMech )
-	    {
-		snprintf( SendBuf, BufLen, "%s BAD Missing required argument to Authenticate\r\n", Tag );
-		if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		{
-		    IMAPCount->CurrentClientConnections--;
-		    close( Client.conn->sd );
-		    return;
-		}
-		continue;
-	    }
-	    
-	    if ( !strcasecmp( (const char *)AuthMech, "LOGIN" ) )
-	    {
-		rc = cmd_authenticate_login( &Client, S_Tag, S_QueuedPreauthCommand );
-
-		if ( rc == 0 )
-		    continue;
-		
-		if ( rc == 1 )
-		{
-		    /* caught a logout */
-		    Tag = memtok( Client.ReadBuf, EndOfLine, &Lasts );
-		    if ( Tag )
-		    {
-			strncpy( S_Tag, Tag, MAXTAGLEN - 1 );
-			S_Tag[ MAXTAGLEN - 1 ] = '\0';
-			cmd_logout( &Client, S_Tag );
-		    }
-		}
-		
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    else if ( !strcasecmp( (const char *)AuthMech, "PLAIN" ) )
-	    {
-		/*
-		 * we handle this mechanism, but internally; not as
-		 * requested by a client
-		 */
-		snprintf( SendBuf, BufLen, "%s NO no mechanism available, we do something different!\r\n", Tag );
-		if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		{
-		    IMAPCount->CurrentClientConnections--;
-		    close( Client.conn->sd );
-		    return;
-		}
-		continue;
-	    }
-	    else
-	    {
-		/*
-		 * an auth mechanism we can't handle.
-		 */
-		snprintf( SendBuf, BufLen, "%s NO no mechanism available\r\n", Tag );
-		if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		{
-		    IMAPCount->CurrentClientConnections--;
-		    close( Client.conn->sd );
-		    return;
-		}
-		continue;
-	    }
-	    
-	}
-	else if ( ! strcasecmp( (const char *)Command, "LOGOUT" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of LOGOUT command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    cmd_logout( &Client, S_Tag );
-	    IMAPCount->CurrentClientConnections--;
-	    close( Client.conn->sd );
-	    return;
-	}
-	else if ( ! strcasecmp( (const char *)Command, "XPROXY_TRACE" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_TRACE command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    Username = memtok( NULL, EndOfLine, &Lasts );
-	    cmd_trace( &Client, S_Tag, Username );
-	    continue;
-	}
-	else if ( ! strcasecmp( (const char *)Command, "XPROXY_DUMPICC" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_DUMPICC command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    cmd_dumpicc( &Client, S_Tag );
-	    continue;
-	}
-	else if ( ! strcasecmp( (const char *)Command, "XPROXY_RESETCOUNTERS" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_RESETCOUNTERS command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    cmd_resetcounters( &Client, S_Tag );
-	    continue;
-	}
-	else if ( ! strcasecmp( (const char *)Command, "XPROXY_NEWLOG" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_NEWLOG command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    cmd_newlog( &Client, S_Tag );
-	    continue;
-	}
-	else if ( ! strcasecmp( (const char *)Command, "XPROXY_VERSION" ) )
-	{
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of P_VERSION command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    cmd_version( &Client, S_Tag );
-	    continue;
-	}
-	else if ( ! strcasecmp( (const char *)Command, "LOGIN" ) )
-	{
-	    /*
-	     * Got a LOGIN command.  validate that we got all four required
-	     * tokens (Tag, Command, Username, Password) before we waste
-	     * a connection to the IMAP server.
-	     */
-	    Username = memtok( NULL, EndOfLine, &Lasts );
-	    if ( !Username )
-	    {
-		/* no username -- complain back to the client */
-		snprintf( SendBuf, BufLen, "%s BAD Missing required argument to Login\r\n", Tag );
-		if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		{
-		    IMAPCount->CurrentClientConnections--;
-		    close( Client.conn->sd );
-		    return;
-		}
-		continue;
-	    }
-	    strncpy( S_UserName, Username, sizeof S_UserName - 1 );
-	    S_UserName[ sizeof S_UserName - 1 ] = '\0';
-	    
-	    /*
-	     * Clients can send the username as a literal bytestream.  Check
-	     * for that here (the username we grabbed above will actually
-	     * be the literal token itself (the ONLY token on the line)
-	     * instead of the real username).
-	     */
-	    if ( Client.LiteralBytesRemaining
-	     && memtok( NULL, EndOfLine, &Lasts ) == NULL
-	     && S_UserName[ 0 ] == '{' && S_UserName[ strlen( S_UserName ) - 1 ] == '}' )
-	    {
-
-		if ( ( sizeof S_UserName - 1 ) < Client.LiteralBytesRemaining )
-		{
-		    syslog( LOG_ERR, "%s: username length would cause buffer overflow.", fn );
-		    /*
-		     * we have to at least eat the literal bytestream because
-		     * of the way our I/O routines work.
-		     */
-		    memset( &Client.ReadBuf, 0, sizeof Client.ReadBuf );
-		    Client.BytesInReadBuffer = 0;
-		    Client.ReadBytesProcessed = 0;
-		    Client.LiteralBytesRemaining = 0;
-		    Client.NonSyncLiteral = 0;
-		    Client.MoreData = 0;
-		    
-		    snprintf( SendBuf, BufLen, "%s NO LOGIN failed\r\n", S_Tag );
-		    if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		    {
-			IMAPCount->CurrentClientConnections--;
-			close( Client.conn->sd );
-			return;
-		    }
-		    continue;
-		}
-
-		CP = S_UserName;
-
-		if ( ! Client.NonSyncLiteral )
-		{
-		    sprintf( SendBuf, "+ go ahead\r\n" );
-		    if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		    {
-			IMAPCount->CurrentClientConnections--;
-			close( Client.conn->sd );
-			return;
-		    }
-		}
-
-		while ( Client.LiteralBytesRemaining )
-		{
-		    BytesRead = IMAP_Literal_Read( &Client );
-		    
-		    if ( BytesRead == -1 )
-		    {
-			syslog( LOG_NOTICE, "%s: Failed to read string literal from client on login.", fn );
-			snprintf( SendBuf, BufLen, "%s NO LOGIN failed\r\n", S_Tag );
-			if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-			{
-			    IMAPCount->CurrentClientConnections--;
-			    close( Client.conn->sd );
-			    return;
-			}
-			continue;
-		    }
-		    
-		    memcpy ( (void *)CP, (const void *)Client.ReadBuf, BytesRead );
-		    CP += BytesRead;
-		}
-		*CP = '\0';
-
-		/*
-		 * Thankfully, IMAP_Literal_Read() leaves the rest of
-		 * the line in buffer, so we can read the rest now and
-		 * let the code below grab the password as usual, being
-		 * careful to reset our read/token pointers
-		 */
-		BytesRead = IMAP_Line_Read( &Client );
-		EndOfLine = Client.ReadBuf + BytesRead;
-		Lasts = Client.ReadBuf;
-
-	    }
-
-	    /*
-	     * Clients can send the password as a literal bytestream.  Check
-	     * for that here.
-	     */
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		if ( ( sizeof S_Password - 1 ) < Client.LiteralBytesRemaining )
-		{
-		    syslog( LOG_ERR, "%s: password length would cause buffer overflow.", fn );
-		    /*
-		     * we have to at least eat the literal bytestream because
-		     * of the way our I/O routines work.
-		     */
-		    memset( &Client.ReadBuf, 0, sizeof Client.ReadBuf );
-		    Client.BytesInReadBuffer = 0;
-		    Client.ReadBytesProcessed = 0;
-		    Client.LiteralBytesRemaining = 0;
-		    Client.NonSyncLiteral = 0;
-		    Client.MoreData = 0;
-
-		    snprintf( SendBuf, BufLen, "%s NO LOGIN failed\r\n", S_Tag );
-		    if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		    {
-			IMAPCount->CurrentClientConnections--;
-			close( Client.conn->sd );
-			return;
-		    }
-		    continue;
-		}
-	
-		LiteralFlag = LITERAL_PASSWORD;
-		
-		CP = S_Password;
-
-		if ( ! Client.NonSyncLiteral )
-		{
-		    sprintf( SendBuf, "+ go ahead\r\n" );
-		    if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		    {
-			IMAPCount->CurrentClientConnections--;
-			close( Client.conn->sd );
-			return;
-		    }
-		}
-
-		while ( Client.LiteralBytesRemaining )
-		{
-		    BytesRead = IMAP_Literal_Read( &Client );
-		    
-		    if ( BytesRead == -1 )
-		    {
-			syslog( LOG_NOTICE, "%s: Failed to read string literal from client on login.", fn );
-			snprintf( SendBuf, BufLen, "%s NO LOGIN failed\r\n", S_Tag );
-			if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-			{
-			    IMAPCount->CurrentClientConnections--;
-			    close( Client.conn->sd );
-			    return;
-			}
-			continue;
-		    }
-		    
-		    memcpy ( (void *)CP, (const void *)Client.ReadBuf, BytesRead );
-		    CP += BytesRead;
-		}
-		*CP = '\0';
-
-		/*
-		 * I'm not sure if IMAP_Literal_Read() is written entirely
-		 * in a correct fashion.  There will be a CRLF at the end
-		 * of the literal bytestream that it doesn't deal with.
-		 * If we don't eat that here, it will be read as a separate
-		 * (Null) command...  Reading it here is more of a hack than
-		 * a real solution, but I hesitate to fiddle with 
-		 * IMAP_Literal_Read() right now since it works properly
-		 * otherwise.
-		 * Note: from the perspective of a naive user of this function
-		 * (elsewhere), the fact that it leaves the rest of the line
-		 * in the buffer is very helpful, so I'd say don't change that
-		 * behavior!
-		 */
-		rc = IMAP_Line_Read( &Client );
-	    }
-	    else
-	    {
-		/*
-		 * The password is just being sent as a plain old string.
-		 * Can't use memtok() because it uses a single space as the
-		 * token delimeter and any password with a space in it would
-		 * break.
-		 */
-		CP = EndOfLine - 2;
-		Lasts++;
-		
-		if ( Lasts >= CP )
-		{
-		    /* no password -- complain back to the client */
-		    snprintf( SendBuf, BufLen, "%s BAD Missing required argument to Login\r\n", S_Tag );
-		    if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-		    {
-			IMAPCount->CurrentClientConnections--;
-			close( Client.conn->sd );
-			return;
-		    }
-		    continue;
-		}
-		
-		*CP = '\0';
-		strncpy( S_Password, Lasts, sizeof S_Password - 1 );
-		S_Password[ sizeof S_Password - 1 ] = '\0';
-	    }
-	    
-
-	    
-	    /*
-	     * wipe out the the client read buffer since a copy of the
-	     * password lives in there.
-	     */
-	    memset( &Client.ReadBuf, 0, sizeof Client.ReadBuf );
-	    Client.BytesInReadBuffer = 0;
-	    Client.ReadBytesProcessed = 0;
-	    Client.LiteralBytesRemaining = 0;
-	    Client.NonSyncLiteral = 0;
-	    Client.MoreData = 0;
-	    
-	    
-	    rc = cmd_login( &Client, S_UserName, S_Password, sizeof S_Password, S_Tag, LiteralFlag, S_QueuedPreauthCommand );
-	    
-	    if ( rc == 0)
-		continue;
-	    
-	    if ( rc == 1)
-	    {
-		/*
-		 * We caught a LOGOUT from the client.  Respond with
-		 * a successful logout back to the client.
-		 */
-		Tag = memtok( Client.ReadBuf, EndOfLine, &Lasts );
-		if ( Tag )
-		{
-		    strncpy( S_Tag, Tag, MAXTAGLEN - 1 );
-		    S_Tag[ MAXTAGLEN - 1 ] = '\0';
-		    cmd_logout( &Client, S_Tag );
-		}
-	    }
-	    
-	    /* 
-	     * close the client side socket.
-	     */
-	    IMAPCount->CurrentClientConnections--;
-	    close( Client.conn->sd );
-	    return;
-	    
-	}
-	else
-	{
-	    /*
-	     * We got a command that we don't understand.  Treat this the
-	     * same way the cyrus implementation does -- tell the client to
-	     * log in first.
-	     */
-	    if ( Client.LiteralBytesRemaining )
-	    {
-		syslog( LOG_ERR, "%s: Unexpected literal specifier read from client on sd [%d] as part of unknown command -- disconnecting client", fn, Client.conn->sd );
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    
-	    snprintf( SendBuf, BufLen, "%s BAD Please login first\r\n", Tag );
-	    if ( IMAP_Write( Client.conn, SendBuf, strlen(SendBuf) ) == -1 )
-	    {
-		IMAPCount->CurrentClientConnections--;
-		close( Client.conn->sd );
-		return;
-	    }
-	    continue;
-	    
-	}
-	
-	
+	COUNT( CurrentClientConnections, -1 );
+	close( Client.conn->sd );
+	return;
     }  /* End of infinite for loop */
-    
-    
-    /* should never reach this code */
-    IMAPCount->CurrentClientConnections--;
-    close( Client.conn->sd );
-    return;
 }
 
 /*
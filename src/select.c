@@ -51,8 +51,12 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 
+#include "common.h"
 #include "imapproxy.h"
 
 /*
@@ -60,12 +64,49 @@
  */
 extern int errno;
 extern IMAPCounter_Struct *IMAPCount;
+extern ProxyConfig_Struct PC_Struct;
+
+/*
+ * Per mailbox hits and misses, for the metrics page.  The first
+ * SELECT_MAILBOX_STATS - 1 mailbox names seen get a row each, and the
+ * rest share the last one.
+ */
+#define SELECT_MAILBOX_STATS	64
+
+struct SelectMailboxStat
+{
+    char Name[ MAXMAILBOXNAME ];
+    unsigned long Hits;
+    unsigned long Misses;
+    unsigned long Revalidations;
+};
+
+#define SELECT_COUNT_MISS	0
+#define SELECT_COUNT_HIT	1
+#define SELECT_COUNT_REVALIDATED 2
+
+static struct SelectMailboxStat SelectMailboxes[ SELECT_MAILBOX_STATS ];
+static unsigned int SelectMailboxCount = 0;
+static pthread_mutex_t SelectMailboxMutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Internal prototypes
  */
-static int Send_Cached_Select_Response( ITD_Struct *, ISC_Struct *, char * );
-static int Populate_Select_Cache( ITD_Struct *, ISC_Struct *, char *, char *, unsigned int );
+static int Send_Cached_Select_Response( ITD_Struct *, struct IMAPSelectCacheEntry *, char * );
+static int Populate_Select_Cache( ITD_Struct *, struct IMAPSelectCacheEntry *, char *, char *, unsigned int );
+static int Revalidate_Select_Cache( ITD_Struct *, struct IMAPSelectCacheEntry * );
+static unsigned int Select_Cache_Slots( void );
+static unsigned int Select_Cache_Lifetime( void );
+static void Select_Count( const char *, int );
+static void Observe_Response( ISC_Struct * );
+static void Observe_Drop( ISC_Struct * );
+static char *Select_Line( struct IMAPSelectCacheEntry *, const char *, const char * );
+static int Select_Replace( struct IMAPSelectCacheEntry *, char *, unsigned int, const char *, unsigned int );
+static int Select_Set_Number( struct IMAPSelectCacheEntry *, char *, unsigned long long );
+static char *Find_Fetch_Item( char *, const char * );
+static int Mailbox_Arg( const char **, const char *, char *, unsigned int );
+static int Enables_CondStore( const char *, unsigned int );
+static void Select_Cache_Forget( ISC_Struct *, const char * );
 
 
 /*
@@ -107,6 +148,15 @@ static int Populate_Select_Cache( ITD_Struct *, ISC_Struct *, char *, char *, un
  *
  * Notes:        The SELECT command string passed into here will be the
  *               entire command, including the tag.
+ *
+ *               A hit on a mailbox other than the one the server has
+ *               selected is answered straight away, and the server is
+ *               only sent the SELECT when the client sends its next
+ *               command (see Select_Cache_Sync()).
+ *
+ *               An entry that has outlived select_cache_lifetime is
+ *               checked with a STATUS first (see Revalidate_Select_Cache())
+ *               and only SELECTed again if the mailbox has changed.
  *--
  */
 extern int Handle_Select_Command( ITD_Struct *Client,
@@ -116,14 +166,24 @@ extern int Handle_Select_Command( ITD_Struct *Client,
 				  int SelectCmdLength )
 {
     char *fn = "Handle_Select_Command";
+    struct IMAPSelectCacheEntry *Entry;
+    struct IMAPSelectCacheEntry *Victim;
+    unsigned int Slots;
+    unsigned int Lifetime;
+    unsigned int i;
     char *Mailbox;
     char *Tag;
     char *CP;
+    int Revalidated;
     int rc;
+    time_t Now;
+    struct timeval Start;
 
     char Buf[ BUFSIZE ];
 
-    IMAPCount->TotalSelectCommands++;
+    gettimeofday( &Start, NULL );
+
+    COUNT( TotalSelectCommands, 1 );
     
     /*
      * Make a local copy of the select buffer so we can chop it to hell without
@@ -131,7 +191,7 @@ extern int Handle_Select_Command( ITD_Struct *Client,
      */
     if ( SelectCmdLength >= BUFSIZE )
     {
-	IMAPCount->SelectCacheMisses++;
+	COUNT( SelectCacheMisses, 1 );
 	syslog( LOG_ERR, "%s: Length of SELECT command (%d bytes) would overflow %d byte buffer.", fn, SelectCmdLength, BUFSIZE );
 	return( 1 );
     }
@@ -145,7 +205,7 @@ extern int Handle_Select_Command( ITD_Struct *Client,
     CP = memchr( (const void *)Buf, '\r', SelectCmdLength );
     if ( ! CP )
     {
-	IMAPCount->SelectCacheMisses++;
+	COUNT( SelectCacheMisses, 1 );
 	
 	syslog( LOG_ERR, "%s: Sanity check failed!  SELECT command from client sd [%d] has no CRLF after it.", fn, Client->conn->sd );
 	return( -1 );
@@ -157,7 +217,7 @@ extern int Handle_Select_Command( ITD_Struct *Client,
     
     if ( ! CP )
     {
-	IMAPCount->SelectCacheMisses++;
+	COUNT( SelectCacheMisses, 1 );
 	
 	syslog( LOG_ERR, "%s: Sanity check failed!  No tokens found in SELECT command '%s' sent from client sd [%d].", fn, Buf, Client->conn->sd );
 	return( 1 );
@@ -171,7 +231,7 @@ extern int Handle_Select_Command( ITD_Struct *Client,
     
     if ( ! Mailbox )
     {
-	IMAPCount->SelectCacheMisses++;
+	COUNT( SelectCacheMisses, 1 );
 	
 	syslog( LOG_WARNING, "%s: Protocol error.  Client sd [%d] sent SELECT command with no mailbox name: '%s'", fn, Client->conn->sd, SelectCmd );
 	snprintf( Buf, sizeof Buf - 1, "%s BAD missing required argument to SELECT command\r\n", Tag );
@@ -184,29 +244,100 @@ extern int Handle_Select_Command( ITD_Struct *Client,
     }
 
     Mailbox++;
-    
+
     /*
-     * We have a valid SELECT command.  See if we have a cache entry that
-     * isn't expired.
+     * A mailbox name sent as a literal follows on the next line, which
+     * we haven't got.  Let it go straight through.
      */
-    if ( time( 0 ) > ( ISC->ISCTime + SELECT_CACHE_EXP ) )
+    CP = Mailbox + strlen( Mailbox );
+    if ( CP > Mailbox && *( CP - 1 ) == '}' )
     {
-	/*
-	 * The SELECT data that's cached has expired.
-	 */
-	IMAPCount->SelectCacheMisses++;
-	
-	rc = Populate_Select_Cache( Server, ISC, Mailbox, SelectCmd, SelectCmdLength );
-	if ( rc == -1 )
+	COUNT( SelectCacheMisses, 1 );
+	return( 1 );
+    }
+
+    ICC_Note_Select( Server->conn->ICC, Mailbox );
+
+    /* SELECT mailbox (CONDSTORE) and the like */
+    if ( Enables_CondStore( Mailbox, strlen( Mailbox ) ) )
+	ISC->CondStore = 1;
+
+    Slots = Select_Cache_Slots();
+
+    if ( ! ISC->Entry )
+    {
+	ISC->Entry = calloc( Slots, sizeof ( struct IMAPSelectCacheEntry ) );
+	if ( ! ISC->Entry )
 	{
+	    COUNT( SelectCacheMisses, 1 );
+	    syslog( LOG_ERR, "%s: calloc() failed: %s", fn, strerror( errno ) );
 	    return( 1 );
 	}
+	ISC->Clock = 0;
+	ISC->Current = -1;
+	ISC->Wanted = -1;
+    }
+    
+    /*
+     * We have a valid SELECT command.  See if we have a cache entry for
+     * this mailbox, and if so, whether it's expired.
+     */
+    Entry = NULL;
+    for ( i = 0; i < Slots; i++ )
+    {
+	if ( ISC->Entry[ i ].ISCTime &&
+	     ! strcmp( Mailbox, ISC->Entry[ i ].MailboxName ) )
+	{
+	    Entry = &ISC->Entry[ i ];
+	    break;
+	}
+    }
+
+    Lifetime = Select_Cache_Lifetime();
+    Now = time( 0 );
+    Revalidated = 0;
+
+    /*
+     * An old entry may well still be right.  Ask the server whether the
+     * mailbox has changed, which is a lot less work for it than a SELECT.
+     * The mailbox the server has selected is left alone, as STATUS
+     * isn't meant to be used on that.
+     */
+    if ( Entry && Now > ( Entry->ISCTime + Lifetime ) &&
+	 (int)i != ISC->Current )
+    {
+	rc = Revalidate_Select_Cache( Server, Entry );
 	if ( rc == -2 )
 	{
 	    return( -2 );
 	}
+	if ( rc == 1 )
+	{
+	    Entry->ISCTime = Now;
+	    Revalidated = 1;
+	}
+    }
+
+    if ( Entry && Now <= ( Entry->ISCTime + Lifetime ) )
+    {
+	/*
+	 * We have this mailbox cached already
+	 */
+	if ( Revalidated )
+	{
+	    COUNT( SelectCacheRevalidations, 1 );
+	    Select_Count( Mailbox, SELECT_COUNT_REVALIDATED );
+	}
+	else
+	{
+	    COUNT( SelectCacheHits, 1 );
+	    Select_Count( Mailbox, SELECT_COUNT_HIT );
+	}
 	
-	rc = Send_Cached_Select_Response( Client, ISC, Tag );
+	Entry->LastUsed = ++ISC->Clock;
+	ISC->Wanted = ( (int)i == ISC->Current ) ? -1 : (int)i;
+
+	rc = Send_Cached_Select_Response( Client, Entry, Tag );
 	if ( rc == -2 )
 	{
 	    return( -1 );
@@ -226,47 +357,39 @@ extern int Handle_Select_Command( ITD_Struct *Client,
 	    return( 0 );
 	}
 	
+	Counter_Latency( LATENCY_SELECT_CACHED, &Start );
 	return( 0 );
+	
     }
 
+    COUNT( SelectCacheMisses, 1 );
+    Select_Count( Mailbox, SELECT_COUNT_MISS );
 
     /*
-     * Our data isn't expired, but is it the correct mailbox?
+     * Refresh the expired entry, or make room in the least recently
+     * used one.
      */
-    if ( ! strcmp( Mailbox, ISC->MailboxName ) )
+    if ( ! Entry )
     {
-	/*
-	 * We have the correct mailbox selected and cached already
-	 */
-	IMAPCount->SelectCacheHits++;
-	
-	rc = Send_Cached_Select_Response( Client, ISC, Tag );
-	if ( rc == -2 )
-	{
-	    return( -1 );
-	}
-	if ( rc == -1 )
+	Entry = &ISC->Entry[ 0 ];
+	for ( Victim = ISC->Entry; Victim < ISC->Entry + Slots; Victim++ )
 	{
-	    snprintf( Buf, sizeof Buf - 1, "%s BAD internal proxy server error\r\n", Tag );
-	    if ( IMAP_Write( Client->conn, Buf, strlen( Buf ) ) == -1 )
+	    if ( ! Victim->ISCTime )
 	    {
-		syslog(LOG_ERR, "%s: IMAP_Write() failed sending data to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
-		return( -1 );
+		Entry = Victim;
+		break;
 	    }
-
-	    // soft failure - we sent BAD response, so
-	    // now let client decide what to do next
-	    //
-	    return( 0 );
+	    if ( Victim->LastUsed < Entry->LastUsed )
+		Entry = Victim;
 	}
-	
-	return( 0 );
-	
     }
 
-    IMAPCount->SelectCacheMisses++;
+    /* the server is about to select something else */
+    ISC->Current = -1;
+    ISC->Wanted = -1;
+    Select_Cache_Observe_Reset( ISC );
     
-    rc = Populate_Select_Cache( Server, ISC, Mailbox, SelectCmd, SelectCmdLength );
+    rc = Populate_Select_Cache( Server, Entry, Mailbox, SelectCmd, SelectCmdLength );
     if ( rc == -1 )
     {
 	return( 1 );
@@ -275,8 +398,12 @@ extern int Handle_Select_Command( ITD_Struct *Client,
     {
 	return( -2 );
     }
+
+    Entry->LastUsed = ++ISC->Clock;
+    if ( ! strncasecmp( Entry->SelectStatus, "OK", 2 ) )
+	ISC->Current = Entry - ISC->Entry;
     
-    rc = Send_Cached_Select_Response( Client, ISC, Tag );
+    rc = Send_Cached_Select_Response( Client, Entry, Tag );
     if ( rc == -2 )
     {
 	return( -1 );
@@ -296,6 +423,7 @@ extern int Handle_Select_Command( ITD_Struct *Client,
 	return( 0 );
     }
     
+    Counter_Latency( LATENCY_SELECT_UNCACHED, &Start );
     return( 0 );
     
 }
@@ -308,7 +436,7 @@ extern int Handle_Select_Command( ITD_Struct *Client,
  * Purpose:      Send cached SELECT server response data back to a client.
  *
  * Parameters:   ptr to ITD -- client transaction descriptor
- *               ptr to ISC -- IMAP select cache structure
+ *               ptr to the select cache entry
  *               ptr to char -- client tag for response
  *
  * Returns:      0 on success
@@ -321,21 +449,21 @@ extern int Handle_Select_Command( ITD_Struct *Client,
  *--
  */
 static int Send_Cached_Select_Response( ITD_Struct *Client,
-					ISC_Struct *ISC,
+					struct IMAPSelectCacheEntry *Entry,
 					char *Tag )
 {
     char *fn = "Send_Cached_Select_Response()";
     char SendBuf[ BUFSIZE ];
 
-    if ( IMAP_Write( Client->conn, ISC->SelectString, 
-		     strlen( ISC->SelectString ) ) == -1 )
+    if ( IMAP_Write( Client->conn, Entry->SelectString, 
+		     strlen( Entry->SelectString ) ) == -1 )
     {
 	syslog( LOG_WARNING, "%s: Failed to send cached SELECT string to client on sd [%d]: %s", fn, Client->conn->sd, strerror( errno ) );
 	return( -2 );
     }
     
     snprintf( SendBuf, sizeof SendBuf - 1, "%s %s", Tag, 
-	      ISC->SelectStatus );
+	      Entry->SelectStatus );
     
     if ( IMAP_Write( Client->conn, SendBuf, strlen( SendBuf ) ) == -1 )
     {
@@ -356,7 +484,7 @@ static int Send_Cached_Select_Response( ITD_Struct *Client,
  * Purpose:      Send a SELECT command to the server and cache the response.
  *
  * Parameters:   ptr to ITD -- server transaction descriptor
- *               ptr to ISC -- the cache structure to populate
+ *               ptr to the select cache entry to populate
  *               ptr to char -- the mailbox name that's being selected
  *               ptr to char -- The select command string from the client.
  *               unsigned int -- the length of the select command
@@ -367,11 +495,11 @@ static int Send_Cached_Select_Response( ITD_Struct *Client,
  *
  * Authors:      Dave McMurtrie <davemcmurtrie@hotmail.com>
  *
- * Notes:
+ * Notes:        The entry isn't valid again until it's been filled in.
  *--
  */
 static int Populate_Select_Cache( ITD_Struct *Server,
-				  ISC_Struct *ISC,
+				  struct IMAPSelectCacheEntry *Entry,
 				  char *MailboxName,
 				  char *ClientCommand,
 				  unsigned int Length )
@@ -383,6 +511,8 @@ static int Populate_Select_Cache( ITD_Struct *Server,
     char *CP;
     char *EOS;
 
+    Entry->ISCTime = 0;
+
     rc = IMAP_Write( Server->conn, ClientCommand, Length );
     
     if ( rc == -1 )
@@ -391,7 +521,7 @@ static int Populate_Select_Cache( ITD_Struct *Server,
 	return( -2 );
     }
 
-    BufPtr = ISC->SelectString;
+    BufPtr = Entry->SelectString;
     
     for( ;; )
     {
@@ -421,7 +551,7 @@ static int Populate_Select_Cache( ITD_Struct *Server,
 	/*
 	 * If it's not untagged data, we're done
 	 */
-	if ( Server->ReadBuf[0] != '*' )
+	if ( ITD_LINE( Server )[0] != '*' )
 	    break;
 	
 	if ( rc >= BytesLeftInBuffer ) 
@@ -430,7 +560,7 @@ static int Populate_Select_Cache( ITD_Struct *Server,
 	    return( -1 );
 	}
 	
-	memcpy( (void *)BufPtr, (const void *)Server->ReadBuf, rc );
+	memcpy( (void *)BufPtr, (const void *)ITD_LINE( Server ), rc );
 	BytesLeftInBuffer -= rc;
 	BufPtr += rc;
     }
@@ -445,7 +575,7 @@ static int Populate_Select_Cache( ITD_Struct *Server,
     /*
      * The SELECT output string is filled in.  Now fill in the status.
      */
-    CP = memchr( (const void *)Server->ReadBuf, ' ', rc );
+    CP = memchr( (const void *)ITD_LINE( Server ), ' ', rc );
     if ( ! CP )
     {
 	syslog( LOG_ERR, "%s: Invalid response to SELECT command.  Contains no tokens.", fn );
@@ -453,7 +583,7 @@ static int Populate_Select_Cache( ITD_Struct *Server,
     }
     CP++;
     
-    EOS = memchr( (const void *)Server->ReadBuf, '\r', rc );
+    EOS = memchr( (const void *)ITD_LINE( Server ), '\r', rc );
     if ( ! EOS )
     {
 	syslog( LOG_ERR, "%s: Invalid response to SELECT command.  Not CRLF terminated.", fn );
@@ -461,17 +591,29 @@ static int Populate_Select_Cache( ITD_Struct *Server,
     }
     
     *EOS = '\0';
-    snprintf( (char *)ISC->SelectStatus, SELECT_STATUS_BUF_SIZE - 1, "%s\r\n",
+    snprintf( (char *)Entry->SelectStatus, SELECT_STATUS_BUF_SIZE - 1, "%s\r\n",
 	      CP );
     *EOS = '\r';
 
+    /*
+     * Keep what Revalidate_Select_Cache() will compare.
+     */
+    CP = strstr( Entry->SelectString, "[UIDVALIDITY " );
+    Entry->UIDValidity = CP ? strtoul( CP + 13, NULL, 10 ) : 0;
+    CP = strstr( Entry->SelectString, "[UIDNEXT " );
+    Entry->UIDNext = CP ? strtoul( CP + 9, NULL, 10 ) : 0;
+    CP = strstr( Entry->SelectString, "[HIGHESTMODSEQ " );
+    Entry->HighestModSeq = CP ? strtoull( CP + 15, NULL, 10 ) : 0;
+    CP = Select_Line( Entry, "* ", " EXISTS\r\n" );
+    Entry->Messages = CP ? strtoul( CP + 2, NULL, 10 ) : 0;
+
     /*
      * Update the cache time
      */
-    ISC->ISCTime = time( 0 );
+    Entry->ISCTime = time( 0 );
 
-    strncpy( (char *)ISC->MailboxName, (const char *)MailboxName, MAXMAILBOXNAME - 1 );
-    ISC->MailboxName[ MAXMAILBOXNAME - 1 ] = '\0';
+    strncpy( (char *)Entry->MailboxName, (const char *)MailboxName, MAXMAILBOXNAME - 1 );
+    Entry->MailboxName[ MAXMAILBOXNAME - 1 ] = '\0';
 
     return( 0 );
     
@@ -479,94 +621,1276 @@ static int Populate_Select_Cache( ITD_Struct *Server,
 
 
 
+/*++
+ * Function:     Revalidate_Select_Cache
+ *
+ * Purpose:      Ask the server, with a STATUS command, whether a mailbox
+ *               has changed since its SELECT response was cached.
+ *
+ * Parameters:   ptr to ITD -- server transaction descriptor
+ *               ptr to the select cache entry
+ *
+ * Returns:      1 if the cached response is still good
+ *               0 if it isn't, or we can't tell
+ *               -2 on hard failure
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        UIDVALIDITY, UIDNEXT and MESSAGES must all match.  If a
+ *               client has turned CONDSTORE on for the server session,
+ *               HIGHESTMODSEQ must match too, which also catches flag
+ *               changes.  It isn't asked for otherwise: that would turn
+ *               CONDSTORE on, and FETCH responses would start carrying
+ *               MODSEQ for clients that never asked for it.
+ *
+ *               Untagged responses other than the STATUS aren't passed
+ *               on, as the client is leaving the mailbox the server has
+ *               selected.  They still go through Select_Cache_Observe(),
+ *               so that the entry of that mailbox stays right (or is
+ *               dropped) in case the client comes back to it.
+ *--
+ */
+static int Revalidate_Select_Cache( ITD_Struct *Server,
+				    struct IMAPSelectCacheEntry *Entry )
+{
+    char *fn = "Revalidate_Select_Cache()";
+    ISC_Struct *ISC = &Server->conn->ISC;
+    char SendBuf[ MAXMAILBOXNAME + 64 ];
+    unsigned long UIDValidity = 0;
+    unsigned long UIDNext = 0;
+    unsigned long Messages = 0;
+    unsigned long long HighestModSeq = 0;
+    int ModSeq;
+    int Seen = 0;
+    char *Line;
+    char *CP;
+    int rc;
+
+    if ( ! Entry->UIDValidity || ! Entry->UIDNext )
+	return( 0 );
+
+    ModSeq = ( PC_Struct.support_condstore == CONDSTORE_SUPPORTED &&
+	       Server->conn->ISC.CondStore && Entry->HighestModSeq );
+
+    snprintf( SendBuf, sizeof SendBuf, "PXYS STATUS %s (UIDVALIDITY UIDNEXT MESSAGES%s)\r\n",
+	      Entry->MailboxName, ModSeq ? " HIGHESTMODSEQ" : "" );
+    if ( IMAP_Write( Server->conn, SendBuf, strlen( SendBuf ) ) == -1 )
+    {
+	syslog( LOG_ERR, "%s: IMAP_Write() failed sending STATUS to server on sd [%d]: %s", fn, Server->conn->sd, strerror( errno ) );
+	return( -2 );
+    }
+
+    for ( ;; )
+    {
+	if ( Server->LiteralBytesRemaining )
+	{
+	    rc = IMAP_Literal_Read( Server );
+	    if ( rc == -1 )
+		return( -2 );
+	    Select_Cache_Observe( ISC, ITD_LINE( Server ), rc );
+	    continue;
+	}
+
+	rc = IMAP_Line_Read( Server );
+	if ( ( rc == -1 ) || ( rc == 0 ) )
+	{
+	    syslog( LOG_WARNING, "%s: Unable to read STATUS response from server on sd [%d].", fn, Server->conn->sd );
+	    return( -2 );
+	}
+
+	Line = ITD_LINE( Server );
+
+	if ( rc > 5 && ! memcmp( Line, "PXYS ", 5 ) )
+	    break;
+
+	/* EXPUNGE and the like, for the mailbox the server has selected */
+	Select_Cache_Observe( ISC, Line, rc );
+
+	if ( rc < 10 || strncasecmp( Line, "* STATUS ", 9 ) )
+	    continue;
+
+	/*
+	 * The mailbox name may come back in another form, so go by the
+	 * attribute list.
+	 */
+	CP = memchr( Line, '(', rc );
+	if ( ! CP )
+	    continue;
+
+	Seen = 1;
+	while ( CP && *CP != ')' && *CP != '\r' )
+	{
+	    CP++;
+	    if ( ! strncasecmp( CP, "UIDVALIDITY ", 12 ) )
+		UIDValidity = strtoul( CP + 12, &CP, 10 );
+	    else if ( ! strncasecmp( CP, "UIDNEXT ", 8 ) )
+		UIDNext = strtoul( CP + 8, &CP, 10 );
+	    else if ( ! strncasecmp( CP, "MESSAGES ", 9 ) )
+		Messages = strtoul( CP + 9, &CP, 10 );
+	    else if ( ! strncasecmp( CP, "HIGHESTMODSEQ ", 14 ) )
+		HighestModSeq = strtoull( CP + 14, &CP, 10 );
+	    else
+		CP = strpbrk( CP, " )\r" );
+	}
+    }
+
+    if ( strncasecmp( Line + 5, "OK", 2 ) || ! Seen )
+	return( 0 );
+
+    if ( UIDValidity != Entry->UIDValidity ||
+	 UIDNext != Entry->UIDNext ||
+	 Messages != Entry->Messages ||
+	 ( ModSeq && HighestModSeq != Entry->HighestModSeq ) )
+	return( 0 );
+
+    return( 1 );
+}
+
+
 
 /*++
- * Function:     Is_Safe_Command
+ * Function:     Select_Cache_Sync
  *
- * Purpose:      Determine whether a given command is "safe".  A command that
- *               is not "safe" should cause the select cache for a given
- *               mailbox to be invalidated.
+ * Purpose:      Send the server the SELECT for a mailbox that the client
+ *               was told about from the cache, before the client's next
+ *               command goes to the server.
  *
- * Parameters:   char ptr -- the command
+ * Parameters:   ptr to ITD -- client transaction descriptor
+ *               ptr to ITD -- server transaction descriptor
+ *               ptr to ISC -- IMAP select cache structure
  *
- * Returns:      1 if the command is safe
- *               0 if the command is not safe
+ * Returns:      0 on success, or if there was nothing to do
+ *               -1 on client failure
+ *               -2 on server failure
  *
- * Authors:      Dave McMurtrie <davemcmurtrie@hotmail.com>
+ * Authors:      The SquirrelMail Project Team
  *
- * Notes:
+ * Notes:        The response is the proxy's, not the client's, with two
+ *               exceptions.  EXISTS and RECENT go on to the client, as
+ *               the cached ones may be out of date and a server may send
+ *               them at any time.  Tagged lines that aren't ours finish
+ *               commands the client sent earlier, and go on too.
+ *
+ *               If the SELECT fails, the mailbox has a new UIDVALIDITY,
+ *               or it has fewer messages than the client was told, the
+ *               client can't be put right: it has had a tagged OK, and
+ *               EXISTS may not go down without EXPUNGEs.  The entry is
+ *               dropped and the client gets a BYE.  If the mailbox only
+ *               has more messages, the new EXISTS goes on and the entry
+ *               is dropped.
  *--
  */
-extern unsigned int Is_Safe_Command( char *Command )
+extern int Select_Cache_Sync( ITD_Struct *Client,
+			      ITD_Struct *Server,
+			      ISC_Struct *ISC )
 {
-    unsigned int i;
-    
-    /*
-     * The safety of some of these is very questionable, particularly
-     * APPEND.  Since time also invalidates the cache, hopefully the
-     * contents will be accurate enough to not break stuff...
-     */
-    char *SafeCommands[] = 
-	{
-	    "CAPABILITY",
-	    "NOOP",
-	    "LOGOUT",
-	    "STARTTLS",
-	    "AUTHENTICATE",
-	    "LOGIN",
-	    "SELECT",
-	    "EXAMINE",
-	    "CREATE",
-	    "DELETE",
-	    "RENAME",
-	    "SUBSCRIBE",
-	    "UNSUBSCRIBE",
-	    "LIST",
-	    "LSUB",
-	    "STATUS",
-	    "APPEND",
-	    "CHECK",
-	    "SEARCH",
-	    "FETCH",
-	    "COPY",
-	    "UID",
-	    NULL
-	};
+    char *fn = "Select_Cache_Sync()";
+    struct IMAPSelectCacheEntry *Entry;
+    char SendBuf[ MAXMAILBOXNAME + 32 ];
+    unsigned long UIDValidity = 0;
+    unsigned long Messages;
+    unsigned long Exists;
+    char *Why = NULL;
+    char *Line;
+    char *CP;
+    int Wanted;
+    int rc;
 
-    /*
-     * For a list this small a simple linear search should suffice.
-     */
-    for ( i = 0; SafeCommands[i] != 0; i++ )
+    if ( ! ISC->Entry || ISC->Wanted == -1 )
+	return( 0 );
+
+    Wanted = ISC->Wanted;
+    Entry = &ISC->Entry[ Wanted ];
+    ISC->Wanted = -1;
+    ISC->Current = -1;
+    Select_Cache_Observe_Reset( ISC );
+    Messages = Entry->Messages;
+
+    snprintf( SendBuf, sizeof SendBuf, "PXYS SELECT %s\r\n", Entry->MailboxName );
+    if ( IMAP_Write( Server->conn, SendBuf, strlen( SendBuf ) ) == -1 )
+    {
+	syslog( LOG_ERR, "%s: IMAP_Write() failed sending deferred SELECT to server on sd [%d]: %s", fn, Server->conn->sd, strerror( errno ) );
+	return( -2 );
+    }
+
+    for ( ;; )
     {
-	if ( ! strncasecmp( SafeCommands[i], Command,
-			    strlen( SafeCommands[i] ) ) )
+	if ( Server->LiteralBytesRemaining )
 	{
-	    return( 1 );
+	    if ( IMAP_Literal_Read( Server ) == -1 )
+		return( -2 );
+	    continue;
+	}
+
+	rc = IMAP_Line_Read( Server );
+	if ( ( rc == -1 ) || ( rc == 0 ) )
+	{
+	    syslog( LOG_WARNING, "%s: Unable to read deferred SELECT response from server on sd [%d].", fn, Server->conn->sd );
+	    return( -2 );
 	}
+
+	Line = ITD_LINE( Server );
+
+	if ( rc > 5 && ! memcmp( Line, "PXYS ", 5 ) )
+	    break;
+
+	if ( Line[ 0 ] == '*' )
+	{
+	    CP = memchr( Line, '\r', rc );
+	    if ( CP && CP - Line > 8 &&
+		 ( ! strncasecmp( CP - 7, " EXISTS", 7 ) ||
+		   ! strncasecmp( CP - 7, " RECENT", 7 ) ) )
+	    {
+		if ( ! strncasecmp( CP - 7, " EXISTS", 7 ) )
+		{
+		    Exists = strtoul( Line + 2, NULL, 10 );
+		    if ( Exists < Entry->Messages )
+		    {
+			Why = "fewer messages";
+			continue;
+		    }
+		    Messages = Exists;
+		}
+		if ( IMAP_Write( Client->conn, Line, rc ) == -1 )
+		    return( -1 );
+	    }
+	    else if ( rc > 16 && ( CP = memchr( Line, '[', rc ) ) &&
+		      ! strncasecmp( CP, "[UIDVALIDITY ", 13 ) )
+	    {
+		UIDValidity = strtoul( CP + 13, NULL, 10 );
+	    }
+	    continue;
+	}
+
+	if ( IMAP_Write( Client->conn, Line, rc ) == -1 )
+	    return( -1 );
     }
-    
+
+    if ( strncasecmp( Line + 5, "OK", 2 ) )
+	Why = "SELECT failed";
+    else if ( UIDValidity && Entry->UIDValidity &&
+	      UIDValidity != Entry->UIDValidity )
+	Why = "new UIDVALIDITY";
+
+    if ( Why )
+    {
+	syslog( LOG_WARNING, "%s: cached mailbox '%s' is out of date on the server (%s); disconnecting client on sd [%d].", fn, Entry->MailboxName, Why, Client->conn->sd );
+	Entry->ISCTime = 0;
+
+	snprintf( SendBuf, sizeof SendBuf, "* BYE Mailbox changed on the server\r\n" );
+	IMAP_Write( Client->conn, SendBuf, strlen( SendBuf ) );
+	return( -1 );
+    }
+
+    if ( Messages != Entry->Messages )
+	Entry->ISCTime = 0;
+
+    ISC->Current = Wanted;
     return( 0 );
 }
 
 
 
 /*++
- * Function:     Invalidate_Cache_Entry
+ * Function:     Select_Cache_Holds
+ *
+ * Purpose:      See whether a select cache can answer a SELECT of a
+ *               mailbox without going to the server.
+ *
+ * Parameters:   ptr to ISC -- IMAP select cache structure
+ *               unsigned int -- Hash() of the mailbox name
+ *               time_t -- the time now
+ *
+ * Returns:      1 if it can
+ *               0 if not
+ *
+ * Authors:      The SquirrelMail Project Team
+ *--
+ */
+extern int Select_Cache_Holds( ISC_Struct *ISC, unsigned int MailboxHash,
+			       time_t Now )
+{
+    unsigned int Slots;
+    unsigned int i;
+
+    if ( ! ISC->Entry )
+	return( 0 );
+
+    Slots = Select_Cache_Slots();
+    for ( i = 0; i < Slots; i++ )
+    {
+	if ( ISC->Entry[ i ].ISCTime &&
+	     Now <= ( ISC->Entry[ i ].ISCTime + Select_Cache_Lifetime() ) &&
+	     Hash( ISC->Entry[ i ].MailboxName ) == MailboxHash )
+	    return( 1 );
+    }
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:     Select_Cache_Free
  *
- * Purpose:      Reset the cache time so the entry will not be valid
+ * Purpose:      Free a select cache's entries, when its server connection
+ *               goes away.
  *
  * Parameters:   ptr to ISC -- IMAP select cache structure
  *
  * Returns:      nothing
  *
- * Authors:      Dave McMurtrie <davemcmurtrie@hotmail.com>
+ * Authors:      The SquirrelMail Project Team
+ *--
+ */
+extern void Select_Cache_Free( ISC_Struct *ISC )
+{
+    free( ISC->Entry );
+    ISC->Entry = NULL;
+}
+
+
+
+/*++
+ * Function:     Select_Cache_Observe
  *
- * Notes:
+ * Purpose:      Watch what the server sends the client, and keep the
+ *               cached SELECT response of the mailbox the server has
+ *               selected up to date with it.
+ *
+ * Parameters:   ptr to ISC -- IMAP select cache structure
+ *               ptr to data from the server
+ *               int -- how much of it there is
+ *
+ * Returns:      nothing
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        The data can be cut anywhere, so the response we're in
+ *               the middle of is kept in the ISC until its CRLF turns up.
+ *               Literals are skipped, not kept, and only the first
+ *               SELECT_OBSERVE_LINE bytes of a response are looked at.
  *--
  */
-extern void Invalidate_Cache_Entry( ISC_Struct *ISC )
+extern void Select_Cache_Observe( ISC_Struct *ISC, const char *Buf, int Len )
 {
-    ISC->ISCTime = 0;
+    const char *EOL;
+    unsigned int Piece;
+    unsigned int Room;
+    char *CP;
+
+    while ( Len > 0 )
+    {
+	if ( ISC->Skip )
+	{
+	    Piece = ( ISC->Skip < (unsigned long)Len ) ? ISC->Skip : Len;
+	    ISC->Skip -= Piece;
+	    Buf += Piece;
+	    Len -= Piece;
+	    continue;
+	}
+
+	EOL = memchr( Buf, '\n', Len );
+	Piece = EOL ? EOL - Buf + 1 : Len;
+
+	Room = sizeof ISC->Line - 1 - ISC->LineLen;
+	if ( Piece > Room )
+	    ISC->Overflow = 1;
+	memcpy( ISC->Line + ISC->LineLen, Buf, Piece > Room ? Room : Piece );
+	ISC->LineLen += Piece > Room ? Room : Piece;
+
+	/*
+	 * Whatever didn't fit, a literal's {n} is at the very end.
+	 */
+	if ( Piece >= sizeof ISC->Tail )
+	{
+	    memcpy( ISC->Tail, Buf + Piece - sizeof ISC->Tail, sizeof ISC->Tail );
+	    ISC->TailLen = sizeof ISC->Tail;
+	}
+	else
+	{
+	    if ( ISC->TailLen + Piece > sizeof ISC->Tail )
+	    {
+		Room = ISC->TailLen + Piece - sizeof ISC->Tail;
+		memmove( ISC->Tail, ISC->Tail + Room, ISC->TailLen - Room );
+		ISC->TailLen -= Room;
+	    }
+	    memcpy( ISC->Tail + ISC->TailLen, Buf, Piece );
+	    ISC->TailLen += Piece;
+	}
+
+	Buf += Piece;
+	Len -= Piece;
+
+	if ( ! EOL )
+	    break;
+
+	/* a literal, and after it more of this response */
+	if ( ISC->TailLen > 4 &&
+	     ISC->Tail[ ISC->TailLen - 2 ] == '\r' &&
+	     ISC->Tail[ ISC->TailLen - 3 ] == '}' )
+	{
+	    for ( CP = ISC->Tail + ISC->TailLen - 4;
+		  CP > ISC->Tail && isdigit( (unsigned char)*CP ); CP-- )
+		;
+	    if ( *CP == '{' && CP < ISC->Tail + ISC->TailLen - 4 )
+	    {
+		ISC->Skip = strtoul( CP + 1, NULL, 10 );
+		continue;
+	    }
+	}
+
+	Observe_Response( ISC );
+	Select_Cache_Observe_Reset( ISC );
+    }
+}
+
+
+
+/*++
+ * Function:     Select_Cache_Observe_Reset
+ *
+ * Purpose:      Forget any partial server response Select_Cache_Observe()
+ *               was part way through.
+ *
+ * Parameters:   ptr to ISC -- IMAP select cache structure
+ *
+ * Returns:      nothing
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        For when the server's responses have been read some
+ *               other way, or the connection changes hands.
+ *--
+ */
+extern void Select_Cache_Observe_Reset( ISC_Struct *ISC )
+{
+    ISC->Skip = 0;
+    ISC->LineLen = 0;
+    ISC->TailLen = 0;
+    ISC->Overflow = 0;
+}
+
+
+
+/*++
+ * Function:     Observe_Response
+ *
+ * Purpose:      Patch the cached SELECT response of the selected mailbox
+ *               to match one complete response from the server.
+ *
+ * Parameters:   ptr to ISC -- IMAP select cache structure
+ *
+ * Returns:      nothing
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        FLAGS, PERMANENTFLAGS and RECENT are copied over.
+ *               EXPUNGE takes one off EXISTS, and moves UNSEEN down if it
+ *               has to.  FETCH flags can move UNSEEN, and MODSEQ raises
+ *               HIGHESTMODSEQ.
+ *
+ *               Anything we can't follow drops the entry, so the next
+ *               SELECT goes to the server.  That includes new mail,
+ *               since we can't know the new UIDNEXT.
+ *--
+ */
+static void Observe_Response( ISC_Struct *ISC )
+{
+    struct IMAPSelectCacheEntry *Entry;
+    char *Line = ISC->Line;
+    unsigned long Number;
+    unsigned long Unseen;
+    unsigned long long ModSeq;
+    char *Unseen_At;
+    char *Items;
+    char *Flags;
+    char *End;
+    char *CP;
+
+    if ( ! ISC->Entry || ISC->Current == -1 )
+	return;
+
+    Entry = &ISC->Entry[ ISC->Current ];
+    if ( ! Entry->ISCTime )
+	return;
+
+    if ( ISC->LineLen < 4 || Line[ 0 ] != '*' || Line[ 1 ] != ' ' )
+	return;
+
+    Line[ ISC->LineLen ] = '\0';
+
+    if ( ! strncasecmp( Line + 2, "FLAGS ", 6 ) )
+    {
+	CP = Select_Line( Entry, "* FLAGS ", "" );
+	if ( ISC->Overflow || ! CP ||
+	     Select_Replace( Entry, CP, strchr( CP, '\n' ) + 1 - CP,
+			     Line, ISC->LineLen ) < 0 )
+	    Observe_Drop( ISC );
+	return;
+    }
+
+    /* comes with FLAGS when, say, a STORE makes a new keyword */
+    if ( ! strncasecmp( Line + 2, "OK [PERMANENTFLAGS ", 19 ) )
+    {
+	CP = Select_Line( Entry, "* OK [PERMANENTFLAGS ", "" );
+	if ( ISC->Overflow || ! CP ||
+	     Select_Replace( Entry, CP, strchr( CP, '\n' ) + 1 - CP,
+			     Line, ISC->LineLen ) < 0 )
+	    Observe_Drop( ISC );
+	return;
+    }
+
+    if ( ! strncasecmp( Line + 2, "VANISHED ", 9 ) )
+    {
+	Observe_Drop( ISC );
+	return;
+    }
+
+    if ( ! isdigit( (unsigned char)Line[ 2 ] ) )
+	return;
+
+    Number = strtoul( Line + 2, &CP, 10 );
+    if ( *CP++ != ' ' )
+	return;
+
+    if ( ! strncasecmp( CP, "EXISTS\r", 7 ) )
+    {
+	if ( Number != Entry->Messages )
+	    Observe_Drop( ISC );
+	return;
+    }
+
+    if ( ! strncasecmp( CP, "RECENT\r", 7 ) )
+    {
+	CP = Select_Line( Entry, "* ", " RECENT\r\n" );
+	if ( ! CP || Select_Set_Number( Entry, CP + 2, Number ) < 0 )
+	    Observe_Drop( ISC );
+	return;
+    }
+
+    Unseen_At = Select_Line( Entry, "* OK [UNSEEN ", "" );
+    Unseen = Unseen_At ? strtoul( Unseen_At + 13, NULL, 10 ) : 0;
+
+    if ( ! strncasecmp( CP, "EXPUNGE\r", 8 ) )
+    {
+	CP = Select_Line( Entry, "* ", " EXISTS\r\n" );
+	if ( ! CP || ! Number || Number > Entry->Messages ||
+	     Number == Unseen ||
+	     Select_Set_Number( Entry, CP + 2, Entry->Messages - 1 ) < 0 )
+	{
+	    Observe_Drop( ISC );
+	    return;
+	}
+	Entry->Messages--;
+
+	if ( Number < Unseen &&
+	     Select_Set_Number( Entry, Unseen_At + 13, Unseen - 1 ) < 0 )
+	    Observe_Drop( ISC );
+	return;
+    }
+
+    if ( strncasecmp( CP, "FETCH ", 6 ) )
+	return;
+
+    if ( ISC->Overflow )
+    {
+	Observe_Drop( ISC );
+	return;
+    }
+
+    Items = CP + 6;
+    Flags = Find_Fetch_Item( Items, "FLAGS (" );
+    if ( Flags )
+    {
+	End = strchr( Flags, ')' );
+	for ( CP = Flags; End && CP < End; CP++ )
+	{
+	    if ( ! strncasecmp( CP, "\\Seen", 5 ) &&
+		 ( CP[ 5 ] == ' ' || CP[ 5 ] == ')' ) )
+		break;
+	}
+
+	if ( ! End )
+	{
+	    Observe_Drop( ISC );
+	    return;
+	}
+
+	if ( CP < End )
+	{
+	    /* seen: the first unseen one may not be any more */
+	    if ( Number == Unseen )
+	    {
+		Observe_Drop( ISC );
+		return;
+	    }
+	}
+	else if ( ! Unseen )
+	{
+	    /* no UNSEEN to move, and we can't make one up */
+	    Observe_Drop( ISC );
+	    return;
+	}
+	else if ( Number < Unseen &&
+		  Select_Set_Number( Entry, Unseen_At + 13, Number ) < 0 )
+	{
+	    Observe_Drop( ISC );
+	    return;
+	}
+    }
+
+    CP = Find_Fetch_Item( Items, "MODSEQ (" );
+    if ( CP && Entry->HighestModSeq )
+    {
+	ModSeq = strtoull( CP, NULL, 10 );
+	if ( ModSeq > Entry->HighestModSeq )
+	{
+	    CP = Select_Line( Entry, "* OK [HIGHESTMODSEQ ", "" );
+	    if ( ! CP || Select_Set_Number( Entry, CP + 20, ModSeq ) < 0 )
+	    {
+		Observe_Drop( ISC );
+		return;
+	    }
+	    Entry->HighestModSeq = ModSeq;
+	}
+    }
+}
+
+
+
+/*++
+ * Function:     Observe_Drop
+ *
+ * Purpose:      Give up on the cached SELECT response of the selected
+ *               mailbox, when the server says something we can't follow.
+ *
+ * Parameters:   ptr to ISC -- IMAP select cache structure
+ *
+ * Returns:      nothing
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        Unlike Invalidate_Cache_Entry(), a deferred SELECT the
+ *               client is waiting on is left alone.
+ *--
+ */
+static void Observe_Drop( ISC_Struct *ISC )
+{
+    ISC->Entry[ ISC->Current ].ISCTime = 0;
+    ISC->Current = -1;
+}
+
+
+
+/*++
+ * Function:     Select_Line
+ *
+ * Purpose:      Find a line of a cached SELECT response.
+ *
+ * Parameters:   ptr to the select cache entry
+ *               char ptr -- what the line starts with
+ *               char ptr -- what it ends with, CRLF included, or ""
+ *
+ * Returns:      ptr to the start of the line
+ *               NULL if there isn't one
+ *
+ * Authors:      The SquirrelMail Project Team
+ *--
+ */
+static char *Select_Line( struct IMAPSelectCacheEntry *Entry,
+			  const char *Prefix, const char *Suffix )
+{
+    unsigned int PrefixLen = strlen( Prefix );
+    unsigned int SuffixLen = strlen( Suffix );
+    char *Line;
+    char *EOL;
+
+    for ( Line = Entry->SelectString; *Line; Line = EOL + 1 )
+    {
+	EOL = strchr( Line, '\n' );
+	if ( ! EOL )
+	    break;
+
+	if ( (unsigned int)( EOL + 1 - Line ) >= PrefixLen + SuffixLen &&
+	     ! strncasecmp( Line, Prefix, PrefixLen ) &&
+	     ! strncasecmp( EOL + 1 - SuffixLen, Suffix, SuffixLen ) )
+	    return( Line );
+    }
+
+    return( NULL );
+}
+
+
+
+/*++
+ * Function:     Select_Replace
+ *
+ * Purpose:      Replace part of a cached SELECT response.
+ *
+ * Parameters:   ptr to the select cache entry
+ *               char ptr -- where the part to replace starts
+ *               unsigned int -- its length
+ *               char ptr -- what to put there
+ *               unsigned int -- and its length
+ *
+ * Returns:      0 on success
+ *               -1 if the result wouldn't fit
+ *
+ * Authors:      The SquirrelMail Project Team
+ *--
+ */
+static int Select_Replace( struct IMAPSelectCacheEntry *Entry, char *At,
+			   unsigned int OldLen, const char *New,
+			   unsigned int NewLen )
+{
+    unsigned int Len = strlen( Entry->SelectString );
+
+    if ( Len - OldLen + NewLen >= SELECT_BUF_SIZE )
+	return( -1 );
+
+    memmove( At + NewLen, At + OldLen,
+	     Len + 1 - ( At - Entry->SelectString ) - OldLen );
+    memcpy( At, New, NewLen );
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:     Select_Set_Number
+ *
+ * Purpose:      Replace a number in a cached SELECT response.
+ *
+ * Parameters:   ptr to the select cache entry
+ *               char ptr -- the first digit of the old number
+ *               unsigned long long -- the new one
+ *
+ * Returns:      as Select_Replace()
+ *
+ * Authors:      The SquirrelMail Project Team
+ *--
+ */
+static int Select_Set_Number( struct IMAPSelectCacheEntry *Entry, char *At,
+			      unsigned long long Value )
+{
+    char Digits[ 24 ];
+    char *End;
+
+    for ( End = At; isdigit( (unsigned char)*End ); End++ )
+	;
+
+    snprintf( Digits, sizeof Digits, "%llu", Value );
+    return( Select_Replace( Entry, At, End - At, Digits, strlen( Digits ) ) );
+}
+
+
+
+/*++
+ * Function:     Find_Fetch_Item
+ *
+ * Purpose:      Find an item of a FETCH response.
+ *
+ * Parameters:   char ptr -- the response, from its attribute list on
+ *               char ptr -- the item name and what follows it, e.g.
+ *                           "FLAGS ("
+ *
+ * Returns:      ptr to just past the name
+ *               NULL if it isn't there
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        Quoted strings are skipped, so a subject line can't fool
+ *               us.  The name has to start a word.
+ *--
+ */
+static char *Find_Fetch_Item( char *CP, const char *Name )
+{
+    unsigned int Len = strlen( Name );
+
+    for ( ; *CP; CP++ )
+    {
+	if ( *CP == '"' )
+	{
+	    for ( CP++; *CP && *CP != '"'; CP++ )
+	    {
+		if ( *CP == '\\' && CP[ 1 ] )
+		    CP++;
+	    }
+	    if ( ! *CP )
+		break;
+	    continue;
+	}
+
+	if ( ( *( CP - 1 ) == '(' || *( CP - 1 ) == ' ' ) &&
+	     ! strncasecmp( CP, Name, Len ) )
+	    return( CP + Len );
+    }
+
+    return( NULL );
+}
+
+
+
+/*++
+ * Function:     Select_Cache_Slots
+ *
+ * Purpose:      How many mailboxes each server connection caches.
+ *
+ * Parameters:   nada
+ *
+ * Returns:      select_cache_size, within limits
+ *
+ * Authors:      The SquirrelMail Project Team
+ *--
+ */
+static unsigned int Select_Cache_Slots( void )
+{
+    if ( ! PC_Struct.select_cache_size )
+	return( SELECT_CACHE_SIZE );
+
+    if ( PC_Struct.select_cache_size > SELECT_CACHE_MAX )
+	return( SELECT_CACHE_MAX );
+
+    return( PC_Struct.select_cache_size );
+}
+
+
+
+/*++
+ * Function:     Select_Cache_Lifetime
+ *
+ * Purpose:      How long a cached SELECT response is used before it's
+ *               checked again.
+ *
+ * Parameters:   nada
+ *
+ * Returns:      select_cache_lifetime, in seconds
+ *
+ * Authors:      The SquirrelMail Project Team
+ *--
+ */
+static unsigned int Select_Cache_Lifetime( void )
+{
+    if ( ! PC_Struct.select_cache_lifetime )
+	return( SELECT_CACHE_EXP );
+
+    return( PC_Struct.select_cache_lifetime );
+}
+
+
+
+/*++
+ * Function:     Select_Count
+ *
+ * Purpose:      Count a SELECT cache hit, miss or revalidation against
+ *               its mailbox.
+ *
+ * Parameters:   char ptr -- the mailbox name as the client sent it
+ *               int -- SELECT_COUNT_HIT, _MISS or _REVALIDATED
+ *
+ * Returns:      nothing
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        Quotes around the name are dropped, so "Sent" and Sent
+ *               are counted together.
+ *--
+ */
+static void Select_Count( const char *Mailbox, int Kind )
+{
+    char Name[ MAXMAILBOXNAME ];
+    unsigned int Len;
+    unsigned int i;
+
+    Len = strlen( Mailbox );
+    if ( Len >= 2 && Mailbox[ 0 ] == '"' && Mailbox[ Len - 1 ] == '"' )
+    {
+	Mailbox++;
+	Len -= 2;
+    }
+    if ( Len > sizeof Name - 1 )
+	Len = sizeof Name - 1;
+    memcpy( Name, Mailbox, Len );
+    Name[ Len ] = '\0';
+
+    LockMutex( &SelectMailboxMutex );
+
+    for ( i = 0; i < SelectMailboxCount; i++ )
+	if ( ! strcmp( SelectMailboxes[ i ].Name, Name ) )
+	    break;
+
+    if ( i == SelectMailboxCount )
+    {
+	if ( SelectMailboxCount == SELECT_MAILBOX_STATS )
+	{
+	    i = SELECT_MAILBOX_STATS - 1;
+	}
+	else
+	{
+	    strcpy( SelectMailboxes[ i ].Name,
+		    ( i == SELECT_MAILBOX_STATS - 1 ) ? "(other)" : Name );
+	    SelectMailboxCount++;
+	}
+    }
+
+    if ( Kind == SELECT_COUNT_HIT )
+	SelectMailboxes[ i ].Hits++;
+    else if ( Kind == SELECT_COUNT_REVALIDATED )
+	SelectMailboxes[ i ].Revalidations++;
+    else
+	SelectMailboxes[ i ].Misses++;
+
+    UnLockMutex( &SelectMailboxMutex );
+}
+
+
+
+/*++
+ * Function:     Select_Metrics
+ *
+ * Purpose:      Add the per mailbox SELECT cache counts to a metrics page.
+ *
+ * Parameters:   ptr to the page
+ *
+ * Returns:      nothing
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        Backslashes and double quotes in a mailbox name are
+ *               escaped, as the exposition format wants.
+ *--
+ */
+extern void Select_Metrics( struct MetricsPage *Page )
+{
+    static const char *Families[][ 2 ] =
+    {
+	{ "select_cache_mailbox_hits_total", "SELECTs of this mailbox answered from the cache." },
+	{ "select_cache_mailbox_misses_total", "SELECTs of this mailbox that went to the server." },
+	{ "select_cache_mailbox_revalidations_total", "SELECTs of this mailbox answered from the cache after a STATUS check." }
+    };
+    unsigned long Value;
+    char Label[ MAXMAILBOXNAME * 2 ];
+    unsigned int f;
+    unsigned int i;
+    char *Out;
+    char *In;
+
+    for ( f = 0; f < sizeof Families / sizeof Families[ 0 ]; f++ )
+    {
+	Metrics_Printf( Page, "# HELP imapproxy_%s %s\n# TYPE imapproxy_%s counter\n",
+			Families[ f ][ 0 ], Families[ f ][ 1 ], Families[ f ][ 0 ] );
+
+	LockMutex( &SelectMailboxMutex );
+	for ( i = 0; i < SelectMailboxCount; i++ )
+	{
+	    Out = Label;
+	    for ( In = SelectMailboxes[ i ].Name; *In; In++ )
+	    {
+		if ( *In == '\\' || *In == '"' )
+		    *Out++ = '\\';
+		*Out++ = *In;
+	    }
+	    *Out = '\0';
+
+	    if ( f == 0 )
+		Value = SelectMailboxes[ i ].Hits;
+	    else if ( f == 1 )
+		Value = SelectMailboxes[ i ].Misses;
+	    else
+		Value = SelectMailboxes[ i ].Revalidations;
+
+	    Metrics_Printf( Page, "imapproxy_%s{mailbox=\"%s\"} %lu\n",
+			    Families[ f ][ 0 ], Label, Value );
+	}
+	UnLockMutex( &SelectMailboxMutex );
+    }
+}
+
+
+
+
+/*++
+ * Function:     Invalidate_Cache_Entry
+ *
+ * Purpose:      Reset the cache time of the selected mailbox's entry so it
+ *               will not be valid, and forget which mailbox the server has
+ *               selected.
+ *
+ * Parameters:   ptr to ISC -- IMAP select cache structure
+ *
+ * Returns:      nothing
+ *
+ * Authors:      Dave McMurtrie <davemcmurtrie@hotmail.com>
+ *
+ * Notes:        Called when a command may have changed the selected
+ *               mailbox, or changed which one is selected.
+ *--
+ */
+extern void Invalidate_Cache_Entry( ISC_Struct *ISC )
+{
+    if ( ! ISC->Entry )
+	return;
+
+    if ( ISC->Current != -1 )
+	ISC->Entry[ ISC->Current ].ISCTime = 0;
+
+    ISC->Current = -1;
+    ISC->Wanted = -1;
+    Select_Cache_Observe_Reset( ISC );
+}
+
+
+
+/*++
+ * Function:     Select_Cache_Command
+ *
+ * Purpose:      Drop the cache entries of mailboxes that a command changes
+ *               or removes without their being selected, and note whether
+ *               it turns CONDSTORE on for the server session.
+ *
+ * Parameters:   ptr to ISC -- IMAP select cache structure
+ *               unsigned int -- the command's CMD_ id
+ *               unsigned int -- its COMMAND_ flags
+ *               ptr to the command, just past the tag
+ *               unsigned int -- bytes from there to the end of the line
+ *
+ * Returns:      nothing
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        APPEND, COPY and MOVE add messages to their target,
+ *               DELETE and RENAME take a mailbox away (RENAME may also
+ *               replace another).  If a name can't be made out, say
+ *               because it's a literal, every entry is dropped.
+ *--
+ */
+extern void Select_Cache_Command( ISC_Struct *ISC, unsigned int Command,
+				  unsigned int Flags, const char *Args,
+				  unsigned int Len )
+{
+    char Name[ MAXMAILBOXNAME ];
+    const char *End = Args + Len;
+    const char *CP = Args;
+    unsigned int Words;
+    unsigned int Names;
+
+    if ( Enables_CondStore( Args, Len ) )
+    {
+	switch ( Command )
+	{
+	    case CMD_ENABLE:
+	    case CMD_EXAMINE:
+	    case CMD_FETCH:
+	    case CMD_SEARCH:
+	    case CMD_SELECT:
+	    case CMD_STATUS:
+	    case CMD_STORE:
+		ISC->CondStore = 1;
+		break;
+	}
+    }
+
+    if ( ! ISC->Entry )
+	return;
+
+    switch ( Command )
+    {
+	case CMD_APPEND:
+	case CMD_DELETE:
+	    Words = 1;
+	    Names = 1;
+	    break;
+
+	case CMD_COPY:
+	case CMD_MOVE:
+	    Words = 2;
+	    Names = 1;
+	    break;
+
+	case CMD_RENAME:
+	    Words = 1;
+	    Names = 2;
+	    break;
+
+	default:
+	    return;
+    }
+
+    if ( Flags & COMMAND_UID )
+	Words++;
+
+    /* the command name, and the sequence set of COPY and MOVE */
+    while ( Words-- )
+    {
+	CP = memchr( CP, ' ', End - CP );
+	if ( ! CP )
+	    return;
+	CP++;
+    }
+
+    while ( Names-- )
+    {
+	if ( Mailbox_Arg( &CP, End, Name, sizeof Name ) == -1 )
+	{
+	    Select_Cache_Forget( ISC, NULL );
+	    return;
+	}
+
+	Select_Cache_Forget( ISC, Name );
+
+	if ( CP < End && *CP == ' ' )
+	    CP++;
+    }
+}
+
+
+
+/*++
+ * Function:     Mailbox_Arg
+ *
+ * Purpose:      Pick a mailbox name out of a command line.
+ *
+ * Parameters:   ptr to ptr to the name; left just past it
+ *               ptr to the end of the line
+ *               ptr to a buffer for the name
+ *               unsigned int -- size of the buffer
+ *
+ * Returns:      0 on success
+ *               -1 if the name is a literal, or too long
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        Quoted names are unquoted, and INBOX is put in upper
+ *               case, so that two spellings of one name compare equal.
+ *--
+ */
+static int Mailbox_Arg( const char **Where, const char *End, char *Name,
+			unsigned int Size )
+{
+    const char *CP = *Where;
+    unsigned int i = 0;
+
+    if ( CP >= End || *CP == '{' )
+	return( -1 );
+
+    if ( *CP == '"' )
+    {
+	for ( CP++; CP < End && *CP != '"'; CP++ )
+	{
+	    if ( *CP == '\\' && CP + 1 < End )
+		CP++;
+	    if ( i == Size - 1 )
+		return( -1 );
+	    Name[ i++ ] = *CP;
+	}
+	if ( CP < End )
+	    CP++;
+    }
+    else
+    {
+	for ( ; CP < End && *CP != ' ' && *CP != '\r' && *CP != '\n'; CP++ )
+	{
+	    if ( i == Size - 1 )
+		return( -1 );
+	    Name[ i++ ] = *CP;
+	}
+    }
+
+    Name[ i ] = '\0';
+    *Where = CP;
+
+    if ( ! strcasecmp( Name, "INBOX" ) )
+	strcpy( Name, "INBOX" );
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:     Enables_CondStore
+ *
+ * Purpose:      Tell whether a command line asks for anything that turns
+ *               CONDSTORE on (RFC 7162 section 3.1).
+ *
+ * Parameters:   ptr to the command, just past the tag
+ *               unsigned int -- bytes from there to the end of the line
+ *
+ * Returns:      1 if it does
+ *               0 if not
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        Looks for CONDSTORE, QRESYNC, MODSEQ and CHANGEDSINCE,
+ *               which also match HIGHESTMODSEQ and UNCHANGEDSINCE.  A
+ *               mailbox name with one of those in it errs on the side of
+ *               leaving HIGHESTMODSEQ out of the STATUS check.
+ *--
+ */
+static int Enables_CondStore( const char *Args, unsigned int Len )
+{
+    static const char *Words[] = { "CONDSTORE", "QRESYNC", "MODSEQ",
+				   "CHANGEDSINCE" };
+    unsigned int WordLen;
+    unsigned int i;
+    unsigned int j;
+
+    for ( i = 0; i < sizeof Words / sizeof Words[ 0 ]; i++ )
+    {
+	WordLen = strlen( Words[ i ] );
+	for ( j = 0; j + WordLen <= Len; j++ )
+	{
+	    if ( ! strncasecmp( Args + j, Words[ i ], WordLen ) )
+		return( 1 );
+	}
+    }
+
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:     Select_Cache_Forget
+ *
+ * Purpose:      Drop the cache entry of a mailbox, by name.
+ *
+ * Parameters:   ptr to ISC -- IMAP select cache structure
+ *               ptr to the name, as Mailbox_Arg() gives it, or NULL to
+ *               drop every entry
+ *
+ * Returns:      nothing
+ *
+ * Authors:      The SquirrelMail Project Team
+ *
+ * Notes:        Entries keep the name as the client sent it in its
+ *               SELECT, so that's put in the same form first.
+ *--
+ */
+static void Select_Cache_Forget( ISC_Struct *ISC, const char *Mailbox )
+{
+    char Name[ MAXMAILBOXNAME ];
+    const char *CP;
+    unsigned int Slots;
+    unsigned int i;
+
+    Slots = Select_Cache_Slots();
+    for ( i = 0; i < Slots; i++ )
+    {
+	if ( ! ISC->Entry[ i ].ISCTime )
+	    continue;
+
+	if ( Mailbox )
+	{
+	    CP = ISC->Entry[ i ].MailboxName;
+	    if ( Mailbox_Arg( &CP, CP + strlen( CP ), Name, sizeof Name ) == 0 &&
+		 strcmp( Name, Mailbox ) )
+		continue;
+	}
+
+	ISC->Entry[ i ].ISCTime = 0;
+    }
 }
 
 
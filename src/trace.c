@@ -0,0 +1,818 @@
+/*
+**
+** Copyright (c) 2010-2016 The SquirrelMail Project Team
+**
+** Licensed under the GNU GPL. For full terms see the file COPYING.
+**
+** This file is part of SquirrelMail IMAP Proxy.
+**
+**  Facility:
+**
+**	trace.c
+**
+**  Abstract:
+**
+**	Routines to write the protocol log.  A traced session doesn't
+**	write to the trace file itself; it copies each chunk into a record
+**	and pushes it on a queue, and one writer thread takes everything
+**	queued at once and writes it out with writev().  So a slow disk
+**	holds up the writer, not the user being traced.
+**
+**	Up to TRACE_TARGETS users and client addresses can be traced at
+**	once.  They're checked at login, and each session that matches
+**	gets its own session id.  Every record is a binary TraceFrame
+**	(see imapproxy.h) giving the session, the direction, when it was
+**	read to the nanosecond, and the length, so sessions traced side by
+**	side can be pulled apart again by pimptrace.
+**
+**	The queue is a stack that session threads push on with a compare
+**	and swap, and the writer empties with a single exchange and then
+**	turns around, so each thread's records come out in the order they
+**	went in.  Nothing is locked on the way in, except to wake the
+**	writer when the queue was empty.  Without the GCC atomic builtins
+**	a mutex does the same job.
+**
+**	At most TRACE_QUEUE_MAX bytes are queued.  Beyond that, records
+**	are dropped and counted, and the writer says so in syslog.
+**
+**  Authors:
+**
+**      The SquirrelMail Project Team
+**
+**  Version:
+**
+**      $Id$
+**
+**  Modification History:
+**
+**      $Log$
+**
+*/
+
+
+#define _REENTRANT
+
+#include <config.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "imapproxy.h"
+
+/*
+ * External globals
+ */
+extern pthread_mutex_t trace;
+extern int Tracefd;
+
+#define TRACE_QUEUE_MAX		( 8 * 1024 * 1024 )	/* bytes */
+#define TRACE_BATCH		64			/* records per writev() */
+
+#if defined( IOV_MAX ) && IOV_MAX < TRACE_BATCH
+#undef TRACE_BATCH
+#define TRACE_BATCH		IOV_MAX
+#endif
+
+struct TraceRecord
+{
+    struct TraceRecord *next;
+    unsigned int Len;                   /* of Data */
+    char Data[ 1 ];                     /* header and chunk, as written */
+};
+
+/*
+ * Globals private to this file.  TraceMutex is only taken to wake the
+ * writer (and, without atomics, to get at the queue).
+ */
+static struct TraceRecord *TraceQueue = NULL;	/* newest first */
+static unsigned long TraceQueued = 0;		/* bytes in it */
+static unsigned long TraceDropped = 0;		/* since the writer last said */
+static pthread_mutex_t TraceMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t TraceCond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * What we trace, and the last session id handed out.  Both are guarded
+ * by the trace mutex.  Addresses are kept in inet_ntop() form.
+ */
+static char TraceTargets[ TRACE_TARGETS ][ MAXUSERNAMELEN ];
+static unsigned int TraceTargetCount = 0;
+static unsigned int TraceSessions = 0;
+
+/*
+ * internal prototypes
+ */
+static int Trace_Address( const char *, char *, socklen_t );
+static void Trace_Frame( int, unsigned int, const char *, int );
+static void Trace_Write( const char *, int, const char *, int );
+static int Trace_Push( struct TraceRecord * );
+static struct TraceRecord *Trace_Take( void );
+static void *Trace_Writer( void * );
+static void Trace_Flush( struct TraceRecord * );
+
+
+
+/*++
+ * Function:	Trace_Init
+ *
+ * Purpose:	Start the trace writer thread.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada -- exits on failure
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern void Trace_Init( void )
+{
+    char *fn = "Trace_Init()";
+    pthread_attr_t attr;
+    pthread_t ThreadId;
+    int rc;
+
+    rc = pthread_attr_init( &attr );
+    if ( ! rc )
+	rc = pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if ( ! rc )
+	rc = pthread_create( &ThreadId, &attr, Trace_Writer, NULL );
+    if ( rc )
+    {
+	syslog( LOG_ERR, "%s: pthread_create() returned error [%d] for Trace_Writer -- Exiting.", fn, rc );
+	exit( 1 );
+    }
+
+    pthread_attr_destroy( &attr );
+}
+
+
+
+/*++
+ * Function:	Trace_Add
+ *
+ * Purpose:	Start tracing a user, or everyone from a client address.
+ *
+ * Parameters:	char ptr to the username or address
+ *
+ * Returns:	0 if it's now traced
+ *		1 if it already was
+ *		-1 if TRACE_TARGETS things are already being traced
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Only logins from here on are traced.
+ *--
+ */
+extern int Trace_Add( const char *Target )
+{
+    char Address[ INET6_ADDRSTRLEN ];
+    char Note[ MAXUSERNAMELEN + 64 ];
+    unsigned int i;
+
+    if ( Trace_Address( Target, Address, sizeof Address ) == 0 )
+	Target = Address;
+
+    LockMutex( &trace );
+
+    for ( i = 0; i < TraceTargetCount; i++ )
+    {
+	if ( ! strcmp( TraceTargets[ i ], Target ) )
+	{
+	    UnLockMutex( &trace );
+	    return( 1 );
+	}
+    }
+
+    if ( TraceTargetCount == TRACE_TARGETS )
+    {
+	UnLockMutex( &trace );
+	return( -1 );
+    }
+
+    strncpy( TraceTargets[ TraceTargetCount ], Target, MAXUSERNAMELEN - 1 );
+    TraceTargets[ TraceTargetCount ][ MAXUSERNAMELEN - 1 ] = '\0';
+    TraceTargetCount++;
+
+    UnLockMutex( &trace );
+
+    snprintf( Note, sizeof Note, "tracing enabled for %s", Target );
+    Trace_Note( Note );
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Trace_Remove
+ *
+ * Purpose:	Stop tracing a user or client address.
+ *
+ * Parameters:	char ptr to the username or address
+ *
+ * Returns:	0 on success
+ *		-1 if it wasn't being traced
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Sessions already being traced carry on until logout.
+ *--
+ */
+extern int Trace_Remove( const char *Target )
+{
+    char Address[ INET6_ADDRSTRLEN ];
+    char Note[ MAXUSERNAMELEN + 64 ];
+    unsigned int i;
+
+    if ( Trace_Address( Target, Address, sizeof Address ) == 0 )
+	Target = Address;
+
+    LockMutex( &trace );
+
+    for ( i = 0; i < TraceTargetCount; i++ )
+	if ( ! strcmp( TraceTargets[ i ], Target ) )
+	    break;
+
+    if ( i == TraceTargetCount )
+    {
+	UnLockMutex( &trace );
+	return( -1 );
+    }
+
+    TraceTargetCount--;
+    if ( i < TraceTargetCount )
+	memcpy( TraceTargets[ i ], TraceTargets[ TraceTargetCount ], MAXUSERNAMELEN );
+
+    UnLockMutex( &trace );
+
+    snprintf( Note, sizeof Note, "tracing disabled for %s. Expect further output until client logout.", Target );
+    Trace_Note( Note );
+    return( 0 );
+}
+
+
+
+/*++
+ * Function:	Trace_Clear
+ *
+ * Purpose:	Stop tracing everything.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Sessions already being traced carry on until logout.
+ *--
+ */
+extern void Trace_Clear( void )
+{
+    LockMutex( &trace );
+    TraceTargetCount = 0;
+    UnLockMutex( &trace );
+
+    Trace_Note( "tracing disabled. Expect further output until client logout." );
+}
+
+
+
+/*++
+ * Function:	Trace_Start
+ *
+ * Purpose:	Decide at login whether a session is traced, and if so,
+ *		give it a session id and log who it is.
+ *
+ * Parameters:	ptr to the client ITD_Struct
+ *		ptr to the server ITD_Struct
+ *		char ptr to the username
+ *		char ptr to the client address, in numeric form
+ *
+ * Returns:	nada -- TraceOn is set in both ITDs if it's traced
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern void Trace_Start( ITD_Struct *Client, ITD_Struct *Server,
+			 const char *Username, const char *ClientAddr )
+{
+    char Address[ INET6_ADDRSTRLEN ];
+    char Payload[ MAXUSERNAMELEN + INET6_ADDRSTRLEN + sizeof ( ( struct Backend * )0 )->Name ];
+    const char *Field[ 3 ];
+    unsigned int Session = 0;
+    unsigned int i;
+    size_t Len;
+    size_t n;
+
+    Client->TraceOn = 0;
+    Server->TraceOn = 0;
+
+    if ( Trace_Address( ClientAddr, Address, sizeof Address ) )
+	Address[ 0 ] = '\0';
+
+    LockMutex( &trace );
+    for ( i = 0; i < TraceTargetCount; i++ )
+    {
+	if ( ! strcmp( TraceTargets[ i ], Username ) ||
+	     ( Address[ 0 ] && ! strcmp( TraceTargets[ i ], Address ) ) )
+	{
+	    /* session 0 is the proxy's own */
+	    if ( ! ++TraceSessions )
+		++TraceSessions;
+	    Session = TraceSessions;
+	    break;
+	}
+    }
+    UnLockMutex( &trace );
+
+    if ( ! Session )
+	return;
+
+    Client->TraceOn = 1;
+    Server->TraceOn = 1;
+    Client->TraceSession = Session;
+    Server->TraceSession = Session;
+
+    Field[ 0 ] = Username;
+    Field[ 1 ] = Address;
+    Field[ 2 ] = ( Server->conn && Server->conn->Backend ) ?
+	Server->conn->Backend->Name : "";
+
+    Len = 0;
+    for ( i = 0; i < 3; i++ )
+    {
+	n = strlen( Field[ i ] );
+	if ( n > sizeof Payload - Len - 1 )
+	    n = sizeof Payload - Len - 1;
+	memcpy( Payload + Len, Field[ i ], n );
+	Len += n;
+	Payload[ Len++ ] = '\0';
+    }
+
+    Trace_Frame( TRACE_OPEN, Session, Payload, Len );
+}
+
+
+
+/*++
+ * Function:	Trace_End
+ *
+ * Purpose:	Log the end of a traced session.
+ *
+ * Parameters:	ptr to either ITD_Struct of the session
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern void Trace_End( ITD_Struct *ITD )
+{
+    Trace_Frame( TRACE_CLOSE, ITD->TraceSession, NULL, 0 );
+}
+
+
+
+/*++
+ * Function:	Trace_Data
+ *
+ * Purpose:	Write a chunk of proxied data to the protocol log.
+ *
+ * Parameters:	ptr to the ITD_Struct the data was read from
+ *		int TRACE_CLIENT or TRACE_SERVER, for where it came from
+ *		ptr to the data
+ *		int length of the data
+ *
+ * Returns:	nada
+ *--
+ */
+extern void Trace_Data( ITD_Struct *ITD, int Source,
+			const char *Data, int Len )
+{
+    Trace_Frame( Source, ITD->TraceSession, Data, Len );
+}
+
+
+
+/*++
+ * Function:	Trace_Note
+ *
+ * Purpose:	Write a note from the proxy itself to the protocol log.
+ *
+ * Parameters:	char ptr to the text
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+extern void Trace_Note( const char *Text )
+{
+    Trace_Frame( TRACE_NOTE, 0, Text, strlen( Text ) );
+}
+
+
+
+/*++
+ * Function:	Trace_Address
+ *
+ * Purpose:	Put a numeric address in a form it can be compared in.
+ *
+ * Parameters:	char ptr to the address
+ *		ptr to a buffer for the result, and its size
+ *
+ * Returns:	0 on success
+ *		-1 if it isn't an address
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	An IPv4 client on an IPv6 socket shows up as ::ffff:a.b.c.d;
+ *		that's turned into a.b.c.d.
+ *--
+ */
+static int Trace_Address( const char *Address, char *Buf, socklen_t Size )
+{
+    struct in_addr In;
+    struct in6_addr In6;
+
+    if ( inet_pton( AF_INET, Address, &In ) == 1 )
+	return( inet_ntop( AF_INET, &In, Buf, Size ) ? 0 : -1 );
+
+    if ( inet_pton( AF_INET6, Address, &In6 ) != 1 )
+	return( -1 );
+
+    if ( IN6_IS_ADDR_V4MAPPED( &In6 ) )
+	return( inet_ntop( AF_INET, &In6.s6_addr[ 12 ], Buf, Size ) ? 0 : -1 );
+
+    return( inet_ntop( AF_INET6, &In6, Buf, Size ) ? 0 : -1 );
+}
+
+
+
+/*++
+ * Function:	Trace_Frame
+ *
+ * Purpose:	Queue a frame for the protocol log.
+ *
+ * Parameters:	int frame type
+ *		unsigned int session id
+ *		ptr to the payload, and its length (may be 0)
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The time is taken now, not when the writer gets to it.
+ *--
+ */
+static void Trace_Frame( int Type, unsigned int Session,
+			 const char *Data, int Len )
+{
+    struct TraceFrame Frame;
+#if defined( CLOCK_REALTIME )
+    struct timespec Now;
+
+    clock_gettime( CLOCK_REALTIME, &Now );
+    Frame.Nanoseconds = htonl( (unsigned int)Now.tv_nsec );
+#else
+    struct timeval Now;
+
+    gettimeofday( &Now, NULL );
+    Frame.Nanoseconds = htonl( (unsigned int)Now.tv_usec * 1000 );
+#endif
+
+    Frame.Magic = TRACE_MAGIC;
+    Frame.Version = TRACE_VERSION;
+    Frame.Type = Type;
+    Frame.Reserved = 0;
+    Frame.Session = htonl( Session );
+    Frame.Seconds = htonl( (unsigned int)Now.tv_sec );
+    Frame.Length = htonl( (unsigned int)Len );
+
+    Trace_Write( (const char *)&Frame, sizeof Frame, Data, Len );
+}
+
+
+
+/*++
+ * Function:	Trace_Write
+ *
+ * Purpose:	Queue something for the protocol log.
+ *
+ * Parameters:	ptr to a header for it, and its length
+ *		ptr to the data, and its length (may be 0)
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The two are written back to back, as one record.  If the
+ *		queue is full or there's no memory, it's dropped.
+ *--
+ */
+static void Trace_Write( const char *Header, int HeaderLen,
+			 const char *Data, int Len )
+{
+    struct TraceRecord *Record;
+    unsigned long Size;
+
+    Size = HeaderLen + Len;
+
+#if defined( __ATOMIC_ACQ_REL )
+    if ( __atomic_add_fetch( &TraceQueued, Size, __ATOMIC_RELAXED ) > TRACE_QUEUE_MAX )
+    {
+	__atomic_sub_fetch( &TraceQueued, Size, __ATOMIC_RELAXED );
+	__atomic_add_fetch( &TraceDropped, 1, __ATOMIC_RELAXED );
+	COUNT( TraceRecordsDropped, 1 );
+	return;
+    }
+#else
+    LockMutex( &TraceMutex );
+    if ( TraceQueued + Size > TRACE_QUEUE_MAX )
+    {
+	TraceDropped++;
+	UnLockMutex( &TraceMutex );
+	COUNT( TraceRecordsDropped, 1 );
+	return;
+    }
+    TraceQueued += Size;
+    UnLockMutex( &TraceMutex );
+#endif
+
+    Record = malloc( sizeof ( struct TraceRecord ) + Size );
+    if ( ! Record )
+    {
+#if defined( __ATOMIC_ACQ_REL )
+	__atomic_sub_fetch( &TraceQueued, Size, __ATOMIC_RELAXED );
+	__atomic_add_fetch( &TraceDropped, 1, __ATOMIC_RELAXED );
+#else
+	LockMutex( &TraceMutex );
+	TraceQueued -= Size;
+	TraceDropped++;
+	UnLockMutex( &TraceMutex );
+#endif
+	COUNT( TraceRecordsDropped, 1 );
+	return;
+    }
+
+    Record->Len = Size;
+    memcpy( Record->Data, Header, HeaderLen );
+    if ( Len )
+	memcpy( Record->Data + HeaderLen, Data, Len );
+
+    /*
+     * Only the first record onto an empty queue has to wake the writer.
+     * Taking the mutex to signal means the writer is either still
+     * looking at the queue, and will see this, or already waiting.
+     */
+    if ( Trace_Push( Record ) )
+    {
+	LockMutex( &TraceMutex );
+	pthread_cond_signal( &TraceCond );
+	UnLockMutex( &TraceMutex );
+    }
+}
+
+
+
+/*++
+ * Function:	Trace_Push
+ *
+ * Purpose:	Put a record on the trace queue.
+ *
+ * Parameters:	ptr to the record
+ *
+ * Returns:	1 if the queue was empty
+ *		0 if not
+ *
+ * Authors:	The SquirrelMail Project Team
+ *--
+ */
+static int Trace_Push( struct TraceRecord *Record )
+{
+    struct TraceRecord *Head;
+
+#if defined( __ATOMIC_ACQ_REL )
+    Head = __atomic_load_n( &TraceQueue, __ATOMIC_RELAXED );
+    do
+	Record->next = Head;
+    while ( ! __atomic_compare_exchange_n( &TraceQueue, &Head, Record, 1,
+					   __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+#else
+    LockMutex( &TraceMutex );
+    Head = TraceQueue;
+    Record->next = Head;
+    TraceQueue = Record;
+    UnLockMutex( &TraceMutex );
+#endif
+
+    return( Head == NULL );
+}
+
+
+
+/*++
+ * Function:	Trace_Take
+ *
+ * Purpose:	Take everything on the trace queue.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	ptr to the records, oldest first, or NULL if none
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Only the writer takes, so nothing can be pushed and
+ *		popped under its feet.
+ *--
+ */
+static struct TraceRecord *Trace_Take( void )
+{
+    struct TraceRecord *List;
+    struct TraceRecord *Oldest = NULL;
+    struct TraceRecord *Next;
+
+#if defined( __ATOMIC_ACQ_REL )
+    List = __atomic_exchange_n( &TraceQueue, NULL, __ATOMIC_ACQUIRE );
+#else
+    LockMutex( &TraceMutex );
+    List = TraceQueue;
+    TraceQueue = NULL;
+    UnLockMutex( &TraceMutex );
+#endif
+
+    for ( ; List; List = Next )
+    {
+	Next = List->next;
+	List->next = Oldest;
+	Oldest = List;
+    }
+
+    return( Oldest );
+}
+
+
+
+/*++
+ * Function:	Trace_Writer
+ *
+ * Purpose:	Write out the trace queue, forever.
+ *
+ * Parameters:	nada
+ *
+ * Returns:	never
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	The queue is checked with TraceMutex held, so a push
+ *		that finds it empty can't signal between the check and
+ *		the wait.  The timeout is only there to report drops.
+ *--
+ */
+static void *Trace_Writer( void *arg )
+{
+    char *fn = "Trace_Writer()";
+    struct TraceRecord *List;
+    struct timespec Until;
+    unsigned long Dropped;
+
+    for ( ;; )
+    {
+	LockMutex( &TraceMutex );
+#if defined( __ATOMIC_ACQ_REL )
+	while ( ! __atomic_load_n( &TraceQueue, __ATOMIC_RELAXED ) )
+#else
+	while ( ! TraceQueue )
+#endif
+	{
+	    Until.tv_sec = time( 0 ) + 10;
+	    Until.tv_nsec = 0;
+	    if ( pthread_cond_timedwait( &TraceCond, &TraceMutex, &Until ) == ETIMEDOUT )
+		break;
+	}
+	UnLockMutex( &TraceMutex );
+
+	List = Trace_Take();
+	if ( List )
+	    Trace_Flush( List );
+
+#if defined( __ATOMIC_ACQ_REL )
+	Dropped = __atomic_exchange_n( &TraceDropped, 0, __ATOMIC_RELAXED );
+#else
+	LockMutex( &TraceMutex );
+	Dropped = TraceDropped;
+	TraceDropped = 0;
+	UnLockMutex( &TraceMutex );
+#endif
+	if ( Dropped )
+	    syslog( LOG_WARNING, "%s: the protocol log can't keep up; dropped %lu trace records.", fn, Dropped );
+    }
+
+    return( NULL );
+}
+
+
+
+/*++
+ * Function:	Trace_Flush
+ *
+ * Purpose:	Write a list of trace records to the trace file and free
+ *		them.
+ *
+ * Parameters:	ptr to the records, oldest first
+ *
+ * Returns:	nada
+ *
+ * Authors:	The SquirrelMail Project Team
+ *
+ * Notes:	Up to TRACE_BATCH records go in each writev().  If the
+ *		file can't be written, the records are lost; the sessions
+ *		being traced carry on regardless.
+ *--
+ */
+static void Trace_Flush( struct TraceRecord *List )
+{
+    char *fn = "Trace_Flush()";
+    struct iovec iov[ TRACE_BATCH ];
+    struct TraceRecord *Batch[ TRACE_BATCH ];
+    unsigned long Bytes;
+    unsigned int Count;
+    unsigned int First;
+    unsigned int i;
+    ssize_t Written;
+
+    while ( List )
+    {
+	Count = 0;
+	Bytes = 0;
+	for ( ; List && Count < TRACE_BATCH; List = List->next )
+	{
+	    iov[ Count ].iov_base = List->Data;
+	    iov[ Count ].iov_len = List->Len;
+	    Bytes += List->Len;
+	    Batch[ Count++ ] = List;
+	}
+
+	/* pick up where a short write left off */
+	First = 0;
+	while ( First < Count )
+	{
+	    Written = writev( Tracefd, iov + First, Count - First );
+	    if ( Written < 0 )
+	    {
+		if ( errno == EINTR )
+		    continue;
+		syslog( LOG_WARNING, "%s: writev() failed: %s", fn, strerror( errno ) );
+		break;
+	    }
+
+	    while ( First < Count && (size_t)Written >= iov[ First ].iov_len )
+		Written -= iov[ First++ ].iov_len;
+
+	    if ( First < Count )
+	    {
+		iov[ First ].iov_base = (char *)iov[ First ].iov_base + Written;
+		iov[ First ].iov_len -= Written;
+	    }
+	}
+
+	for ( i = 0; i < Count; i++ )
+	    free( Batch[ i ] );
+
+#if defined( __ATOMIC_ACQ_REL )
+	__atomic_sub_fetch( &TraceQueued, Bytes, __ATOMIC_RELAXED );
+#else
+	LockMutex( &TraceMutex );
+	TraceQueued -= Bytes;
+	UnLockMutex( &TraceMutex );
+#endif
+    }
+}
+
+
+/*
+ *                            _________
+ *                           /        |
+ *                          /         |
+ *                         /    ______|
+ *                        /    /       ________
+ *                       |    |        |      /
+ *                       |    |        |_____/
+ *                       |    |        ______
+ *                       |    |        |     \
+ *                       |    |        |______\
+ *                        \    \_______
+ *                         \           |
+ *                          \          |
+ *                           \_________|
+ */